@@ -0,0 +1,831 @@
+// Renders a fixed set of scenes at several resolutions and reports the time, ray throughput and BVH build time of
+// every render, with the peak memory of the process, as JSON. With --baseline the results are compared to an earlier
+// report and the program fails if one of them regressed. With --bvh the scenes are not rendered: the same rays are
+// traced through the binary BVH and the compact wide ones, to compare their memory and speed. With --float every render
+// is made again in float precision, and its time and its largest difference to the double image are added to the
+// report. The analytic shapes are rendered next to meshes of the same shapes, to compare them with the triangles they
+// save.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "renderer.h"
+#include "scene.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Scene files of the benchmark, kept here so that edits to the scenes directory do not move the baseline.
+    // $DATA is replaced by the data directory. The output image and the resolution are replaced by the benchmark.
+    struct BenchmarkScene
+    {
+        const char* name;
+        const char* text;
+    };
+
+    const char* const common_settings = R"(
+output benchmark.ppm
+camera position 0 0 2 target 0 0 1 up 0 1 0 fov 90
+light -1 1 1
+light 1 1 1
+material green 0.3 1 0.6
+material blue 0.3 0.1 0.9
+material glass 1 0.8 0.3 transmit 0.8 ior 1.5
+material mirror 0.6 0.6 0.6 reflect 0.8
+quad -4 -1 -8  -4 -1 2  4 -1 2  4 -1 -8 mirror
+)";
+
+    const BenchmarkScene benchmark_scenes[] = {
+        {"spheres", R"(
+sphere 0.3 0.3 0.3 0.3 green
+sphere -0.5 -0.4 -0.7 0.4 blue
+sphere 0 -0.7 0.2 0.25 glass
+)"},
+        {"bunny", R"(
+mesh $DATA/bunny.off blue scale 8 translate -0.2 0 -1.2 ground -1
+)"},
+        {"bumpy_cube", R"(
+mesh $DATA/bumpy_cube.off glass scale 0.15 rotate y 30 translate 0 -0.3 -1.6
+)"},
+        {"synthetic_1m", R"(
+mesh synthetic_torus.off green rotate x 60 translate 0 -0.2 -1.4
+)"},
+        {"shapes", "$SHAPES"},
+        {"shapes_tessellated", "$TESSELLATED_SHAPES"},
+    };
+
+    // The shapes of the "shapes" scene, which "shapes_tessellated" replaces by meshes of them with the same placement
+    struct BenchmarkShape
+    {
+        const char* shape;     // Kind and parameters of a shape statement
+        const char* placement; // Material and transforms
+    };
+
+    const BenchmarkShape benchmark_shapes[] = {
+        {"sphere", "glass scale 0.4 0.25 0.4 translate -0.2 -0.75 -0.6"},
+        {"cylinder", "blue scale 0.3 0.8 0.3 translate -1.3 -1 -1.8"},
+        {"cone", "green scale 0.4 0.9 0.4 translate 1.3 -1 -1.8"},
+        {"torus 0.3", "green rotate x 70 scale 0.4 translate -0.7 0.1 -1.3"},
+        {"revolution 8  0 0  0.3 0  0.35 0.1  0.22 0.4  0.12 0.6  0.16 0.8  0.18 0.85  0 0.85", "mirror scale 1.2 translate 0.5 -1 -1.3"},
+    };
+
+    // Around the axis, and along the circles of the profiles of the sphere and the torus
+    const int tessellation_segments = 1024;
+
+    // Statements of the shapes, or of their meshes tessellated_k.off
+    string shape_statements(bool is_tessellated)
+    {
+        string text;
+        for (size_t k = 0; k < size(benchmark_shapes); k++)
+        {
+            if (is_tessellated)
+                text += "mesh tessellated_" + to_string(k) + ".off " + benchmark_shapes[k].placement + "\n";
+            else
+                text += string("shape ") + benchmark_shapes[k].shape + " " + benchmark_shapes[k].placement + "\n";
+        }
+        return text;
+    }
+
+    // Triangles of a shape turned around the y axis in tessellation_segments steps. The sphere and the torus get a profile
+    // of half as many points on their circle, like the one Shape walks for the others.
+    Mesh tessellated_shape(const Shape& shape)
+    {
+        const int segments = tessellation_segments, circle_points = tessellation_segments / 2;
+        vector<Vector2d> profile = shape.profile;
+        for (int k = 0; k <= circle_points && (shape.type == sphere_shape || shape.type == torus_shape); k++)
+        {
+            double angle = (shape.type == sphere_shape ? EIGEN_PI : 2 * EIGEN_PI) * k / circle_points;
+            if (shape.type == sphere_shape)
+                profile.emplace_back(sin(angle), -cos(angle));
+            else
+                profile.emplace_back(1 + shape.minor_radius * cos(angle), shape.minor_radius * sin(angle));
+        }
+
+        Mesh mesh;
+        mesh.vertices.resize(profile.size() * segments, 3);
+        vector<Vector3i> faces;
+        for (int k = 0; k < profile.size(); k++)
+        {
+            for (int segment = 0; segment < segments; segment++)
+            {
+                double u = 2 * EIGEN_PI * segment / segments;
+                mesh.vertices.row(k * segments + segment) << profile[k](0) * cos(u), profile[k](1), profile[k](0) * sin(u);
+                if (k + 1 == profile.size())
+                    continue;
+
+                // A point of the profile on the axis gives one triangle instead of two
+                int next_segment = (segment + 1) % segments;
+                int a = k * segments + segment, b = k * segments + next_segment;
+                int c = (k + 1) * segments + next_segment, d = (k + 1) * segments + segment;
+                if (profile[k + 1](0) > 0)
+                    faces.emplace_back(a, d, c);
+                if (profile[k](0) > 0)
+                    faces.emplace_back(a, c, b);
+            }
+        }
+        mesh.faces.resize(faces.size(), 3);
+        for (int k = 0; k < faces.size(); k++)
+            mesh.faces.row(k) = faces[k].transpose();
+        return mesh;
+    }
+
+    // Make the meshes of the shapes available to the scenes, from the shapes as the scene parser reads them
+    bool add_tessellated_shapes(MeshLibrary& library)
+    {
+        Scene scene;
+        string error;
+        istringstream input(string(common_settings) + shape_statements(false));
+        if (!parse_scene(input, "shapes", library, scene, error))
+        {
+            cerr << error << endl;
+            return false;
+        }
+        for (size_t k = 0; k < scene.instances.shapes.size(); k++)
+            library.add("tessellated_" + to_string(k) + ".off", tessellated_shape(scene.instances.shapes[k]));
+        return true;
+    }
+
+    // A bumpy torus of 500 x 1000 quads, one million triangles
+    Mesh synthetic_torus()
+    {
+        const int rings = 500, segments = 1000;
+        const double major_radius = 0.6, minor_radius = 0.25;
+        Mesh mesh;
+        mesh.vertices.resize(rings * segments, 3);
+        mesh.faces.resize(2 * rings * segments, 3);
+        for (int ring = 0; ring < rings; ring++)
+        {
+            for (int segment = 0; segment < segments; segment++)
+            {
+                double u = 2 * EIGEN_PI * segment / segments;
+                double v = 2 * EIGEN_PI * ring / rings;
+                double radius = minor_radius * (1 + 0.08 * sin(23 * u) * sin(17 * v));
+                double distance = major_radius + radius * cos(v);
+                mesh.vertices.row(ring * segments + segment) << distance * cos(u), radius * sin(v), distance * sin(u);
+
+                int next_ring = (ring + 1) % rings, next_segment = (segment + 1) % segments;
+                int a = ring * segments + segment, b = ring * segments + next_segment;
+                int c = next_ring * segments + next_segment, d = next_ring * segments + segment;
+                mesh.faces.row(2 * a) << a, c, b;
+                mesh.faces.row(2 * a + 1) << a, d, c;
+            }
+        }
+        return mesh;
+    }
+
+    // Largest resident set of the process so far, in megabytes
+    double peak_rss_mb()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+        return counters.PeakWorkingSetSize / 1e6;
+#else
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1e6; // Bytes
+#else
+        return usage.ru_maxrss / 1e3; // Kilobytes
+#endif
+#endif
+    }
+
+    struct Result
+    {
+        string scene;
+        int width, height;
+        int triangles;
+        double bvh_build_ms;
+        double render_ms;
+        long long primary_rays, secondary_rays, shadow_rays;
+        double process_peak_rss_mb; // Of the whole process when the render ended, the scenes before it included
+        double float_render_ms; // With --float, and then float_max_difference is in levels of 8 bits
+        double float_max_difference;
+        long long float_differing_pixels;
+
+        double primary_mrays_per_second() const { return primary_rays / (render_ms * 1e3); }
+        double secondary_mrays_per_second() const { return secondary_rays / (render_ms * 1e3); }
+        double total_mrays_per_second() const { return (primary_rays + secondary_rays + shadow_rays) / (render_ms * 1e3); }
+    };
+
+    void write_json(ostream& out, const RenderSettings& settings, int repeat, bool is_float_comparison, const vector<Result>& results)
+    {
+        out << "{\n";
+        out << "  \"settings\": {\"threads\": " << TileScheduler(settings.thread_count).thread_count << ", \"packet_size\": " << settings.packet_size
+            << ", \"max_depth\": " << settings.max_depth << ", \"ray_budget\": " << settings.ray_budget << ", \"repeat\": " << repeat << "},\n";
+        out << "  \"results\": [\n";
+        for (size_t k = 0; k < results.size(); k++)
+        {
+            const Result& r = results[k];
+            out << "    {\"scene\": \"" << r.scene << "\", \"width\": " << r.width << ", \"height\": " << r.height
+                << ", \"triangles\": " << r.triangles << ", \"bvh_build_ms\": " << r.bvh_build_ms << ", \"render_ms\": " << r.render_ms
+                << ", \"primary_rays\": " << r.primary_rays << ", \"secondary_rays\": " << r.secondary_rays << ", \"shadow_rays\": " << r.shadow_rays
+                << ", \"primary_mrays_per_s\": " << r.primary_mrays_per_second() << ", \"secondary_mrays_per_s\": " << r.secondary_mrays_per_second()
+                << ", \"total_mrays_per_s\": " << r.total_mrays_per_second() << ", \"process_peak_rss_mb\": " << r.process_peak_rss_mb;
+            if (is_float_comparison)
+                out << ", \"float_render_ms\": " << r.float_render_ms << ", \"float_speedup\": " << r.render_ms / r.float_render_ms
+                    << ", \"float_max_difference\": " << r.float_max_difference << ", \"float_differing_pixels\": " << r.float_differing_pixels;
+            out << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    // Just enough of JSON to read back the reports: objects, arrays, strings without escapes, numbers and literals.
+    // Every object of the "results" array becomes a map from its keys to their values, strings are kept as text.
+    class ReportReader
+    {
+    public:
+        explicit ReportReader(const string& text) : text(text), position(0) {}
+
+        bool read(vector<map<string, string>>& results)
+        {
+            return parse_value(0, results) && (skip_spaces(), position == text.size());
+        }
+
+    private:
+        const string& text;
+        size_t position;
+        string key; // Last key read in the current object
+
+        void skip_spaces()
+        {
+            while (position < text.size() && isspace((unsigned char)text[position]))
+                position++;
+        }
+
+        bool expect(char c)
+        {
+            skip_spaces();
+            if (position >= text.size() || text[position] != c)
+                return false;
+            position++;
+            return true;
+        }
+
+        bool parse_string(string& value)
+        {
+            if (!expect('"'))
+                return false;
+            size_t end = text.find('"', position);
+            if (end == string::npos)
+                return false;
+            value = text.substr(position, end - position);
+            position = end + 1;
+            return true;
+        }
+
+        // depth 1 is the top object, 2 the "results" array, 3 its objects
+        bool parse_value(int depth, vector<map<string, string>>& results, string* scalar = nullptr)
+        {
+            skip_spaces();
+            if (position >= text.size())
+                return false;
+            char c = text[position];
+            if (c == '{')
+            {
+                position++;
+                bool is_result = depth == 2;
+                if (is_result)
+                    results.emplace_back();
+                if (expect('}'))
+                    return true;
+                do
+                {
+                    string name, value;
+                    if (!parse_string(name) || !expect(':'))
+                        return false;
+                    bool is_results_array = depth == 0 && name == "results";
+                    if (!parse_value(is_results_array ? 1 : depth + 2, results, &value))
+                        return false;
+                    if (is_result)
+                        results.back()[name] = value;
+                } while (expect(','));
+                return expect('}');
+            }
+            if (c == '[')
+            {
+                position++;
+                if (expect(']'))
+                    return true;
+                do
+                {
+                    if (!parse_value(depth + 1, results))
+                        return false;
+                } while (expect(','));
+                return expect(']');
+            }
+            if (c == '"')
+            {
+                string value;
+                if (!parse_string(value))
+                    return false;
+                if (scalar)
+                    *scalar = value;
+                return true;
+            }
+            size_t end = text.find_first_of(",}] \t\r\n", position);
+            if (end == string::npos || end == position)
+                return false;
+            if (scalar)
+                *scalar = text.substr(position, end - position);
+            position = end;
+            return true;
+        }
+    };
+
+    // Compare the results to the baseline report, print every metric of the runs found in both and
+    // return the number of regressions. Rates may drop and times grow by tolerance (0.1 = 10%), plus a small absolute
+    // slack for the timings that are too short to be stable. The peak memory is that of the process, which depends on
+    // the scenes rendered before, so it is not compared.
+    int compare_to_baseline(const vector<Result>& results, const string& baseline_path, double tolerance)
+    {
+        ifstream file(baseline_path);
+        stringstream text;
+        text << file.rdbuf();
+        vector<map<string, string>> baseline;
+        if (!file || !ReportReader(text.str()).read(baseline))
+        {
+            cerr << "Cannot read the baseline " << baseline_path << endl;
+            return 1;
+        }
+
+        int regressions = 0;
+        int compared = 0;
+        for (const Result& result : results)
+        {
+            for (const map<string, string>& old : baseline)
+            {
+                auto field = [&](const char* key) { return old.count(key) ? atof(old.at(key).c_str()) : NAN; };
+                if (!old.count("scene") || old.at("scene") != result.scene || field("width") != result.width || field("height") != result.height)
+                    continue;
+                compared++;
+
+                // Higher is better for the rates, lower for the times
+                auto check = [&](const char* metric, double value, double baseline_value, bool higher_is_better, double slack)
+                {
+                    if (std::isnan(baseline_value))
+                        return;
+                    bool is_regression = higher_is_better ? value < baseline_value * (1 - tolerance) - slack
+                                                          : value > baseline_value * (1 + tolerance) + slack;
+                    regressions += is_regression;
+                    cout << (is_regression ? "REGRESSION " : "ok         ") << result.scene << " " << result.width << "x" << result.height << " "
+                         << metric << ": " << value << " (baseline " << baseline_value << ", " << showpos
+                         << 100 * (value / baseline_value - 1) << noshowpos << "%)" << endl;
+                };
+                check("primary_mrays_per_s", result.primary_mrays_per_second(), field("primary_mrays_per_s"), true, 0);
+                check("total_mrays_per_s", result.total_mrays_per_second(), field("total_mrays_per_s"), true, 0);
+                check("bvh_build_ms", result.bvh_build_ms, field("bvh_build_ms"), false, 5);
+                check("render_ms", result.render_ms, field("render_ms"), false, 5);
+            }
+        }
+        cout << compared << " runs compared to " << baseline_path << ", " << regressions << " regressions" << endl;
+        return regressions;
+    }
+
+    // Rays of the --bvh comparison, all traced from the hits of the primary rays
+    struct RaySet
+    {
+        const char* name;
+        bool is_shadow;
+        vector<Vector3d> origins, directions;
+        vector<double> t_max;
+    };
+
+    vector<RaySet> comparison_rays(const Scene& scene)
+    {
+        RaySet primary = {"primary", false}, diffuse = {"diffuse", false}, shadow = {"shadow", true};
+        const double epsilon = 1e-6;
+        Vector3d direction, x_displacement, y_displacement;
+        scene.camera.pixel_rays(direction, x_displacement, y_displacement);
+        mt19937 random(1);
+        uniform_real_distribution<double> uniform(-1, 1);
+
+        for (int j = 0; j < scene.camera.height; j++)
+        {
+            for (int i = 0; i < scene.camera.width; i++)
+            {
+                Vector3d ray_direction = direction + i * x_displacement + j * y_displacement;
+                primary.origins.push_back(scene.camera.position);
+                primary.directions.push_back(ray_direction);
+                primary.t_max.push_back(numeric_limits<double>::infinity());
+
+                Hit hit;
+                if (!scene.bvh.intersect_binary(scene.camera.position, ray_direction, numeric_limits<double>::infinity(), hit))
+                    continue;
+                Vector3d position = scene.camera.position + hit.t * ray_direction;
+                Vector3d normal = scene.bvh.triangles.normal(hit.primitive);
+                if (normal.dot(ray_direction) > 0)
+                    normal = -normal;
+
+                // A direction of the hemisphere of the normal, like the bounce of a rough surface
+                Vector3d bounce;
+                do
+                    bounce = Vector3d(uniform(random), uniform(random), uniform(random));
+                while (bounce.squaredNorm() > 1 || bounce.squaredNorm() < 1e-6);
+                bounce.normalize();
+                if (bounce.dot(normal) < 0)
+                    bounce = -bounce;
+                diffuse.origins.push_back(position + epsilon * bounce);
+                diffuse.directions.push_back(bounce);
+                diffuse.t_max.push_back(numeric_limits<double>::infinity());
+
+                for (const Vector3d& light : scene.light_positions)
+                {
+                    Vector3d to_light = light - position;
+                    shadow.origins.push_back(position + epsilon * to_light.normalized());
+                    shadow.directions.push_back(to_light.normalized());
+                    shadow.t_max.push_back(to_light.norm() - epsilon);
+                }
+            }
+        }
+        return {primary, diffuse, shadow};
+    }
+
+    struct BVHResult
+    {
+        string scene;
+        string tree;
+        int triangles;
+        double build_ms;
+        double node_mb, triangle_mb; // Walked by the rays, the triangles of the binary tree are the 12 doubles of the test
+        vector<double> mrays_per_second; // By ray set
+        vector<double> nodes_per_ray, tests_per_ray;
+        long long mismatches; // Rays whose hit distance or triangle differs from the binary tree
+    };
+
+    // Trace the rays through the binary tree of scene.bvh and through wide trees of 4 and 8 children built from it
+    vector<BVHResult> compare_bvhs(const string& name, const Scene& scene, int repeat)
+    {
+        vector<RaySet> ray_sets = comparison_rays(scene);
+        const BVH& bvh = scene.bvh;
+        const TriangleStore& triangles = bvh.triangles;
+        WideBVH<4> wide_4;
+        WideBVH<8> wide_8;
+
+        vector<BVHResult> results(3);
+        results[0].tree = "binary";
+        results[0].build_ms = bvh.build_time * 1000;
+        results[0].node_mb = bvh.nodes.size() * sizeof(BVH::Node) / 1e6;
+        results[0].triangle_mb = triangles.size() * 12 * sizeof(double) / 1e6;
+        auto start = chrono::steady_clock::now();
+        wide_4.build(bvh);
+        results[1].tree = "wide_4";
+        results[1].build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        results[1].node_mb = wide_4.node_bytes() / 1e6;
+        results[1].triangle_mb = wide_4.triangle_bytes() / 1e6;
+        start = chrono::steady_clock::now();
+        wide_8.build(bvh);
+        results[2].tree = "wide_8";
+        results[2].build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        results[2].node_mb = wide_8.node_bytes() / 1e6;
+        results[2].triangle_mb = wide_8.triangle_bytes() / 1e6;
+
+        // The hits of the binary tree, which the wide ones must find again: the distance and the triangle, or whether
+        // the shadow ray is blocked. Of two triangles at the same distance the trees may keep a different one.
+        vector<vector<pair<double, int>>> expected(ray_sets.size());
+        for (size_t set = 0; set < ray_sets.size(); set++)
+        {
+            const RaySet& rays = ray_sets[set];
+            for (size_t k = 0; k < rays.origins.size(); k++)
+            {
+                Hit hit;
+                if (rays.is_shadow)
+                    expected[set].emplace_back(bvh.occluded_binary(rays.origins[k], rays.directions[k], rays.t_max[k]) ? 1 : -1, -1);
+                else if (bvh.intersect_binary(rays.origins[k], rays.directions[k], rays.t_max[k], hit))
+                    expected[set].emplace_back(hit.t, hit.primitive);
+                else
+                    expected[set].emplace_back(-1, -1);
+            }
+        }
+
+        for (int tree = 0; tree < 3; tree++)
+        {
+            BVHResult& result = results[tree];
+            result.scene = name;
+            result.triangles = triangles.size();
+            result.mismatches = 0;
+            for (size_t set = 0; set < ray_sets.size(); set++)
+            {
+                const RaySet& rays = ray_sets[set];
+                double best_seconds = 0;
+                TraversalStats stats;
+                for (int run = 0; run < repeat; run++)
+                {
+                    stats = TraversalStats();
+                    long long mismatches = 0;
+                    auto run_start = chrono::steady_clock::now();
+                    for (size_t k = 0; k < rays.origins.size(); k++)
+                    {
+                        Hit hit;
+                        double t_max = rays.t_max[k];
+                        pair<double, int> found(-1, -1);
+                        if (rays.is_shadow)
+                        {
+                            int occluder = tree == 0 ? (bvh.occluded_binary(rays.origins[k], rays.directions[k], t_max, &stats) ? 0 : -1)
+                                         : tree == 1 ? wide_4.find_occluder(triangles, rays.origins[k], rays.directions[k], t_max, &stats)
+                                                     : wide_8.find_occluder(triangles, rays.origins[k], rays.directions[k], t_max, &stats);
+                            found.first = occluder >= 0 ? 1 : -1;
+                        }
+                        else
+                        {
+                            bool is_hit = tree == 0 ? bvh.intersect_binary(rays.origins[k], rays.directions[k], t_max, hit, &stats)
+                                        : tree == 1 ? wide_4.intersect(triangles, rays.origins[k], rays.directions[k], t_max, hit, &stats)
+                                                    : wide_8.intersect(triangles, rays.origins[k], rays.directions[k], t_max, hit, &stats);
+                            if (is_hit)
+                                found = {hit.t, hit.primitive};
+                        }
+                        mismatches += found != expected[set][k];
+                    }
+                    double seconds = chrono::duration<double>(chrono::steady_clock::now() - run_start).count();
+                    if (run == 0 || seconds < best_seconds)
+                        best_seconds = seconds;
+                    result.mismatches = max(result.mismatches, mismatches);
+                }
+                long long count = max<size_t>(1, rays.origins.size());
+                result.mrays_per_second.push_back(rays.origins.size() / (best_seconds * 1e6));
+                result.nodes_per_ray.push_back(double(stats.nodes_visited) / count);
+                result.tests_per_ray.push_back(double(stats.triangle_tests) / count);
+            }
+
+            cout << name << " " << result.tree << ": " << result.triangles << " triangles, " << result.node_mb << " MB of nodes and "
+                 << result.triangle_mb << " MB of triangles, built in " << result.build_ms << " ms";
+            for (size_t set = 0; set < ray_sets.size(); set++)
+                cout << ", " << ray_sets[set].name << " " << result.mrays_per_second[set] << " Mrays/s (" << result.nodes_per_ray[set] << " nodes, "
+                     << result.tests_per_ray[set] << " triangles per ray)";
+            cout << ", " << result.mismatches << " hits differ" << endl;
+        }
+        return results;
+    }
+
+    void write_bvh_json(ostream& out, int resolution, int repeat, const vector<BVHResult>& results)
+    {
+        const char* const set_names[] = {"primary", "diffuse", "shadow"};
+        out << "{\n";
+        out << "  \"settings\": {\"resolution\": " << resolution << ", \"repeat\": " << repeat << "},\n";
+        out << "  \"bvh_results\": [\n";
+        for (size_t k = 0; k < results.size(); k++)
+        {
+            const BVHResult& r = results[k];
+            out << "    {\"scene\": \"" << r.scene << "\", \"tree\": \"" << r.tree << "\", \"triangles\": " << r.triangles << ", \"build_ms\": " << r.build_ms
+                << ", \"node_mb\": " << r.node_mb << ", \"triangle_mb\": " << r.triangle_mb;
+            for (size_t set = 0; set < r.mrays_per_second.size(); set++)
+                out << ", \"" << set_names[set] << "_mrays_per_s\": " << r.mrays_per_second[set] << ", \"" << set_names[set] << "_nodes_per_ray\": "
+                    << r.nodes_per_ray[set] << ", \"" << set_names[set] << "_triangles_per_ray\": " << r.tests_per_ray[set];
+            out << ", \"mismatches\": " << r.mismatches << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    // Pixels of a binary PPM written by the renderer, in [0, 1]
+    bool read_ppm(const string& path, int& width, int& height, vector<double>& pixels)
+    {
+        ifstream file(path, ios::binary);
+        string magic;
+        int max_value;
+        if (!(file >> magic >> width >> height >> max_value) || magic != "P6" || (max_value != 255 && max_value != 65535))
+            return false;
+        file.get();
+        int bytes = max_value == 255 ? 1 : 2;
+        vector<unsigned char> data(size_t(width) * height * 3 * bytes);
+        if (!file.read((char*)data.data(), data.size()))
+            return false;
+        pixels.resize(size_t(width) * height * 3);
+        for (size_t k = 0; k < pixels.size(); k++)
+            pixels[k] = (bytes == 1 ? data[k] : data[2 * k] << 8 | data[2 * k + 1]) / double(max_value);
+        return true;
+    }
+
+    // Largest difference of a channel between two images of the same size, in levels of 8 bits, or -1 if they cannot be read,
+    // and the number of pixels that differ by more than a level. Edges that move by a pixel give a large largest difference.
+    double max_image_difference(const string& path, const string& other_path, long long& differing_pixels)
+    {
+        differing_pixels = 0;
+        int width, height, other_width, other_height;
+        vector<double> pixels, other_pixels;
+        if (!read_ppm(path, width, height, pixels) || !read_ppm(other_path, other_width, other_height, other_pixels)
+            || width != other_width || height != other_height)
+            return -1;
+        double difference = 0;
+        for (size_t pixel = 0; pixel < pixels.size() / 3; pixel++)
+        {
+            double pixel_difference = 0;
+            for (size_t k = 3 * pixel; k < 3 * pixel + 3; k++)
+                pixel_difference = max(pixel_difference, abs(pixels[k] - other_pixels[k]));
+            differing_pixels += 255 * pixel_difference > 1.5;
+            difference = max(difference, pixel_difference);
+        }
+        return 255 * difference;
+    }
+
+    vector<int> parse_resolutions(const string& list)
+    {
+        vector<int> resolutions;
+        stringstream items(list);
+        string item;
+        while (getline(items, item, ','))
+            resolutions.push_back(stoi(item));
+        return resolutions;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    RenderSettings settings;
+    settings.verbose = false;
+    string data_directory = "../data";
+    string json_path = "benchmark.json";
+    string baseline_path;
+    double tolerance = 0.1;
+    int repeat = 3;
+    vector<int> resolutions = {400, 800, 1600};
+    vector<string> selected_scenes;
+    bool is_bvh_comparison = false;
+    bool is_float_comparison = false;
+
+    for (int arg_i = 1; arg_i < argc; arg_i++)
+    {
+        string arg = argv[arg_i];
+        bool has_value = arg_i + 1 < argc;
+        if (arg == "--threads" && has_value)
+            settings.thread_count = stoi(argv[++arg_i]);
+        else if (arg == "--packet" && has_value && (string(argv[arg_i + 1]) == "1" || string(argv[arg_i + 1]) == "4" || string(argv[arg_i + 1]) == "8"))
+            settings.packet_size = stoi(argv[++arg_i]);
+        else if (arg == "--data" && has_value)
+            data_directory = argv[++arg_i];
+        else if (arg == "--json" && has_value)
+            json_path = argv[++arg_i];
+        else if (arg == "--baseline" && has_value)
+            baseline_path = argv[++arg_i];
+        else if (arg == "--tolerance" && has_value)
+            tolerance = stod(argv[++arg_i]);
+        else if (arg == "--repeat" && has_value)
+            repeat = max(1, stoi(argv[++arg_i]));
+        else if (arg == "--resolutions" && has_value)
+            resolutions = parse_resolutions(argv[++arg_i]);
+        else if (arg == "--scene" && has_value)
+            selected_scenes.push_back(argv[++arg_i]);
+        else if (arg == "--bvh")
+            is_bvh_comparison = true;
+        else if (arg == "--float")
+            is_float_comparison = true;
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--threads N] [--packet 1|4|8] [--data DIR] [--json FILE] [--baseline FILE] [--tolerance 0.1]"
+                 << " [--repeat N] [--resolutions 400,800,1600] [--scene NAME]... [--bvh] [--float]" << endl;
+            return 1;
+        }
+    }
+
+    // The synthetic meshes are made when their scene comes, the peak memory of the scenes before it does not include them
+    MeshLibrary library;
+    bool has_synthetic_torus = false;
+    bool has_tessellated_shapes = false;
+
+    vector<Result> results;
+    vector<BVHResult> bvh_results;
+    for (const BenchmarkScene& benchmark_scene : benchmark_scenes)
+    {
+        if (!selected_scenes.empty() && find(selected_scenes.begin(), selected_scenes.end(), benchmark_scene.name) == selected_scenes.end())
+            continue;
+
+        string text = string(common_settings) + benchmark_scene.text;
+        for (size_t found = text.find("$SHAPES"); found != string::npos; found = text.find("$SHAPES"))
+            text.replace(found, 7, shape_statements(false));
+        for (size_t found = text.find("$TESSELLATED_SHAPES"); found != string::npos; found = text.find("$TESSELLATED_SHAPES"))
+            text.replace(found, 19, shape_statements(true));
+        for (size_t found = text.find("$DATA"); found != string::npos; found = text.find("$DATA"))
+            text.replace(found, 5, data_directory);
+        if (!has_synthetic_torus && text.find("synthetic_torus.off") != string::npos)
+        {
+            library.add("synthetic_torus.off", synthetic_torus());
+            has_synthetic_torus = true;
+        }
+        if (!has_tessellated_shapes && text.find("tessellated_0.off") != string::npos)
+        {
+            if (!add_tessellated_shapes(library))
+                return 1;
+            has_tessellated_shapes = true;
+        }
+
+        // The rays of the first resolution through each tree
+        if (is_bvh_comparison)
+        {
+            Scene scene;
+            string error;
+            istringstream input(text);
+            if (!parse_scene(input, benchmark_scene.name, library, scene, error))
+            {
+                cerr << error << endl;
+                return 1;
+            }
+            scene.camera.width = scene.camera.height = resolutions[0];
+            for (const BVHResult& result : compare_bvhs(benchmark_scene.name, scene, repeat))
+                bvh_results.push_back(result);
+            continue;
+        }
+
+        for (int resolution : resolutions)
+        {
+            // Best of the runs, the scene and its BVH are rebuilt for each of them so that the build is measured the same way
+            Result result = {};
+            Scene scene;
+            auto render_runs = [&](const RenderSettings& run_settings, const string& output, Result& best)
+            {
+                for (int run = 0; run < repeat; run++)
+                {
+                    string error;
+                    istringstream input(text);
+                    if (!parse_scene(input, benchmark_scene.name, library, scene, error))
+                    {
+                        cerr << error << endl;
+                        return false;
+                    }
+                    scene.camera.width = scene.camera.height = resolution;
+                    scene.output = output;
+
+                    RenderStats stats;
+                    if (!render_scene(scene, run_settings, &stats))
+                        return false;
+                    double render_ms = stats.render_time * 1000;
+                    if (run == 0 || render_ms < best.render_ms)
+                    {
+                        best.render_ms = render_ms;
+                        best.primary_rays = stats.primary_rays;
+                        best.secondary_rays = stats.secondary_rays;
+                        best.shadow_rays = stats.shadow_rays;
+                    }
+                    double build_ms = scene.bvh.build_time * 1000;
+                    best.bvh_build_ms = run == 0 ? build_ms : min(best.bvh_build_ms, build_ms);
+                }
+                return true;
+            };
+            string output = string("benchmark_") + benchmark_scene.name + ".ppm";
+            if (!render_runs(settings, output, result))
+                return 1;
+
+            // The same render in float, the rates of the report stay those of the double one
+            if (is_float_comparison)
+            {
+                RenderSettings float_settings = settings;
+                float_settings.float_precision = true;
+                string float_output = string("benchmark_") + benchmark_scene.name + "_float.ppm";
+                Result float_result = {};
+                if (!render_runs(float_settings, float_output, float_result))
+                    return 1;
+                result.float_render_ms = float_result.render_ms;
+                result.float_max_difference = max_image_difference(output, float_output, result.float_differing_pixels);
+            }
+            result.scene = benchmark_scene.name;
+            result.width = result.height = resolution;
+            result.triangles = scene.bvh.triangles.size();
+            result.process_peak_rss_mb = peak_rss_mb();
+            results.push_back(result);
+
+            cout << result.scene << " " << resolution << "x" << resolution << ": " << result.render_ms << " ms, "
+                 << result.primary_mrays_per_second() << " primary Mrays/s, " << result.total_mrays_per_second() << " Mrays/s with secondary and shadow rays, BVH of "
+                 << result.triangles << " triangles built in " << result.bvh_build_ms << " ms, " << result.process_peak_rss_mb << " MB peak RSS of the process so far" << endl;
+            if (is_float_comparison)
+                cout << result.scene << " " << resolution << "x" << resolution << " in float: " << result.float_render_ms << " ms, "
+                     << result.render_ms / result.float_render_ms << "x the speed of double, largest difference " << result.float_max_difference
+                     << " levels of 8 bits, " << result.float_differing_pixels << " pixels differ by more than a level" << endl;
+        }
+    }
+
+    ofstream json(json_path);
+    if (is_bvh_comparison)
+        write_bvh_json(json, resolutions[0], repeat, bvh_results);
+    else
+        write_json(json, settings, repeat, is_float_comparison, results);
+    if (!json)
+    {
+        cerr << "Cannot write " << json_path << endl;
+        return 1;
+    }
+    cout << "Results written to " << json_path << endl;
+
+    if (!baseline_path.empty() && !is_bvh_comparison && compare_to_baseline(results, baseline_path, tolerance) > 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include "antialias.h"
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+namespace
+{
+    // The images clamp the channels, so brighter differences do not show
+    float clamped(float value)
+    {
+        return min(max(value, 0.f), 1.f);
+    }
+
+    float channel(const Pixel& pixel, int c)
+    {
+        return clamped(c == 0 ? pixel.r : c == 1 ? pixel.g : c == 2 ? pixel.b : pixel.a);
+    }
+}
+
+SampleTile::SampleTile(const Tile& tile, int width, int height)
+{
+    traced.x_begin = max(tile.x_begin - 1, 0);
+    traced.x_end = min(tile.x_end + 1, width);
+    traced.y_begin = max(tile.y_begin - 1, 0);
+    traced.y_end = min(tile.y_end + 1, height);
+    traced.thread = tile.thread;
+    pixels.resize(size_t(traced.x_end - traced.x_begin) * (traced.y_end - traced.y_begin));
+}
+
+AdaptiveSampler::AdaptiveSampler(const Tile& region, int max_samples, double threshold, double time_budget, bool keep_sample_map)
+    : region(region), max_samples(max_samples), threshold(threshold), time_budget(time_budget),
+      start(chrono::steady_clock::now()), ring_rays(0), pixels_refined(0), samples_added(0), pixels_over_budget(0)
+{
+    if (keep_sample_map)
+        sample_counts.assign(size_t(region.x_end - region.x_begin) * (region.y_end - region.y_begin), 1);
+}
+
+bool AdaptiveSampler::write_sample_map(const string& path) const
+{
+    // Band by band, so that a large image only needs its counts in memory
+    const int width = region.x_end - region.x_begin;
+    const int height = region.y_end - region.y_begin;
+    const int band_height = 64;
+    string error;
+    unique_ptr<ImageWriter> writer = open_image_writer(path, width, height, 8, error);
+    if (!writer)
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    bool is_written = true;
+    vector<Pixel> rows;
+    for (int y_begin = 0; y_begin < height; y_begin += band_height)
+    {
+        int y_end = min(y_begin + band_height, height);
+        rows.resize(size_t(y_end - y_begin) * width);
+        for (size_t k = 0; k < rows.size(); k++)
+        {
+            float value = float(sample_counts[size_t(y_begin) * width + k]) / max_samples;
+            rows[k] = Pixel(value, value, value, 1);
+        }
+        EncodedBand band;
+        band.y_begin = y_begin;
+        band.y_end = y_end;
+        writer->encode(rows.data(), y_begin, y_end, band);
+        is_written = writer->write(band) && is_written;
+    }
+    is_written = writer->close() && is_written;
+    if (is_written)
+        std::cout << path << ": samples per pixel, white is " << max_samples << std::endl;
+    else
+        std::cerr << "Could not write " << path << std::endl;
+    return is_written;
+}
+
+void AdaptiveSampler::print_stats() const
+{
+    long long pixels = (long long)(region.x_end - region.x_begin) * (region.y_end - region.y_begin);
+    std::cout << "Adaptive anti-aliasing: " << pixels_refined << " pixels refined (" << 100. * pixels_refined / pixels << "%), "
+              << double(pixels + samples_added) / pixels << " samples per pixel on average, at most " << max_samples;
+    if (time_budget > 0)
+        std::cout << ", " << pixels_over_budget << " pixels left after the budget of " << time_budget << " s";
+    std::cout << std::endl;
+}
+
+float AdaptiveSampler::contrast(const SampleTile& first, int x, int y) const
+{
+    static const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    const Pixel& pixel = first(x, y);
+    float difference = 0;
+    for (const auto& offset : offsets)
+    {
+        int nx = x + offset[0], ny = y + offset[1];
+        if (nx < first.traced.x_begin || nx >= first.traced.x_end || ny < first.traced.y_begin || ny >= first.traced.y_end)
+            continue;
+        const Pixel& neighbour = first(nx, ny);
+        for (int c = 0; c < 4; c++)
+            difference = max(difference, fabs(channel(pixel, c) - channel(neighbour, c)));
+    }
+    return difference;
+}
+
+float AdaptiveSampler::standard_error(const vector<Sample>& samples) const
+{
+    int n = samples.size();
+    if (n < 2)
+        return numeric_limits<float>::infinity();
+    float error = 0;
+    for (int c = 0; c < 4; c++)
+    {
+        float sum = 0, sum_squares = 0;
+        for (const Sample& sample : samples)
+        {
+            float value = channel(sample.color, c);
+            sum += value;
+            sum_squares += value * value;
+        }
+        float variance = max(0.f, (sum_squares - sum * sum / n) / (n - 1));
+        error = max(error, sqrt(variance / n));
+    }
+    return error;
+}
+
+float AdaptiveSampler::jitter(int x, int y, int sample, int coordinate)
+{
+    // Integer hash of the four numbers, so that the samples do not depend on the thread or the order of the tiles
+    unsigned h = unsigned(x) * 73856093u ^ unsigned(y) * 19349663u ^ unsigned(sample) * 83492791u ^ unsigned(coordinate) * 2654435761u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.f / 16777216.f);
+}
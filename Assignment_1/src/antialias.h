@@ -0,0 +1,144 @@
+#ifndef ANTIALIAS_H
+#define ANTIALIAS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "image.h"
+#include "parallel.h"
+
+// First samples of the pixels of a tile and of the ring of pixels around it, so that the pixels on the edges
+// of the tile can be compared with their neighbours in the other tiles
+class SampleTile
+{
+public:
+    Tile traced; // The tile grown by one pixel, clipped to the image
+
+    SampleTile(const Tile& tile, int width, int height);
+
+    Pixel& operator()(int x, int y) { return pixels[std::size_t(y - traced.y_begin) * (traced.x_end - traced.x_begin) + x - traced.x_begin]; }
+    const Pixel& operator()(int x, int y) const { return pixels[std::size_t(y - traced.y_begin) * (traced.x_end - traced.x_begin) + x - traced.x_begin]; }
+
+private:
+    std::vector<Pixel> pixels;
+};
+
+// Adaptive anti-aliasing: every pixel gets one sample at its corner, and the pixels that differ from one of their
+// neighbours by more than threshold on a channel get more. They are cut into 2x2, then 4x4, then 8x8 strata, and
+// every stratum without a sample gets one at a random position in it, as long as the standard error of the mean of
+// the pixel is above threshold and there are at most max_samples. Once time_budget seconds have passed since
+// the render started, the pixels left keep their first sample.
+class AdaptiveSampler
+{
+public:
+    // region holds the pixels that are refined, in image coordinates, and the sample map covers it
+    AdaptiveSampler(const Tile& region, int max_samples, double threshold, double time_budget, bool keep_sample_map);
+
+    bool is_enabled() const { return max_samples > 1; }
+
+    // Refine the pixels of a tile from their first samples and write them. trace_sample(x, y, u, v, sample) returns the
+    // color of the ray through (x + u, y + v) of the image, sample numbers the samples of a pixel from 1.
+    template <typename TraceSample>
+    void refine(const Tile& tile, const SampleTile& first, BandPixels& pixels, TraceSample trace_sample);
+
+    // Write the samples of every pixel as a gray image, white is max_samples, band by band. Needs keep_sample_map.
+    bool write_sample_map(const std::string& path) const;
+
+    // Primary rays traced for the rings around the tiles and for the samples added to the pixels
+    long long rays_added() const { return ring_rays + samples_added; }
+
+    void print_stats() const;
+
+private:
+    struct Sample
+    {
+        float u, v;
+        Pixel color;
+    };
+
+    Tile region;
+    int max_samples;
+    double threshold;
+    double time_budget;
+    std::chrono::steady_clock::time_point start;
+
+    std::vector<unsigned char> sample_counts; // Per pixel of the region, empty without keep_sample_map
+
+    std::atomic<long long> ring_rays;
+    std::atomic<long long> pixels_refined;
+    std::atomic<long long> samples_added;
+    std::atomic<long long> pixels_over_budget;
+
+    // Largest difference of a channel between a pixel and its four neighbours, clamped to [0, 1] as in the image
+    float contrast(const SampleTile& first, int x, int y) const;
+
+    // Standard error of the mean of the samples, the largest of the channels
+    float standard_error(const std::vector<Sample>& samples) const;
+
+    // Uniform in [0, 1) from the pixel, the sample and the coordinate
+    static float jitter(int x, int y, int sample, int coordinate);
+};
+
+template <typename TraceSample>
+void AdaptiveSampler::refine(const Tile& tile, const SampleTile& first, BandPixels& pixels, TraceSample trace_sample)
+{
+    std::vector<Sample> samples;
+    long long refined = 0, added = 0, over_budget = 0;
+    for (int y = tile.y_begin; y < tile.y_end; y++)
+    {
+        for (int x = tile.x_begin; x < tile.x_end; x++)
+        {
+            Pixel pixel = first(x, y);
+            samples.assign(1, Sample{0, 0, pixel});
+            if (contrast(first, x, y) > threshold)
+            {
+                if (time_budget > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > time_budget)
+                    over_budget++;
+                else
+                {
+                    refined++;
+                    for (int strata = 2; strata * strata <= max_samples && standard_error(samples) > threshold; strata *= 2)
+                    {
+                        // One sample in every stratum that has none yet
+                        std::vector<bool> is_covered(strata * strata, false);
+                        for (const Sample& sample : samples)
+                            is_covered[std::min(int(sample.v * strata), strata - 1) * strata + std::min(int(sample.u * strata), strata - 1)] = true;
+                        for (int stratum = 0; stratum < strata * strata; stratum++)
+                        {
+                            if (is_covered[stratum])
+                                continue;
+                            int n = samples.size();
+                            float u = (stratum % strata + jitter(x, y, n, 0)) / strata;
+                            float v = (stratum / strata + jitter(x, y, n, 1)) / strata;
+                            samples.push_back(Sample{u, v, trace_sample(x, y, u, v, n)});
+                        }
+                    }
+                    added += samples.size() - 1;
+
+                    Pixel sum(0, 0, 0, 0);
+                    for (const Sample& sample : samples)
+                    {
+                        sum.r += sample.color.r;
+                        sum.g += sample.color.g;
+                        sum.b += sample.color.b;
+                        sum.a += sample.color.a;
+                    }
+                    float scale = 1.f / samples.size();
+                    pixel = Pixel(sum.r * scale, sum.g * scale, sum.b * scale, sum.a * scale);
+                }
+            }
+            pixels(x, y) = pixel;
+            if (!sample_counts.empty())
+                sample_counts[std::size_t(y - region.y_begin) * (region.x_end - region.x_begin) + x - region.x_begin] = samples.size();
+        }
+    }
+    ring_rays += (long long)(first.traced.x_end - first.traced.x_begin) * (first.traced.y_end - first.traced.y_begin)
+               - (long long)(tile.x_end - tile.x_begin) * (tile.y_end - tile.y_begin);
+    pixels_refined += refined;
+    samples_added += added;
+    pixels_over_budget += over_budget;
+}
+
+#endif
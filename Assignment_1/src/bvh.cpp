@@ -0,0 +1,957 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Relative costs used by the surface area heuristic
+    const double traversal_cost = 1.0;
+    const double intersection_cost = 1.0;
+
+    // Number of bins used to evaluate the candidate splits along each axis
+    const int sah_bins = 16;
+
+    // Leaves are never bigger than this, unless all the centroids coincide or the tree cannot get deeper
+    const int max_leaf_size = 8;
+
+    double surface_area(const Vector3d& box_min, const Vector3d& box_max)
+    {
+        Vector3d extent = (box_max - box_min).cwiseMax(0.);
+        return 2 * (extent(0) * extent(1) + extent(1) * extent(2) + extent(2) * extent(0));
+    }
+
+    // Nearest Scalar below or above x, or x itself, so that a box rounded this way still contains what it bounded
+    template <typename Scalar>
+    Scalar round_down(double x)
+    {
+        Scalar rounded = Scalar(x);
+        return rounded > x ? nextafter(rounded, -numeric_limits<Scalar>::infinity()) : rounded;
+    }
+
+    template <typename Scalar>
+    Scalar round_up(double x)
+    {
+        Scalar rounded = Scalar(x);
+        return rounded < x ? nextafter(rounded, numeric_limits<Scalar>::infinity()) : rounded;
+    }
+}
+
+void BVH::build(const vector<MatrixXd>& vertices, const vector<MatrixXi>& faces, int first_mesh)
+{
+    auto start = chrono::steady_clock::now();
+
+    nodes.clear();
+    triangles.clear();
+    built_costs.clear();
+    garbage_nodes = 0;
+    this->first_mesh = first_mesh;
+
+    // Bounds and centroid of every triangle
+    vector<int> order;
+    vector<int> meshes, mesh_faces;
+    vector<Vector3d> centroids, box_mins, box_maxs;
+    for (int mesh_i = 0; mesh_i < faces.size(); mesh_i++)
+    {
+        for (int face_i = 0; face_i < faces[mesh_i].rows(); face_i++)
+        {
+            Vector3d box_min = Vector3d::Constant(numeric_limits<double>::infinity());
+            Vector3d box_max = -box_min;
+            for (int k = 0; k < 3; k++)
+            {
+                Vector3d p = vertices[mesh_i].row(faces[mesh_i](face_i, k)).transpose();
+                box_min = box_min.cwiseMin(p);
+                box_max = box_max.cwiseMax(p);
+            }
+            order.push_back(order.size());
+            meshes.push_back(mesh_i);
+            mesh_faces.push_back(face_i);
+            box_mins.push_back(box_min);
+            box_maxs.push_back(box_max);
+            centroids.push_back((box_min + box_max) / 2);
+        }
+    }
+
+    if (!order.empty())
+    {
+        nodes.reserve(2 * order.size());
+        nodes.push_back(Node());
+        build_recursive(order, centroids, box_mins, box_maxs, 0, 0, 0, order.size());
+    }
+    nodes.shrink_to_fit();
+
+    // Copy the triangles in leaf order
+    for (int k : order)
+    {
+        const MatrixXd& V = vertices[meshes[k]];
+        const MatrixXi& F = faces[meshes[k]];
+        int face_i = mesh_faces[k];
+        Vector3d a(V(F(face_i, 0), 0), V(F(face_i, 0), 1), V(F(face_i, 0), 2));
+        Vector3d b(V(F(face_i, 1), 0), V(F(face_i, 1), 1), V(F(face_i, 1), 2));
+        Vector3d c(V(F(face_i, 2), 0), V(F(face_i, 2), 1), V(F(face_i, 2), 2));
+        triangles.add(a, b, c, first_mesh + meshes[k], face_i);
+    }
+    triangles.finalize();
+
+#ifdef COMPACT_BVH
+    compact.build(*this);
+#endif
+
+    build_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void BVH::build_nodes(const vector<Vector3d>& box_mins, const vector<Vector3d>& box_maxs, vector<int>& order)
+{
+    auto start = chrono::steady_clock::now();
+
+    nodes.clear();
+    triangles.clear();
+    built_costs.clear();
+    garbage_nodes = 0;
+    order.resize(box_mins.size());
+    vector<Vector3d> centroids(box_mins.size()), sorted_mins = box_mins, sorted_maxs = box_maxs;
+    for (int k = 0; k < order.size(); k++)
+    {
+        order[k] = k;
+        centroids[k] = (box_mins[k] + box_maxs[k]) / 2;
+    }
+
+    if (!order.empty())
+    {
+        nodes.reserve(2 * order.size());
+        nodes.push_back(Node());
+        build_recursive(order, centroids, sorted_mins, sorted_maxs, 0, 0, 0, order.size());
+    }
+    nodes.shrink_to_fit();
+    triangles.finalize();
+
+    build_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+BVHUpdate BVH::update(const vector<MatrixXd>& vertices, const vector<MatrixXi>& faces, double rebuild_threshold)
+{
+    BVHUpdate update;
+    if (nodes.empty())
+        return update;
+    auto start = chrono::steady_clock::now();
+
+    // The boxes still hold the triangles as built, so the first update can measure the costs of the build
+    if (built_costs.size() != nodes.size())
+    {
+        built_costs.assign(nodes.size(), 0);
+        compute_costs(0, built_costs);
+    }
+
+    vector<double> costs(nodes.size(), 0);
+    refit_subtree(0, vertices, faces, costs);
+    update.refit_cost = update.cost = costs[0] / built_costs[0];
+    auto refit_end = chrono::steady_clock::now();
+    update.refit_time = chrono::duration<double>(refit_end - start).count();
+
+    // Lowest subtrees that got worse: a degraded node is rebuilt unless one of its children degraded too,
+    // in which case the children are looked at first. Leaves keep their cost and never degrade.
+    vector<int> rebuilds, rebuild_depths;
+    int rebuilt_triangles = 0;
+    vector<pair<int, int>> stack = {{0, 0}};
+    while (!stack.empty())
+    {
+        int node = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        if (nodes[node].count > 0)
+            continue;
+
+        int left = nodes[node].first, right = left + 1;
+        auto is_degraded = [&](int n) { return nodes[n].count == 0 && costs[n] > (1 + rebuild_threshold) * built_costs[n]; };
+        if (is_degraded(node) && !is_degraded(left) && !is_degraded(right))
+        {
+            int first, count;
+            subtree_range(node, first, count);
+            rebuilds.push_back(node);
+            rebuild_depths.push_back(depth);
+            rebuilt_triangles += count;
+            continue;
+        }
+        stack.push_back({left, depth + 1});
+        stack.push_back({right, depth + 1});
+    }
+
+    if (!rebuilds.empty())
+    {
+        if (rebuilds[0] == 0 || 2 * rebuilt_triangles > triangles.size() || garbage_nodes > int(nodes.size()) / 2)
+        {
+            double refit_time = update.refit_time;
+            build(vertices, faces, first_mesh);
+            built_costs.assign(nodes.size(), 0);
+            compute_costs(0, built_costs);
+            update.refit_time = refit_time;
+            update.is_full_rebuild = true;
+            update.subtrees_rebuilt = 1;
+            update.triangles_rebuilt = triangles.size();
+        }
+        else
+        {
+            for (int k = 0; k < rebuilds.size(); k++)
+                rebuild_subtree(rebuilds[k], rebuild_depths[k], vertices, faces);
+            update.subtrees_rebuilt = rebuilds.size();
+            update.triangles_rebuilt = rebuilt_triangles;
+        }
+
+        // The ancestors of the rebuilt subtrees keep their boxes, only their costs change
+        costs.assign(nodes.size(), 0);
+        compute_costs(0, costs);
+        update.cost = costs[0] / built_costs[0];
+        update.rebuild_time = chrono::duration<double>(chrono::steady_clock::now() - refit_end).count();
+    }
+
+#ifdef COMPACT_BVH
+    // The wide tree has no refit, it is collapsed again from the binary one
+    if (!update.is_full_rebuild)
+    {
+        auto compact_start = chrono::steady_clock::now();
+        compact.build(*this);
+        update.rebuild_time += chrono::duration<double>(chrono::steady_clock::now() - compact_start).count();
+    }
+#endif
+    return update;
+}
+
+double BVH::node_cost(int node, const vector<double>& costs) const
+{
+    const Node& n = nodes[node];
+    if (n.count > 0)
+        return intersection_cost * n.count;
+    const Node& left = nodes[n.first];
+    const Node& right = nodes[n.first + 1];
+    double area = surface_area(n.box_min, n.box_max);
+    if (area <= 0)
+        return traversal_cost + costs[n.first] + costs[n.first + 1];
+    return traversal_cost + (surface_area(left.box_min, left.box_max) * costs[n.first] + surface_area(right.box_min, right.box_max) * costs[n.first + 1]) / area;
+}
+
+void BVH::compute_costs(int node, vector<double>& costs) const
+{
+    if (nodes[node].count == 0)
+    {
+        compute_costs(nodes[node].first, costs);
+        compute_costs(nodes[node].first + 1, costs);
+    }
+    costs[node] = node_cost(node, costs);
+}
+
+void BVH::refit_subtree(int node, const vector<MatrixXd>& vertices, const vector<MatrixXi>& faces, vector<double>& costs)
+{
+    Node& n = nodes[node];
+    if (n.count > 0)
+    {
+        n.box_min = Vector3d::Constant(numeric_limits<double>::infinity());
+        n.box_max = -n.box_min;
+        for (int i = n.first; i < n.first + n.count; i++)
+        {
+            Vector3d corners[3];
+            triangle_corners(i, vertices, faces, corners);
+            triangles.set(i, corners[0], corners[1], corners[2], triangles.mesh[i], triangles.face[i]);
+            for (const Vector3d& corner : corners)
+            {
+                n.box_min = n.box_min.cwiseMin(corner);
+                n.box_max = n.box_max.cwiseMax(corner);
+            }
+        }
+    }
+    else
+    {
+        refit_subtree(n.first, vertices, faces, costs);
+        refit_subtree(n.first + 1, vertices, faces, costs);
+        n.box_min = nodes[n.first].box_min.cwiseMin(nodes[n.first + 1].box_min);
+        n.box_max = nodes[n.first].box_max.cwiseMax(nodes[n.first + 1].box_max);
+    }
+    costs[node] = node_cost(node, costs);
+}
+
+void BVH::rebuild_subtree(int node, int depth, const vector<MatrixXd>& vertices, const vector<MatrixXi>& faces)
+{
+    int first, count;
+    subtree_range(node, first, count);
+
+    // Its nodes below the root are dropped
+    vector<int> stack = {node};
+    while (!stack.empty())
+    {
+        int n = stack.back();
+        stack.pop_back();
+        if (nodes[n].count == 0)
+        {
+            stack.push_back(nodes[n].first);
+            stack.push_back(nodes[n].first + 1);
+            garbage_nodes += 2;
+        }
+    }
+
+    // Build over the range as if it was a whole tree, then shift the leaves to the range
+    vector<int> order(count);
+    vector<int> meshes(count), mesh_faces(count);
+    vector<Vector3d> centroids(count), box_mins(count), box_maxs(count);
+    for (int k = 0; k < count; k++)
+    {
+        Vector3d corners[3];
+        triangle_corners(first + k, vertices, faces, corners);
+        order[k] = k;
+        meshes[k] = triangles.mesh[first + k];
+        mesh_faces[k] = triangles.face[first + k];
+        box_mins[k] = corners[0].cwiseMin(corners[1]).cwiseMin(corners[2]);
+        box_maxs[k] = corners[0].cwiseMax(corners[1]).cwiseMax(corners[2]);
+        centroids[k] = (box_mins[k] + box_maxs[k]) / 2;
+    }
+    int first_new_node = nodes.size();
+    build_recursive(order, centroids, box_mins, box_maxs, node, depth, 0, count);
+    if (nodes[node].count > 0)
+        nodes[node].first += first;
+    for (int n = first_new_node; n < nodes.size(); n++)
+        if (nodes[n].count > 0)
+            nodes[n].first += first;
+
+    // Copy the triangles in their new leaf order
+    for (int k = 0; k < count; k++)
+    {
+        triangles.mesh[first + k] = meshes[order[k]];
+        triangles.face[first + k] = mesh_faces[order[k]];
+        Vector3d corners[3];
+        triangle_corners(first + k, vertices, faces, corners);
+        triangles.set(first + k, corners[0], corners[1], corners[2], triangles.mesh[first + k], triangles.face[first + k]);
+    }
+
+    built_costs.resize(nodes.size(), 0);
+    compute_costs(node, built_costs);
+}
+
+void BVH::subtree_range(int node, int& first, int& count) const
+{
+    // The triangles of a subtree are contiguous, from its leftmost to its rightmost leaf
+    int leftmost = node, rightmost = node;
+    while (nodes[leftmost].count == 0)
+        leftmost = nodes[leftmost].first;
+    while (nodes[rightmost].count == 0)
+        rightmost = nodes[rightmost].first + 1;
+    first = nodes[leftmost].first;
+    count = nodes[rightmost].first + nodes[rightmost].count - first;
+}
+
+void BVH::triangle_corners(int i, const vector<MatrixXd>& vertices, const vector<MatrixXi>& faces, Vector3d corners[3]) const
+{
+    const MatrixXd& V = vertices[triangles.mesh[i] - first_mesh];
+    const MatrixXi& F = faces[triangles.mesh[i] - first_mesh];
+    int face_i = triangles.face[i];
+    for (int k = 0; k < 3; k++)
+        corners[k] = Vector3d(V(F(face_i, k), 0), V(F(face_i, k), 1), V(F(face_i, k), 2));
+}
+
+void BVH::build_recursive(vector<int>& order, vector<Vector3d>& centroids, vector<Vector3d>& box_mins, vector<Vector3d>& box_maxs, int node_index, int depth, int first, int count)
+{
+    Vector3d box_min = Vector3d::Constant(numeric_limits<double>::infinity());
+    Vector3d box_max = -box_min;
+    Vector3d centroid_min = box_min;
+    Vector3d centroid_max = box_max;
+    for (int i = first; i < first + count; i++)
+    {
+        box_min = box_min.cwiseMin(box_mins[i]);
+        box_max = box_max.cwiseMax(box_maxs[i]);
+        centroid_min = centroid_min.cwiseMin(centroids[i]);
+        centroid_max = centroid_max.cwiseMax(centroids[i]);
+    }
+    nodes[node_index].box_min = box_min;
+    nodes[node_index].box_max = box_max;
+    nodes[node_index].first = first;
+    nodes[node_index].count = count;
+    nodes[node_index].axis = 0;
+
+    if (count == 1 || depth == traversal_stack_size - 1)
+        return;
+
+    // Evaluate the binned SAH on the three axes
+    double best_cost = numeric_limits<double>::infinity();
+    int best_axis = -1;
+    int best_bin = 0;
+    Vector3d centroid_extent = centroid_max - centroid_min;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (centroid_extent(axis) <= 0)
+            continue;
+
+        int bin_counts[sah_bins] = {0};
+        Vector3d bin_mins[sah_bins], bin_maxs[sah_bins];
+        for (int b = 0; b < sah_bins; b++)
+        {
+            bin_mins[b] = Vector3d::Constant(numeric_limits<double>::infinity());
+            bin_maxs[b] = -bin_mins[b];
+        }
+
+        double bin_scale = sah_bins / centroid_extent(axis);
+        for (int i = first; i < first + count; i++)
+        {
+            int b = min(sah_bins - 1, int((centroids[i](axis) - centroid_min(axis)) * bin_scale));
+            bin_counts[b]++;
+            bin_mins[b] = bin_mins[b].cwiseMin(box_mins[i]);
+            bin_maxs[b] = bin_maxs[b].cwiseMax(box_maxs[i]);
+        }
+
+        // Sweep from the right to get the area and count of every right side
+        double right_areas[sah_bins];
+        int right_counts[sah_bins];
+        Vector3d sweep_min = Vector3d::Constant(numeric_limits<double>::infinity());
+        Vector3d sweep_max = -sweep_min;
+        int sweep_count = 0;
+        for (int b = sah_bins - 1; b > 0; b--)
+        {
+            sweep_min = sweep_min.cwiseMin(bin_mins[b]);
+            sweep_max = sweep_max.cwiseMax(bin_maxs[b]);
+            sweep_count += bin_counts[b];
+            right_areas[b] = surface_area(sweep_min, sweep_max);
+            right_counts[b] = sweep_count;
+        }
+
+        // Then from the left, the split b puts bins [0, b) on the left side
+        sweep_min = Vector3d::Constant(numeric_limits<double>::infinity());
+        sweep_max = -sweep_min;
+        sweep_count = 0;
+        for (int b = 1; b < sah_bins; b++)
+        {
+            sweep_min = sweep_min.cwiseMin(bin_mins[b - 1]);
+            sweep_max = sweep_max.cwiseMax(bin_maxs[b - 1]);
+            sweep_count += bin_counts[b - 1];
+            if (sweep_count == 0 || right_counts[b] == 0)
+                continue;
+
+            double cost = surface_area(sweep_min, sweep_max) * sweep_count + right_areas[b] * right_counts[b];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    double leaf_cost = intersection_cost * count;
+    double split_cost = traversal_cost + intersection_cost * best_cost / surface_area(box_min, box_max);
+
+    int middle;
+    if (best_axis >= 0)
+    {
+        if (count <= max_leaf_size && leaf_cost <= split_cost)
+            return;
+
+        // Partition the range around the chosen bin boundary
+        double bin_scale = sah_bins / centroid_extent(best_axis);
+        middle = first;
+        for (int i = first; i < first + count; i++)
+        {
+            int b = min(sah_bins - 1, int((centroids[i](best_axis) - centroid_min(best_axis)) * bin_scale));
+            if (b < best_bin)
+            {
+                swap(centroids[i], centroids[middle]);
+                swap(box_mins[i], box_mins[middle]);
+                swap(box_maxs[i], box_maxs[middle]);
+                swap(order[i], order[middle]);
+                middle++;
+            }
+        }
+    }
+    else
+    {
+        // All the centroids coincide, no split can help unless the leaf is too big
+        if (count <= max_leaf_size)
+            return;
+        middle = first + count / 2;
+    }
+
+    // Allocate both children together, the right one directly follows the left one
+    int left_index = nodes.size();
+    nodes[node_index].first = left_index;
+    nodes[node_index].count = 0;
+    nodes[node_index].axis = max(best_axis, 0);
+    nodes.resize(nodes.size() + 2);
+
+    build_recursive(order, centroids, box_mins, box_maxs, left_index, depth + 1, first, middle - first);
+    build_recursive(order, centroids, box_mins, box_maxs, left_index + 1, depth + 1, middle, first + count - middle);
+}
+
+template <typename Scalar>
+bool BasicBVH<Scalar>::intersect_box(const Node& node, const Vector3& ray_origin, const Vector3& inverse_direction, Scalar t_max, Scalar& t_entry)
+{
+    Scalar t_near = 0;
+    Scalar t_far = t_max;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        Scalar t_0 = (node.box_min(axis) - ray_origin(axis)) * inverse_direction(axis);
+        Scalar t_1 = (node.box_max(axis) - ray_origin(axis)) * inverse_direction(axis);
+        if (t_0 > t_1)
+            swap(t_0, t_1);
+        t_near = max(t_near, t_0);
+        t_far = min(t_far, t_1);
+    }
+    t_entry = t_near;
+    return t_near <= t_far;
+}
+
+template <typename Scalar>
+template <typename Other>
+void BasicBVH<Scalar>::assign(const BasicBVH<Other>& other)
+{
+    nodes.resize(other.nodes.size());
+    for (int k = 0; k < nodes.size(); k++)
+    {
+        const typename BasicBVH<Other>::Node& node = other.nodes[k];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            nodes[k].box_min(axis) = round_down<Scalar>(node.box_min(axis));
+            nodes[k].box_max(axis) = round_up<Scalar>(node.box_max(axis));
+        }
+        nodes[k].first = node.first;
+        nodes[k].count = node.count;
+        nodes[k].axis = node.axis;
+    }
+    triangles.assign(other.triangles);
+    build_time = other.build_time;
+}
+
+template <typename Scalar>
+bool BasicBVH<Scalar>::intersect(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, TraversalStats* stats) const
+{
+    if (stats)
+        stats->rays++;
+    if (nodes.empty())
+        return false;
+
+    return closest_hit(ray_origin, ray_direction, t_max, hit, stats);
+}
+
+template <typename Scalar>
+bool BasicBVH<Scalar>::intersect_binary(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, TraversalStats* stats) const
+{
+    if (stats)
+        stats->rays++;
+    if (nodes.empty())
+        return false;
+
+    return intersect_subtree(0, ray_origin, ray_direction, t_max, hit, stats);
+}
+
+template <typename Scalar>
+bool BasicBVH<Scalar>::closest_hit(const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max, Hit& hit, TraversalStats* stats) const
+{
+#ifdef COMPACT_BVH
+    if constexpr (is_same<Scalar, double>::value)
+        return compact.intersect(triangles, ray_origin, ray_direction, t_max, hit, stats);
+#endif
+    return intersect_subtree(0, ray_origin, ray_direction, t_max, hit, stats);
+}
+
+template <typename Scalar>
+bool BasicBVH<Scalar>::intersect_subtree(int root, const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max, Hit& hit, TraversalStats* stats) const
+{
+    Vector3 inverse_direction = ray_direction.cwiseInverse();
+    Scalar t_entry;
+    if (!intersect_box(nodes[root], ray_origin, inverse_direction, t_max, t_entry))
+        return false;
+
+    struct StackEntry
+    {
+        int node;
+        Scalar t_entry;
+    };
+    StackEntry stack[traversal_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = {root, t_entry};
+
+    bool is_intersected = false;
+    Scalar smallest_t = t_max;
+    long long nodes_visited = 0;
+    long long triangle_tests = 0;
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_entry >= smallest_t)
+            continue;
+
+        const Node& node = nodes[entry.node];
+        nodes_visited++;
+
+        if (node.count > 0)
+        {
+            triangle_tests += node.count;
+            int nearest = triangles.intersect(node.first, node.count, ray_origin, ray_direction, smallest_t);
+#ifdef INSTRUMENT_RENDER
+            count_mesh_tests(stats, node.first, node.count);
+#endif
+            if (nearest >= 0)
+            {
+                is_intersected = true;
+                hit.t = smallest_t;
+                hit.mesh = triangles.mesh[nearest];
+                hit.face = triangles.face[nearest];
+                hit.primitive = nearest;
+                hit.instance = -1;
+            }
+            continue;
+        }
+
+        // Push the far child first so that the near one is visited first
+        assert(stack_size + 2 <= traversal_stack_size);
+        Scalar t_left, t_right;
+        bool hit_left = intersect_box(nodes[node.first], ray_origin, inverse_direction, smallest_t, t_left);
+        bool hit_right = intersect_box(nodes[node.first + 1], ray_origin, inverse_direction, smallest_t, t_right);
+        if (hit_left && hit_right)
+        {
+            if (t_left <= t_right)
+            {
+                stack[stack_size++] = {node.first + 1, t_right};
+                stack[stack_size++] = {node.first, t_left};
+            }
+            else
+            {
+                stack[stack_size++] = {node.first, t_left};
+                stack[stack_size++] = {node.first + 1, t_right};
+            }
+        }
+        else if (hit_left)
+            stack[stack_size++] = {node.first, t_left};
+        else if (hit_right)
+            stack[stack_size++] = {node.first + 1, t_right};
+    }
+
+    if (stats)
+    {
+        stats->nodes_visited += nodes_visited;
+        stats->triangle_tests += triangle_tests;
+    }
+    t_max = smallest_t;
+    return is_intersected;
+}
+
+template <typename Scalar>
+bool BasicBVH<Scalar>::occluded(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, int* last_occluder, TraversalStats* stats) const
+{
+    if (stats)
+        stats->rays++;
+    if (nodes.empty())
+        return false;
+
+    // Neighbouring shadow rays are usually blocked by the same triangle
+    if (last_occluder && *last_occluder >= 0)
+    {
+        if (stats)
+            stats->triangle_tests++;
+#ifdef INSTRUMENT_RENDER
+        count_mesh_tests(stats, *last_occluder, 1);
+#endif
+        if (triangles.occluded(*last_occluder, 1, ray_origin, ray_direction, t_max) >= 0)
+        {
+            if (stats)
+            {
+                stats->occluded++;
+                stats->cache_hits++;
+            }
+            return true;
+        }
+    }
+
+    int occluder = find_occluder(ray_origin, ray_direction, t_max, stats);
+    if (stats && occluder >= 0)
+        stats->occluded++;
+    if (last_occluder)
+        *last_occluder = occluder;
+    return occluder >= 0;
+}
+
+template <typename Scalar>
+bool BasicBVH<Scalar>::occluded_binary(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats) const
+{
+    if (stats)
+        stats->rays++;
+    if (nodes.empty())
+        return false;
+
+    int occluder = find_binary_occluder(ray_origin, ray_direction, t_max, stats);
+    if (stats && occluder >= 0)
+        stats->occluded++;
+    return occluder >= 0;
+}
+
+template <typename Scalar>
+int BasicBVH<Scalar>::find_occluder(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats) const
+{
+#ifdef COMPACT_BVH
+    if constexpr (is_same<Scalar, double>::value)
+        return compact.find_occluder(triangles, ray_origin, ray_direction, t_max, stats);
+#endif
+    return find_binary_occluder(ray_origin, ray_direction, t_max, stats);
+}
+
+template <typename Scalar>
+int BasicBVH<Scalar>::find_binary_occluder(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats) const
+{
+    Vector3 inverse_direction = ray_direction.cwiseInverse();
+    int stack[traversal_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    int occluder = -1;
+    long long nodes_visited = 0;
+    long long triangle_tests = 0;
+
+    while (stack_size > 0 && occluder < 0)
+    {
+        const Node& node = nodes[stack[--stack_size]];
+        Scalar t_entry;
+        if (!intersect_box(node, ray_origin, inverse_direction, t_max, t_entry))
+            continue;
+        nodes_visited++;
+
+        if (node.count > 0)
+        {
+            triangle_tests += node.count;
+            occluder = triangles.occluded(node.first, node.count, ray_origin, ray_direction, t_max);
+#ifdef INSTRUMENT_RENDER
+            count_mesh_tests(stats, node.first, node.count);
+#endif
+            continue;
+        }
+
+        // A ray going towards +axis meets the left child first, push it last
+        assert(stack_size + 2 <= traversal_stack_size);
+        if (ray_direction(node.axis) < 0)
+        {
+            stack[stack_size++] = node.first;
+            stack[stack_size++] = node.first + 1;
+        }
+        else
+        {
+            stack[stack_size++] = node.first + 1;
+            stack[stack_size++] = node.first;
+        }
+    }
+
+    if (stats)
+    {
+        stats->nodes_visited += nodes_visited;
+        stats->triangle_tests += triangle_tests;
+    }
+    return occluder;
+}
+
+template <typename Scalar>
+template <int N>
+void BasicBVH<Scalar>::intersect_packet(const RayPacket<N, Scalar>& packet, Scalar t_max, Hit hits[N], bool is_intersected[N], TraversalStats* stats) const
+{
+    Scalar smallest_t[N];
+    int nearest[N];
+    for (int lane = 0; lane < N; lane++)
+    {
+        smallest_t[lane] = t_max;
+        nearest[lane] = -1;
+        is_intersected[lane] = false;
+    }
+    if (stats)
+        stats->rays += N;
+    if (nodes.empty())
+        return;
+
+#ifdef COMPACT_BVH
+    // The wide tree has no packet traversal, its rays go one by one
+    for (int lane = 0; lane < N; lane++)
+    {
+        Hit hit;
+        Vector3 ray_origin(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+        Vector3 ray_direction(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+        if (closest_hit(ray_origin, ray_direction, smallest_t[lane], hit, stats))
+            nearest[lane] = hit.primitive;
+    }
+#else
+    Scalar inverse_x[N], inverse_y[N], inverse_z[N];
+    for (int lane = 0; lane < N; lane++)
+    {
+        inverse_x[lane] = Scalar(1) / packet.dx[lane];
+        inverse_y[lane] = Scalar(1) / packet.dy[lane];
+        inverse_z[lane] = Scalar(1) / packet.dz[lane];
+    }
+
+    // Each entry keeps the lanes that entered the parent node
+    struct StackEntry
+    {
+        int node;
+        unsigned mask;
+    };
+    StackEntry stack[traversal_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = {0, (1u << N) - 1};
+
+    long long nodes_visited = 0;
+    long long triangle_tests = 0;
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+        const Node& node = nodes[entry.node];
+
+        // Slab test of the node box for every lane, with the same arithmetic as intersect_box()
+        unsigned mask = 0;
+        for (int lane = 0; lane < N; lane++)
+        {
+            Scalar t_near = 0;
+            Scalar t_far = smallest_t[lane];
+            const Scalar origin[3] = {packet.ox[lane], packet.oy[lane], packet.oz[lane]};
+            const Scalar inverse[3] = {inverse_x[lane], inverse_y[lane], inverse_z[lane]};
+            for (int axis = 0; axis < 3; axis++)
+            {
+                Scalar t_0 = (node.box_min(axis) - origin[axis]) * inverse[axis];
+                Scalar t_1 = (node.box_max(axis) - origin[axis]) * inverse[axis];
+                t_near = max(t_near, min(t_0, t_1));
+                t_far = min(t_far, max(t_0, t_1));
+            }
+            if (t_near <= t_far)
+                mask |= 1u << lane;
+        }
+        mask &= entry.mask;
+        if (!mask)
+            continue;
+
+        // The packet diverged, finish this subtree with the only ray left
+        if ((mask & (mask - 1)) == 0)
+        {
+            int lane = 0;
+            while (!(mask & (1u << lane)))
+                lane++;
+            Hit hit;
+            Vector3 ray_origin(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+            Vector3 ray_direction(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+            if (intersect_subtree(entry.node, ray_origin, ray_direction, smallest_t[lane], hit, stats))
+                nearest[lane] = hit.primitive;
+            continue;
+        }
+
+        nodes_visited++;
+
+        if (node.count > 0)
+        {
+            triangle_tests += node.count * bitset<32>(mask).count();
+            triangles.intersect_packet(node.first, node.count, packet, mask, smallest_t, nearest);
+#ifdef INSTRUMENT_RENDER
+            count_mesh_tests(stats, node.first, node.count, bitset<32>(mask).count());
+#endif
+            continue;
+        }
+
+        // Visit first the child that is nearer along the direction of the first active ray
+        int lane = 0;
+        while (!(mask & (1u << lane)))
+            lane++;
+        const Node& left = nodes[node.first];
+        const Node& right = nodes[node.first + 1];
+        Vector3 left_to_right = (right.box_min + right.box_max) - (left.box_min + left.box_max);
+        Scalar along_ray = left_to_right(0) * packet.dx[lane] + left_to_right(1) * packet.dy[lane] + left_to_right(2) * packet.dz[lane];
+        assert(stack_size + 2 <= traversal_stack_size);
+        if (along_ray >= 0)
+        {
+            stack[stack_size++] = {node.first + 1, mask};
+            stack[stack_size++] = {node.first, mask};
+        }
+        else
+        {
+            stack[stack_size++] = {node.first, mask};
+            stack[stack_size++] = {node.first + 1, mask};
+        }
+    }
+
+    if (stats)
+    {
+        stats->nodes_visited += nodes_visited;
+        stats->triangle_tests += triangle_tests;
+    }
+#endif
+
+    for (int lane = 0; lane < N; lane++)
+    {
+        if (nearest[lane] >= 0)
+        {
+            is_intersected[lane] = true;
+            hits[lane].t = smallest_t[lane];
+            hits[lane].mesh = triangles.mesh[nearest[lane]];
+            hits[lane].face = triangles.face[nearest[lane]];
+            hits[lane].primitive = nearest[lane];
+            hits[lane].instance = -1;
+        }
+    }
+}
+
+#ifdef INSTRUMENT_RENDER
+template <typename Scalar>
+void BasicBVH<Scalar>::count_mesh_tests(TraversalStats* stats, int first, int count, int rays) const
+{
+    if (!stats)
+        return;
+    for (int k = first; k < first + count; k++)
+    {
+        int mesh = triangles.mesh[k];
+        if (stats->mesh_triangle_tests.size() <= mesh)
+            stats->mesh_triangle_tests.resize(mesh + 1, 0);
+        stats->mesh_triangle_tests[mesh] += rays;
+    }
+}
+#endif
+
+template <typename Scalar>
+int BasicBVH<Scalar>::depth(int node) const
+{
+    if (nodes[node].count > 0)
+        return 1;
+    return 1 + max(depth(nodes[node].first), depth(nodes[node].first + 1));
+}
+
+template <typename Scalar>
+size_t BasicBVH<Scalar>::memory_bytes() const
+{
+    const BasicTriangleStore<Scalar>& t = triangles;
+    size_t scalars = t.ax.size() + t.ay.size() + t.az.size() + t.e1x.size() + t.e1y.size() + t.e1z.size() + t.e2x.size() + t.e2y.size()
+                   + t.e2z.size() + t.ngx.size() + t.ngy.size() + t.ngz.size() + t.nx.size() + t.ny.size() + t.nz.size();
+    size_t bytes = nodes.size() * sizeof(Node) + scalars * sizeof(Scalar) + (t.mesh.size() + t.face.size()) * sizeof(int);
+#ifdef COMPACT_BVH
+    bytes += compact.node_bytes() + compact.triangle_bytes();
+#endif
+    return bytes;
+}
+
+template <typename Scalar>
+void BasicBVH<Scalar>::print_summary() const
+{
+    int leaves = 0;
+    for (const Node& node : nodes)
+        leaves += node.count > 0;
+
+    cout << "BVH: " << triangles.size() << " triangles, " << nodes.size() << " nodes (" << leaves << " leaves), depth "
+         << (nodes.empty() ? 0 : depth(0)) << ", " << memory_bytes() / 1e6 << " MB, built in " << build_time * 1000 << " ms" << endl;
+#ifdef COMPACT_BVH
+    cout << "Compact BVH: " << COMPACT_BVH << " children per node, " << compact.nodes.size() << " nodes, walked through "
+         << (compact.node_bytes() + compact.triangle_bytes()) / 1e6 << " MB of nodes and float triangles instead of "
+         << (nodes.size() * sizeof(Node) + triangles.size() * 12 * sizeof(Scalar)) / 1e6 << " MB" << endl;
+#endif
+}
+
+template class BasicBVH<double>;
+template class BasicBVH<float>;
+
+template void BasicBVH<float>::assign(const BasicBVH<double>&);
+
+template void BasicBVH<double>::intersect_packet<4>(const RayPacket<4, double>&, double, Hit[4], bool[4], TraversalStats*) const;
+template void BasicBVH<double>::intersect_packet<8>(const RayPacket<8, double>&, double, Hit[8], bool[8], TraversalStats*) const;
+template void BasicBVH<float>::intersect_packet<4>(const RayPacket<4, float>&, float, Hit[4], bool[4], TraversalStats*) const;
+template void BasicBVH<float>::intersect_packet<8>(const RayPacket<8, float>&, float, Hit[8], bool[8], TraversalStats*) const;
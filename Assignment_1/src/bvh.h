@@ -0,0 +1,276 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <Eigen/Core>
+#include "triangles.h"
+
+// Entries of the fixed stacks of the traversals. The builds keep every leaf at most traversal_stack_size - 1 levels
+// below the root, and a binary traversal holds at most the two children of the node it visits and one sibling for
+// each level above it, so that the stacks cannot overflow.
+const int traversal_stack_size = 64;
+
+// Closest intersection found along a ray
+struct Hit
+{
+    double t;
+    int mesh; // Index of the mesh (off file) that was hit, -1 for one of the spheres of a Tracer
+    int face; // Index of the face inside that mesh, or of the sphere
+    int primitive; // Index of the triangle in BVH::triangles, -1 for a sphere
+    int instance; // Index in InstanceBVH::instances for a hit on an instanced mesh, -1 otherwise
+};
+
+// Traversal counters, accumulated over all the rays traced by the caller
+struct TraversalStats
+{
+    long long rays;
+    long long nodes_visited;
+    long long triangle_tests;
+
+    // Shadow rays only: rays that hit an occluder, and how many of them were stopped by the last occluder cache
+    long long occluded;
+    long long cache_hits;
+
+#ifdef INSTRUMENT_RENDER
+    // Triangle tests by mesh of the triangle, to find the meshes that cost the most
+    std::vector<long long> mesh_triangle_tests;
+#endif
+
+    TraversalStats() : rays(0), nodes_visited(0), triangle_tests(0), occluded(0), cache_hits(0) {}
+
+    TraversalStats& operator+=(const TraversalStats& other)
+    {
+        rays += other.rays;
+        nodes_visited += other.nodes_visited;
+        triangle_tests += other.triangle_tests;
+        occluded += other.occluded;
+        cache_hits += other.cache_hits;
+#ifdef INSTRUMENT_RENDER
+        if (mesh_triangle_tests.size() < other.mesh_triangle_tests.size())
+            mesh_triangle_tests.resize(other.mesh_triangle_tests.size(), 0);
+        for (int mesh = 0; mesh < other.mesh_triangle_tests.size(); mesh++)
+            mesh_triangle_tests[mesh] += other.mesh_triangle_tests[mesh];
+#endif
+        return *this;
+    }
+};
+
+// What BVH::update() did for a frame
+struct BVHUpdate
+{
+    double refit_time;    // Seconds spent moving the triangles and the boxes
+    double rebuild_time;  // Seconds spent rebuilding subtrees
+    int subtrees_rebuilt;
+    int triangles_rebuilt;
+    bool is_full_rebuild;
+    double refit_cost;    // SAH cost after the refit, relative to the cost when the tree was built
+    double cost;          // Same after the rebuilds
+
+    BVHUpdate() : refit_time(0), rebuild_time(0), subtrees_rebuilt(0), triangles_rebuilt(0), is_full_rebuild(false), refit_cost(1), cost(1) {}
+};
+
+class BVH;
+
+// Compact copy of the binary tree of a BVH for scenes that do not fit in the caches. Each node holds up to Width
+// children, the grandchildren of the binary tree pulled up, with their boxes quantized to 8 bits per plane relative to
+// the box of the node and rounded outwards. The triangles of the leaves are copied as floats, 40 bytes each instead of
+// the 128 of TriangleStore. The float test only rejects the triangles that are missed by more than its rounding error,
+// and those that pass are tested again with the doubles of BVH::triangles, so the hits are those of the binary tree.
+template <int Width>
+class WideBVH
+{
+public:
+    struct Node
+    {
+        // Child k spans origin + lo[axis][k] * 2^exponent[axis] to origin + hi[axis][k] * 2^exponent[axis]
+        float origin[3];
+        signed char exponent[3];
+        unsigned char child_count;
+        unsigned char lo[3][Width];
+        unsigned char hi[3][Width];
+        unsigned char triangle_count[Width]; // Triangles of a leaf child, 0 for an inner child
+        int first_child;    // The inner children are consecutive nodes, in the order of the children
+        int first_triangle; // The triangles of the leaf children follow each other, in the order of the children
+    };
+
+    std::vector<Node> nodes;
+
+    // Leaf triangles: first vertex and the edges of TriangleStore, and their index in BVH::triangles
+    std::vector<float> ax, ay, az;
+    std::vector<float> e1x, e1y, e1z;
+    std::vector<float> e2x, e2y, e2z;
+    std::vector<int> primitive;
+
+    // Largest |x| + |y| + |z| of a vertex, which bounds the rounding of the float test
+    float magnitude;
+
+    WideBVH() : magnitude(0) {}
+
+    // Collapse the binary tree of bvh, again after every change of bvh. A BVH of build_nodes() gives an empty tree.
+    void build(const BVH& bvh);
+
+    // Same queries as BVH::intersect() and BVH::find_occluder(), on the triangles of the BVH the tree was built from.
+    // intersect() lowers t_max to the distance of the hit, neither counts a ray in stats.
+    bool intersect(const TriangleStore& triangles, const Eigen::Vector3d& ray_origin, const Eigen::Vector3d& ray_direction, double& t_max, Hit& hit, TraversalStats* stats) const;
+    int find_occluder(const TriangleStore& triangles, const Eigen::Vector3d& ray_origin, const Eigen::Vector3d& ray_direction, double t_max, TraversalStats* stats) const;
+
+    // Bytes of the nodes and of the float triangles
+    size_t node_bytes() const { return nodes.size() * sizeof(Node); }
+    size_t triangle_bytes() const { return (9 * ax.size()) * sizeof(float) + primitive.size() * sizeof(int); }
+
+private:
+    struct Ray;
+
+    // Slab tests of the children of node, returns the bits of the children hit in [0, t_max) and their entry distances
+    unsigned intersect_children(const Node& node, const Ray& ray, double t_max, double t_entries[Width]) const;
+
+    // Float test of the triangles [first, first + count), count <= 8: returns the bits of those that may be hit with 0 < t < t_max
+    unsigned candidates(int first, int count, const Ray& ray, double t_max) const;
+
+    // Fill the node at index with the given children, see wide_bvh.cpp
+    struct Child;
+    void build_node(const BVH& bvh, int index, const std::vector<Child>& children);
+    std::vector<Child> expand(const BVH& bvh, const Child& child) const;
+};
+
+template <typename Scalar>
+class BasicInstanceBVH;
+
+// Bounding volume hierarchy over triangles, with its boxes and triangles in Scalar, and its queries. BVH builds it in
+// double; a float copy made by assign() has its boxes rounded outwards, so that they still contain their triangles.
+template <typename Scalar>
+class BasicBVH
+{
+public:
+    typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+
+    struct Node
+    {
+        Vector3 box_min;
+        Vector3 box_max;
+        int first; // Leaf: first triangle in triangles. Inner node: index of the left child, the right one follows it
+        int count; // Number of triangles in a leaf, 0 for inner nodes
+        int axis; // Inner node: axis of the split, the left child holds the smaller centroids
+    };
+
+    std::vector<Node> nodes;
+
+    // The triangles of every leaf are contiguous
+    BasicTriangleStore<Scalar> triangles;
+
+    // Seconds spent in the last call to BVH::build()
+    double build_time;
+
+#ifdef COMPACT_BVH
+    // With COMPACT_BVH set to 4 or 8, intersect(), occluded() and intersect_packet() walk this tree instead of nodes.
+    // It is built again after BVH::build() and BVH::update(). A float copy has none and walks its binary tree.
+    WideBVH<COMPACT_BVH> compact;
+#endif
+
+    BasicBVH() : build_time(0) {}
+
+    // Copy the tree of other in Scalar
+    template <typename Other>
+    void assign(const BasicBVH<Other>& other);
+
+    // Find the closest triangle hit by the ray with 0 < t < t_max, returns false if there is none
+    bool intersect(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, TraversalStats* stats = nullptr) const;
+
+    // Same query for the N rays of a packet, which walk the tree together as long as more than one of them enters a node.
+    // When only one lane is left in a subtree it is finished with the single ray traversal.
+    template <int N>
+    void intersect_packet(const RayPacket<N, Scalar>& packet, Scalar t_max, Hit hits[N], bool is_intersected[N], TraversalStats* stats = nullptr) const;
+
+    // Any-hit query for shadow rays: true if a triangle is hit with 0 < t < t_max. The traversal stops at the first hit
+    // and visits first the child on the side the ray comes from along the split axis.
+    // last_occluder is a cache owned by the caller (one per thread and light): that triangle is tested before the
+    // traversal, and it is replaced by the occluder found, -1 for none.
+    bool occluded(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, int* last_occluder = nullptr, TraversalStats* stats = nullptr) const;
+
+    // The queries of intersect() and occluded() without the cache on the binary tree, even with COMPACT_BVH, to compare both
+    bool intersect_binary(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, TraversalStats* stats = nullptr) const;
+    bool occluded_binary(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats = nullptr) const;
+
+    // Bytes held by the nodes and the triangles, and by the compact tree if there is one
+    size_t memory_bytes() const;
+
+    // Print node count, depth, memory and build time
+    void print_summary() const;
+
+    // Slab test of the box of a node, returns the entry distance in t_entry if the box is hit in [0, t_max)
+    static bool intersect_box(const Node& node, const Vector3& ray_origin, const Vector3& inverse_direction, Scalar t_max, Scalar& t_entry);
+
+protected:
+    // The top level of instancing walks the BVH of each mesh without counting a new ray
+    template <typename>
+    friend class BasicInstanceBVH;
+
+    // Closest hit in the whole tree, binary or compact, lowers t_max to the distance of the hit
+    bool closest_hit(const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max, Hit& hit, TraversalStats* stats) const;
+
+    // Closest hit in the binary subtree rooted at root, lowers t_max to the distance of the hit
+    bool intersect_subtree(int root, const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max, Hit& hit, TraversalStats* stats) const;
+
+    // Traversal of occluded() without the cache, binary or compact, returns the occluder found or -1
+    int find_occluder(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats) const;
+    int find_binary_occluder(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats) const;
+
+    int depth(int node) const;
+
+#ifdef INSTRUMENT_RENDER
+    // Count the tests of the triangles [first, first + count) by rays rays for the meshes of the triangles
+    void count_mesh_tests(TraversalStats* stats, int first, int count, int rays = 1) const;
+#endif
+};
+
+// Bounding volume hierarchy over the triangles of several meshes, built with the surface area heuristic.
+// The triangles are copied in leaf order, so the meshes can change or be freed after build().
+class BVH : public BasicBVH<double>
+{
+public:
+    BVH() : first_mesh(0), garbage_nodes(0) {}
+
+    // Build the hierarchy over all the faces of all the meshes. Hit::mesh of the first mesh is first_mesh.
+    void build(const std::vector<Eigen::MatrixXd>& vertices, const std::vector<Eigen::MatrixXi>& faces, int first_mesh = 0);
+
+    // Build only the nodes, over boxes instead of triangles. On return order holds, in leaf order, the index
+    // of the box at each position, the leaves cover ranges of these positions.
+    void build_nodes(const std::vector<Eigen::Vector3d>& box_mins, const std::vector<Eigen::Vector3d>& box_maxs, std::vector<int>& order);
+
+    // For meshes that moved or deformed since build(), with the same faces: move the triangles and refit the boxes
+    // bottom-up, keeping the tree. A subtree whose SAH cost grew by more than rebuild_threshold (0.3 is 30%) since
+    // it was built is then rebuilt in place, the lowest such subtrees first; the whole tree is rebuilt when the root
+    // is one of them or when more than half of the triangles would be.
+    BVHUpdate update(const std::vector<Eigen::MatrixXd>& vertices, const std::vector<Eigen::MatrixXi>& faces, double rebuild_threshold);
+
+private:
+    // Hit::mesh of the mesh 0 of build(), kept for update()
+    int first_mesh;
+
+    // SAH cost of each node when its subtree was built, filled by the first update(). A rebuilt subtree leaves its
+    // old nodes unused until the next full rebuild.
+    std::vector<double> built_costs;
+    int garbage_nodes;
+
+    // Expected cost of a ray that enters the node, from the costs of its children
+    double node_cost(int node, const std::vector<double>& costs) const;
+    void compute_costs(int node, std::vector<double>& costs) const;
+
+    // Move the triangles of a subtree to the vertices and recompute its boxes and costs
+    void refit_subtree(int node, const std::vector<Eigen::MatrixXd>& vertices, const std::vector<Eigen::MatrixXi>& faces, std::vector<double>& costs);
+
+    // Build the subtree of node, depth levels below the root, again over its triangles, the new nodes are appended
+    void rebuild_subtree(int node, int depth, const std::vector<Eigen::MatrixXd>& vertices, const std::vector<Eigen::MatrixXi>& faces);
+
+    // Range of triangles held by the leaves of a subtree
+    void subtree_range(int node, int& first, int& count) const;
+
+    // Corners of the triangle i of triangles, at the place of its face in vertices
+    void triangle_corners(int i, const std::vector<Eigen::MatrixXd>& vertices, const std::vector<Eigen::MatrixXi>& faces, Eigen::Vector3d corners[3]) const;
+
+    // Build the subtree of node_index over the range [first, first + count) of order, node_index being depth levels
+    // below the root. A node traversal_stack_size - 1 levels down is always a leaf.
+    void build_recursive(std::vector<int>& order, std::vector<Eigen::Vector3d>& centroids, std::vector<Eigen::Vector3d>& box_mins, std::vector<Eigen::Vector3d>& box_maxs, int node_index, int depth, int first, int count);
+};
+
+#endif
@@ -0,0 +1,344 @@
+#include "denoise.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    // Pixels of a row filtered together by the vector kernel
+    const int lanes = 8;
+
+    // Rows handed to a thread at a time
+    const int chunk_rows = 4;
+
+    // B3 spline, the kernel of a pass is its outer product with itself
+    const float spline[5] = {1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f};
+
+    // Albedos below this are not divided by, their colors are filtered as they are
+    const float min_albedo = 0.01f;
+
+    // Added to the variances, so that the colors of flat areas without noise are still compared
+    const float min_variance = 1e-4f;
+
+    // Half the side of the window of the variances
+    const int variance_radius = 2;
+
+    // One float per pixel, with a border wide enough for the largest step of the kernel, so the kernel never tests
+    // whether a neighbour is inside the image: the border has a weight of 0. The rows have lanes more on the right,
+    // so the last pixels of a row are filtered as a whole vector.
+    struct Plane
+    {
+        int pad;
+        int stride;
+        vector<float> values;
+
+        Plane(int width, int height, int pad) : pad(pad), stride(width + 2 * pad + lanes), values(size_t(stride) * (height + 2 * pad), 0.f) {}
+
+        float* row(int y) { return values.data() + size_t(y + pad) * stride + pad; }
+        const float* row(int y) const { return values.data() + size_t(y + pad) * stride + pad; }
+    };
+
+    // Features of the pixels that stop the filter at the edges, the same for every pass
+    struct Guides
+    {
+        Plane nx, ny, nz, depth, ar, ag, ab;
+        Plane variance; // Of the colors around the pixel, the noise that the color weights let through
+        Plane valid;    // 1 inside the image, 0 in the border
+
+        Guides(int width, int height, int pad)
+            : nx(width, height, pad), ny(width, height, pad), nz(width, height, pad), depth(width, height, pad),
+              ar(width, height, pad), ag(width, height, pad), ab(width, height, pad), variance(width, height, pad), valid(width, height, pad) {}
+    };
+
+    struct ColorPlanes
+    {
+        Plane r, g, b;
+
+        ColorPlanes(int width, int height, int pad) : r(width, height, pad), g(width, height, pad), b(width, height, pad) {}
+    };
+
+    // Weights of a pass that do not depend on the pixel
+    struct PassWeights
+    {
+        int offsets[25];               // Of the neighbours in a plane
+        float kernel[25];
+        float inverse_distance[25];    // 1 / pixels to the neighbour, 0 for the pixel itself
+        float inverse_sigma_color;     // Divided by the variance of the pixel
+        float inverse_sigma_normal;
+        float inverse_sigma_depth;
+        float inverse_sigma_albedo;
+    };
+
+#ifdef __AVX2__
+    // e^x for x <= 0: x = n ln 2 + r with |r| <= ln 2 / 2, e^r from its Taylor series and 2^n put in the exponent bits.
+    // Relative error below 2e-7, enough for weights.
+    __m256 exp_negative(__m256 x)
+    {
+        x = _mm256_max_ps(x, _mm256_set1_ps(-87.f));
+        __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+        r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+        __m256 p = _mm256_set1_ps(1 / 720.f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1 / 120.f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1 / 24.f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1 / 6.f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(0.5f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.f));
+        __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+    }
+
+    // Squared distance of two 3 vectors, 8 lanes at a time
+    __m256 squared_distance(__m256 x0, __m256 y0, __m256 z0, __m256 x1, __m256 y1, __m256 z1)
+    {
+        __m256 dx = _mm256_sub_ps(x1, x0), dy = _mm256_sub_ps(y1, y0), dz = _mm256_sub_ps(z1, z0);
+        return _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+    }
+#endif
+
+    // One pass over the rows [y_begin, y_end) from source into target
+    void filter_rows(const Guides& guides, const ColorPlanes& source, ColorPlanes& target, const PassWeights& weights, int width, int y_begin, int y_end)
+    {
+        for (int y = y_begin; y < y_end; y++)
+        {
+            const float *c_r = source.r.row(y), *c_g = source.g.row(y), *c_b = source.b.row(y);
+            const float *n_x = guides.nx.row(y), *n_y = guides.ny.row(y), *n_z = guides.nz.row(y), *z = guides.depth.row(y);
+            const float *a_r = guides.ar.row(y), *a_g = guides.ag.row(y), *a_b = guides.ab.row(y), *valid = guides.valid.row(y);
+            const float* variance = guides.variance.row(y);
+            float *out_r = target.r.row(y), *out_g = target.g.row(y), *out_b = target.b.row(y);
+
+#ifdef __AVX2__
+            const __m256 sign_bit = _mm256_set1_ps(-0.f);
+            const __m256 tiny = _mm256_set1_ps(1e-20f);
+            for (int x = 0; x < width; x += lanes)
+            {
+                __m256 r = _mm256_loadu_ps(c_r + x), g = _mm256_loadu_ps(c_g + x), b = _mm256_loadu_ps(c_b + x);
+                __m256 nx = _mm256_loadu_ps(n_x + x), ny = _mm256_loadu_ps(n_y + x), nz = _mm256_loadu_ps(n_z + x);
+                __m256 ar = _mm256_loadu_ps(a_r + x), ag = _mm256_loadu_ps(a_g + x), ab = _mm256_loadu_ps(a_b + x);
+                __m256 depth = _mm256_loadu_ps(z + x);
+                __m256 inverse_depth = _mm256_div_ps(_mm256_set1_ps(weights.inverse_sigma_depth),
+                                                     _mm256_max_ps(depth, _mm256_set1_ps(1e-3f)));
+                __m256 inverse_color = _mm256_div_ps(_mm256_set1_ps(weights.inverse_sigma_color),
+                                                     _mm256_add_ps(_mm256_loadu_ps(variance + x), _mm256_set1_ps(min_variance)));
+
+                __m256 sum_w = tiny, sum_r = _mm256_setzero_ps(), sum_g = _mm256_setzero_ps(), sum_b = _mm256_setzero_ps();
+                for (int k = 0; k < 25; k++)
+                {
+                    int q = x + weights.offsets[k];
+                    __m256 qr = _mm256_loadu_ps(c_r + q), qg = _mm256_loadu_ps(c_g + q), qb = _mm256_loadu_ps(c_b + q);
+
+                    __m256 e = _mm256_mul_ps(squared_distance(r, g, b, qr, qg, qb), inverse_color);
+                    e = _mm256_fmadd_ps(squared_distance(nx, ny, nz, _mm256_loadu_ps(n_x + q), _mm256_loadu_ps(n_y + q), _mm256_loadu_ps(n_z + q)),
+                                        _mm256_set1_ps(weights.inverse_sigma_normal), e);
+                    e = _mm256_fmadd_ps(squared_distance(ar, ag, ab, _mm256_loadu_ps(a_r + q), _mm256_loadu_ps(a_g + q), _mm256_loadu_ps(a_b + q)),
+                                        _mm256_set1_ps(weights.inverse_sigma_albedo), e);
+                    __m256 depth_difference = _mm256_andnot_ps(sign_bit, _mm256_sub_ps(_mm256_loadu_ps(z + q), depth));
+                    e = _mm256_fmadd_ps(_mm256_mul_ps(depth_difference, inverse_depth), _mm256_set1_ps(weights.inverse_distance[k]), e);
+
+                    __m256 w = _mm256_mul_ps(_mm256_mul_ps(exp_negative(_mm256_xor_ps(e, sign_bit)), _mm256_loadu_ps(valid + q)),
+                                             _mm256_set1_ps(weights.kernel[k]));
+                    sum_w = _mm256_add_ps(sum_w, w);
+                    sum_r = _mm256_fmadd_ps(w, qr, sum_r);
+                    sum_g = _mm256_fmadd_ps(w, qg, sum_g);
+                    sum_b = _mm256_fmadd_ps(w, qb, sum_b);
+                }
+                _mm256_storeu_ps(out_r + x, _mm256_div_ps(sum_r, sum_w));
+                _mm256_storeu_ps(out_g + x, _mm256_div_ps(sum_g, sum_w));
+                _mm256_storeu_ps(out_b + x, _mm256_div_ps(sum_b, sum_w));
+            }
+#else
+            for (int x = 0; x < width; x++)
+            {
+                // Same weights as the vector kernel, with the exponential of the library
+                float inverse_depth = weights.inverse_sigma_depth / max(z[x], 1e-3f);
+                float inverse_color = weights.inverse_sigma_color / (variance[x] + min_variance);
+                float sum_w = 1e-20f, sum_r = 0, sum_g = 0, sum_b = 0;
+                for (int k = 0; k < 25; k++)
+                {
+                    int q = x + weights.offsets[k];
+                    float dr = c_r[q] - c_r[x], dg = c_g[q] - c_g[x], db = c_b[q] - c_b[x];
+                    float dnx = n_x[q] - n_x[x], dny = n_y[q] - n_y[x], dnz = n_z[q] - n_z[x];
+                    float dar = a_r[q] - a_r[x], dag = a_g[q] - a_g[x], dab = a_b[q] - a_b[x];
+                    float e = (dr * dr + dg * dg + db * db) * inverse_color
+                            + (dnx * dnx + dny * dny + dnz * dnz) * weights.inverse_sigma_normal
+                            + (dar * dar + dag * dag + dab * dab) * weights.inverse_sigma_albedo
+                            + fabs(z[q] - z[x]) * inverse_depth * weights.inverse_distance[k];
+                    float w = weights.kernel[k] * exp(-e) * valid[q];
+                    sum_w += w;
+                    sum_r += w * c_r[q];
+                    sum_g += w * c_g[q];
+                    sum_b += w * c_b[q];
+                }
+                out_r[x] = sum_r / sum_w;
+                out_g[x] = sum_g / sum_w;
+                out_b[x] = sum_b / sum_w;
+            }
+#endif
+            // The vector kernel wrote past the last pixel, the border must stay black for the next pass
+            fill(out_r + width, out_r + width + lanes, 0.f);
+            fill(out_g + width, out_g + width + lanes, 0.f);
+            fill(out_b + width, out_b + width + lanes, 0.f);
+        }
+    }
+}
+
+DenoiseStats denoise(const Framebuffer& image, const Framebuffer& normal_depth, const Framebuffer& albedo, Framebuffer& result,
+                     const DenoiseParameters& parameters, int thread_count)
+{
+    auto start = chrono::steady_clock::now();
+    DenoiseStats stats;
+#ifdef __AVX2__
+    stats.is_vectorized = true;
+#else
+    stats.is_vectorized = false;
+#endif
+    int width = image.width, height = image.height;
+    // A pass whose spacing reaches across the image would only sample the border
+    int passes = 0;
+    while (passes < min(parameters.passes, max_denoise_passes) && 1 << passes < max(width, height))
+        passes++;
+    int pad = passes > 0 ? 2 << (passes - 1) : 0;
+    stats.passes = passes;
+
+    // Split the guides into planes and divide the colors by the albedo
+    Guides guides(width, height, pad);
+    ColorPlanes color(width, height, pad), filtered(width, height, pad);
+    parallel_for(height, thread_count, chunk_rows, [&](int begin, int end, int)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                const Pixel& c = image(x, y);
+                const Pixel& n = normal_depth(x, y);
+                const Pixel& a = albedo(x, y);
+                guides.nx.row(y)[x] = n.r;
+                guides.ny.row(y)[x] = n.g;
+                guides.nz.row(y)[x] = n.b;
+                guides.depth.row(y)[x] = n.a;
+                guides.ar.row(y)[x] = a.r;
+                guides.ag.row(y)[x] = a.g;
+                guides.ab.row(y)[x] = a.b;
+                guides.valid.row(y)[x] = 1;
+                color.r.row(y)[x] = a.r > min_albedo ? c.r / a.r : c.r;
+                color.g.row(y)[x] = a.g > min_albedo ? c.g / a.g : c.g;
+                color.b.row(y)[x] = a.b > min_albedo ? c.b / a.b : c.b;
+            }
+        }
+    });
+
+    // A sample that found a bright light by chance makes a single pixel far brighter than all its neighbours. The color
+    // weights would keep it out of its neighbours and keep it as it is, so it is clamped to its brightest neighbour.
+    parallel_for(height, thread_count, chunk_rows, [&](int begin, int end, int)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                float max_r = 0, max_g = 0, max_b = 0;
+                for (int ny = max(0, y - 1); ny <= min(height - 1, y + 1); ny++)
+                {
+                    for (int nx = max(0, x - 1); nx <= min(width - 1, x + 1); nx++)
+                    {
+                        if (nx == x && ny == y)
+                            continue;
+                        max_r = max(max_r, color.r.row(ny)[nx]);
+                        max_g = max(max_g, color.g.row(ny)[nx]);
+                        max_b = max(max_b, color.b.row(ny)[nx]);
+                    }
+                }
+                filtered.r.row(y)[x] = min(color.r.row(y)[x], max_r);
+                filtered.g.row(y)[x] = min(color.g.row(y)[x], max_g);
+                filtered.b.row(y)[x] = min(color.b.row(y)[x], max_b);
+            }
+        }
+    });
+    swap(color, filtered);
+
+    // Variance of the colors in a window around every pixel, averaged over the channels. Where the samples are noisy
+    // the colors of neighbours differ more, so the color weights are relative to it.
+    parallel_for(height, thread_count, chunk_rows, [&](int begin, int end, int)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                float sum[3] = {0, 0, 0}, squares[3] = {0, 0, 0};
+                int count = 0;
+                for (int ny = max(0, y - variance_radius); ny <= min(height - 1, y + variance_radius); ny++)
+                {
+                    for (int nx = max(0, x - variance_radius); nx <= min(width - 1, x + variance_radius); nx++)
+                    {
+                        float c[3] = {color.r.row(ny)[nx], color.g.row(ny)[nx], color.b.row(ny)[nx]};
+                        for (int channel = 0; channel < 3; channel++)
+                        {
+                            sum[channel] += c[channel];
+                            squares[channel] += c[channel] * c[channel];
+                        }
+                        count++;
+                    }
+                }
+                float variance = 0;
+                for (int channel = 0; channel < 3; channel++)
+                    variance += max(0.f, squares[channel] / count - sum[channel] * sum[channel] / (count * count));
+                guides.variance.row(y)[x] = variance / 3;
+            }
+        }
+    });
+    auto filter_start = chrono::steady_clock::now();
+    stats.setup_time = chrono::duration<double>(filter_start - start).count();
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        int step = 1 << pass;
+        PassWeights weights;
+        for (int ky = 0; ky < 5; ky++)
+        {
+            for (int kx = 0; kx < 5; kx++)
+            {
+                int k = ky * 5 + kx;
+                int dx = (kx - 2) * step, dy = (ky - 2) * step;
+                weights.offsets[k] = dy * color.r.stride + dx;
+                weights.kernel[k] = spline[kx] * spline[ky];
+                weights.inverse_distance[k] = k == 12 ? 0.f : 1.f / sqrt(float(dx * dx + dy * dy));
+            }
+        }
+        weights.inverse_sigma_color = step / parameters.sigma_color;
+        weights.inverse_sigma_normal = 1 / parameters.sigma_normal;
+        weights.inverse_sigma_depth = 1 / parameters.sigma_depth;
+        weights.inverse_sigma_albedo = 1 / parameters.sigma_albedo;
+
+        parallel_for(height, thread_count, chunk_rows, [&](int begin, int end, int)
+        {
+            filter_rows(guides, color, filtered, weights, width, begin, end);
+        });
+        swap(color, filtered);
+    }
+
+    // Multiply the albedo back
+    result = Framebuffer(width, height);
+    parallel_for(height, thread_count, chunk_rows, [&](int begin, int end, int)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                const Pixel& a = albedo(x, y);
+                float r = color.r.row(y)[x], g = color.g.row(y)[x], b = color.b.row(y)[x];
+                result(x, y) = Pixel(a.r > min_albedo ? r * a.r : r, a.g > min_albedo ? g * a.g : g, a.b > min_albedo ? b * a.b : b, image(x, y).a);
+            }
+        }
+    });
+    stats.filter_time = chrono::duration<double>(chrono::steady_clock::now() - filter_start).count();
+    return stats;
+}
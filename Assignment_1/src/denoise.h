@@ -0,0 +1,42 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "image.h"
+
+// Most passes of the denoiser, pass i samples every 2^i pixels so that the last one spans 65536 pixels
+const int max_denoise_passes = 16;
+
+// Strength of the edge stopping functions of the denoiser: a neighbour's weight is multiplied by
+// exp(-distance / sigma) for each of its features, so larger sigmas blur across larger differences
+struct DenoiseParameters
+{
+    int passes;          // Passes of the 5x5 kernel, pass i samples every 2^i pixels, 5 covers 125x125 pixels. At most
+                         // max_denoise_passes, and the passes whose spacing is not smaller than the image are skipped
+    float sigma_color;   // Squared distance of the colors divided by the albedo, relative to their variance around the pixel,
+                         // halved at every pass
+    float sigma_normal;  // Squared distance of the unit normals
+    float sigma_depth;   // Difference of depth relative to the depth of the pixel, per pixel between them
+    float sigma_albedo;  // Squared distance of the albedos
+
+    DenoiseParameters() : passes(5), sigma_color(32.f), sigma_normal(0.1f), sigma_depth(0.002f), sigma_albedo(0.05f) {}
+};
+
+// Wall time of a call to denoise()
+struct DenoiseStats
+{
+    double setup_time;  // Dividing by the albedo and padding the buffers
+    double filter_time; // All the passes
+    int passes;         // Passes run
+    bool is_vectorized; // 8 pixels at a time with AVX2
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). The colors are divided by the albedo, so the texture of
+// the surfaces is not blurred, filtered by passes of a B3 spline kernel that doubles its spacing at every pass, then
+// multiplied back. Neighbours whose color, normal, depth or albedo differ are weighted down, so edges stay sharp.
+// normal_depth holds the unit normal of the first diffuse surface of every pixel in r, g, b and its distance along
+// the camera ray in a, 0 for the background. albedo holds its color, 1 for the background. The alpha of the image
+// is kept. Rows are filtered on thread_count threads (0 uses all the cores).
+DenoiseStats denoise(const Framebuffer& image, const Framebuffer& normal_depth, const Framebuffer& albedo, Framebuffer& result,
+                     const DenoiseParameters& parameters, int thread_count);
+
+#endif
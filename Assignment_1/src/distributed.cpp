@@ -0,0 +1,1089 @@
+#include "distributed.h"
+#include "image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+
+namespace
+{
+    const uint32_t protocol_magic = 0x44524e41; // "ANRD"
+    const uint32_t protocol_version = 4;
+
+    // Slower tiles than this many times the average are copied to idle workers once none is left to hand out
+    const double slow_tile_factor = 4;
+
+    // Time between the checks of the timeouts when no message comes
+    const int poll_milliseconds = 100;
+
+    // Largest tiles, and largest payload accepted: the raw pixels of such a tile and the fields before them. A peer
+    // that announces more is cut off instead of being given the memory.
+    const int max_tile_size = 2048;
+    const uint32_t max_message_size = max_tile_size * max_tile_size * sizeof(Pixel) + 1024;
+
+    enum MessageType : uint32_t
+    {
+        hello = 1,   // Worker: magic, version, process id
+        scene = 2,   // Coordinator: scene number, scene file, image size, render settings
+        ready = 3,   // Worker: scene number, seconds to load it. Asks for a tile.
+        tile = 4,    // Coordinator: scene number, tile number, rectangle
+        result = 5,  // Worker: scene number, tile number, seconds, primary rays, encoding, pixel bytes. Asks for a tile.
+        failure = 6, // Worker: error message, the worker then exits
+        quit = 7     // Coordinator: no more scenes
+    };
+
+    enum PixelEncoding : uint32_t
+    {
+        raw = 0,
+        deflated = 1
+    };
+
+    struct MessageHeader
+    {
+        uint32_t type;
+        uint32_t size;
+    };
+
+    // Payloads are the fields one after the other in the byte order of the machine: the workers and the coordinator
+    // run the same program
+    class Writer
+    {
+    public:
+        vector<char> bytes;
+
+        template <typename T>
+        void put(const T& value)
+        {
+            const char* data = reinterpret_cast<const char*>(&value);
+            bytes.insert(bytes.end(), data, data + sizeof(T));
+        }
+
+        void put_string(const string& text)
+        {
+            put(uint32_t(text.size()));
+            bytes.insert(bytes.end(), text.begin(), text.end());
+        }
+    };
+
+    class Reader
+    {
+    public:
+        Reader(const vector<char>& bytes) : bytes(bytes), position(0), is_valid(true) {}
+
+        template <typename T>
+        T get()
+        {
+            T value = T();
+            if (position + sizeof(T) > bytes.size())
+                is_valid = false;
+            else
+                memcpy(&value, bytes.data() + position, sizeof(T));
+            position += sizeof(T);
+            return value;
+        }
+
+        string get_string()
+        {
+            uint32_t size = get<uint32_t>();
+            if (!is_valid || position + size > bytes.size())
+            {
+                is_valid = false;
+                return string();
+            }
+            position += size;
+            return string(bytes.data() + position - size, size);
+        }
+
+        // Bytes left after the fields read
+        const char* rest() const { return bytes.data() + min(position, bytes.size()); }
+        size_t rest_size() const { return bytes.size() - min(position, bytes.size()); }
+
+        bool valid() const { return is_valid; }
+
+    private:
+        const vector<char>& bytes;
+        size_t position;
+        bool is_valid;
+    };
+
+    // Write everything, waiting up to a second at a time when the socket is full
+    bool write_all(int fd, const char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                pollfd waiting = {fd, POLLOUT, 0};
+                if (poll(&waiting, 1, 1000) <= 0)
+                    return false;
+                continue;
+            }
+            if (written <= 0)
+                return false;
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // One write for the header and the payload, so that TCP does not hold the payload back for the acknowledgement of the header
+    bool send_message(int fd, MessageType type, const Writer& payload)
+    {
+        MessageHeader header = {type, uint32_t(payload.bytes.size())};
+        vector<char> message(sizeof(header) + payload.bytes.size());
+        memcpy(message.data(), &header, sizeof(header));
+        copy(payload.bytes.begin(), payload.bytes.end(), message.begin() + sizeof(header));
+        return write_all(fd, message.data(), message.size());
+    }
+
+    // Blocking read of exactly size bytes, false at the end of the stream
+    bool read_all(int fd, char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t received = ::recv(fd, data, size, 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                return false;
+            data += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    // False at the end of the stream, and for a message larger than max_message_size
+    bool receive_message(int fd, MessageType& type, vector<char>& payload)
+    {
+        MessageHeader header;
+        if (!read_all(fd, reinterpret_cast<char*>(&header), sizeof(header)) || header.size > max_message_size)
+            return false;
+        type = MessageType(header.type);
+        payload.resize(header.size);
+        return read_all(fd, payload.data(), payload.size());
+    }
+
+    // Unix socket if the address has a '/', otherwise TCP on [host:]port, where the host is 127.0.0.1 if none is given
+    bool is_unix_address(const string& address)
+    {
+        return address.find('/') != string::npos;
+    }
+
+    bool make_unix_address(const string& path, sockaddr_un& socket_address, string& error)
+    {
+        memset(&socket_address, 0, sizeof(socket_address));
+        socket_address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(socket_address.sun_path))
+        {
+            error = "socket path too long: " + path;
+            return false;
+        }
+        memcpy(socket_address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    addrinfo* resolve_tcp_address(const string& address, string& error)
+    {
+        size_t colon = address.rfind(':');
+        string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+        string port = colon == string::npos ? address : address.substr(colon + 1);
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+        if (status != 0)
+        {
+            error = "cannot resolve " + address + ": " + gai_strerror(status);
+            return nullptr;
+        }
+        return found;
+    }
+
+    // Tiles and requests are small messages, TCP must not wait to group them
+    void send_immediately(int fd)
+    {
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    }
+
+    int listen_on(const string& address, string& error)
+    {
+        if (is_unix_address(address))
+        {
+            sockaddr_un socket_address;
+            if (!make_unix_address(address, socket_address, error))
+                return -1;
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            unlink(address.c_str());
+            if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) != 0 || listen(fd, 64) != 0)
+            {
+                error = "cannot listen on " + address + ": " + strerror(errno);
+                if (fd >= 0)
+                    close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        addrinfo* found = resolve_tcp_address(address, error);
+        if (!found)
+            return -1;
+        int fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+        int reuse = 1;
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (fd < 0 || bind(fd, found->ai_addr, found->ai_addrlen) != 0 || listen(fd, 64) != 0)
+        {
+            error = "cannot listen on " + address + ": " + strerror(errno);
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(found);
+        return fd;
+    }
+
+    int connect_to(const string& address, string& error)
+    {
+        if (is_unix_address(address))
+        {
+            sockaddr_un socket_address;
+            if (!make_unix_address(address, socket_address, error))
+                return -1;
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) != 0)
+            {
+                error = "cannot connect to " + address + ": " + strerror(errno);
+                if (fd >= 0)
+                    close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        addrinfo* found = resolve_tcp_address(address, error);
+        if (!found)
+            return -1;
+        int fd = -1;
+        for (addrinfo* candidate = found; candidate && fd < 0; candidate = candidate->ai_next)
+        {
+            fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+            if (fd >= 0 && connect(fd, candidate->ai_addr, candidate->ai_addrlen) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (fd < 0)
+            error = "cannot connect to " + address + ": " + strerror(errno);
+        else
+        {
+            send_immediately(fd);
+        }
+        return fd;
+    }
+
+    // The bytes of the floats of the pixels regrouped by their position in the float: the sign and exponent bytes of
+    // neighbouring pixels are mostly equal, so deflate finds them, it would not in the interleaved floats
+    void encode_pixels(const vector<Pixel>& pixels, uint32_t& encoding, vector<char>& bytes)
+    {
+        const size_t count = pixels.size() * sizeof(Pixel) / sizeof(float);
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(pixels.data());
+        vector<unsigned char> shuffled(count * sizeof(float));
+        for (size_t i = 0; i < count; i++)
+            for (size_t b = 0; b < sizeof(float); b++)
+                shuffled[b * count + i] = in[i * sizeof(float) + b];
+
+#ifdef HAVE_ZLIB
+        uLongf size = compressBound(shuffled.size());
+        bytes.resize(size);
+        if (compress2(reinterpret_cast<Bytef*>(bytes.data()), &size, shuffled.data(), shuffled.size(), Z_BEST_SPEED) == Z_OK && size < shuffled.size())
+        {
+            bytes.resize(size);
+            encoding = deflated;
+            return;
+        }
+#endif
+        bytes.assign(shuffled.begin(), shuffled.end());
+        encoding = raw;
+    }
+
+    bool decode_pixels(uint32_t encoding, const char* bytes, size_t size, vector<Pixel>& pixels)
+    {
+        const size_t count = pixels.size() * sizeof(Pixel) / sizeof(float);
+        vector<unsigned char> shuffled(count * sizeof(float));
+        if (encoding == raw && size == shuffled.size())
+            memcpy(shuffled.data(), bytes, size);
+#ifdef HAVE_ZLIB
+        else if (encoding == deflated)
+        {
+            uLongf unpacked = shuffled.size();
+            if (uncompress(shuffled.data(), &unpacked, reinterpret_cast<const Bytef*>(bytes), size) != Z_OK || unpacked != shuffled.size())
+                return false;
+        }
+#endif
+        else
+            return false;
+
+        unsigned char* out = reinterpret_cast<unsigned char*>(pixels.data());
+        for (size_t i = 0; i < count; i++)
+            for (size_t b = 0; b < sizeof(float); b++)
+                out[i * sizeof(float) + b] = shuffled[b * count + i];
+        return true;
+    }
+
+    double seconds_since(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+}
+
+struct Coordinator::State
+{
+    enum WorkerStatus
+    {
+        connecting, // Until its hello
+        loading,    // A scene was sent, until it is ready
+        idle,       // Asked for a tile and none was left
+        busy        // Rendering a tile
+    };
+
+    struct Worker
+    {
+        int fd;
+        int pid;
+        WorkerStatus status;
+        int scene_number;   // Sent to it, -1 for none
+        int tile;           // Of the current scene while busy
+        chrono::steady_clock::time_point tile_start;
+        vector<char> received; // Bytes of the messages not complete yet
+
+        int tiles_rendered;
+        double busy_time;
+        long long bytes_received;
+        long long pixel_bytes;
+
+        Worker(int fd) : fd(fd), pid(0), status(connecting), scene_number(-1), tile(-1), tiles_rendered(0), busy_time(0), bytes_received(0), pixel_bytes(0) {}
+    };
+
+    // Tiles of the scene being rendered
+    struct TileState
+    {
+        Tile rectangle;
+        bool is_done;
+        int copies; // Workers rendering it
+    };
+
+    RenderSettings settings;
+    string address;
+    bool owns_socket_file;
+    int listen_fd;
+    vector<int> children;   // Processes started by start() that have not exited
+    int children_started;
+    vector<Worker> workers;
+    int scene_number;
+
+    // Render in progress
+    const Scene* current;
+    string scene_file;
+    vector<TileState> tiles;
+    deque<int> pending;
+    int tiles_done;
+    double tile_time_sum;
+    StreamingFramebuffer* framebuffer;
+    long long primary_rays;
+    int tiles_reassigned;
+    int copies_sent;
+    int copies_wasted;
+    int workers_lost;
+
+    State(const RenderSettings& settings)
+        : settings(settings), owns_socket_file(false), listen_fd(-1), children_started(0), scene_number(-1), current(nullptr), framebuffer(nullptr) {}
+
+    void accept_workers()
+    {
+        while (true)
+        {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                return;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if (!is_unix_address(address))
+                send_immediately(fd);
+            workers.push_back(Worker(fd));
+        }
+    }
+
+    void send_scene(Worker& worker)
+    {
+        Writer payload;
+        payload.put(int32_t(scene_number));
+        payload.put_string(scene_file);
+        payload.put(int32_t(current->camera.width));
+        payload.put(int32_t(current->camera.height));
+        payload.put(int32_t(settings.tile_size));
+        payload.put(int32_t(settings.packet_size));
+        payload.put(int32_t(settings.max_depth));
+        payload.put(int32_t(settings.ray_budget));
+        payload.put(double(settings.roulette_weight));
+        payload.put(int32_t(settings.max_samples));
+        payload.put(double(settings.aa_threshold));
+        payload.put(int32_t(settings.float_precision));
+        payload.put(int32_t(settings.light_samples));
+        payload.put(int32_t(settings.light_top_k));
+        worker.scene_number = scene_number;
+        worker.status = loading;
+        if (!send_message(worker.fd, scene, payload))
+            drop(worker, "cannot send the scene");
+    }
+
+    void send_tile(Worker& worker, int t)
+    {
+        const Tile& rectangle = tiles[t].rectangle;
+        Writer payload;
+        payload.put(int32_t(scene_number));
+        payload.put(int32_t(t));
+        payload.put(int32_t(rectangle.x_begin));
+        payload.put(int32_t(rectangle.x_end));
+        payload.put(int32_t(rectangle.y_begin));
+        payload.put(int32_t(rectangle.y_end));
+        worker.status = busy;
+        worker.tile = t;
+        worker.tile_start = chrono::steady_clock::now();
+        tiles[t].copies++;
+        if (!send_message(worker.fd, tile, payload))
+            drop(worker, "cannot send a tile");
+    }
+
+    // The next tile for a worker that asks for one, or a copy of a slow tile, or nothing
+    void hand_out(Worker& worker)
+    {
+        worker.status = idle;
+        if (!current)
+            return;
+        if (worker.scene_number != scene_number)
+        {
+            send_scene(worker);
+            return;
+        }
+        while (!pending.empty())
+        {
+            int t = pending.front();
+            pending.pop_front();
+            if (!tiles[t].is_done)
+            {
+                send_tile(worker, t);
+                return;
+            }
+        }
+
+        // Copy the slowest tile that has a single worker on it, if it is slow enough
+        if (tiles_done == 0)
+            return;
+        double threshold = slow_tile_factor * tile_time_sum / tiles_done;
+        int slowest = -1;
+        double slowest_time = threshold;
+        for (const Worker& other : workers)
+        {
+            if (other.status != busy || other.scene_number != scene_number || tiles[other.tile].copies != 1)
+                continue;
+            double elapsed = seconds_since(other.tile_start);
+            if (elapsed > slowest_time)
+            {
+                slowest = other.tile;
+                slowest_time = elapsed;
+            }
+        }
+        if (slowest >= 0)
+        {
+            copies_sent++;
+            send_tile(worker, slowest);
+        }
+    }
+
+    // Close the connection, the tile of the worker goes back to the front of the queue if no other worker has it
+    void drop(Worker& worker, const string& reason)
+    {
+        if (worker.fd < 0)
+            return;
+        if (settings.verbose || worker.status == busy)
+            std::cerr << "Worker " << worker.pid << " dropped: " << reason << std::endl;
+        if (worker.status == busy && current && worker.scene_number == scene_number)
+        {
+            TileState& state = tiles[worker.tile];
+            state.copies--;
+            if (!state.is_done && state.copies == 0)
+            {
+                pending.push_front(worker.tile);
+                tiles_reassigned++;
+            }
+        }
+        if (current)
+            workers_lost++;
+        close(worker.fd);
+        worker.fd = -1;
+        worker.status = idle;
+    }
+
+    void receive_result(Worker& worker, Reader& reader)
+    {
+        int number = reader.get<int32_t>();
+        int t = reader.get<int32_t>();
+        double seconds = reader.get<double>();
+        long long rays = reader.get<int64_t>();
+        uint32_t encoding = reader.get<uint32_t>();
+        bool is_current = current && reader.valid() && number == scene_number && worker.status == busy && t == worker.tile;
+        if (!is_current)
+        {
+            hand_out(worker);
+            return;
+        }
+
+        worker.tiles_rendered++;
+        worker.busy_time += seconds;
+        TileState& state = tiles[t];
+        state.copies--;
+
+        // Give the worker its next tile before the pixels are copied, so it does not wait for the image
+        if (state.is_done)
+        {
+            copies_wasted++;
+            hand_out(worker);
+            return;
+        }
+        state.is_done = true;
+        hand_out(worker);
+
+        const Tile& rectangle = state.rectangle;
+        int tile_width = rectangle.x_end - rectangle.x_begin;
+        vector<Pixel> pixels(size_t(tile_width) * (rectangle.y_end - rectangle.y_begin));
+        if (!decode_pixels(encoding, reader.rest(), reader.rest_size(), pixels))
+        {
+            state.is_done = false;
+            pending.push_front(t);
+            tiles_reassigned++;
+            drop(worker, "damaged tile");
+            return;
+        }
+        worker.pixel_bytes += pixels.size() * sizeof(Pixel);
+        tiles_done++;
+        tile_time_sum += seconds;
+        primary_rays += rays;
+
+        BandPixels band = framebuffer->begin_tile(rectangle);
+        for (int y = rectangle.y_begin; y < rectangle.y_end; y++)
+            for (int x = rectangle.x_begin; x < rectangle.x_end; x++)
+                band(x, y) = pixels[size_t(y - rectangle.y_begin) * tile_width + x - rectangle.x_begin];
+        framebuffer->end_tile(rectangle);
+    }
+
+    void handle_message(Worker& worker, MessageType type, const vector<char>& payload)
+    {
+        Reader reader(payload);
+        if (type == hello)
+        {
+            uint32_t magic = reader.get<uint32_t>();
+            uint32_t version = reader.get<uint32_t>();
+            worker.pid = reader.get<int32_t>();
+            if (!reader.valid() || magic != protocol_magic || version != protocol_version)
+                drop(worker, "not a worker of this version");
+            else
+                hand_out(worker);
+        }
+        else if (type == ready)
+        {
+            int number = reader.get<int32_t>();
+            if (worker.status == loading && number == worker.scene_number)
+                hand_out(worker);
+        }
+        else if (type == result)
+            receive_result(worker, reader);
+        else if (type == failure)
+            drop(worker, reader.get_string());
+        else
+            drop(worker, "unknown message");
+    }
+
+    // Read what the worker sent and handle the messages that are complete
+    void receive(Worker& worker)
+    {
+        char buffer[65536];
+        while (worker.fd >= 0)
+        {
+            ssize_t received = ::recv(worker.fd, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (received <= 0)
+            {
+                drop(worker, "connection closed");
+                return;
+            }
+            worker.received.insert(worker.received.end(), buffer, buffer + received);
+            worker.bytes_received += received;
+        }
+
+        size_t used = 0;
+        vector<char> payload;
+        while (worker.fd >= 0 && worker.received.size() - used >= sizeof(MessageHeader))
+        {
+            MessageHeader header;
+            memcpy(&header, worker.received.data() + used, sizeof(header));
+            if (header.size > max_message_size)
+            {
+                drop(worker, "message too large (" + to_string(header.size) + " bytes)");
+                return;
+            }
+            if (worker.received.size() - used - sizeof(header) < header.size)
+                break;
+            const char* start = worker.received.data() + used + sizeof(header);
+            payload.assign(start, start + header.size);
+            used += sizeof(header) + header.size;
+            handle_message(worker, MessageType(header.type), payload);
+        }
+        if (worker.fd >= 0)
+            worker.received.erase(worker.received.begin(), worker.received.begin() + used);
+    }
+
+    // Forget the children that exited
+    void reap_children()
+    {
+        children.erase(remove_if(children.begin(), children.end(), [](int pid) { return waitpid(pid, nullptr, WNOHANG) == pid; }), children.end());
+    }
+
+    int connected_workers() const
+    {
+        return count_if(workers.begin(), workers.end(), [](const Worker& worker) { return worker.fd >= 0; });
+    }
+
+    // Wait for messages or connections, up to poll_milliseconds
+    void poll_once()
+    {
+        vector<pollfd> fds;
+        fds.push_back(pollfd{listen_fd, POLLIN, 0});
+        for (const Worker& worker : workers)
+            fds.push_back(pollfd{worker.fd, POLLIN, 0});
+        int ready_count = poll(fds.data(), fds.size(), poll_milliseconds);
+        if (ready_count > 0)
+        {
+            // Workers accepted now are at the end, they were not polled
+            size_t polled = workers.size();
+            for (size_t i = 0; i < polled; i++)
+                if (fds[i + 1].revents)
+                    receive(workers[i]);
+            if (fds[0].revents & POLLIN)
+                accept_workers();
+        }
+
+        // A worker stuck on a tile is dropped, a worker started by start() is killed too
+        if (settings.worker_timeout > 0)
+        {
+            for (Worker& worker : workers)
+            {
+                if (worker.fd >= 0 && worker.status == busy && seconds_since(worker.tile_start) > settings.worker_timeout)
+                {
+                    ostringstream reason;
+                    reason << "no tile after " << settings.worker_timeout << " s";
+                    if (find(children.begin(), children.end(), worker.pid) != children.end())
+                        kill(worker.pid, SIGKILL);
+                    drop(worker, reason.str());
+                }
+            }
+        }
+
+        // Tiles put back in the queue go to the workers waiting for one, as do copies of slow tiles
+        for (Worker& worker : workers)
+            if (worker.fd >= 0 && worker.status == idle)
+                hand_out(worker);
+        reap_children();
+    }
+};
+
+Coordinator::Coordinator(const RenderSettings& settings) : state(new State(settings))
+{
+}
+
+Coordinator::~Coordinator()
+{
+    // The workers still on a tile send it before they read the quit, wait for them to close the connection so
+    // that they do not fail to send it
+    vector<pollfd> fds;
+    for (State::Worker& worker : state->workers)
+    {
+        if (worker.fd >= 0 && send_message(worker.fd, quit, Writer()) && shutdown(worker.fd, SHUT_WR) == 0)
+            fds.push_back(pollfd{worker.fd, POLLIN, 0});
+        else if (worker.fd >= 0)
+            close(worker.fd);
+    }
+    auto start = chrono::steady_clock::now();
+    while (!fds.empty() && (state->settings.worker_timeout <= 0 || seconds_since(start) < state->settings.worker_timeout))
+    {
+        poll(fds.data(), fds.size(), poll_milliseconds);
+        for (pollfd& polled : fds)
+        {
+            char buffer[65536];
+            if (polled.revents && ::recv(polled.fd, buffer, sizeof(buffer), 0) <= 0)
+            {
+                close(polled.fd);
+                polled.fd = -1;
+            }
+        }
+        fds.erase(remove_if(fds.begin(), fds.end(), [](const pollfd& polled) { return polled.fd < 0; }), fds.end());
+    }
+    for (const pollfd& polled : fds)
+        close(polled.fd);
+    for (int pid : state->children)
+        waitpid(pid, nullptr, 0);
+    if (state->listen_fd >= 0)
+        close(state->listen_fd);
+    if (state->owns_socket_file)
+        unlink(state->address.c_str());
+}
+
+bool Coordinator::start(const string& executable, string& error)
+{
+    signal(SIGPIPE, SIG_IGN);
+    State& s = *state;
+    if (s.settings.tile_size > max_tile_size)
+    {
+        error = "tiles of the workers are at most " + to_string(max_tile_size) + " pixels wide";
+        return false;
+    }
+    s.address = s.settings.listen_address;
+    if (s.address.empty())
+        s.address = "/tmp/assignment1-" + to_string(getpid()) + ".sock";
+    s.listen_fd = listen_on(s.address, error);
+    if (s.listen_fd < 0)
+        return false;
+    s.owns_socket_file = is_unix_address(s.address);
+    fcntl(s.listen_fd, F_SETFL, fcntl(s.listen_fd, F_GETFL) | O_NONBLOCK);
+
+    for (int i = 0; i < s.settings.workers; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            error = string("cannot start a worker: ") + strerror(errno);
+            return false;
+        }
+        if (pid == 0)
+        {
+            close(s.listen_fd);
+            execl(executable.c_str(), executable.c_str(), "--worker", s.address.c_str(), static_cast<char*>(nullptr));
+            std::cerr << "Cannot run " << executable << ": " << strerror(errno) << std::endl;
+            _exit(127);
+        }
+        s.children.push_back(pid);
+        s.children_started++;
+    }
+    if (s.settings.verbose)
+        std::cout << "Coordinator listening on " << s.address << ", " << s.settings.workers << " workers started" << std::endl;
+    return true;
+}
+
+bool Coordinator::render(const Scene& scene, RenderStats* stats)
+{
+    State& s = *state;
+    const Camera& camera = scene.camera;
+    if (s.settings.verbose)
+    {
+        std::cout << "Scene " << scene.path << ": " << scene.mesh_materials.size() << " meshes, " << scene.spheres.size() << " spheres, "
+                  << scene.light_positions.size() << " lights, rendered on the workers" << std::endl;
+    }
+
+    string error;
+    Tile region;
+    unique_ptr<ImageWriter> writer;
+    if (render_region(camera, s.settings, region, error))
+        writer = open_image_writer(scene.output, region.x_end - region.x_begin, region.y_end - region.y_begin, s.settings.output_bits, error);
+    if (!writer)
+    {
+        std::cerr << scene.path << ": " << error << std::endl;
+        return false;
+    }
+    StreamingFramebuffer framebuffer(region, s.settings.tile_size, *writer);
+
+    // The workers may run in other directories
+    char resolved[PATH_MAX];
+    s.scene_file = realpath(scene.path.c_str(), resolved) ? string(resolved) : scene.path;
+    s.scene_number++;
+    s.current = &scene;
+    s.framebuffer = &framebuffer;
+    s.tiles.clear();
+    s.pending.clear();
+    for (int y = region.y_begin; y < region.y_end; y += s.settings.tile_size)
+    {
+        for (int x = region.x_begin; x < region.x_end; x += s.settings.tile_size)
+        {
+            Tile rectangle = {x, min(x + s.settings.tile_size, region.x_end), y, min(y + s.settings.tile_size, region.y_end), 0};
+            s.pending.push_back(s.tiles.size());
+            s.tiles.push_back(State::TileState{rectangle, false, 0});
+        }
+    }
+    s.workers.erase(remove_if(s.workers.begin(), s.workers.end(), [](const State::Worker& worker) { return worker.fd < 0; }), s.workers.end());
+    s.tiles_done = 0;
+    s.tile_time_sum = 0;
+    s.primary_rays = 0;
+    s.tiles_reassigned = s.copies_sent = s.copies_wasted = s.workers_lost = 0;
+    for (State::Worker& worker : s.workers)
+    {
+        worker.tiles_rendered = 0;
+        worker.busy_time = 0;
+        worker.bytes_received = 0;
+        worker.pixel_bytes = 0;
+    }
+
+    auto start = chrono::steady_clock::now();
+    for (State::Worker& worker : s.workers)
+        if (worker.status == State::idle)
+            s.hand_out(worker);
+    bool is_waiting_reported = false;
+    bool has_failed = false;
+    while (s.tiles_done < int(s.tiles.size()))
+    {
+        s.poll_once();
+        if (s.connected_workers() == 0 && s.children.empty())
+        {
+            if (s.children_started > 0)
+            {
+                std::cerr << scene.path << ": all the workers are gone" << std::endl;
+                has_failed = true;
+                break;
+            }
+            if (!is_waiting_reported)
+                std::cout << "Waiting for workers on " << s.address << std::endl;
+            is_waiting_reported = true;
+        }
+    }
+    s.current = nullptr;
+    s.framebuffer = nullptr;
+    bool is_written = !has_failed && framebuffer.close();
+    double render_time = seconds_since(start);
+
+    if (stats)
+    {
+        stats->render_time = render_time;
+        stats->primary_rays = s.primary_rays;
+        stats->peak_image_bytes = framebuffer.peak_bytes();
+    }
+    if (s.settings.verbose)
+    {
+        print_ray_throughput(s.primary_rays, start, s.settings.packet_size);
+        long long received = 0, pixel_bytes = 0;
+        for (const State::Worker& worker : s.workers)
+        {
+            std::cout << "Worker " << worker.pid << (worker.fd < 0 ? " (dropped)" : "") << ": " << worker.tiles_rendered << " tiles in " << worker.busy_time * 1000 << " ms ("
+                      << (render_time > 0 ? 100 * worker.busy_time / render_time : 0) << "% busy), " << worker.bytes_received / 1e3 << " kB received" << std::endl;
+            received += worker.bytes_received;
+            pixel_bytes += worker.pixel_bytes;
+        }
+        std::cout << s.tiles.size() << " tiles on " << s.workers.size() << " workers: " << received / 1e6 << " MB received for " << pixel_bytes / 1e6
+                  << " MB of pixels (x" << (received > 0 ? double(pixel_bytes) / received : 0) << "), " << s.workers_lost << " workers lost, "
+                  << s.tiles_reassigned << " tiles reassigned, " << s.copies_sent << " copies of slow tiles (" << s.copies_wasted << " wasted)" << std::endl;
+    }
+    if (!is_written)
+        std::cerr << "Could not write " << scene.output << std::endl;
+    return is_written;
+}
+
+int run_worker(const string& address, const RenderSettings& settings)
+{
+    signal(SIGPIPE, SIG_IGN);
+    string error;
+    int fd = -1;
+    for (int attempt = 0; attempt < 50 && fd < 0; attempt++)
+    {
+        fd = connect_to(address, error);
+        if (fd < 0)
+            this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    if (fd < 0)
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    Writer greeting;
+    greeting.put(protocol_magic);
+    greeting.put(protocol_version);
+    greeting.put(int32_t(getpid()));
+    if (!send_message(fd, hello, greeting))
+        return 1;
+
+    // The meshes stay loaded from one scene to the next
+    MeshLibrary library;
+    unique_ptr<Scene> scene;
+    unique_ptr<TileRenderer> renderer;
+    unique_ptr<BasicTileRenderer<float>> float_renderer;
+    RenderSettings tile_settings;
+    tile_settings.thread_count = 1;
+    tile_settings.verbose = false;
+    int scene_number = -1;
+    int tiles_rendered = 0;
+
+    MessageType type;
+    vector<char> payload;
+    while (receive_message(fd, type, payload))
+    {
+        Reader reader(payload);
+        if (type == quit)
+            break;
+        if (type == MessageType::scene)
+        {
+            auto start = chrono::steady_clock::now();
+            scene_number = reader.get<int32_t>();
+            string path = reader.get_string();
+            int width = reader.get<int32_t>();
+            int height = reader.get<int32_t>();
+            tile_settings.tile_size = reader.get<int32_t>();
+            tile_settings.packet_size = reader.get<int32_t>();
+            tile_settings.max_depth = reader.get<int32_t>();
+            tile_settings.ray_budget = reader.get<int32_t>();
+            tile_settings.roulette_weight = reader.get<double>();
+            tile_settings.max_samples = reader.get<int32_t>();
+            tile_settings.aa_threshold = reader.get<double>();
+            tile_settings.float_precision = reader.get<int32_t>() != 0;
+            tile_settings.light_samples = reader.get<int32_t>();
+            tile_settings.light_top_k = reader.get<int32_t>() != 0;
+
+            renderer.reset();
+            float_renderer.reset();
+            scene.reset(new Scene);
+            if (!reader.valid() || !load_scene(path, library, *scene, error))
+            {
+                Writer message;
+                message.put_string(reader.valid() ? error : "damaged scene message");
+                send_message(fd, failure, message);
+                return 1;
+            }
+            scene->camera.width = width;
+            scene->camera.height = height;
+            if (tile_settings.float_precision)
+                float_renderer.reset(new BasicTileRenderer<float>(*scene, tile_settings, Tile{0, width, 0, height, 0}, 1));
+            else
+                renderer.reset(new TileRenderer(*scene, tile_settings, Tile{0, width, 0, height, 0}, 1));
+
+            Writer message;
+            message.put(int32_t(scene_number));
+            message.put(seconds_since(start));
+            if (!send_message(fd, ready, message))
+                return 1;
+        }
+        else if (type == tile)
+        {
+            int number = reader.get<int32_t>();
+            int t = reader.get<int32_t>();
+            Tile rectangle;
+            rectangle.x_begin = reader.get<int32_t>();
+            rectangle.x_end = reader.get<int32_t>();
+            rectangle.y_begin = reader.get<int32_t>();
+            rectangle.y_end = reader.get<int32_t>();
+            rectangle.thread = 0;
+            if (!reader.valid() || !(renderer || float_renderer) || number != scene_number)
+                return 1;
+            if (settings.fail_after > 0 && tiles_rendered >= settings.fail_after)
+                _exit(1);
+
+            // The band holds just the tile
+            auto start = chrono::steady_clock::now();
+            const AdaptiveSampler& sampler = renderer ? renderer->sampler : float_renderer->sampler;
+            long long rays_before = sampler.rays_added();
+            int tile_width = rectangle.x_end - rectangle.x_begin;
+            vector<Pixel> tile_pixels(size_t(tile_width) * (rectangle.y_end - rectangle.y_begin));
+            BandPixels pixels(tile_pixels.data(), rectangle.y_begin, tile_width, rectangle.x_begin);
+            if (renderer)
+                renderer->render(rectangle, pixels);
+            else
+                float_renderer->render(rectangle, pixels);
+            if (settings.tile_delay > 0)
+                this_thread::sleep_for(chrono::duration<double>(settings.tile_delay));
+
+            uint32_t encoding;
+            vector<char> bytes;
+            encode_pixels(tile_pixels, encoding, bytes);
+            Writer message;
+            message.put(int32_t(scene_number));
+            message.put(int32_t(t));
+            message.put(seconds_since(start));
+            message.put(int64_t(tile_pixels.size() + sampler.rays_added() - rays_before));
+            message.put(encoding);
+            message.bytes.insert(message.bytes.end(), bytes.begin(), bytes.end());
+            if (!send_message(fd, result, message))
+                return 1;
+            tiles_rendered++;
+        }
+        else
+            return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+#else
+
+struct Coordinator::State
+{
+};
+
+Coordinator::Coordinator(const RenderSettings&)
+{
+}
+
+Coordinator::~Coordinator()
+{
+}
+
+bool Coordinator::start(const string&, string& error)
+{
+    error = "distributed rendering needs POSIX sockets";
+    return false;
+}
+
+bool Coordinator::render(const Scene&, RenderStats*)
+{
+    return false;
+}
+
+int run_worker(const string&, const RenderSettings&)
+{
+    std::cerr << "Distributed rendering needs POSIX sockets" << std::endl;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <memory>
+#include <string>
+#include "renderer.h"
+#include "scene.h"
+
+// Renders the tiles of the Whitted renderer on worker processes, on this machine or on others. The coordinator listens
+// on a Unix socket (an address with a '/') or on TCP (port or host:port). Workers connect, load every scene and build
+// its BVH once, then pull tiles one at a time: they ask for a tile when they have rendered the previous one, so fast
+// workers get more. A tile comes back as its float pixels, the bytes of the pixels regrouped by position in the float
+// and deflated, and goes into a StreamingFramebuffer, so the image is the same as a render on one process.
+//
+// A worker that disconnects or has spent settings.worker_timeout seconds on one tile is dropped and its tile handed to
+// the next worker that asks. When no tile is left to hand out, the idle workers also get a copy of the tiles that have
+// taken four times longer than the average so far, and the first copy back is kept.
+class Coordinator
+{
+public:
+    explicit Coordinator(const RenderSettings& settings);
+    ~Coordinator();
+
+    // Listen and start settings.workers worker processes of the program at executable. Workers started by hand with
+    // --worker <address> may join at any time.
+    bool start(const std::string& executable, std::string& error);
+
+    // Render the scene on the workers and write its image. Returns false if it cannot be written, or if every worker
+    // started by start() is gone while tiles are left.
+    bool render(const Scene& scene, RenderStats* stats = nullptr);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// Connect to the coordinator at address and render the tiles it hands out until it says to quit. Retries the connection
+// for a few seconds, so workers can be started before the coordinator. For tests, settings.fail_after makes the worker
+// exit without a word when it gets its next tile after that many, and settings.tile_delay makes it sleep after every
+// tile. Returns the exit status of the program.
+int run_worker(const std::string& address, const RenderSettings& settings);
+
+#endif
@@ -0,0 +1,539 @@
+#include "image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#else
+#define STB_IMAGE_WRITE_IMPLEMENTATION // Do not include this line twice in your project!
+#include "stb_image_write.h"
+#endif
+
+using namespace std;
+
+namespace
+{
+    uint8_t to_8_bits(float value)
+    {
+        return uint8_t(lround(max(min(value, 1.f), 0.f) * 255));
+    }
+
+    uint16_t to_16_bits(float value)
+    {
+        return uint16_t(lround(max(min(value, 1.f), 0.f) * 65535));
+    }
+
+    // Append the channels of a pixel, 16 bit values are big endian as in PNG and PPM files
+    void append_channels(const float* channels, int channel_count, int bits, unsigned char*& out)
+    {
+        for (int c = 0; c < channel_count; c++)
+        {
+            if (bits == 8)
+                *out++ = to_8_bits(channels[c]);
+            else
+            {
+                uint16_t value = to_16_bits(channels[c]);
+                *out++ = value >> 8;
+                *out++ = value & 0xff;
+            }
+        }
+    }
+
+    string extension_of(const string& path)
+    {
+        size_t dot = path.find_last_of('.');
+        if (dot == string::npos || path.find_first_of("/\\", dot) != string::npos)
+            return string();
+        string extension = path.substr(dot + 1);
+        transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(tolower(c)); });
+        return extension;
+    }
+
+    // Binary PPM (P6), RGB without compression
+    class PpmWriter : public ImageWriter
+    {
+    public:
+        PpmWriter(int width, int height, int bits) : width(width), height(height), bits(bits) {}
+
+        bool open(const string& path)
+        {
+            file.open(path, ios::binary);
+            file << "P6\n" << width << " " << height << "\n" << (bits == 8 ? 255 : 65535) << "\n";
+            return bool(file);
+        }
+
+        void encode(const Pixel* rows, int y_begin, int y_end, EncodedBand& band) const override
+        {
+            band.bytes.resize(size_t(y_end - y_begin) * width * 3 * (bits / 8));
+            unsigned char* out = band.bytes.data();
+            for (size_t k = 0; k < size_t(y_end - y_begin) * width; k++)
+                append_channels(&rows[k].r, 3, bits, out);
+        }
+
+        bool write(const EncodedBand& band) override
+        {
+            file.write(reinterpret_cast<const char*>(band.bytes.data()), band.bytes.size());
+            return bool(file);
+        }
+
+        bool close() override
+        {
+            file.close();
+            return bool(file);
+        }
+
+    private:
+        int width, height, bits;
+        ofstream file;
+    };
+
+    // Portable float map: RGB floats, the rows go from the bottom of the image to the top. Every band is written
+    // at its place in the file.
+    class PfmWriter : public ImageWriter
+    {
+    public:
+        PfmWriter(int width, int height) : width(width), height(height), header_size(0) {}
+
+        bool open(const string& path)
+        {
+            // The sign of the scale gives the byte order of the floats
+            const uint16_t one = 1;
+            bool is_little_endian = *reinterpret_cast<const uint8_t*>(&one) == 1;
+
+            file.open(path, ios::binary);
+            file << "PF\n" << width << " " << height << "\n" << (is_little_endian ? "-1" : "1") << "\n";
+            header_size = file.tellp();
+            return bool(file);
+        }
+
+        void encode(const Pixel* rows, int y_begin, int y_end, EncodedBand& band) const override
+        {
+            band.bytes.resize(size_t(y_end - y_begin) * width * 3 * sizeof(float));
+            float* out = reinterpret_cast<float*>(band.bytes.data());
+            for (int y = y_end - 1; y >= y_begin; y--)
+            {
+                const Pixel* row = rows + size_t(y - y_begin) * width;
+                for (int x = 0; x < width; x++)
+                {
+                    *out++ = row[x].r;
+                    *out++ = row[x].g;
+                    *out++ = row[x].b;
+                }
+            }
+        }
+
+        bool write(const EncodedBand& band) override
+        {
+            file.seekp(header_size + streamoff(height - band.y_end) * width * 3 * sizeof(float));
+            file.write(reinterpret_cast<const char*>(band.bytes.data()), band.bytes.size());
+            return bool(file);
+        }
+
+        bool close() override
+        {
+            file.close();
+            return bool(file);
+        }
+
+    private:
+        int width, height;
+        streamoff header_size;
+        ofstream file;
+    };
+
+#ifdef HAVE_ZLIB
+    // PNG, RGBA. The filtered rows of every band are compressed as a raw deflate stream of their own that ends
+    // with a sync flush (an empty stored block that realigns it on a byte), so that the streams of the bands can
+    // follow each other in a single zlib stream. Only the last band finishes the stream. The Adler-32 of the
+    // bands are combined as they are written.
+    class PngWriter : public ImageWriter
+    {
+    public:
+        PngWriter(int width, int height, int bits) : width(width), height(height), bits(bits), checksum(1) {}
+
+        bool open(const string& path)
+        {
+            file.open(path, ios::binary);
+            const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+            file.write(reinterpret_cast<const char*>(signature), 8);
+
+            unsigned char header[13];
+            store_u32(header, width);
+            store_u32(header + 4, height);
+            header[8] = bits;
+            header[9] = 6; // Color type RGBA
+            header[10] = 0; // Deflate
+            header[11] = 0; // Adaptive filtering
+            header[12] = 0; // No interlacing
+            write_chunk("IHDR", header, 13);
+
+            // zlib header of a deflate stream with a 32 KB window and the default compression level
+            const unsigned char zlib_header[2] = {0x78, 0x9c};
+            write_chunk("IDAT", zlib_header, 2);
+            return bool(file);
+        }
+
+        void encode(const Pixel* rows, int y_begin, int y_end, EncodedBand& band) const override
+        {
+            const int pixel_bytes = 4 * bits / 8;
+            const size_t row_bytes = size_t(width) * pixel_bytes;
+
+            // Convert and filter the rows, the first row of a band does not look at the band above it
+            vector<unsigned char> raw((row_bytes + 1) * (y_end - y_begin));
+            vector<unsigned char> row(row_bytes), previous_row(row_bytes), scratch(row_bytes);
+            for (int y = y_begin; y < y_end; y++)
+            {
+                unsigned char* out = row.data();
+                const Pixel* pixels = rows + size_t(y - y_begin) * width;
+                for (int x = 0; x < width; x++)
+                    append_channels(&pixels[x].r, 4, bits, out);
+                filter_row(row.data(), y > y_begin ? previous_row.data() : nullptr, row_bytes, pixel_bytes, scratch.data(), &raw[(row_bytes + 1) * (y - y_begin)]);
+                swap(row, previous_row);
+            }
+            band.checksum = adler32(adler32(0, Z_NULL, 0), raw.data(), raw.size());
+            band.raw_size = raw.size();
+
+            z_stream stream = {};
+            deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            band.bytes.resize(deflateBound(&stream, raw.size()) + 16);
+            stream.next_in = raw.data();
+            stream.avail_in = raw.size();
+            stream.next_out = band.bytes.data();
+            stream.avail_out = band.bytes.size();
+            deflate(&stream, y_end == height ? Z_FINISH : Z_SYNC_FLUSH);
+            band.bytes.resize(stream.total_out);
+            deflateEnd(&stream);
+        }
+
+        bool write(const EncodedBand& band) override
+        {
+            checksum = adler32_combine(checksum, band.checksum, band.raw_size);
+            if (!band.bytes.empty())
+                write_chunk("IDAT", band.bytes.data(), band.bytes.size());
+            return bool(file);
+        }
+
+        bool close() override
+        {
+            unsigned char trailer[4];
+            store_u32(trailer, checksum);
+            write_chunk("IDAT", trailer, 4);
+            write_chunk("IEND", nullptr, 0);
+            file.close();
+            return bool(file);
+        }
+
+    private:
+        int width, height, bits;
+        unsigned long checksum;
+        ofstream file;
+
+        static void store_u32(unsigned char* out, uint32_t value)
+        {
+            out[0] = value >> 24;
+            out[1] = value >> 16;
+            out[2] = value >> 8;
+            out[3] = value;
+        }
+
+        void write_chunk(const char* type, const unsigned char* data, size_t size)
+        {
+            unsigned char length[4], crc[4];
+            store_u32(length, size);
+            uLong chunk_crc = crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(type), 4);
+            if (size > 0)
+                chunk_crc = crc32(chunk_crc, data, size);
+            store_u32(crc, chunk_crc);
+            file.write(reinterpret_cast<const char*>(length), 4);
+            file.write(type, 4);
+            file.write(reinterpret_cast<const char*>(data), size);
+            file.write(reinterpret_cast<const char*>(crc), 4);
+        }
+
+        // Filter a row with the filter type (0 None, 1 Sub, 2 Up, 4 Paeth) into out, returns the sum of the absolute
+        // values of the filtered bytes read as signed bytes. Up and Paeth need the previous row.
+        static long apply_filter(int filter, const unsigned char* row, const unsigned char* previous, size_t size, size_t pixel_bytes, unsigned char* out)
+        {
+            size_t first = min(pixel_bytes, size);
+            switch (filter)
+            {
+            case 0:
+                memcpy(out, row, size);
+                break;
+            case 1:
+                memcpy(out, row, first);
+                for (size_t k = first; k < size; k++)
+                    out[k] = row[k] - row[k - pixel_bytes];
+                break;
+            case 2:
+                for (size_t k = 0; k < size; k++)
+                    out[k] = row[k] - previous[k];
+                break;
+            case 4:
+                // The pixels of the left column only have a neighbour above
+                for (size_t k = 0; k < first; k++)
+                    out[k] = row[k] - previous[k];
+                for (size_t k = first; k < size; k++)
+                {
+                    int a = row[k - pixel_bytes], b = previous[k], c = previous[k - pixel_bytes];
+                    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+                    out[k] = row[k] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+                }
+                break;
+            }
+
+            long cost = 0;
+            for (size_t k = 0; k < size; k++)
+                cost += abs(int(int8_t(out[k])));
+            return cost;
+        }
+
+        // Write the filter byte and the filtered row, picking the filter with the smallest sum of absolute
+        // differences like libpng does. scratch must hold a row.
+        static void filter_row(const unsigned char* row, const unsigned char* previous, size_t size, int pixel_bytes, unsigned char* scratch, unsigned char* out)
+        {
+            int best_filter = 0;
+            long best_cost = apply_filter(0, row, previous, size, pixel_bytes, out + 1);
+            for (int filter : {1, 2, 4})
+            {
+                if (!previous && filter != 1)
+                    continue;
+                long cost = apply_filter(filter, row, previous, size, pixel_bytes, scratch);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_filter = filter;
+                    memcpy(out + 1, scratch, size);
+                }
+            }
+            out[0] = best_filter;
+        }
+    };
+#else
+    // Without zlib the 8 bit rows are kept and compressed by stb_image_write once the image is complete
+    class PngWriter : public ImageWriter
+    {
+    public:
+        PngWriter(int width, int height, int bits) : width(width), height(height) {}
+
+        bool open(const string& path)
+        {
+            this->path = path;
+            data.reserve(size_t(width) * height * 4);
+            return true;
+        }
+
+        void encode(const Pixel* rows, int y_begin, int y_end, EncodedBand& band) const override
+        {
+            band.bytes.resize(size_t(y_end - y_begin) * width * 4);
+            unsigned char* out = band.bytes.data();
+            for (size_t k = 0; k < size_t(y_end - y_begin) * width; k++)
+                append_channels(&rows[k].r, 4, 8, out);
+        }
+
+        bool write(const EncodedBand& band) override
+        {
+            data.insert(data.end(), band.bytes.begin(), band.bytes.end());
+            return true;
+        }
+
+        bool close() override
+        {
+            return stbi_write_png(path.c_str(), width, height, 4, data.data(), width * 4) != 0;
+        }
+
+    private:
+        int width, height;
+        string path;
+        vector<unsigned char> data;
+    };
+#endif
+}
+
+unique_ptr<ImageWriter> open_image_writer(const string& path, int width, int height, int bits, string& error)
+{
+    const string extension = extension_of(path);
+    bool is_open = false;
+    unique_ptr<ImageWriter> writer;
+    if (extension == "pfm")
+    {
+        unique_ptr<PfmWriter> pfm(new PfmWriter(width, height));
+        is_open = pfm->open(path);
+        writer = move(pfm);
+    }
+    else if ((extension == "png" || extension == "ppm") && bits != 8 && bits != 16)
+    {
+        error = "PNG and PPM images have 8 or 16 bits per channel";
+        return nullptr;
+    }
+    else if (extension == "ppm")
+    {
+        unique_ptr<PpmWriter> ppm(new PpmWriter(width, height, bits));
+        is_open = ppm->open(path);
+        writer = move(ppm);
+    }
+    else if (extension == "png")
+    {
+#ifndef HAVE_ZLIB
+        if (bits != 8)
+        {
+            error = "16 bit PNG images need zlib";
+            return nullptr;
+        }
+#endif
+        unique_ptr<PngWriter> png(new PngWriter(width, height, bits));
+        is_open = png->open(path);
+        writer = move(png);
+    }
+    else
+    {
+        error = "unknown image format \"" + extension + "\", use png, ppm or pfm";
+        return nullptr;
+    }
+
+    if (!is_open)
+    {
+        error = "cannot create " + path;
+        return nullptr;
+    }
+    return writer;
+}
+
+string sibling_path(const string& image, const string& suffix)
+{
+    size_t extension = image.find_last_of('.');
+    size_t separator = image.find_last_of("/\\");
+    if (extension == string::npos || (separator != string::npos && extension < separator))
+        return image + suffix;
+    return image.substr(0, extension) + suffix;
+}
+
+bool Framebuffer::write(const string& path, int bits) const
+{
+    string error;
+    unique_ptr<ImageWriter> writer = open_image_writer(path, width, height, bits, error);
+    if (!writer)
+    {
+        cerr << error << endl;
+        return false;
+    }
+
+    // Encode bands of 64 rows on all the cores, then write them in order
+    const int band_height = 64;
+    const int band_count = (height + band_height - 1) / band_height;
+    vector<EncodedBand> bands(band_count);
+    atomic<int> next_band(0);
+    auto encode_bands = [&]()
+    {
+        for (int band = next_band++; band < band_count; band = next_band++)
+        {
+            bands[band].y_begin = band * band_height;
+            bands[band].y_end = min(height, (band + 1) * band_height);
+            writer->encode(&pixels[size_t(bands[band].y_begin) * width], bands[band].y_begin, bands[band].y_end, bands[band]);
+        }
+    };
+    vector<thread> threads;
+    for (int t = 1; t < min<int>(band_count, thread::hardware_concurrency()); t++)
+        threads.emplace_back(encode_bands);
+    encode_bands();
+    for (thread& t : threads)
+        t.join();
+
+    bool is_written = true;
+    for (const EncodedBand& band : bands)
+        is_written = writer->write(band) && is_written;
+    if (!writer->close() || !is_written)
+    {
+        cerr << "Could not write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+StreamingFramebuffer::StreamingFramebuffer(int width, int height, int band_height, ImageWriter& writer)
+    : StreamingFramebuffer(Tile{0, width, 0, height, 0}, band_height, writer)
+{
+}
+
+StreamingFramebuffer::StreamingFramebuffer(const Tile& region, int band_height, ImageWriter& writer)
+    : x_origin(region.x_begin), y_origin(region.y_begin), width(region.x_end - region.x_begin), height(region.y_end - region.y_begin),
+      band_height(band_height), writer(writer), next_band(0), writing(false), failed(false), held(0), peak(0)
+{
+    tiles_per_band = (width + band_height - 1) / band_height;
+    int band_count = (height + band_height - 1) / band_height;
+    bands.resize(band_count);
+    tiles_done.assign(band_count, 0);
+}
+
+BandPixels StreamingFramebuffer::begin_tile(const Tile& tile)
+{
+    const int band = (tile.y_begin - y_origin) / band_height;
+    lock_guard<mutex> guard(lock);
+    if (!bands[band])
+    {
+        int rows = min(height, (band + 1) * band_height) - band * band_height;
+        bands[band].reset(new vector<Pixel>(size_t(rows) * width));
+        held += bands[band]->size() * sizeof(Pixel);
+        peak = max(peak, held);
+    }
+    return BandPixels(bands[band]->data(), y_origin + band * band_height, width, x_origin);
+}
+
+void StreamingFramebuffer::end_tile(const Tile& tile)
+{
+    const int band = (tile.y_begin - y_origin) / band_height;
+    unique_ptr<vector<Pixel>> pixels;
+    {
+        lock_guard<mutex> guard(lock);
+        if (++tiles_done[band] < tiles_per_band)
+            return;
+        pixels = move(bands[band]);
+    }
+
+    // The band is complete, encode it outside of the lock while the other threads keep rendering
+    EncodedBand encoded_band;
+    encoded_band.y_begin = band * band_height;
+    encoded_band.y_end = min(height, (band + 1) * band_height);
+    writer.encode(pixels->data(), encoded_band.y_begin, encoded_band.y_end, encoded_band);
+    size_t pixel_bytes = pixels->size() * sizeof(Pixel);
+    pixels.reset();
+
+    unique_lock<mutex> guard(lock);
+    held -= pixel_bytes;
+    held += encoded_band.bytes.size();
+    peak = max(peak, held);
+    encoded[band] = move(encoded_band);
+
+    // Only one thread writes at a time, it also writes the bands that are finished meanwhile
+    if (writing)
+        return;
+    writing = true;
+    while (true)
+    {
+        auto found = encoded.find(next_band);
+        if (found == encoded.end())
+            break;
+        EncodedBand ready = move(found->second);
+        encoded.erase(found);
+        guard.unlock();
+        bool is_written = writer.write(ready);
+        guard.lock();
+        failed = failed || !is_written;
+        held -= ready.bytes.size();
+        next_band++;
+    }
+    writing = false;
+}
+
+bool StreamingFramebuffer::close()
+{
+    bool is_complete = next_band == int(bands.size()) && !failed;
+    return writer.close() && is_complete;
+}
@@ -0,0 +1,139 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "parallel.h"
+
+// Color and alpha of a pixel, packed so that a row of pixels is a contiguous run of floats
+struct Pixel
+{
+    float r, g, b, a;
+
+    Pixel() : r(0), g(0), b(0), a(0) {}
+    Pixel(float r, float g, float b, float a) : r(r), g(g), b(b), a(a) {}
+};
+
+// Bytes of the file for a band of rows, produced by ImageWriter::encode()
+struct EncodedBand
+{
+    int y_begin, y_end;
+    std::vector<unsigned char> bytes;
+    unsigned long checksum; // Adler-32 of the uncompressed PNG data
+    std::size_t raw_size;   // Size of the uncompressed PNG data
+};
+
+// Writes an image band of rows by band of rows, from top to bottom. The format follows the extension of the file:
+//   .png  RGBA, 8 or 16 bits per channel. Every band is deflated on its own and the streams are chained.
+//   .ppm  RGB, 8 or 16 bits per channel, no compression
+//   .pfm  RGB, 32 bit floats, no compression
+// Values are clamped to [0, 1] except in PFM files.
+class ImageWriter
+{
+public:
+    virtual ~ImageWriter() {}
+
+    // Convert the rows [y_begin, y_end) to the bytes of the file, rows holds their pixels one row after the other.
+    // Bands do not depend on each other, so different bands can be encoded at the same time by different threads.
+    virtual void encode(const Pixel* rows, int y_begin, int y_end, EncodedBand& band) const = 0;
+
+    // Append an encoded band to the file, called once for every band in row order
+    virtual bool write(const EncodedBand& band) = 0;
+
+    // Write the end of the file, returns false if anything failed to be written
+    virtual bool close() = 0;
+};
+
+// Open a writer for a width x height image, bits is 8 or 16 for PNG and PPM, PFM is always 32 bit float.
+// Returns nullptr with a message if the format is unknown or the file cannot be created.
+std::unique_ptr<ImageWriter> open_image_writer(const std::string& path, int width, int height, int bits, std::string& error);
+
+// Path of a file written next to an image: the image path without its extension, followed by suffix
+std::string sibling_path(const std::string& image, const std::string& suffix);
+
+// Whole image in memory, one row after the other
+class Framebuffer
+{
+public:
+    int width;
+    int height;
+    std::vector<Pixel> pixels;
+
+    Framebuffer(int width, int height) : width(width), height(height), pixels(std::size_t(width) * height) {}
+
+    Pixel& operator()(int x, int y) { return pixels[std::size_t(y) * width + x]; }
+    const Pixel& operator()(int x, int y) const { return pixels[std::size_t(y) * width + x]; }
+
+    // Write the image, the bands of rows are encoded on all the cores. Prints an error and returns false on failure.
+    bool write(const std::string& path, int bits = 8) const;
+};
+
+// Pixels of the band of rows holding a tile, (x, y) are image coordinates inside the band. The band starts at
+// column x_begin of the image when it only holds a region of it.
+class BandPixels
+{
+public:
+    BandPixels(Pixel* band, int y_begin, int width, int x_begin = 0) : band(band), x_begin(x_begin), y_begin(y_begin), width(width) {}
+
+    Pixel& operator()(int x, int y) { return band[std::size_t(y - y_begin) * width + x - x_begin]; }
+
+private:
+    Pixel* band;
+    int x_begin;
+    int y_begin;
+    int width;
+};
+
+// Image rendered tile by tile and written while it is rendered. The rows are grouped in bands of the height of the
+// tiles; a band is allocated by its first tile, and when its last tile is done the thread that rendered it encodes
+// the band and frees its pixels. Encoded bands are written in order, so only the bands being rendered and the
+// encoded ones waiting for an earlier band are in memory. Render with TileScheduler::scanline_order so that
+// the bands are finished roughly from top to bottom.
+class StreamingFramebuffer
+{
+public:
+    // The tiles must be band_height x band_height squares (smaller on the right and bottom edges), as cut by a
+    // TileScheduler with a tile_size of band_height
+    StreamingFramebuffer(int width, int height, int band_height, ImageWriter& writer);
+
+    // Image of a region of a larger one, such as a crop of the camera image. The tiles and the BandPixels are in the
+    // coordinates of the larger image, the tiles cut from the top left corner of the region.
+    StreamingFramebuffer(const Tile& region, int band_height, ImageWriter& writer);
+
+    // Pixels of the band of a tile, cleared to transparent black
+    BandPixels begin_tile(const Tile& tile);
+
+    // Mark the tile as rendered
+    void end_tile(const Tile& tile);
+
+    // Write the end of the file once all the tiles are done, returns false if a band could not be written
+    bool close();
+
+    // Largest number of bytes of pixels and encoded bands held at the same time
+    std::size_t peak_bytes() const { return peak; }
+
+private:
+    int x_origin;
+    int y_origin;
+    int width;
+    int height;
+    int band_height;
+    int tiles_per_band;
+    ImageWriter& writer;
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<std::vector<Pixel>>> bands;
+    std::vector<int> tiles_done;
+    std::map<int, EncodedBand> encoded; // Bands waiting for an earlier one to be written
+    int next_band;
+    bool writing; // A thread is writing the bands that are ready
+    bool failed;
+    std::size_t held;
+    std::size_t peak;
+};
+
+#endif
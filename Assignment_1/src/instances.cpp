@@ -0,0 +1,341 @@
+#include "instances.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <Eigen/LU>
+
+using namespace std;
+using namespace Eigen;
+
+int InstanceBVH::add_mesh(const MatrixXd& vertices, const MatrixXi& faces, int first_mesh)
+{
+    // A mesh is never updated, only the tree and the queries are kept
+    BVH mesh;
+    mesh.build(vector<MatrixXd>(1, vertices), vector<MatrixXi>(1, faces), first_mesh);
+    meshes.push_back(move(mesh));
+    return meshes.size() - 1;
+}
+
+void InstanceBVH::add_instance(int mesh, const Matrix3d& linear, const Vector3d& translation, int material)
+{
+    Instance instance;
+    instance.mesh = mesh;
+    instance.shape = -1;
+    instance.material = material;
+    instance.linear = linear;
+    instance.translation = translation;
+    instance.inverse_linear = linear.inverse();
+    instance.inverse_translation = -instance.inverse_linear * translation;
+    instances.push_back(instance);
+}
+
+int InstanceBVH::add_shape(const Shape& shape)
+{
+    shapes.push_back(shape);
+    return shapes.size() - 1;
+}
+
+void InstanceBVH::add_shape_instance(int shape, const Matrix3d& linear, const Vector3d& translation, int material)
+{
+    add_instance(-1, linear, translation, material);
+    instances.back().shape = shape;
+}
+
+void InstanceBVH::build()
+{
+    // World box of every instance, from the corners of the root box of its mesh or of the box of its shape
+    vector<Vector3d> box_mins, box_maxs;
+    for (const Instance& instance : instances)
+    {
+        Vector3d box_min = Vector3d::Constant(numeric_limits<double>::infinity());
+        Vector3d box_max = -box_min;
+        Vector3d local_min = box_min, local_max = box_max;
+        if (instance.shape >= 0)
+        {
+            local_min = shapes[instance.shape].box_min;
+            local_max = shapes[instance.shape].box_max;
+        }
+        else if (!meshes[instance.mesh].nodes.empty())
+        {
+            local_min = meshes[instance.mesh].nodes[0].box_min;
+            local_max = meshes[instance.mesh].nodes[0].box_max;
+        }
+        if (local_min.x() <= local_max.x())
+        {
+            for (int corner = 0; corner < 8; corner++)
+            {
+                Vector3d p((corner & 1) ? local_max(0) : local_min(0), (corner & 2) ? local_max(1) : local_min(1),
+                           (corner & 4) ? local_max(2) : local_min(2));
+                Vector3d world = instance.linear * p + instance.translation;
+                box_min = box_min.cwiseMin(world);
+                box_max = box_max.cwiseMax(world);
+            }
+        }
+        box_mins.push_back(box_min);
+        box_maxs.push_back(box_max);
+    }
+
+    vector<int> order;
+    BVH nodes;
+    nodes.build_nodes(box_mins, box_maxs, order);
+    top = move(nodes);
+
+    vector<Instance> sorted;
+    sorted.reserve(instances.size());
+    for (int k : order)
+        sorted.push_back(instances[k]);
+    instances.swap(sorted);
+}
+
+template <typename Scalar>
+template <typename Other>
+void BasicInstanceBVH<Scalar>::assign(const BasicInstanceBVH<Other>& other)
+{
+    meshes.resize(other.meshes.size());
+    for (int k = 0; k < meshes.size(); k++)
+        meshes[k].assign(other.meshes[k]);
+    shapes = other.shapes;
+    instances = other.instances;
+    top.assign(other.top);
+}
+
+template <typename Scalar>
+bool BasicInstanceBVH<Scalar>::intersect(const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max, Hit& hit, TraversalStats* stats) const
+{
+    if (top.nodes.empty())
+        return false;
+
+    Vector3 inverse_direction = ray_direction.cwiseInverse();
+    Scalar t_entry;
+    if (!BasicBVH<Scalar>::intersect_box(top.nodes[0], ray_origin, inverse_direction, t_max, t_entry))
+        return false;
+
+    struct StackEntry
+    {
+        int node;
+        Scalar t_entry;
+    };
+    StackEntry stack[traversal_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = {0, t_entry};
+
+    bool is_intersected = false;
+    long long nodes_visited = 0;
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_entry >= t_max)
+            continue;
+
+        const typename BasicBVH<Scalar>::Node& node = top.nodes[entry.node];
+        nodes_visited++;
+
+        if (node.count > 0)
+        {
+            // The direction is not normalized in the space of the mesh, so t is the same in both spaces
+            for (int k = node.first; k < node.first + node.count; k++)
+            {
+                const Instance& instance = instances[k];
+                if (instance.shape >= 0)
+                {
+                    const Shape& shape = shapes[instance.shape];
+                    double shape_t = t_max;
+                    int part;
+                    if (shape.intersect(instance.inverse_linear * ray_origin.template cast<double>() + instance.inverse_translation,
+                                        instance.inverse_linear * ray_direction.template cast<double>(), shape_t, part) && Scalar(shape_t) < t_max)
+                    {
+                        t_max = Scalar(shape_t);
+                        hit.t = shape_t;
+                        hit.mesh = shape.mesh;
+                        hit.face = part;
+                        hit.primitive = -1;
+                        hit.instance = k;
+                        is_intersected = true;
+                    }
+                    continue;
+                }
+                const BasicBVH<Scalar>& mesh = meshes[instance.mesh];
+                if (mesh.nodes.empty())
+                    continue;
+                Vector3 mesh_origin = (instance.inverse_linear * ray_origin.template cast<double>() + instance.inverse_translation).template cast<Scalar>();
+                Vector3 mesh_direction = (instance.inverse_linear * ray_direction.template cast<double>()).template cast<Scalar>();
+                if (mesh.closest_hit(mesh_origin, mesh_direction, t_max, hit, stats))
+                {
+                    hit.instance = k;
+                    is_intersected = true;
+                }
+            }
+            continue;
+        }
+
+        // Push the far child first so that the near one is visited first
+        assert(stack_size + 2 <= traversal_stack_size);
+        Scalar t_left, t_right;
+        bool hit_left = BasicBVH<Scalar>::intersect_box(top.nodes[node.first], ray_origin, inverse_direction, t_max, t_left);
+        bool hit_right = BasicBVH<Scalar>::intersect_box(top.nodes[node.first + 1], ray_origin, inverse_direction, t_max, t_right);
+        if (hit_left && hit_right)
+        {
+            if (t_left <= t_right)
+            {
+                stack[stack_size++] = {node.first + 1, t_right};
+                stack[stack_size++] = {node.first, t_left};
+            }
+            else
+            {
+                stack[stack_size++] = {node.first, t_left};
+                stack[stack_size++] = {node.first + 1, t_right};
+            }
+        }
+        else if (hit_left)
+            stack[stack_size++] = {node.first, t_left};
+        else if (hit_right)
+            stack[stack_size++] = {node.first + 1, t_right};
+    }
+
+    if (stats)
+        stats->nodes_visited += nodes_visited;
+    return is_intersected;
+}
+
+template <typename Scalar>
+bool BasicInstanceBVH<Scalar>::occluded(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats) const
+{
+    if (top.nodes.empty())
+        return false;
+
+    Vector3 inverse_direction = ray_direction.cwiseInverse();
+    int stack[traversal_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    bool is_occluded = false;
+    long long nodes_visited = 0;
+
+    while (stack_size > 0 && !is_occluded)
+    {
+        const typename BasicBVH<Scalar>::Node& node = top.nodes[stack[--stack_size]];
+        Scalar t_entry;
+        if (!BasicBVH<Scalar>::intersect_box(node, ray_origin, inverse_direction, t_max, t_entry))
+            continue;
+        nodes_visited++;
+
+        if (node.count > 0)
+        {
+            for (int k = node.first; k < node.first + node.count && !is_occluded; k++)
+            {
+                const Instance& instance = instances[k];
+                if (instance.shape >= 0)
+                {
+                    double shape_t = t_max;
+                    int part;
+                    is_occluded = shapes[instance.shape].intersect(instance.inverse_linear * ray_origin.template cast<double>() + instance.inverse_translation,
+                                                                   instance.inverse_linear * ray_direction.template cast<double>(), shape_t, part);
+                    continue;
+                }
+                const BasicBVH<Scalar>& mesh = meshes[instance.mesh];
+                if (mesh.nodes.empty())
+                    continue;
+                Vector3 mesh_origin = (instance.inverse_linear * ray_origin.template cast<double>() + instance.inverse_translation).template cast<Scalar>();
+                Vector3 mesh_direction = (instance.inverse_linear * ray_direction.template cast<double>()).template cast<Scalar>();
+                is_occluded = mesh.find_occluder(mesh_origin, mesh_direction, t_max, stats) >= 0;
+            }
+            continue;
+        }
+
+        // A ray going towards +axis meets the left child first, push it last
+        assert(stack_size + 2 <= traversal_stack_size);
+        if (ray_direction(node.axis) < 0)
+        {
+            stack[stack_size++] = node.first;
+            stack[stack_size++] = node.first + 1;
+        }
+        else
+        {
+            stack[stack_size++] = node.first + 1;
+            stack[stack_size++] = node.first;
+        }
+    }
+
+    if (stats)
+    {
+        stats->nodes_visited += nodes_visited;
+        stats->occluded += is_occluded;
+    }
+    return is_occluded;
+}
+
+template <typename Scalar>
+typename BasicInstanceBVH<Scalar>::Vector3 BasicInstanceBVH<Scalar>::normal(const Hit& hit, const Vector3& position) const
+{
+    // Normals transform by the inverse transpose of the linear part, the one of a shape is found at the point in its space
+    const Instance& instance = instances[hit.instance];
+    Vector3d local_normal;
+    if (instance.shape >= 0)
+        local_normal = shapes[instance.shape].normal(instance.inverse_linear * position.template cast<double>() + instance.inverse_translation, hit.face);
+    else
+        local_normal = meshes[instance.mesh].triangles.normal(hit.primitive).template cast<double>();
+    return (instance.inverse_linear.transpose() * local_normal).normalized().template cast<Scalar>();
+}
+
+template <typename Scalar>
+size_t BasicInstanceBVH<Scalar>::memory_bytes() const
+{
+    size_t bytes = top.memory_bytes() + instances.size() * sizeof(Instance);
+    for (const BasicBVH<Scalar>& mesh : meshes)
+        bytes += mesh.memory_bytes();
+    for (const Shape& shape : shapes)
+        bytes += sizeof(Shape) + shape.profile.size() * sizeof(Vector2d);
+    return bytes;
+}
+
+template <typename Scalar>
+long long BasicInstanceBVH<Scalar>::instanced_triangles() const
+{
+    long long triangles = 0;
+    for (const Instance& instance : instances)
+        if (instance.mesh >= 0)
+            triangles += meshes[instance.mesh].triangles.size();
+    return triangles;
+}
+
+template <typename Scalar>
+void BasicInstanceBVH<Scalar>::print_summary() const
+{
+    if (instances.empty())
+        return;
+
+    long long triangles = 0;
+    for (const BasicBVH<Scalar>& mesh : meshes)
+        triangles += mesh.triangles.size();
+
+    // A flat BVH over copies of the triangles needs about the bytes of the meshes for every instance
+    double copies_bytes = 0;
+    int shape_instances = 0;
+    for (const Instance& instance : instances)
+    {
+        if (instance.mesh >= 0)
+            copies_bytes += meshes[instance.mesh].memory_bytes();
+        shape_instances += instance.shape >= 0;
+    }
+
+    // Shapes have no triangles to copy, so a scene of shapes alone has no mesh counts and no copies to compare with
+    int mesh_instances = int(instances.size()) - shape_instances;
+    cout << "Instances: ";
+    if (mesh_instances > 0)
+        cout << mesh_instances << " copies of " << meshes.size() << " meshes, " << instanced_triangles() << " triangles placed from " << triangles << " stored, ";
+    if (shape_instances > 0)
+        cout << shape_instances << " copies of " << shapes.size() << " shapes, ";
+    cout << memory_bytes() / 1e6 << " MB";
+    if (mesh_instances > 0)
+        cout << " instead of about " << copies_bytes / 1e6 << " MB for copies";
+    cout << ", top level built in " << top.build_time * 1000 << " ms" << endl;
+}
+
+template class BasicInstanceBVH<double>;
+template class BasicInstanceBVH<float>;
+
+template void BasicInstanceBVH<float>::assign(const BasicInstanceBVH<double>&);
@@ -0,0 +1,94 @@
+#ifndef INSTANCES_H
+#define INSTANCES_H
+
+#include <cstddef>
+#include <vector>
+#include <Eigen/Core>
+#include "bvh.h"
+#include "shapes.h"
+
+// A copy of a mesh or of an analytic shape placed in the scene by an affine transform x -> linear * x + translation
+struct Instance
+{
+    int mesh;     // Index of the BVH of its mesh in InstanceBVH::meshes, -1 for a shape
+    int shape;    // Index of its shape in InstanceBVH::shapes, -1 for a mesh
+    int material; // Index chosen by the caller, e.g. in Scene::instance_materials
+
+    Eigen::Matrix3d linear;
+    Eigen::Vector3d translation;
+
+    // World to mesh space
+    Eigen::Matrix3d inverse_linear;
+    Eigen::Vector3d inverse_translation;
+};
+
+// Two level hierarchy for meshes placed many times: one BVH per mesh (the bottom level) built once in its own space,
+// and a BVH over the world boxes of the instances (the top level). A ray that reaches an instance is moved to the space
+// of its mesh and continues in the BVH of the mesh, so memory grows with the triangles of the distinct meshes and only
+// by an Instance for every copy. The BVHs are in Scalar, the transforms of the instances stay in double.
+// Analytic shapes are placed the same way, as leaves of the top level next to the meshes, and are intersected in double.
+template <typename Scalar>
+class BasicInstanceBVH
+{
+public:
+    typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+
+    // Bottom level, the triangles of mesh k have Hit::mesh equal to the first_mesh given to InstanceBVH::add_mesh()
+    std::vector<BasicBVH<Scalar>> meshes;
+
+    // Shapes in their own space, their hits have the Hit::mesh of the shape, the part of the shape in Hit::face
+    // and no Hit::primitive
+    std::vector<Shape> shapes;
+
+    // In the leaf order of the top level after InstanceBVH::build()
+    std::vector<Instance> instances;
+
+    // Nodes over the instances, the leaves cover ranges of instances. It holds no triangles.
+    BasicBVH<Scalar> top;
+
+    // Copy both levels of other in Scalar
+    template <typename Other>
+    void assign(const BasicInstanceBVH<Other>& other);
+
+    // Closest triangle or shape of an instance hit with 0 < t < t_max, lowers t_max to its distance. hit.primitive is
+    // the triangle in the BVH of the mesh and hit.instance the instance. The ray is not counted in stats->rays, the
+    // caller counts it once for both levels.
+    bool intersect(const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max, Hit& hit, TraversalStats* stats = nullptr) const;
+
+    // Any-hit query for shadow rays, the ray is not counted in stats->rays either
+    bool occluded(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, TraversalStats* stats = nullptr) const;
+
+    // Unit shading normal of a hit found by intersect() at position, in world space
+    Vector3 normal(const Hit& hit, const Vector3& position) const;
+
+    // Bytes of the nodes, triangles, shapes and instances
+    std::size_t memory_bytes() const;
+
+    // Triangles of all the instances, as if each copy was stored
+    long long instanced_triangles() const;
+
+    // Print the instances, the meshes and the memory used compared to copying the meshes
+    void print_summary() const;
+};
+
+// The instances of a scene, built in double
+class InstanceBVH : public BasicInstanceBVH<double>
+{
+public:
+    // Add the BVH of a mesh in its own space, returns its index for add_instance()
+    int add_mesh(const Eigen::MatrixXd& vertices, const Eigen::MatrixXi& faces, int first_mesh);
+
+    // Place a copy of a mesh, the transform must be invertible
+    void add_instance(int mesh, const Eigen::Matrix3d& linear, const Eigen::Vector3d& translation, int material);
+
+    // Add a shape in its own space, returns its index for add_shape_instance()
+    int add_shape(const Shape& shape);
+
+    // Place a copy of a shape, the transform must be invertible
+    void add_shape_instance(int shape, const Eigen::Matrix3d& linear, const Eigen::Vector3d& translation, int material);
+
+    // Build the top level over the instances added so far
+    void build();
+};
+
+#endif
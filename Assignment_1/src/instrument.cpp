@@ -0,0 +1,164 @@
+#include "instrument.h"
+
+#ifdef INSTRUMENT_RENDER
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include "image.h"
+
+using namespace std;
+
+namespace
+{
+    // Black, purple, red, orange and pale yellow at equal steps of value in [0, 1], close to matplotlib's inferno
+    Pixel false_color(float value)
+    {
+        static const float stops[5][3] = {{0, 0, 0}, {0.34f, 0.06f, 0.43f}, {0.73f, 0.21f, 0.33f}, {0.98f, 0.55f, 0.04f}, {0.99f, 1, 0.64f}};
+        float position = min(max(value, 0.f), 1.f) * 4;
+        int stop = min(int(position), 3);
+        float fraction = position - stop;
+        float rgb[3];
+        for (int c = 0; c < 3; c++)
+            rgb[c] = stops[stop][c] + fraction * (stops[stop + 1][c] - stops[stop][c]);
+        return Pixel(rgb[0], rgb[1], rgb[2], 1);
+    }
+
+    // Counter of a pixel shown by a heatmap
+    struct Counter
+    {
+        const char* suffix;
+        const char* unit;
+        float PixelCost::*value;
+    };
+}
+
+bool CostMap::write_heatmaps(const string& output) const
+{
+    static const Counter counters[] = {
+        {"_cost_time.png", "microseconds", &PixelCost::microseconds},
+        {"_cost_nodes.png", "BVH nodes visited", &PixelCost::nodes_visited},
+        {"_cost_triangles.png", "triangle tests", &PixelCost::triangle_tests},
+        {"_cost_shadow.png", "shadow rays", &PixelCost::shadow_rays},
+    };
+
+    bool is_written = true;
+    for (const Counter& counter : counters)
+    {
+        // A few very expensive pixels would leave the rest of the map black, so the scale stops at the 99th percentile
+        vector<float> values(pixels.size());
+        for (size_t k = 0; k < pixels.size(); k++)
+            values[k] = pixels[k].*counter.value;
+        float maximum = values.empty() ? 0 : *max_element(values.begin(), values.end());
+        float scale = 0;
+        if (!values.empty())
+        {
+            auto percentile = values.begin() + (values.size() - 1) * 99 / 100;
+            nth_element(values.begin(), percentile, values.end());
+            scale = *percentile > 0 ? *percentile : maximum;
+        }
+
+        Framebuffer heatmap(width, height);
+        for (size_t k = 0; k < pixels.size(); k++)
+            heatmap.pixels[k] = false_color(scale > 0 ? pixels[k].*counter.value / scale : 0);
+
+        string path = sibling_path(output, counter.suffix);
+        is_written = heatmap.write(path) && is_written;
+        std::cout << path << ": white is " << scale << " " << counter.unit << " per pixel or more (99th percentile, maximum " << maximum << ")" << std::endl;
+    }
+    return is_written;
+}
+
+void CostMap::print_mesh_table(const Scene& scene, const TraversalStats& traversal) const
+{
+    // Triangles stored for each mesh, once for an instanced mesh
+    int mesh_count = scene.mesh_names.size();
+    vector<int> triangles(mesh_count, 0);
+    for (int k = 0; k < scene.bvh.triangles.size(); k++)
+        triangles[scene.bvh.triangles.mesh[k]]++;
+    for (const BasicBVH<double>& mesh : scene.instances.meshes)
+        for (int k = 0; k < mesh.triangles.size(); k++)
+            triangles[mesh.triangles.mesh[k]]++;
+
+    // Rows of the meshes, then of the spheres and of the background
+    vector<long long> pixel_counts(mesh_count + 2, 0);
+    vector<double> microseconds(mesh_count + 2, 0);
+    double total_microseconds = 0;
+    for (const PixelCost& pixel : pixels)
+    {
+        int row = pixel.mesh >= 0 ? pixel.mesh : pixel.mesh == sphere ? mesh_count : mesh_count + 1;
+        pixel_counts[row]++;
+        microseconds[row] += pixel.microseconds;
+        total_microseconds += pixel.microseconds;
+    }
+    long long total_tests = max(1LL, traversal.triangle_tests);
+
+    std::cout << left << setw(28) << "Primary hit" << right << setw(11) << "Triangles" << setw(11) << "Pixels" << setw(13) << "Time (ms)"
+              << setw(8) << "Time" << setw(17) << "Triangle tests" << setw(8) << "Tests" << std::endl;
+    std::cout << fixed << setprecision(1);
+    for (int row = 0; row < mesh_count + 2; row++)
+    {
+        string name = row < mesh_count ? to_string(row) + " " + scene.mesh_names[row] : row == mesh_count ? "spheres" : "background";
+        if (name.size() > 27)
+            name = "..." + name.substr(name.size() - 24);
+        double time_share = total_microseconds > 0 ? 100 * microseconds[row] / total_microseconds : 0;
+        std::cout << left << setw(28) << name << right;
+        if (row < mesh_count)
+            std::cout << setw(11) << triangles[row];
+        else
+            std::cout << setw(11) << "-";
+        std::cout << setw(11) << pixel_counts[row] << setw(13) << microseconds[row] / 1000 << setw(7) << time_share << "%";
+        if (row < mesh_count)
+        {
+            long long tests = row < traversal.mesh_triangle_tests.size() ? traversal.mesh_triangle_tests[row] : 0;
+            std::cout << setw(17) << tests << setw(7) << 100. * tests / total_tests << "%" << std::endl;
+        }
+        else
+            std::cout << setw(17) << "-" << setw(8) << "-" << std::endl;
+    }
+    std::cout << defaultfloat << setprecision(6);
+}
+
+template <typename Scalar>
+void CostProbe<Scalar>::start()
+{
+    read_counters(nodes_visited, triangle_tests, shadow_rays);
+    start_time = chrono::steady_clock::now();
+}
+
+template <typename Scalar>
+void CostProbe<Scalar>::stop(const unsigned* i, const unsigned* j, int count)
+{
+    auto stop_time = chrono::steady_clock::now();
+    long long nodes, tests, shadows;
+    read_counters(nodes, tests, shadows);
+
+    float share = 1.f / count;
+    float microseconds = chrono::duration<float, micro>(stop_time - start_time).count();
+    for (int k = 0; k < count; k++)
+    {
+        PixelCost& pixel = costs(i[k], j[k]);
+        pixel.microseconds += share * microseconds;
+        pixel.nodes_visited += share * (nodes - nodes_visited);
+        pixel.triangle_tests += share * (tests - triangle_tests);
+        pixel.shadow_rays += share * (shadows - shadow_rays);
+    }
+
+    nodes_visited = nodes;
+    triangle_tests = tests;
+    shadow_rays = shadows;
+    start_time = chrono::steady_clock::now();
+}
+
+template <typename Scalar>
+void CostProbe<Scalar>::read_counters(long long& nodes, long long& tests, long long& shadows) const
+{
+    tracer.thread_counters(thread, nodes, tests, shadows);
+    nodes += primary_stats.nodes_visited;
+    tests += primary_stats.triangle_tests;
+}
+
+template class CostProbe<double>;
+template class CostProbe<float>;
+
+#endif
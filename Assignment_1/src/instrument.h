@@ -0,0 +1,88 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+// Cost of every pixel of a render, counted only when the renderer is compiled with INSTRUMENT_RENDER
+// (cmake -DINSTRUMENT=ON). Otherwise this header declares nothing and the renderer does not measure anything.
+#ifdef INSTRUMENT_RENDER
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "bvh.h"
+#include "parallel.h"
+#include "scene.h"
+#include "tracer.h"
+
+// Work done for one pixel by its primary ray (a share of the packet for packets), its secondary rays and their shadow rays
+struct PixelCost
+{
+    float microseconds;
+    float nodes_visited;
+    float triangle_tests;
+    float shadow_rays;
+    int mesh; // Mesh hit by the primary ray, CostMap::sphere or CostMap::background
+
+    PixelCost() : microseconds(0), nodes_visited(0), triangle_tests(0), shadow_rays(0), mesh(-2) {}
+};
+
+// Costs of all the pixels of a region of an image, addressed in image coordinates
+class CostMap
+{
+public:
+    static const int sphere = -1;     // Same as Hit::mesh
+    static const int background = -2;
+
+    int x_origin;
+    int y_origin;
+    int width;
+    int height;
+    std::vector<PixelCost> pixels;
+
+    CostMap(const Tile& region)
+        : x_origin(region.x_begin), y_origin(region.y_begin), width(region.x_end - region.x_begin), height(region.y_end - region.y_begin),
+          pixels(std::size_t(width) * height) {}
+
+    PixelCost& operator()(int x, int y) { return pixels[std::size_t(y - y_origin) * width + x - x_origin]; }
+
+    // Write one false color PNG per counter next to the image output: <name>_cost_time.png, _cost_nodes.png,
+    // _cost_triangles.png and _cost_shadow.png. Black is no cost and white the 99th percentile of the pixels or more.
+    bool write_heatmaps(const std::string& output) const;
+
+    // Print for every mesh the pixels whose primary ray hit it and their time, and the tests of its triangles
+    // by all the rays, from traversal. The spheres and the background follow the meshes.
+    void print_mesh_table(const Scene& scene, const TraversalStats& traversal) const;
+};
+
+// Measures what a render thread does between start() and stop(), from the counters of its primary rays and of the Tracer
+template <typename Scalar>
+class CostProbe
+{
+public:
+    CostProbe(CostMap& costs, const BasicTracer<Scalar>& tracer, const TraversalStats& primary_stats, int thread)
+        : costs(costs), tracer(tracer), primary_stats(primary_stats), thread(thread)
+    {
+        start();
+    }
+
+    void start();
+
+    // Share the time and the counters since start() evenly between the pixels (i[k], j[k]) and start again
+    void stop(const unsigned* i, const unsigned* j, int count);
+
+private:
+    CostMap& costs;
+    const BasicTracer<Scalar>& tracer;
+    const TraversalStats& primary_stats;
+    int thread;
+
+    std::chrono::steady_clock::time_point start_time;
+    long long nodes_visited;
+    long long triangle_tests;
+    long long shadow_rays;
+
+    void read_counters(long long& nodes, long long& tests, long long& shadows) const;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+#include "light_tree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Smallest cosine bound of a node, so that no light has a probability of 0
+    const double min_cosine = 0.05;
+
+    // Closest squared distance used for the falloff, a light on the surface would take all the probability
+    const double min_squared_distance = 1e-6;
+}
+
+void LightTree::build(const vector<Vector3d>& positions, const vector<double>& powers)
+{
+    nodes.clear();
+    if (positions.empty())
+        return;
+    nodes.reserve(2 * positions.size() - 1);
+    nodes.emplace_back();
+    vector<int> lights(positions.size());
+    iota(lights.begin(), lights.end(), 0);
+    mt19937 random(1);
+    build_node(0, positions, powers, lights, 0, lights.size(), random);
+}
+
+void LightTree::build_node(int node_i, const vector<Vector3d>& positions, const vector<double>& powers, vector<int>& lights, int begin, int end, mt19937& random)
+{
+    if (end - begin == 1)
+    {
+        Node& leaf = nodes[node_i];
+        int light = lights[begin];
+        leaf.box_min = leaf.box_max = positions[light];
+        leaf.power = powers[light] > 0 ? 0 : 1;
+        leaf.falloff_power = powers[light];
+        leaf.first = light;
+        leaf.count = 1;
+        leaf.representative = light;
+        leaf.weight = 1;
+        return;
+    }
+
+    Vector3d box_min = positions[lights[begin]], box_max = box_min;
+    for (int k = begin + 1; k < end; k++)
+    {
+        box_min = box_min.cwiseMin(positions[lights[k]]);
+        box_max = box_max.cwiseMax(positions[lights[k]]);
+    }
+    int axis;
+    (box_max - box_min).maxCoeff(&axis);
+    int middle = (begin + end) / 2;
+    nth_element(lights.begin() + begin, lights.begin() + middle, lights.begin() + end,
+                [&](int a, int b) { return positions[a](axis) < positions[b](axis); });
+
+    // Both children are allocated before their subtrees, so that the right one follows the left one
+    int left = nodes.size();
+    nodes.resize(left + 2);
+    build_node(left, positions, powers, lights, begin, middle, random);
+    build_node(left + 1, positions, powers, lights, middle, end, random);
+
+    Node& node = nodes[node_i];
+    node.box_min = box_min;
+    node.box_max = box_max;
+    node.power = nodes[left].power + nodes[left + 1].power;
+    node.falloff_power = nodes[left].falloff_power + nodes[left + 1].falloff_power;
+    node.first = left;
+    node.count = 0;
+
+    // The representative of a child is kept in proportion to the power of the child
+    double left_power = nodes[left].power + nodes[left].falloff_power;
+    double right_power = nodes[left + 1].power + nodes[left + 1].falloff_power;
+    bool is_left_kept = uniform_real_distribution<double>(0, left_power + right_power)(random) < left_power;
+    const Node& kept = nodes[is_left_kept ? left : left + 1];
+    node.representative = kept.representative;
+    node.weight = kept.weight * (left_power + right_power) / (is_left_kept ? left_power : right_power);
+}
+
+double LightTree::importance(const Node& node, const Vector3d& position, const Vector3d& normal)
+{
+    Vector3d to_center = (node.box_min + node.box_max) / 2 - position;
+    double squared_radius = (node.box_max - node.box_min).squaredNorm() / 4;
+    double squared_distance = to_center.squaredNorm();
+
+    // Largest cosine between the normal and a direction to the bounding sphere of the node: the angle to its center
+    // minus the angle the sphere spans, 1 if the point is inside it
+    double cos_bound = 1;
+    if (squared_distance > squared_radius)
+    {
+        double distance = sqrt(squared_distance);
+        double sin_spread = sqrt(squared_radius) / distance;
+        double cos_spread = sqrt(1 - sin_spread * sin_spread);
+        double cos_center = normal.dot(to_center) / distance;
+        if (cos_center < cos_spread)
+            cos_bound = cos_center * cos_spread + sqrt(max(0., 1 - cos_center * cos_center)) * sin_spread;
+    }
+    cos_bound = max(cos_bound, min_cosine);
+    return cos_bound * (node.power + node.falloff_power / max({squared_distance, squared_radius, min_squared_distance}));
+}
+
+int LightTree::sample(const Vector3d& position, const Vector3d& normal, double u, double& probability) const
+{
+    probability = 1;
+    if (nodes.empty())
+        return -1;
+    int node_i = 0;
+    while (nodes[node_i].count == 0)
+    {
+        int left = nodes[node_i].first;
+        double left_importance = importance(nodes[left], position, normal);
+        double right_importance = importance(nodes[left + 1], position, normal);
+        double p_left = left_importance / (left_importance + right_importance);
+
+        // u is stretched back to [0, 1) inside the part of the child it fell in, for the next level
+        if (u < p_left)
+        {
+            u /= p_left;
+            probability *= p_left;
+            node_i = left;
+        }
+        else
+        {
+            u = min((u - p_left) / (1 - p_left), 1.);
+            probability *= 1 - p_left;
+            node_i = left + 1;
+        }
+    }
+    return nodes[node_i].first;
+}
+
+void LightTree::light_cut(const Vector3d& position, const Vector3d& normal, int k, vector<pair<double, int>>& cut) const
+{
+    // A heap by importance, where the leaves come last since they cannot be split
+    cut.clear();
+    if (nodes.empty())
+        return;
+    auto entry = [&](int node_i) { return make_pair(nodes[node_i].count > 0 ? -1. : importance(nodes[node_i], position, normal), node_i); };
+    cut.push_back(entry(0));
+    while (cut.size() < k && cut.front().first >= 0)
+    {
+        int node_i = cut.front().second;
+        pop_heap(cut.begin(), cut.end());
+        cut.back() = entry(nodes[node_i].first);
+        push_heap(cut.begin(), cut.end());
+        cut.push_back(entry(nodes[node_i].first + 1));
+        push_heap(cut.begin(), cut.end());
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <random>
+#include <utility>
+#include <vector>
+#include <Eigen/Core>
+
+// Bounding volume hierarchy over the point lights of a scene, so that a shading point can evaluate a few of thousands
+// of lights. Every node bounds its lights and sums their power. Its importance for a point is what it could bring there:
+// the power over the squared distance for the lights with a falloff, and an upper bound of the cosine between the
+// normal and the directions to the node. The lights are then chosen at random going down the tree in proportion to
+// the importance of the children, or as a cut of the k most important nodes, each shaded by a representative light.
+// A node that mixes lights with and without falloff is shaded as if they all were of the kind of its representative.
+class LightTree
+{
+public:
+    struct Node
+    {
+        Eigen::Vector3d box_min;
+        Eigen::Vector3d box_max;
+        double power;         // Lights without falloff, each counts 1
+        double falloff_power; // Power of the lights with an inverse square falloff
+        int first; // Leaf: the light, an index in the positions given to build(). Inner node: index of the left child, the right one follows it
+        int count; // 1 for a leaf, 0 for inner nodes
+        int representative; // One of the lights, chosen at random in proportion to the power when the tree is built
+        double weight;      // Power of the node over that of its representative
+    };
+
+    std::vector<Node> nodes;
+
+    // One leaf per light. powers holds the power of every light with a falloff, and 0 for the others.
+    // The lights are split at the median of the longest axis of their box.
+    void build(const std::vector<Eigen::Vector3d>& positions, const std::vector<double>& powers);
+
+    // Light chosen at random for the point from u in [0, 1), -1 if there are none. probability is the chance that it
+    // was chosen, never 0: the cosine bound has a floor, so that the lights behind the normal can still be chosen.
+    int sample(const Eigen::Vector3d& position, const Eigen::Vector3d& normal, double u, double& probability) const;
+
+    // A cut of at most k nodes through the tree, which covers every light once, made by splitting the most important
+    // node until there are k of them. cut receives the nodes, each with its importance (-1 for the leaves).
+    // The light of a node is its weight times the light of its representative, a cut of all the leaves is exact.
+    void light_cut(const Eigen::Vector3d& position, const Eigen::Vector3d& normal, int k, std::vector<std::pair<double, int>>& cut) const;
+
+    // What the lights of the node could bring to the point, up to a factor
+    static double importance(const Node& node, const Eigen::Vector3d& position, const Eigen::Vector3d& normal);
+
+private:
+    // Fill nodes[node_i] with the lights[begin, end)
+    void build_node(int node_i, const std::vector<Eigen::Vector3d>& positions, const std::vector<double>& powers, std::vector<int>& lights, int begin, int end, std::mt19937& random);
+};
+
+#endif
@@ -1,15 +1,28 @@
 // C++ include
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <cmath>
 #include <sstream>
-
-// Image writing library
-#define STB_IMAGE_WRITE_IMPLEMENTATION // Do not include this line twice in your project!
-#include "stb_image_write.h"
-#include "utils.h"
+#include <chrono>
+#include <memory>
+
+#include "image.h"
+#include "bvh.h"
+#include "parallel.h"
+#include "shading.h"
+#include "spheres.h"
+#include "tracer.h"
+#include "scene.h"
+#include "renderer.h"
+#include "pathtracer.h"
+#include "distributed.h"
+#include "denoise.h"
 #include <Eigen/LU>
 #include <Eigen/Geometry>
 
@@ -17,24 +30,41 @@
 using namespace std;
 using namespace Eigen;
 
+// Threads, tiles, packets, ray budget and image depth, set from the command line
+RenderSettings settings;
+
+// Program started as the worker processes, argv[0]
+std::string executable;
+
 void part1()
 {
     std::cout << "Part 1: Writing a grid png image" << std::endl;
 
     const std::string filename("part1.png");
-    Eigen::MatrixXd M(800,800);
+    Framebuffer image(800,800);
 
     // Draw a grid, each square has a side of e pixels
     const int e = 50;
     const double black = 0;
     const double white = 1;
 
-    for (unsigned wi = 0; wi<M.cols();++wi)
-        for (unsigned hi = 0; hi < M.rows(); ++hi)
-            M(hi,wi) = (lround(wi / e) % 2) == (lround(hi / e) % 2) ? black : white;
+    TileScheduler scheduler(settings.thread_count, settings.tile_size);
+    scheduler.render(image.width, image.height, [&](const Tile& tile)
+    {
+        for (unsigned wi = tile.x_begin; wi<tile.x_end;++wi)
+        {
+            for (unsigned hi = tile.y_begin; hi < tile.y_end; ++hi)
+            {
+                // Note that the alpha channel is reversed to make the white (color = 1) pixels transparent (alhpa = 0)
+                double color = (lround(wi / e) % 2) == (lround(hi / e) % 2) ? black : white;
+                image(wi,hi) = Pixel(color, color, color, 1.0 - color);
+            }
+        }
+    });
+    scheduler.print_timings();
 
-    // Write it in a png image. Note that the alpha channel is reversed to make the white (color = 1) pixels transparent (alhpa = 0)
-    write_matrix_to_png(M,M,M,1.0-M.array(),filename);
+    // Write it in a png image
+    image.write(filename, settings.output_bits);
 }
 
 void part2()
@@ -42,52 +72,56 @@ void part2()
     std::cout << "Part 2: Simple ray tracer, one sphere with orthographic projection" << std::endl;
 
     const std::string filename("part2.png");
-    MatrixXd C = MatrixXd::Zero(800,800); // Store the color
-    MatrixXd A = MatrixXd::Zero(800,800); // Store the alpha mask
+    Framebuffer image(800,800); // Store the color and the alpha mask
 
     // The camera is orthographic, pointing in the direction -z and covering the unit square (-1,1) in x and y
     Vector3d origin(-1,1,1);
-    Vector3d x_displacement(2.0/C.cols(),0,0);
-    Vector3d y_displacement(0,-2.0/C.rows(),0);
+    Vector3d x_displacement(2.0/image.width,0,0);
+    Vector3d y_displacement(0,-2.0/image.height,0);
 
     // Single light source
     const Vector3d light_position(-1,1,1);
 
-    for (unsigned i=0;i<C.cols();i++)
+    TileScheduler scheduler(settings.thread_count, settings.tile_size);
+    scheduler.render(image.width, image.height, [&](const Tile& tile)
     {
-        for (unsigned j=0;j<C.rows();j++)
+        for (unsigned i=tile.x_begin;i<tile.x_end;i++)
         {
-            // Prepare the ray
-            Vector3d ray_origin = origin + double(i)*x_displacement + double(j)*y_displacement;
-            Vector3d ray_direction = RowVector3d(0,0,-1);
+            for (unsigned j=tile.y_begin;j<tile.y_end;j++)
+            {
+                // Prepare the ray
+                Vector3d ray_origin = origin + double(i)*x_displacement + double(j)*y_displacement;
+                Vector3d ray_direction = RowVector3d(0,0,-1);
 
-            // Intersect with the sphere
-            // NOTE: this is a special case of a sphere centered in the origin and for orthographic rays aligned with the z axis
-            Vector2d ray_on_xy(ray_origin(0),ray_origin(1));
-            const double sphere_radius = 0.9;
+                // Intersect with the sphere
+                // NOTE: this is a special case of a sphere centered in the origin and for orthographic rays aligned with the z axis
+                Vector2d ray_on_xy(ray_origin(0),ray_origin(1));
+                const double sphere_radius = 0.9;
 
-            if (ray_on_xy.norm()<sphere_radius)
-            {
-                // The ray hit the sphere, compute the exact intersection point
-                Vector3d ray_intersection(ray_on_xy(0),ray_on_xy(1),sqrt(sphere_radius*sphere_radius - ray_on_xy.squaredNorm()));
+                if (ray_on_xy.norm()<sphere_radius)
+                {
+                    // The ray hit the sphere, compute the exact intersection point
+                    Vector3d ray_intersection(ray_on_xy(0),ray_on_xy(1),sqrt(sphere_radius*sphere_radius - ray_on_xy.squaredNorm()));
 
-                // Compute normal at the intersection point
-                Vector3d ray_normal = ray_intersection.normalized();
+                    // Compute normal at the intersection point
+                    Vector3d ray_normal = ray_intersection.normalized();
 
-                // Simple diffuse model
-                C(i,j) = (light_position-ray_intersection).normalized().transpose() * ray_normal;
+                    // Simple diffuse model
+                    double lightness = (light_position-ray_intersection).normalized().transpose() * ray_normal;
 
-                // Clamp to zero
-                C(i,j) = max(C(i,j),0.);
+                    // Clamp to zero
+                    lightness = max(lightness,0.);
 
-                // Disable the alpha mask for this pixel
-                A(i,j) = 1;
+                    // Disable the alpha mask for this pixel
+                    image(i,j) = Pixel(lightness, lightness, lightness, 1);
+                }
             }
         }
-    }
+    });
+    scheduler.print_timings();
 
     // Save to png
-    write_matrix_to_png(C,C,C,A,filename);
+    image.write(filename, settings.output_bits);
 
 }
 
@@ -96,13 +130,12 @@ void part1_1()
     std::cout << "Part 1_1: Rendering multiple spheres in general positions with orthographic projection" << std::endl;
 
     const std::string filename("part1_1.png");
-    MatrixXd C = MatrixXd::Zero(800,800); // Store the color
-    MatrixXd A = MatrixXd::Zero(800,800); // Store the alpha mask
+    Framebuffer image(800,800); // Store the color and the alpha mask
 
     // The camera is orthographic, pointing in the direction -z and covering the unit square (-1,1) in x and y
     Vector3d origin(-1,1,1);
-    Vector3d x_displacement(2.0/C.cols(),0,0);
-    Vector3d y_displacement(0,-2.0/C.rows(),0);
+    Vector3d x_displacement(2.0/image.width,0,0);
+    Vector3d y_displacement(0,-2.0/image.height,0);
 
     // Single light source
     const Vector3d light_position(-1,1,1);
@@ -110,64 +143,69 @@ void part1_1()
     // Multiple Spheres (x,y,z,r)
     vector<Vector4d> spheres = {Vector4d(0.1,0.1,0.1,0.5), Vector4d(-0.2,0.1,0.2,0.3), Vector4d(0.3,-0.4,0.1,0.3)};
 
-    for (unsigned i=0;i<C.cols();i++)
+    TileScheduler scheduler(settings.thread_count, settings.tile_size);
+    scheduler.render(image.width, image.height, [&](const Tile& tile)
     {
-        for (unsigned j=0;j<C.rows();j++)
+        for (unsigned i=tile.x_begin;i<tile.x_end;i++)
         {
-            // Prepare the ray
-            Vector3d ray_origin = origin + double(i)*x_displacement + double(j)*y_displacement;
-            Vector3d ray_direction = RowVector3d(0,0,-1);
-
-            // Intersect with the sphere
-            Vector2d ray_on_xy(ray_origin(0),ray_origin(1));
-
-            double hit_sum = 0;
-            for (int i = 0; i < spheres.size(); i++)
+            for (unsigned j=tile.y_begin;j<tile.y_end;j++)
             {
-                Vector2d sphere_origin_to_ray_xy = ray_on_xy - spheres[i].head<2>();
-                double ray_to_sphere_xy = spheres[i](3) - sphere_origin_to_ray_xy.norm();
-                hit_sum += max(ray_to_sphere_xy, 0.);
-            }
+                // Prepare the ray
+                Vector3d ray_origin = origin + double(i)*x_displacement + double(j)*y_displacement;
+                Vector3d ray_direction = RowVector3d(0,0,-1);
 
-            if (hit_sum > 0)
-            {
-                // The ray hit the sphere, compute the exact intersection point
-                double ray_intersection_z = -1;
-                int intersection_sphere_number = 0;
+                // Intersect with the sphere
+                Vector2d ray_on_xy(ray_origin(0),ray_origin(1));
 
+                double hit_sum = 0;
                 for (int i = 0; i < spheres.size(); i++)
                 {
                     Vector2d sphere_origin_to_ray_xy = ray_on_xy - spheres[i].head<2>();
-                    double h_square = spheres[i](3)*spheres[i](3) - sphere_origin_to_ray_xy.squaredNorm();
-                    if(h_square > 0)
+                    double ray_to_sphere_xy = spheres[i](3) - sphere_origin_to_ray_xy.norm();
+                    hit_sum += max(ray_to_sphere_xy, 0.);
+                }
+
+                if (hit_sum > 0)
+                {
+                    // The ray hit the sphere, compute the exact intersection point
+                    double ray_intersection_z = -1;
+                    int intersection_sphere_number = 0;
+
+                    for (int i = 0; i < spheres.size(); i++)
                     {
-                        if (ray_intersection_z < spheres[i](2) + sqrt(h_square))
+                        Vector2d sphere_origin_to_ray_xy = ray_on_xy - spheres[i].head<2>();
+                        double h_square = spheres[i](3)*spheres[i](3) - sphere_origin_to_ray_xy.squaredNorm();
+                        if(h_square > 0)
                         {
-                            ray_intersection_z = spheres[i](2) + sqrt(h_square);
-                            intersection_sphere_number = i;
+                            if (ray_intersection_z < spheres[i](2) + sqrt(h_square))
+                            {
+                                ray_intersection_z = spheres[i](2) + sqrt(h_square);
+                                intersection_sphere_number = i;
+                            }
                         }
                     }
-                }
                 
-                Vector3d ray_intersection(ray_on_xy(0),ray_on_xy(1), ray_intersection_z);
+                    Vector3d ray_intersection(ray_on_xy(0),ray_on_xy(1), ray_intersection_z);
 
-                // Compute normal at the intersection point
-                Vector3d ray_normal = (ray_intersection - spheres[intersection_sphere_number].head<3>()).normalized();
+                    // Compute normal at the intersection point
+                    Vector3d ray_normal = (ray_intersection - spheres[intersection_sphere_number].head<3>()).normalized();
 
-                // Simple diffuse model
-                C(i,j) = (light_position - ray_intersection).normalized().transpose() * ray_normal;
+                    // Simple diffuse model
+                    double lightness = (light_position - ray_intersection).normalized().transpose() * ray_normal;
 
-                // Clamp to zero
-                C(i,j) = max(C(i,j),0.);
+                    // Clamp to zero
+                    lightness = max(lightness,0.);
 
-                // Disable the alpha mask for this pixel
-                A(i,j) = 1;
+                    // Disable the alpha mask for this pixel
+                    image(i,j) = Pixel(lightness, lightness, lightness, 1);
+                }
             }
         }
-    }
+    });
+    scheduler.print_timings();
 
     // Save to png
-    write_matrix_to_png(C,C,C,A,filename);
+    image.write(filename, settings.output_bits);
 
 }
 
@@ -176,107 +214,98 @@ void part1_2()
     std::cout << "Part 1_2: Support ambient and specular lighting" << std::endl;
 
     const std::string filename("part1_2.png");
-    MatrixXd R = MatrixXd::Zero(800,800); // Store the red color
-    MatrixXd G = MatrixXd::Zero(800,800); // Store the green color
-    MatrixXd B = MatrixXd::Zero(800,800); // Store the blue color
-    MatrixXd A = MatrixXd::Zero(800,800); // Store the alpha mask
+    Framebuffer image(800,800); // Store the color and the alpha mask
 
     // The camera is orthographic, pointing in the direction -z and covering the unit square (-1,1) in x and y
     Vector3d origin(-1,1,1);
-    Vector3d x_displacement(2.0/R.cols(),0,0);
-    Vector3d y_displacement(0,-2.0/R.rows(),0);
+    Vector3d x_displacement(2.0/image.width,0,0);
+    Vector3d y_displacement(0,-2.0/image.height,0);
 
     // Two light sources
-    const Vector3d light_position_1(-1,1,1);
-    const Vector3d light_position_2(1,1,1);
+    const array<Vector3d, 2> light_positions = {Vector3d(-1,1,1), Vector3d(1,1,1)};
 
-    // Multiple Spheres (x,y,z,r), (R,G,B,M) (M=0 diffuse model, M=1 specular model)
+    // Multiple Spheres (x,y,z,r), their colors (R,G,B) and shading models, the specular one with ambient light
     vector<Vector4d> spheres = {Vector4d(0.3,0.3,0.3,0.3), Vector4d(-0.5,-0.4,-0.7,0.4)};
-    vector<Vector4d> spheres_color = {Vector4d(0.3,1.0,0.6,0.), Vector4d(0.3,0.1,0.9,1.)};
+    vector<Vector3d> spheres_color = {Vector3d(0.3,1.0,0.6), Vector3d(0.3,0.1,0.9)};
+    vector<ShadingModel> spheres_model = {diffuse_model, blinn_phong_model};
 
-    for (unsigned i=0;i<R.cols();i++)
+    // Disable the alpha mask for the pixel of a shaded hit
+    auto write = [&](const SurfaceHit& hit, double lightness)
     {
-        for (unsigned j=0;j<R.rows();j++)
-        {
-            // Prepare the ray
-            Vector3d ray_origin = origin + double(i)*x_displacement + double(j)*y_displacement;
-            Vector3d ray_direction = RowVector3d(0,0,-1);
+        image(hit.i,hit.j) = Pixel(lightness * spheres_color[hit.material](0),
+                                   lightness * spheres_color[hit.material](1),
+                                   lightness * spheres_color[hit.material](2), 1);
+    };
 
-            // Intersect with the sphere
-            Vector2d ray_on_xy(ray_origin(0),ray_origin(1));
+    TileScheduler scheduler(settings.thread_count, settings.tile_size);
+    scheduler.render(image.width, image.height, [&](const Tile& tile)
+    {
+        // Hits of the tile by shading model, shaded once all its rays are traced
+        vector<SurfaceHit> batches[shading_model_count];
 
-            double hit_sum = 0;
-            for (int i = 0; i < spheres.size(); i++)
+        for (unsigned i=tile.x_begin;i<tile.x_end;i++)
+        {
+            for (unsigned j=tile.y_begin;j<tile.y_end;j++)
             {
-                Vector2d sphere_origin_to_ray_xy = ray_on_xy - spheres[i].head<2>();
-                double ray_to_sphere_xy = spheres[i](3) - sphere_origin_to_ray_xy.norm();
-                hit_sum += max(ray_to_sphere_xy, 0.);
-            }
+                // Prepare the ray
+                Vector3d ray_origin = origin + double(i)*x_displacement + double(j)*y_displacement;
+                Vector3d ray_direction = RowVector3d(0,0,-1);
 
-            if (hit_sum > 0)
-            {
-                // The ray hit the sphere, compute the exact intersection point
-                double ray_intersection_z = -1;
-                int intersection_sphere_number = 0;
+                // Intersect with the sphere
+                Vector2d ray_on_xy(ray_origin(0),ray_origin(1));
 
+                double hit_sum = 0;
                 for (int i = 0; i < spheres.size(); i++)
                 {
                     Vector2d sphere_origin_to_ray_xy = ray_on_xy - spheres[i].head<2>();
-                    double h_square = spheres[i](3)*spheres[i](3) - sphere_origin_to_ray_xy.squaredNorm();
-                    if(h_square > 0)
+                    double ray_to_sphere_xy = spheres[i](3) - sphere_origin_to_ray_xy.norm();
+                    hit_sum += max(ray_to_sphere_xy, 0.);
+                }
+
+                if (hit_sum > 0)
+                {
+                    // The ray hit the sphere, compute the exact intersection point
+                    double ray_intersection_z = -1;
+                    int intersection_sphere_number = 0;
+
+                    for (int i = 0; i < spheres.size(); i++)
                     {
-                        if (ray_intersection_z < spheres[i](2) + sqrt(h_square))
+                        Vector2d sphere_origin_to_ray_xy = ray_on_xy - spheres[i].head<2>();
+                        double h_square = spheres[i](3)*spheres[i](3) - sphere_origin_to_ray_xy.squaredNorm();
+                        if(h_square > 0)
                         {
-                            ray_intersection_z = spheres[i](2) + sqrt(h_square);
-                            intersection_sphere_number = i;
+                            if (ray_intersection_z < spheres[i](2) + sqrt(h_square))
+                            {
+                                ray_intersection_z = spheres[i](2) + sqrt(h_square);
+                                intersection_sphere_number = i;
+                            }
                         }
                     }
-                }
                 
-                Vector3d ray_intersection(ray_on_xy(0),ray_on_xy(1), ray_intersection_z);
-
-                // Compute normal at the intersection point
-                Vector3d ray_normal = (ray_intersection - spheres[intersection_sphere_number].head<3>()).normalized();
-
-                // Normalized view vector
-                Vector3d view(0,0,1);
-
-                // Compute normalized light vector
-                Vector3d light_1 = (light_position_1 - ray_intersection).normalized();
-                Vector3d light_2 = (light_position_2 - ray_intersection).normalized();
-
-                // Compute normalized half angle vector
-                Vector3d half_angle_1 = (view + light_1).normalized();
-                Vector3d half_angle_2 = (view + light_2).normalized();
-
-                double lightness = 0;               
-
-                if (spheres_color[intersection_sphere_number](3) == 0) {
-                    // Pure diffuse model
-                    double lightness_1 = max(0.,double(light_1.transpose() * ray_normal));
-                    double lightness_2 = max(0.,double(light_2.transpose() * ray_normal));
-                    lightness = lightness_1 + lightness_2;
-                } else if (spheres_color[intersection_sphere_number](3) == 1)
-                {
-                    // Specular shading
-                    double lightness_1 = max(0.,double(light_1.transpose() * ray_normal)) + max(0.,pow(ray_normal.transpose() * half_angle_1, 100));
-                    double lightness_2 = max(0.,double(light_2.transpose() * ray_normal)) + max(0.,pow(ray_normal.transpose() * half_angle_2, 100));
-                    // Plus ambient light
-                    lightness = lightness_1 + lightness_2 + 0.1;
+                    SurfaceHit hit;
+                    hit.i = i;
+                    hit.j = j;
+                    hit.material = intersection_sphere_number;
+                    hit.position = Vector3d(ray_on_xy(0),ray_on_xy(1), ray_intersection_z);
+
+                    // The normal at the intersection point, which is at one radius from the center
+                    hit.normal = (hit.position - spheres[intersection_sphere_number].head<3>()) / spheres[intersection_sphere_number](3);
+
+                    // Normalized view vector
+                    hit.view = Vector3d(0,0,1);
+                    batches[spheres_model[intersection_sphere_number]].push_back(hit);
                 }
-
-                R(i,j) = lightness * spheres_color[intersection_sphere_number](0);
-                G(i,j) = lightness * spheres_color[intersection_sphere_number](1);
-                B(i,j) = lightness * spheres_color[intersection_sphere_number](2);
-
-                // Disable the alpha mask for this pixel
-                A(i,j) = 1;
             }
         }
-    }
+
+        // Pure diffuse model, and specular shading plus ambient light
+        shade_batch<Diffuse>(batches[diffuse_model], light_positions, 0, write);
+        shade_batch<BlinnPhong<100>>(batches[blinn_phong_model], light_positions, 0.1, write);
+    });
+    scheduler.print_timings();
 
     // Save to png
-    write_matrix_to_png(R,G,B,A,filename);
+    image.write(filename, settings.output_bits);
 
 }
 
@@ -285,15 +314,14 @@ void part1_3_single()
         std::cout << "Part 1_3_single: render 1.1 with perspective projection" << std::endl;
 
     const std::string filename("part1_3_single.png");
-    MatrixXd C = MatrixXd::Zero(800,800); // Store the color
-    MatrixXd A = MatrixXd::Zero(800,800); // Store the alpha mask
+    Framebuffer image(800,800); // Store the color and the alpha mask
 
     // The camera is perspective at (0,0,2), pointing in the direction -z 
     // and covering the unit square (-1,1) in x and y at z = 1
     Vector3d origin(0,0,2);
     Vector3d direction = Vector3d(-1,1,1) - origin;
-    Vector3d x_displacement(2.0/C.cols(),0,0);
-    Vector3d y_displacement(0,-2.0/C.rows(),0);
+    Vector3d x_displacement(2.0/image.width,0,0);
+    Vector3d y_displacement(0,-2.0/image.height,0);
 
     // Single light source
     const Vector3d light_position(-1,1,1);
@@ -301,61 +329,68 @@ void part1_3_single()
     // Multiple Spheres (x,y,z,r)
     vector<Vector4d> spheres = {Vector4d(0.1,0.1,0.1,0.5), Vector4d(-0.2,0.1,0.2,0.3), Vector4d(0.3,-0.4,0.1,0.3)};
 
-    for (unsigned i=0;i<C.cols();i++)
+    TileScheduler scheduler(settings.thread_count, settings.tile_size);
+
+    // Shade the pixel (i,j) from the nearest sphere hit by its ray
+    auto shade = [&](unsigned i, unsigned j, const Vector3d& ray_origin, const Vector3d& ray_direction, bool is_intersected, double nearest_intersection, int intersection_sphere_number)
     {
-        for (unsigned j=0;j<C.rows();j++)
+        if (is_intersected)
         {
-            // Prepare the ray
-            Vector3d ray_origin = origin;
-            Vector3d ray_direction = (direction + double(i)*x_displacement + double(j)*y_displacement).normalized();
-
-            // Intersect with the sphere
-            bool is_intersected = false;
-            int intersection_sphere_number = 0;
-            double nearest_intersection = 10;
-            for (int index = 0; index < spheres.size(); index++)
-            {
-                Vector3d origin_to_sphere_center = spheres[index].head<3>() - ray_origin;
-                double origin_to_perpendicular = ray_direction.dot(origin_to_sphere_center);
-                double perpendicular_height = sqrt(origin_to_sphere_center.dot(origin_to_sphere_center) - origin_to_perpendicular * origin_to_perpendicular);
-                if (perpendicular_height <= spheres[index](3))
-                {
-                    is_intersected = true;
-                    double intersection_to_perpendicular = sqrt(spheres[index](3) * spheres[index](3) - perpendicular_height * perpendicular_height);
-                    double origin_to_intersection_length = origin_to_perpendicular - intersection_to_perpendicular;
-                    if (origin_to_intersection_length < nearest_intersection)
-                    {
-                        nearest_intersection = origin_to_intersection_length;
-                        intersection_sphere_number = index;
-                    }
-                }
-            }
+            // The ray hit the sphere
+            Vector3d intersection_position = ray_origin + nearest_intersection * ray_direction;
 
-            if (is_intersected)
-            {
-                // The ray hit the sphere
-                Vector3d intersection_position = ray_origin + nearest_intersection * ray_direction;
+            // Compute normal at the intersection point
+            Vector3d ray_normal = (intersection_position - spheres[intersection_sphere_number].head<3>()).normalized();
 
-                // Compute normal at the intersection point
-                Vector3d ray_normal = (intersection_position - spheres[intersection_sphere_number].head<3>()).normalized();
+            // Compute the light vector
+            Vector3d ray_light = (light_position - intersection_position).normalized();
+        
+            // Simple diffuse model
+            double lightness = ray_light.dot(ray_normal);
 
-                // Compute the light vector
-                Vector3d ray_light = (light_position - intersection_position).normalized();
-                
-                // Simple diffuse model
-                C(i,j) = ray_light.dot(ray_normal);
+            // Clamp to zero
+            lightness = max(lightness,0.);
 
-                // Clamp to zero
-                C(i,j) = max(C(i,j),0.);
-
-                // Disable the alpha mask for this pixel
-                A(i,j) = 1;
-            }
+            // Disable the alpha mask for this pixel
+            image(i,j) = Pixel(lightness, lightness, lightness, 1);
         }
-    }
+    };
+
+    auto start = chrono::steady_clock::now();
+    scheduler.render(image.width, image.height, [&](const Tile& tile)
+    {
+        trace_primary_rays(tile, settings.packet_size, origin, direction, x_displacement, y_displacement,
+            [&](unsigned i, unsigned j, const Vector3d& ray_direction)
+            {
+                // Intersect with the spheres
+                int intersection_sphere_number = 0;
+                double nearest_intersection = 10;
+                bool is_intersected = intersect_spheres(spheres, origin, ray_direction, nearest_intersection, intersection_sphere_number);
+                shade(i, j, origin, ray_direction, is_intersected, nearest_intersection, intersection_sphere_number);
+            },
+            [&](const auto& packet, const unsigned* i, const unsigned* j)
+            {
+                bool is_intersected[max_packet_size];
+                int intersection_sphere_number[max_packet_size];
+                double nearest_intersection[max_packet_size];
+                for (int lane = 0; lane < packet.size; lane++)
+                {
+                    intersection_sphere_number[lane] = 0;
+                    nearest_intersection[lane] = 10;
+                }
+                intersect_spheres_packet(spheres, packet, is_intersected, nearest_intersection, intersection_sphere_number);
+                for (int lane = 0; lane < packet.size; lane++)
+                {
+                    Vector3d ray_direction(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+                    shade(i[lane], j[lane], origin, ray_direction, is_intersected[lane], nearest_intersection[lane], intersection_sphere_number[lane]);
+                }
+            });
+    });
+    print_ray_throughput(image.pixels.size(), start, settings.packet_size);
+    scheduler.print_timings();
 
     // Save to png
-    write_matrix_to_png(C,C,C,A,filename);
+    image.write(filename, settings.output_bits);
 
 }
 
@@ -364,312 +399,318 @@ void part1_3_multiple()
     std::cout << "Part 1_3_multiple: render part1.2 with perspective projection" << std::endl;
 
     const std::string filename("part1_3_multiple.png");
-    MatrixXd R = MatrixXd::Zero(800,800); // Store the red color
-    MatrixXd G = MatrixXd::Zero(800,800); // Store the green color
-    MatrixXd B = MatrixXd::Zero(800,800); // Store the blue color
-    MatrixXd A = MatrixXd::Zero(800,800); // Store the alpha mask
+    Framebuffer image(800,800); // Store the color and the alpha mask
 
     // The camera is perspective at (0,0,2), pointing in the direction -z 
     // and covering the unit square (-1,1) in x and y at z = 1
     Vector3d origin(0,0,2);
     Vector3d direction = Vector3d(-1,1,1) - origin;
-    Vector3d x_displacement(2.0/R.cols(),0,0);
-    Vector3d y_displacement(0,-2.0/R.rows(),0);
+    Vector3d x_displacement(2.0/image.width,0,0);
+    Vector3d y_displacement(0,-2.0/image.height,0);
 
     // Two light sources
-    const Vector3d light_position_1(-1,1,1);
-    const Vector3d light_position_2(1,1,1);
+    const array<Vector3d, 2> light_positions = {Vector3d(-1,1,1), Vector3d(1,1,1)};
 
-    // Multiple Spheres (x,y,z,r), (R,G,B,M) (M=0 diffuse model, M=1 specular model)
+    // Multiple Spheres (x,y,z,r), their colors (R,G,B) and shading models, the specular one with ambient light
     vector<Vector4d> spheres = {Vector4d(0.3,0.3,0.3,0.3), Vector4d(-0.5,-0.4,-0.7,0.4)};
-    vector<Vector4d> spheres_color = {Vector4d(0.3,1.0,0.6,0.), Vector4d(0.3,0.1,0.9,1.)};
+    vector<Vector3d> spheres_color = {Vector3d(0.3,1.0,0.6), Vector3d(0.3,0.1,0.9)};
+    vector<ShadingModel> spheres_model = {diffuse_model, blinn_phong_model};
+
+    TileScheduler scheduler(settings.thread_count, settings.tile_size);
 
-    for (unsigned i=0;i<R.cols();i++)
+    // Disable the alpha mask for the pixel of a shaded hit
+    auto write = [&](const SurfaceHit& hit, double lightness)
     {
-        for (unsigned j=0;j<R.rows();j++)
-        {
-            // Prepare the ray
-            Vector3d ray_origin = origin;
-            Vector3d ray_direction = (direction + double(i)*x_displacement + double(j)*y_displacement).normalized();
-
-            // Intersect with the sphere
-            bool is_intersected = false;
-            int intersection_sphere_number = 0;
-            double nearest_intersection = 10;
-            for (int index = 0; index < spheres.size(); index++)
-            {
-                Vector3d origin_to_sphere_center = spheres[index].head<3>() - ray_origin;
-                double origin_to_perpendicular = ray_direction.dot(origin_to_sphere_center);
-                double perpendicular_height = sqrt(origin_to_sphere_center.dot(origin_to_sphere_center) - origin_to_perpendicular * origin_to_perpendicular);
-                if (perpendicular_height <= spheres[index](3))
-                {
-                    is_intersected = true;
-                    double intersection_to_perpendicular = sqrt(spheres[index](3) * spheres[index](3) - perpendicular_height * perpendicular_height);
-                    double origin_to_intersection_length = origin_to_perpendicular - intersection_to_perpendicular;
-                    if (origin_to_intersection_length < nearest_intersection)
-                    {
-                        nearest_intersection = origin_to_intersection_length;
-                        intersection_sphere_number = index;
-                    }
-                }
-            }
+        image(hit.i,hit.j) = Pixel(lightness * spheres_color[hit.material](0),
+                                   lightness * spheres_color[hit.material](1),
+                                   lightness * spheres_color[hit.material](2), 1);
+    };
+
+    auto start = chrono::steady_clock::now();
+    scheduler.render(image.width, image.height, [&](const Tile& tile)
+    {
+        // Hits of the tile by shading model, shaded once all its rays are traced
+        vector<SurfaceHit> batches[shading_model_count];
 
+        // Add the pixel (i,j) to the batch of the nearest sphere hit by its ray
+        auto add_hit = [&](unsigned i, unsigned j, const Vector3d& ray_origin, const Vector3d& ray_direction, bool is_intersected, double nearest_intersection, int intersection_sphere_number)
+        {
             if (is_intersected)
             {
                 // The ray hit the sphere
-                Vector3d intersection_position = ray_origin + nearest_intersection * ray_direction;
-
-                // Compute normal at the intersection point
-                Vector3d ray_normal = (intersection_position - spheres[intersection_sphere_number].head<3>()).normalized();
+                SurfaceHit hit;
+                hit.i = i;
+                hit.j = j;
+                hit.material = intersection_sphere_number;
+                hit.position = ray_origin + nearest_intersection * ray_direction;
 
-                // Compute the light vectors
-                Vector3d ray_light_1 = (light_position_1 - intersection_position).normalized();
-                Vector3d ray_light_2 = (light_position_2 - intersection_position).normalized();
+                // The normal at the intersection point, which is at one radius from the center
+                hit.normal = (hit.position - spheres[intersection_sphere_number].head<3>()) / spheres[intersection_sphere_number](3);
 
                 // Normalized view vector
-                Vector3d view = -ray_direction;
-
-                // Compute normalized half angle vector
-                Vector3d half_angle_1 = (view + ray_light_1).normalized();
-                Vector3d half_angle_2 = (view + ray_light_2).normalized();
-
-                double lightness = 0;
+                hit.view = -ray_direction;
+                batches[spheres_model[intersection_sphere_number]].push_back(hit);
+            }
+        };
 
-                if (spheres_color[intersection_sphere_number](3) == 0)
+        trace_primary_rays(tile, settings.packet_size, origin, direction, x_displacement, y_displacement,
+            [&](unsigned i, unsigned j, const Vector3d& ray_direction)
+            {
+                // Intersect with the spheres
+                int intersection_sphere_number = 0;
+                double nearest_intersection = 10;
+                bool is_intersected = intersect_spheres(spheres, origin, ray_direction, nearest_intersection, intersection_sphere_number);
+                add_hit(i, j, origin, ray_direction, is_intersected, nearest_intersection, intersection_sphere_number);
+            },
+            [&](const auto& packet, const unsigned* i, const unsigned* j)
+            {
+                bool is_intersected[max_packet_size];
+                int intersection_sphere_number[max_packet_size];
+                double nearest_intersection[max_packet_size];
+                for (int lane = 0; lane < packet.size; lane++)
                 {
-                    // Pure diffuse model
-                    double lightness_1 = max(0.,ray_light_1.dot(ray_normal));
-                    double lightness_2 = max(0.,ray_light_2.dot(ray_normal));
-                    lightness = lightness_1 + lightness_2;
-                } else if (spheres_color[intersection_sphere_number](3) == 1)
+                    intersection_sphere_number[lane] = 0;
+                    nearest_intersection[lane] = 10;
+                }
+                intersect_spheres_packet(spheres, packet, is_intersected, nearest_intersection, intersection_sphere_number);
+                for (int lane = 0; lane < packet.size; lane++)
                 {
-                    // Specular shading
-                    double lightness_1 = max(0.,ray_normal.dot(ray_light_1)) + max(0.,pow(ray_normal.dot(half_angle_1), 100));
-                    double lightness_2 = max(0.,ray_normal.dot(ray_light_2)) + max(0.,pow(ray_normal.dot(half_angle_2), 100));
-                    // Plus ambient light
-                    lightness = lightness_1 + lightness_2 + 0.1;
+                    Vector3d ray_direction(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+                    add_hit(i[lane], j[lane], origin, ray_direction, is_intersected[lane], nearest_intersection[lane], intersection_sphere_number[lane]);
                 }
+            });
 
-                R(i,j) = lightness * spheres_color[intersection_sphere_number](0);
-                G(i,j) = lightness * spheres_color[intersection_sphere_number](1);
-                B(i,j) = lightness * spheres_color[intersection_sphere_number](2);
-
-                // Disable the alpha mask for this pixel
-                A(i,j) = 1;
-            }
-        }
-    }
+        // Pure diffuse model, and specular shading plus ambient light
+        shade_batch<Diffuse>(batches[diffuse_model], light_positions, 0, write);
+        shade_batch<BlinnPhong<100>>(batches[blinn_phong_model], light_positions, 0.1, write);
+    });
+    print_ray_throughput(image.pixels.size(), start, settings.packet_size);
+    scheduler.print_timings();
 
     // Save to png
-    write_matrix_to_png(R,G,B,A,filename);
+    image.write(filename, settings.output_bits);
 
 }
 
-void part1_4()
+// Render the scene files one after the other. The meshes are loaded once and reused by the following scenes,
+// a scene that cannot be loaded is skipped. With workers, the Whitted renders go to the same workers one after the
+// other. Returns the number of scenes that failed.
+int render_scenes(const vector<string>& scene_files)
 {
-    vector<string> off_files_string{"../data/cube.off", "../data/bunny.off", "../data/bumpy_cube.off"};
-    vector<MatrixXd> vertices;
-    vector<MatrixXi> faces;
-    vector<Vector3d> colors{Vector3d(0.3,1.0,0.6), Vector3d(0.3,0.1,0.9)};
+    MeshLibrary library;
+    int failures = 0;
 
-    // Read file to Matrix vector
-    for (int file_i = 0; file_i < off_files_string.size(); file_i++)
+    unique_ptr<Coordinator> coordinator;
+    if (settings.workers > 0 || !settings.listen_address.empty())
     {
-        ifstream off_file(off_files_string[file_i]);
-        string line;
-        int number_of_vertices = 0;
-        int number_of_faces = 0;
-
-        // Ignore the first line
-        getline(off_file, line);
-
-        // Read the numbers from the second line
-        if (getline(off_file, line))
+        string error;
+        coordinator.reset(new Coordinator(settings));
+        if (!coordinator->start(executable, error))
         {
-            istringstream line_stream(line);
-            string element;
-            int element_index = 0;
-
-            // Handle each element
-            while (getline(line_stream, element, ' '))
-            {
-                if (element_index == 0)
-                {
-                    number_of_vertices = stoi(element);
-                } else if (element_index == 1)
-                {
-                    number_of_faces = stoi(element);
-                }
-                element_index++;
-            }
+            std::cerr << error << std::endl;
+            return scene_files.size();
         }
+    }
 
-        // Declare the vertices and faces Matrices
-        MatrixXd vertex = MatrixXd::Zero(number_of_vertices, 3);
-        vertices.push_back(vertex);
-        MatrixXi face = MatrixXi::Zero(number_of_faces, 3);
-        faces.push_back(face);
+    for (const string& scene_file : scene_files)
+    {
+        auto load_start = chrono::steady_clock::now();
+        int files_loaded = library.files_loaded;
+        int files_reused = library.files_reused;
 
-        // Read the vertices data
-        for (int row = 0; row < number_of_vertices; row++)
+        Scene scene;
+        string error;
+        if (!load_scene(scene_file, library, scene, error))
         {
-            if(getline(off_file, line))
-            {
-                istringstream line_stream(line);
-                string element;
-                int element_index = 0;
-                
-                // Handle each element
-                while (getline(line_stream, element, ' '))
-                {
-                    vertices[file_i](row,element_index) = stod(element);
-                    element_index++;
-                }
-            }
+            std::cerr << error << std::endl;
+            failures++;
+            continue;
         }
-
-        // Read the faces data
-        for (int row = 0; row < number_of_faces; row++)
+        std::cout << "Scene loaded in " << chrono::duration<double, milli>(chrono::steady_clock::now() - load_start).count() << " ms ("
+                  << library.files_loaded - files_loaded << " meshes loaded, " << library.files_reused - files_reused << " reused)" << std::endl;
+        if (settings.width > 0)
         {
-            if(getline(off_file, line))
-            {
-                istringstream line_stream(line);
-                string element;
-                int element_index = 0;
-
-                while (getline(line_stream, element, ' '))
-                {
-                    if (element_index == 0)
-                    {
-                        element_index++;
-                        continue;
-                    }
-                    faces[file_i](row,element_index - 1) = stoi(element);
-                    element_index++;
-                }
-            }
+            scene.camera.width = settings.width;
+            scene.camera.height = settings.height;
         }
-    }
 
-    // Rescale Picture
-    vertices[0] = vertices[0] * 5;
-    vertices[1] = vertices[1] / 10;
+        bool is_rendered;
+        if (scene.frames > 1)
+            is_rendered = render_animation(scene, settings);
+        else if (settings.path_tracing)
+            is_rendered = render_path_traced(scene, settings);
+        else if (coordinator)
+            is_rendered = coordinator->render(scene);
+        else
+            is_rendered = render_scene(scene, settings);
+        if (!is_rendered)
+            failures++;
+    }
+    return failures;
+}
 
-    // Shading
-    const std::string filename("part1_4.png");
-    MatrixXd R = MatrixXd::Zero(800,800); // Store the red color
-    MatrixXd G = MatrixXd::Zero(800,800); // Store the green color
-    MatrixXd B = MatrixXd::Zero(800,800); // Store the blue color
-    MatrixXd A = MatrixXd::Zero(800,800); // Store the alpha mask
+// The bunny and the glass bumpy cube on a mirror floor, described in scenes/part1_4.scene
+void part1_4()
+{
+    render_scenes({"../scenes/part1_4.scene"});
+}
 
-    // The camera is perspective at (0,0,2), pointing in the direction -z 
-    // and covering the unit square (-1,1) in x and y at z = 1
-    Vector3d origin(0,0,2);
-    Vector3d direction = Vector3d(-1,1,1) - origin;
-    Vector3d x_displacement(2.0/R.cols(),0,0);
-    Vector3d y_displacement(0,-2.0/R.rows(),0);
+// Read the whole of text as a number, false if it is empty, has other characters or is out of range
+bool parse_number(const char* text, int& value)
+{
+    char* end;
+    errno = 0;
+    long number = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || number < numeric_limits<int>::min() || number > numeric_limits<int>::max())
+        return false;
+    value = int(number);
+    return true;
+}
 
-    // Two light sources
-    const vector<Vector3d> light_positions = {Vector3d(-1,1,1), Vector3d(1,1,1)};
+bool parse_number(const char* text, double& value)
+{
+    char* end;
+    errno = 0;
+    value = strtod(text, &end);
+    return end != text && *end == '\0' && errno != ERANGE;
+}
 
-    for (unsigned i=0;i<R.cols();i++)
+int main(int argc, char* argv[])
+{
+    vector<string> scene_files;
+    string worker_address;
+    executable = argv[0];
+    for (int arg_i = 1; arg_i < argc; arg_i++)
     {
-        for (unsigned j=0;j<R.rows();j++)
-        {
-            // Prepare the ray
-            Vector3d ray_origin = origin;
-            Vector3d ray_direction = (direction + double(i)*x_displacement + double(j)*y_displacement).normalized();
-            double smallest_t = 100;
-
-            int nearest_file_i = 0;
-            int nearest_face_i = 0;
-            bool is_intersected = false;
-
-            // Use Cramer’s rule to solve t and get the nearest triangle
-            for (int file_i = 0; file_i < off_files_string.size(); file_i++)
-            {
-                for (int face_i = 0; face_i < faces[file_i].rows(); face_i++)
-                {
-                    int a_i = faces[file_i](face_i,0);
-                    int b_i = faces[file_i](face_i,1);
-                    int c_i = faces[file_i](face_i,2);
-
-                    Vector3d a(vertices[file_i](a_i,0), vertices[file_i](a_i,1), vertices[file_i](a_i,2));
-                    Vector3d b(vertices[file_i](b_i,0), vertices[file_i](b_i,1), vertices[file_i](b_i,2));
-                    Vector3d c(vertices[file_i](c_i,0), vertices[file_i](c_i,1), vertices[file_i](c_i,2));
-
-                    Matrix3d t_numerator, beta_numerator, gamma_numerator;
-                    t_numerator << a - b, a - c, a - ray_origin;
-
-                    Matrix3d denominator;
-                    denominator << a - b, a - c, ray_direction;
+        string arg = argv[arg_i];
 
-                    double t = t_numerator.determinant() / denominator.determinant();
-
-                    if(t > 0 && t < smallest_t)
-                    {
-                        gamma_numerator << a - b, a - ray_origin, ray_direction;
-                        double gamma = gamma_numerator.determinant() / denominator.determinant();
-                        if (gamma >= 0 && gamma <= 1)
-                        {
-                            beta_numerator << a - ray_origin, a - c, ray_direction;
-                            double beta = beta_numerator.determinant() / denominator.determinant();
-                            if (beta >= 0 && beta <= 1 - gamma )
-                            {
-                                is_intersected = true;
-                                smallest_t = t;
-                                nearest_file_i = file_i;
-                                nearest_face_i = face_i;
-                            }
-                        }
-                    }
-                }
-            }
-
-            if(is_intersected)
+        // Read the argument after the option if it is a number in [min_value, max_value] and move past it, otherwise
+        // remember it to report the option as invalid
+        string invalid_value;
+        auto next_number = [&](auto& value, auto min_value, auto max_value)
+        {
+            if (arg_i + 1 >= argc || !parse_number(argv[arg_i + 1], value) || !(value >= min_value && value <= max_value))
             {
-                int a_i = faces[nearest_file_i](nearest_face_i,0);
-                int b_i = faces[nearest_file_i](nearest_face_i,1);
-                int c_i = faces[nearest_file_i](nearest_face_i,2);
-
-                Vector3d a(vertices[nearest_file_i](a_i,0), vertices[nearest_file_i](a_i,1), vertices[nearest_file_i](a_i,2));
-                Vector3d b(vertices[nearest_file_i](b_i,0), vertices[nearest_file_i](b_i,1), vertices[nearest_file_i](b_i,2));
-                Vector3d c(vertices[nearest_file_i](c_i,0), vertices[nearest_file_i](c_i,1), vertices[nearest_file_i](c_i,2));
-
-                Vector3d intersection_position = ray_origin + smallest_t * ray_direction;
-                Vector3d b_a = b - a;
-                Vector3d c_b = c - b;
-                Vector3d ray_normal = (b_a.cross(c_b)).normalized();
-                Vector3d view = -ray_direction;
-
-                // Ambient light
-                double lightness = 0;
-
-                for(int light_i = 0; light_i < light_positions.size(); light_i++)
-                {
-                    Vector3d ray_light = (light_positions[light_i] - intersection_position).normalized();
-                    Vector3d half_angle = (view + ray_light).normalized();
-                    lightness += max(0.,ray_normal.dot(ray_light)) + max(0.,pow(ray_normal.dot(half_angle), 100));
-                }
-
-                R(i,j) = lightness * colors[nearest_file_i](0);
-                G(i,j) = lightness * colors[nearest_file_i](1);
-                B(i,j) = lightness * colors[nearest_file_i](2);
-
-                // Disable the alpha mask for this pixel
-                A(i,j) = 1;
-
+                invalid_value = arg_i + 1 < argc ? argv[arg_i + 1] : "nothing";
+                return false;
             }
+            arg_i++;
+            return true;
+        };
+        auto next_int = [&](int& value, int min_value, int max_value = numeric_limits<int>::max()) { return next_number(value, min_value, max_value); };
+        auto next_double = [&](double& value, double min_value, double max_value = numeric_limits<double>::max()) { return next_number(value, min_value, max_value); };
+        int n, width, height, x, y;
+        double d;
+
+        if (arg == "--threads" && next_int(n, 0))
+            settings.thread_count = n;
+        else if (arg == "--tile-size" && next_int(n, 1))
+            settings.tile_size = n;
+        else if (arg == "--packet" && arg_i + 1 < argc && (string(argv[arg_i + 1]) == "1" || string(argv[arg_i + 1]) == "4" || string(argv[arg_i + 1]) == "8"))
+            settings.packet_size = stoi(argv[++arg_i]);
+        else if (arg == "--max-depth" && next_int(n, 0))
+            settings.max_depth = n;
+        else if (arg == "--ray-budget" && next_int(n, 0))
+            settings.ray_budget = n;
+        else if (arg == "--roulette" && next_double(d, 0))
+            settings.roulette_weight = d;
+        else if (arg == "--bits" && arg_i + 1 < argc && (string(argv[arg_i + 1]) == "8" || string(argv[arg_i + 1]) == "16"))
+            settings.output_bits = stoi(argv[++arg_i]);
+        else if (arg == "--rebuild-threshold" && next_double(d, 0))
+            settings.rebuild_threshold = d;
+        else if (arg == "--aa" && arg_i + 1 < argc && (string(argv[arg_i + 1]) == "1" || string(argv[arg_i + 1]) == "4" || string(argv[arg_i + 1]) == "16" || string(argv[arg_i + 1]) == "64"))
+            settings.max_samples = stoi(argv[++arg_i]);
+        else if (arg == "--aa-threshold" && next_double(d, 0))
+            settings.aa_threshold = d;
+        else if (arg == "--aa-time" && next_double(d, 0))
+            settings.aa_time_budget = d;
+        else if (arg == "--sample-map")
+            settings.sample_map = true;
+        else if (arg == "--path-trace")
+            settings.path_tracing = true;
+        else if (arg == "--spp" && next_int(n, 1))
+            settings.samples_per_pixel = n;
+        else if (arg == "--wavefront" && next_int(n, 1))
+            settings.wavefront_size = n;
+        else if (arg == "--no-sort")
+            settings.sort_rays = false;
+        else if (arg == "--pass-spp" && next_int(n, 1))
+            settings.pass_samples = n;
+        else if (arg == "--time-budget" && next_double(d, 0))
+            settings.time_budget = d;
+        else if (arg == "--save-every" && next_double(d, 0))
+            settings.save_interval = d;
+        else if (arg == "--checkpoint" && arg_i + 1 < argc)
+            settings.checkpoint = argv[++arg_i];
+        else if (arg == "--denoise" && next_int(n, 0, max_denoise_passes))
+            settings.denoise_passes = n;
+        else if (arg == "--guides")
+            settings.write_guides = true;
+        else if (arg == "--workers" && next_int(n, 0))
+            settings.workers = n;
+        else if (arg == "--listen" && arg_i + 1 < argc)
+            settings.listen_address = argv[++arg_i];
+        else if (arg == "--worker" && arg_i + 1 < argc)
+            worker_address = argv[++arg_i];
+        else if (arg == "--worker-timeout" && next_double(d, 0))
+            settings.worker_timeout = d;
+        else if (arg == "--fail-after" && next_int(n, 0))
+            settings.fail_after = n;
+        else if (arg == "--tile-delay" && next_double(d, 0, 3600))
+            settings.tile_delay = d;
+        else if (arg == "--resolution" && next_int(width, 1) && next_int(height, 1))
+        {
+            settings.width = width;
+            settings.height = height;
+        }
+        else if (arg == "--crop" && next_int(x, 0) && next_int(y, 0) && next_int(width, 1, numeric_limits<int>::max() - x)
+                 && next_int(height, 1, numeric_limits<int>::max() - y))
+        {
+            settings.crop.x_begin = x;
+            settings.crop.y_begin = y;
+            settings.crop.x_end = x + width;
+            settings.crop.y_end = y + height;
+        }
+        else if (arg == "--strip-height" && next_int(n, 0))
+            settings.strip_height = n;
+        else if (arg == "--precision" && arg_i + 1 < argc && (string(argv[arg_i + 1]) == "float" || string(argv[arg_i + 1]) == "double"))
+            settings.float_precision = string(argv[++arg_i]) == "float";
+        else if ((arg == "--light-samples" || arg == "--light-top") && next_int(n, 0))
+        {
+            settings.light_samples = n;
+            settings.light_top_k = arg == "--light-top";
+        }
+        else if (!arg.empty() && arg[0] != '-')
+            scene_files.push_back(arg);
+        else
+        {
+            if (!invalid_value.empty())
+                std::cerr << "Invalid value for " << arg << ": " << invalid_value << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--tile-size N] [--packet 1|4|8] [--max-depth N] [--ray-budget N] [--roulette W] [--bits 8|16] [--rebuild-threshold X] [--aa 1|4|16|64] [--aa-threshold X] [--aa-time S] [--sample-map]"
+                      << " [--path-trace] [--spp N] [--wavefront N] [--no-sort] [--pass-spp N] [--time-budget S] [--save-every S] [--checkpoint FILE]"
+                      << " [--denoise N] [--guides] [--workers N] [--listen ADDRESS] [--worker-timeout S] [--resolution W H] [--crop X Y W H] [--strip-height N]"
+                      << " [--precision float|double] [--light-samples N | --light-top N]"
+                      << " [scene files...]" << std::endl;
+            std::cerr << "       " << argv[0] << " --worker ADDRESS [--fail-after N] [--tile-delay S]" << std::endl;
+            return 1;
         }
     }
 
-    // Save to png
-    write_matrix_to_png(R,G,B,A,filename);
+    // The path tracer keeps the samples of the whole image, and traces in double
+    if (settings.path_tracing && (settings.crop.x_end > 0 || settings.strip_height > 0 || settings.float_precision || settings.light_samples > 0))
+    {
+        std::cerr << "--crop, --strip-height, --precision float and the light selection apply to the Whitted renderer, not to --path-trace" << std::endl;
+        return 1;
+    }
 
-}
+    // A worker renders the tiles of the coordinator at the address and nothing else
+    if (!worker_address.empty())
+        return run_worker(worker_address, settings);
+
+    // Scene files given on the command line replace the parts
+    if (!scene_files.empty())
+        return render_scenes(scene_files) == 0 ? 0 : 1;
 
-int main()
-{
     // part1();
     // part2();
     // part1_1();
@@ -0,0 +1,18 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+// A bundle of N coherent rays traced together, one ray per SIMD lane.
+// Components are stored as arrays so that a vector load reads the same component of 4 rays, or of 8 in float.
+template <int N, typename Scalar = double>
+struct RayPacket
+{
+    enum { size = N };
+
+    Scalar ox[N], oy[N], oz[N];
+    Scalar dx[N], dy[N], dz[N];
+};
+
+// Largest packet used by the tracer, 4x2 pixels
+const int max_packet_size = 8;
+
+#endif
@@ -0,0 +1,170 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+    // The tiles owned by one thread
+    struct TileQueue
+    {
+        mutex lock;
+        deque<Tile> tiles;
+    };
+
+    // Take a tile from the front of our own queue
+    bool pop_tile(TileQueue& queue, Tile& tile)
+    {
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tiles.empty())
+            return false;
+        tile = queue.tiles.front();
+        queue.tiles.pop_front();
+        return true;
+    }
+
+    // Take a tile from the back of another thread's queue, the one it would render last
+    bool steal_tile(TileQueue& queue, Tile& tile)
+    {
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tiles.empty())
+            return false;
+        tile = queue.tiles.back();
+        queue.tiles.pop_back();
+        return true;
+    }
+}
+
+TileScheduler::TileScheduler(int thread_count, int tile_size)
+    : thread_count(thread_count), tile_size(tile_size), scanline_order(false), strip_height(0)
+{
+    if (this->thread_count <= 0)
+        this->thread_count = max(1u, thread::hardware_concurrency());
+    if (this->tile_size <= 0)
+        this->tile_size = 32;
+}
+
+void TileScheduler::render(int width, int height, const function<void(const Tile&)>& render_tile)
+{
+    render(Tile{0, width, 0, height, 0}, render_tile);
+}
+
+void TileScheduler::render(const Tile& region, const function<void(const Tile&)>& render_tile)
+{
+    busy_time.assign(thread_count, 0.);
+    tiles_rendered.assign(thread_count, 0);
+    tiles_stolen.assign(thread_count, 0);
+
+    int strip_rows = region.y_end - region.y_begin;
+    if (strip_height > 0)
+        strip_rows = (strip_height + tile_size - 1) / tile_size * tile_size;
+    for (int y = region.y_begin; y < region.y_end; y += strip_rows)
+        render_strip(Tile{region.x_begin, region.x_end, y, min(y + strip_rows, region.y_end), 0}, render_tile);
+}
+
+void TileScheduler::render_strip(const Tile& strip, const function<void(const Tile&)>& render_tile)
+{
+    // Cut the strip in tiles and give each thread a contiguous run of them, or deal them row by row
+    vector<Tile> tiles;
+    if (scanline_order)
+    {
+        for (int y = strip.y_begin; y < strip.y_end; y += tile_size)
+            for (int x = strip.x_begin; x < strip.x_end; x += tile_size)
+                tiles.push_back({x, min(x + tile_size, strip.x_end), y, min(y + tile_size, strip.y_end), 0});
+    }
+    else
+    {
+        for (int x = strip.x_begin; x < strip.x_end; x += tile_size)
+            for (int y = strip.y_begin; y < strip.y_end; y += tile_size)
+                tiles.push_back({x, min(x + tile_size, strip.x_end), y, min(y + tile_size, strip.y_end), 0});
+    }
+    if (tiles.empty())
+        return;
+
+    vector<unique_ptr<TileQueue>> queues;
+    for (int t = 0; t < thread_count; t++)
+        queues.emplace_back(new TileQueue());
+    for (size_t k = 0; k < tiles.size(); k++)
+        queues[scanline_order ? k % thread_count : k * thread_count / tiles.size()]->tiles.push_back(tiles[k]);
+
+    auto worker = [&](int thread_index)
+    {
+        auto start = chrono::steady_clock::now();
+        Tile tile;
+        while (true)
+        {
+            bool found = pop_tile(*queues[thread_index], tile);
+
+            // Our queue is empty, look for work in the others starting from the next thread
+            for (int k = 1; !found && k < thread_count; k++)
+            {
+                found = steal_tile(*queues[(thread_index + k) % thread_count], tile);
+                if (found)
+                    tiles_stolen[thread_index]++;
+            }
+
+            // Tiles are never added once rendering started, so if all the queues are empty we are done
+            if (!found)
+                break;
+
+            tile.thread = thread_index;
+            render_tile(tile);
+            tiles_rendered[thread_index]++;
+        }
+        busy_time[thread_index] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    // The calling thread works as thread 0
+    vector<thread> threads;
+    for (int t = 1; t < thread_count; t++)
+        threads.emplace_back(worker, t);
+    worker(0);
+    for (thread& t : threads)
+        t.join();
+}
+
+void TileScheduler::print_timings() const
+{
+    for (int t = 0; t < thread_count; t++)
+    {
+        cout << "  Thread " << t << ": " << tiles_rendered[t] << " tiles (" << tiles_stolen[t] << " stolen) in "
+             << busy_time[t] * 1000 << " ms" << endl;
+    }
+}
+
+void parallel_for(int count, int thread_count, int chunk_size, const function<void(int, int, int)>& body)
+{
+    if (thread_count <= 0)
+        thread_count = max(1u, thread::hardware_concurrency());
+    chunk_size = max(chunk_size, 1);
+    int chunk_count = (count + chunk_size - 1) / chunk_size;
+    thread_count = min(thread_count, chunk_count);
+    if (thread_count <= 1)
+    {
+        if (count > 0)
+            body(0, count, 0);
+        return;
+    }
+
+    atomic<int> next_chunk(0);
+    auto worker = [&](int thread_index)
+    {
+        for (int chunk = next_chunk++; chunk < chunk_count; chunk = next_chunk++)
+            body(chunk * chunk_size, min(count, (chunk + 1) * chunk_size), thread_index);
+    };
+
+    vector<thread> threads;
+    for (int t = 1; t < thread_count; t++)
+        threads.emplace_back(worker, t);
+    worker(0);
+    for (thread& t : threads)
+        t.join();
+}
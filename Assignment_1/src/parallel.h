@@ -0,0 +1,61 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+#include <vector>
+
+// A rectangle of pixels [x_begin, x_end) x [y_begin, y_end), rendered by the thread with index "thread"
+struct Tile
+{
+    int x_begin, x_end;
+    int y_begin, y_end;
+    int thread;
+};
+
+// Splits an image into square tiles and renders them on a pool of threads.
+// Every thread owns a deque of neighbouring tiles and pops from its front; once it is empty
+// the thread steals from the back of the other deques, so no core idles while work is left.
+class TileScheduler
+{
+public:
+    int thread_count;
+    int tile_size;
+
+    // Hand the tiles out one row of tiles after the other, in turn to every thread, instead of a contiguous run
+    // of tiles per thread. The rows of the image are then finished roughly from top to bottom, as needed by a
+    // StreamingFramebuffer.
+    bool scanline_order;
+
+    // Rows of the image whose tiles are handed out together, rounded up to a multiple of tile_size, 0 for all of
+    // them. The tiles of a strip are cut once the previous strip is done, so the tiles in flight and the rows being
+    // rendered stay within a strip whatever the size of the image.
+    int strip_height;
+
+    // Per-thread statistics of the last call to render(), over all its strips
+    std::vector<double> busy_time;
+    std::vector<int> tiles_rendered;
+    std::vector<int> tiles_stolen;
+
+    // thread_count = 0 uses all the available cores, 32x32 tiles of doubles fit in L1
+    TileScheduler(int thread_count = 0, int tile_size = 32);
+
+    // Call render_tile once for every tile of a width x height image, returns when all the tiles are done
+    void render(int width, int height, const std::function<void(const Tile&)>& render_tile);
+
+    // Same for the tiles of a region of an image, they are cut from its top left corner
+    void render(const Tile& region, const std::function<void(const Tile&)>& render_tile);
+
+    // Print the time spent and the tiles rendered by each thread
+    void print_timings() const;
+
+private:
+    // Render the tiles of a strip on all the threads, adding to the statistics
+    void render_strip(const Tile& strip, const std::function<void(const Tile&)>& render_tile);
+};
+
+// Call body(begin, end, thread) on chunks of chunk_size items covering [0, count), from thread_count threads
+// (0 uses all the cores). The chunks are handed out in order as the threads finish the previous ones,
+// and the calling thread works as thread 0.
+void parallel_for(int count, int thread_count, int chunk_size, const std::function<void(int, int, int)>& body);
+
+#endif
@@ -0,0 +1,810 @@
+#include "pathtracer.h"
+#include "denoise.h"
+#include "image.h"
+#include "parallel.h"
+#include "progressive.h"
+#include "tracer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <thread>
+#include <vector>
+#include <Eigen/Geometry>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Rays handed to a thread at a time by the stages
+    const int chunk_size = 1024;
+
+    // Paths are stopped by Russian roulette from this bounce on
+    const int roulette_depth = 3;
+
+    // Uniform number in [0, 1) from a xorshift generator
+    double next_random(unsigned& state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state * (1.0 / 4294967296.0);
+    }
+
+    // Seed of the random numbers of a sample of a pixel, never 0, so that images do not depend on the batches or threads
+    unsigned sample_seed(unsigned pixel, unsigned sample)
+    {
+        unsigned h = pixel * 2654435761u ^ (sample + 1) * 2246822519u;
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+        return h ? h : 1;
+    }
+
+    // Direction around the unit normal with a density proportional to the cosine with it
+    Vector3d cosine_direction(const Vector3d& normal, double r1, double r2)
+    {
+        // Orthonormal basis around the normal without a division by a small number (Duff et al. 2017)
+        double sign = copysign(1.0, normal(2));
+        double a = -1 / (sign + normal(2));
+        double b = normal(0) * normal(1) * a;
+        Vector3d tangent(1 + sign * normal(0) * normal(0) * a, sign * b, -sign * normal(0));
+        Vector3d bitangent(b, sign + normal(1) * normal(1) * a, -normal(1));
+
+        double phi = 2 * EIGEN_PI * r1;
+        double radius = sqrt(r2);
+        return radius * cos(phi) * tangent + radius * sin(phi) * bitangent + sqrt(max(0., 1 - r2)) * normal;
+    }
+
+    // Paths of a wavefront, one entry per path in every array
+    struct PathQueue
+    {
+        vector<double> ox, oy, oz;
+        vector<double> dx, dy, dz;
+        vector<double> tr, tg, tb;         // Throughput: part of the light found further along the path that reaches the camera
+        vector<int> slot;                  // Sample of the batch the path adds its light to
+        vector<unsigned> random_state;
+        vector<unsigned char> is_specular; // Leaves the camera, a mirror or a refraction, so the area lights it hits are counted
+
+        // Found by the intersection stage
+        vector<Hit> hit;
+        vector<int> light;             // Area light hit, -1 if none
+        vector<unsigned char> is_hit;  // A triangle or a sphere is hit, when light is -1
+
+        int size() const { return slot.size(); }
+
+        void resize(int n)
+        {
+            for (vector<double>* v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb})
+                v->resize(n);
+            slot.resize(n);
+            random_state.resize(n);
+            is_specular.resize(n);
+            hit.resize(n);
+            light.resize(n);
+            is_hit.resize(n);
+        }
+
+        Vector3d origin(int i) const { return Vector3d(ox[i], oy[i], oz[i]); }
+        Vector3d direction(int i) const { return Vector3d(dx[i], dy[i], dz[i]); }
+
+        void set_ray(int i, const Vector3d& origin, const Vector3d& direction)
+        {
+            ox[i] = origin(0); oy[i] = origin(1); oz[i] = origin(2);
+            dx[i] = direction(0); dy[i] = direction(1); dz[i] = direction(2);
+        }
+    };
+
+    // At most one shadow ray per path, slot is -1 for the paths that cast none
+    struct ShadowQueue
+    {
+        vector<double> ox, oy, oz;
+        vector<double> dx, dy, dz;
+        vector<double> distance;
+        vector<double> r, g, b; // Light brought to the sample if nothing blocks the ray
+        vector<int> slot;
+
+        void resize(int n)
+        {
+            for (vector<double>* v : {&ox, &oy, &oz, &dx, &dy, &dz, &distance, &r, &g, &b})
+                v->resize(n);
+            slot.resize(n);
+        }
+    };
+
+    // Area light with what its intersection and sampling need
+    struct LightFrame
+    {
+        Vector3d normal; // Unit, on the emitting side
+        Vector3d dual_u; // p . dual_u and p . dual_v are the coordinates of p - corner along the edges
+        Vector3d dual_v;
+        double area;
+    };
+
+    // Wall time of every stage, over all the batches and bounces
+    struct StageTimes
+    {
+        double generate, sort, intersect, shade, shadow, accumulate;
+
+        StageTimes() : generate(0), sort(0), intersect(0), shade(0), shadow(0), accumulate(0) {}
+    };
+
+    class WavefrontRenderer
+    {
+    public:
+        long long camera_rays;
+        long long bounce_rays;
+        long long shadow_rays;
+        StageTimes times;
+
+        WavefrontRenderer(const Scene& scene, const RenderSettings& settings, int thread_count);
+
+        // Trace the next samples of the pixels, up to pass_samples more each but no more than target_samples,
+        // and add them to the accumulation
+        void trace_batch(const int* pixels, int pixel_count, int pass_samples, int target_samples, Accumulation& accumulation);
+
+        void print_stats(double seconds) const;
+
+    private:
+        const Scene& scene;
+        const RenderSettings& settings;
+        int thread_count;
+        Tracer tracer;
+        vector<LightFrame> light_frames;
+        int mesh_count;
+
+        PathQueue paths, sorted_paths;
+        ShadowQueue shadows;
+        vector<unsigned char> is_alive;
+        vector<int> keys, order;
+
+        // Pixel and number of every sample of the current batch, the samples of a pixel follow each other
+        vector<int> slot_pixels;
+        vector<unsigned> slot_samples;
+        vector<int> first_slots; // Per pixel of the batch, and the end
+
+        // Light and coverage of every sample of the current batch
+        vector<Vector3d> radiance;
+        vector<float> coverage;
+
+        // Guides of the denoiser of every sample: the surface where the path leaves the mirrors and the refractions.
+        // Each surface of a path overwrites them until one is mostly diffuse or the path leaves it diffusely.
+        vector<Vector3d> guide_normal;
+        vector<Vector3d> guide_albedo;
+        vector<double> guide_depth;
+        vector<double> path_length; // Along the mirrors and the refractions from the camera
+        vector<unsigned char> is_guide_final;
+
+        vector<TraversalStats> intersect_stats;
+        vector<TraversalStats> shadow_stats;
+
+        void generate();
+        void intersect(int depth);
+        void shade(int depth);
+        void trace_shadows();
+        void accumulate(const int* pixels, int pixel_count, Accumulation& accumulation);
+
+        // Reorder the paths by keys[i] in [0, key_count), the paths with key_count are dropped
+        void sort_paths(int key_count, bool with_hits);
+    };
+
+    WavefrontRenderer::WavefrontRenderer(const Scene& scene, const RenderSettings& settings, int thread_count)
+        : camera_rays(0), bounce_rays(0), shadow_rays(0), scene(scene), settings(settings), thread_count(thread_count),
+          tracer(scene.bvh, scene.mesh_materials, scene.light_positions, scene.light_powers, thread_count), mesh_count(scene.mesh_names.size()),
+          intersect_stats(thread_count), shadow_stats(thread_count)
+    {
+        tracer.instances = &scene.instances;
+        tracer.instance_materials = scene.instance_materials;
+        tracer.spheres = scene.spheres;
+        tracer.sphere_materials = scene.sphere_materials;
+
+        for (const AreaLight& light : scene.area_lights)
+        {
+            LightFrame frame;
+            Vector3d n = light.edge1.cross(light.edge2);
+            frame.area = n.norm();
+            frame.normal = n / frame.area;
+            frame.dual_u = light.edge2.cross(n) / light.edge1.dot(light.edge2.cross(n));
+            frame.dual_v = n.cross(light.edge1) / light.edge2.dot(n.cross(light.edge1));
+            light_frames.push_back(frame);
+        }
+    }
+
+    void WavefrontRenderer::trace_batch(const int* pixels, int pixel_count, int pass_samples, int target_samples, Accumulation& accumulation)
+    {
+        slot_pixels.clear();
+        slot_samples.clear();
+        first_slots.resize(pixel_count + 1);
+        for (int k = 0; k < pixel_count; k++)
+        {
+            first_slots[k] = slot_pixels.size();
+            unsigned first_sample = accumulation.counts[pixels[k]];
+            unsigned samples = min<long long>(pass_samples, max(0LL, (long long)target_samples - first_sample));
+            for (unsigned s = 0; s < samples; s++)
+            {
+                slot_pixels.push_back(pixels[k]);
+                slot_samples.push_back(first_sample + s);
+            }
+        }
+        first_slots[pixel_count] = slot_pixels.size();
+        generate();
+
+        for (int depth = 0; paths.size() > 0; depth++)
+        {
+            if (depth > 0)
+            {
+                // Drop the finished paths, and put the rays going the same way together
+                auto start = chrono::steady_clock::now();
+                keys.resize(paths.size());
+                parallel_for(paths.size(), thread_count, chunk_size, [&](int begin, int end, int)
+                {
+                    for (int i = begin; i < end; i++)
+                    {
+                        if (!is_alive[i])
+                            keys[i] = 512;
+                        else if (!settings.sort_rays)
+                            keys[i] = 0;
+                        else
+                        {
+                            // Octant, then 8 x 8 bins of the x and y components
+                            int octant = (paths.dx[i] < 0) | (paths.dy[i] < 0) << 1 | (paths.dz[i] < 0) << 2;
+                            int x_bin = min(7, int(fabs(paths.dx[i]) * 8));
+                            int y_bin = min(7, int(fabs(paths.dy[i]) * 8));
+                            keys[i] = octant * 64 + x_bin * 8 + y_bin;
+                        }
+                    }
+                });
+                sort_paths(512, false);
+                times.sort += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                if (paths.size() == 0)
+                    break;
+            }
+
+            intersect(depth);
+
+            if (settings.sort_rays)
+            {
+                // Hits of the same mesh, then the spheres, the area lights and the misses
+                auto start = chrono::steady_clock::now();
+                keys.resize(paths.size());
+                parallel_for(paths.size(), thread_count, chunk_size, [&](int begin, int end, int)
+                {
+                    for (int i = begin; i < end; i++)
+                    {
+                        if (paths.light[i] >= 0)
+                            keys[i] = mesh_count + 1;
+                        else if (!paths.is_hit[i])
+                            keys[i] = mesh_count + 2;
+                        else
+                            keys[i] = paths.hit[i].mesh >= 0 ? paths.hit[i].mesh : mesh_count;
+                    }
+                });
+                sort_paths(mesh_count + 3, true);
+                times.sort += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            }
+
+            shade(depth);
+            trace_shadows();
+        }
+
+        accumulate(pixels, pixel_count, accumulation);
+    }
+
+    void WavefrontRenderer::generate()
+    {
+        auto start = chrono::steady_clock::now();
+        const Camera& camera = scene.camera;
+        int count = slot_pixels.size();
+        paths.resize(count);
+        radiance.assign(count, Vector3d::Zero());
+        coverage.assign(count, 0);
+        guide_normal.assign(count, Vector3d::Zero());
+        guide_albedo.assign(count, Vector3d::Ones());
+        guide_depth.assign(count, 0);
+        path_length.assign(count, 0);
+        is_guide_final.assign(count, 0);
+
+        Vector3d direction, x_displacement, y_displacement;
+        camera.pixel_rays(direction, x_displacement, y_displacement);
+
+        // The lens lies in the plane of the image, rays through it meet on the plane at the focus distance
+        Vector3d forward = (camera.target - camera.position).normalized();
+        Vector3d right = forward.cross(camera.up).normalized();
+        Vector3d image_up = right.cross(forward);
+        double focus_distance = camera.focus_distance > 0 ? camera.focus_distance : (camera.target - camera.position).norm();
+
+        parallel_for(count, thread_count, chunk_size, [&](int begin, int end, int)
+        {
+            for (int k = begin; k < end; k++)
+            {
+                unsigned pixel = slot_pixels[k];
+                unsigned random_state = sample_seed(pixel, slot_samples[k]);
+                int i = pixel % camera.width, j = pixel / camera.width;
+
+                // A random point of the pixel, so the samples also anti-alias the edges
+                double u = next_random(random_state), v = next_random(random_state);
+                Vector3d ray_direction = (direction + (i + u) * x_displacement + (j + v) * y_displacement).normalized();
+                Vector3d ray_origin = camera.position;
+                if (camera.aperture > 0)
+                {
+                    Vector3d focus = camera.position + ray_direction * (focus_distance / ray_direction.dot(forward));
+                    double angle = 2 * EIGEN_PI * next_random(random_state);
+                    double radius = camera.aperture / 2 * sqrt(next_random(random_state));
+                    ray_origin = camera.position + radius * cos(angle) * right + radius * sin(angle) * image_up;
+                    ray_direction = (focus - ray_origin).normalized();
+                }
+
+                paths.set_ray(k, ray_origin, ray_direction);
+                paths.tr[k] = paths.tg[k] = paths.tb[k] = 1;
+                paths.slot[k] = k;
+                paths.random_state[k] = random_state;
+                paths.is_specular[k] = 1;
+            }
+        });
+        camera_rays += count;
+        times.generate += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    void WavefrontRenderer::intersect(int depth)
+    {
+        auto start = chrono::steady_clock::now();
+        if (depth > 0)
+            bounce_rays += paths.size();
+        parallel_for(paths.size(), thread_count, chunk_size, [&](int begin, int end, int thread)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                Vector3d origin = paths.origin(i), direction = paths.direction(i);
+                Hit& hit = paths.hit[i];
+                paths.is_hit[i] = tracer.intersect(origin, direction, numeric_limits<double>::infinity(), hit, &intersect_stats[thread]);
+                double t_max = paths.is_hit[i] ? hit.t : numeric_limits<double>::infinity();
+
+                // The area lights are few, they are tested one by one. They are seen from their emitting side only.
+                paths.light[i] = -1;
+                for (int l = 0; l < light_frames.size(); l++)
+                {
+                    const LightFrame& frame = light_frames[l];
+                    double facing = direction.dot(frame.normal);
+                    if (facing >= 0)
+                        continue;
+                    double t = (scene.area_lights[l].corner - origin).dot(frame.normal) / facing;
+                    if (t <= tracer.epsilon || t >= t_max)
+                        continue;
+                    Vector3d p = origin + t * direction - scene.area_lights[l].corner;
+                    double u = p.dot(frame.dual_u), v = p.dot(frame.dual_v);
+                    if (u < 0 || u > 1 || v < 0 || v > 1)
+                        continue;
+                    t_max = t;
+                    paths.light[i] = l;
+                }
+            }
+        });
+        times.intersect += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    void WavefrontRenderer::shade(int depth)
+    {
+        auto start = chrono::steady_clock::now();
+        int count = paths.size();
+        is_alive.assign(count, 0);
+        shadows.resize(count);
+        int point_lights = scene.light_positions.size();
+        int light_count = point_lights + scene.area_lights.size();
+
+        parallel_for(count, thread_count, chunk_size, [&](int begin, int end, int)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                shadows.slot[i] = -1;
+                int slot = paths.slot[i];
+                Vector3d throughput(paths.tr[i], paths.tg[i], paths.tb[i]);
+                if (depth == 0 && (paths.is_hit[i] || paths.light[i] >= 0))
+                    coverage[slot] = 1;
+
+                // An area light ends the path. After a diffuse bounce it was already counted by sampling the lights.
+                if (paths.light[i] >= 0)
+                {
+                    if (paths.is_specular[i])
+                        radiance[slot] += throughput.cwiseProduct(scene.area_lights[paths.light[i]].radiance);
+                    if (!is_guide_final[slot])
+                    {
+                        const LightFrame& frame = light_frames[paths.light[i]];
+                        guide_normal[slot] = frame.normal;
+                        guide_albedo[slot] = Vector3d::Ones();
+                        guide_depth[slot] = path_length[slot] + (scene.area_lights[paths.light[i]].corner - paths.origin(i)).dot(frame.normal)
+                                                              / paths.direction(i).dot(frame.normal);
+                        is_guide_final[slot] = 1;
+                    }
+                    continue;
+                }
+                if (!paths.is_hit[i])
+                {
+                    if (!is_guide_final[slot])
+                    {
+                        guide_normal[slot] = Vector3d::Zero();
+                        guide_albedo[slot] = Vector3d::Ones();
+                        guide_depth[slot] = 0;
+                        is_guide_final[slot] = 1;
+                    }
+                    continue;
+                }
+
+                unsigned& random_state = paths.random_state[i];
+                Vector3d ray_direction = paths.direction(i);
+                const Hit& hit = paths.hit[i];
+                Vector3d position = paths.origin(i) + hit.t * ray_direction;
+                Material material;
+                Vector3d normal;
+                tracer.surface(hit, position, material, normal);
+                Vector3d facing_normal = normal.dot(ray_direction) < 0 ? normal : Vector3d(-normal);
+
+                double reflected, transmitted;
+                Vector3d refracted_direction;
+                split_reflection(material, normal, ray_direction, reflected, transmitted, refracted_direction);
+                double local = max(0., 1 - material.reflectivity - material.transmission);
+                if (!is_guide_final[slot])
+                {
+                    path_length[slot] += hit.t;
+                    guide_normal[slot] = facing_normal;
+                    guide_albedo[slot] = material.color;
+                    guide_depth[slot] = path_length[slot];
+                    is_guide_final[slot] = local >= reflected + transmitted;
+                }
+
+                // Next event estimation: one light chosen at random, its light counted as many times as there are lights
+                if (local > 0 && light_count > 0)
+                {
+                    int l = min(int(next_random(random_state) * light_count), light_count - 1);
+                    Vector3d to_light, light_color;
+                    double distance;
+                    if (l < point_lights)
+                    {
+                        to_light = scene.light_positions[l] - position;
+                        distance = to_light.norm();
+                        to_light /= distance;
+                        light_color = Vector3d::Constant(max(0., facing_normal.dot(to_light)));
+                        if (scene.light_powers[l] > 0)
+                            light_color *= scene.light_powers[l] / (distance * distance);
+                    }
+                    else
+                    {
+                        // Uniform point of the parallelogram, the solid angle it covers follows from its area
+                        const AreaLight& light = scene.area_lights[l - point_lights];
+                        const LightFrame& frame = light_frames[l - point_lights];
+                        Vector3d point = light.corner + next_random(random_state) * light.edge1 + next_random(random_state) * light.edge2;
+                        to_light = point - position;
+                        distance = to_light.norm();
+                        to_light /= distance;
+                        double cos_light = -frame.normal.dot(to_light);
+                        double cos_surface = facing_normal.dot(to_light);
+                        light_color = cos_light > 0 && cos_surface > 0
+                            ? Vector3d(light.radiance * (cos_surface * cos_light * frame.area / (EIGEN_PI * distance * distance)))
+                            : Vector3d::Zero();
+                    }
+                    Vector3d contribution = light_count * local * throughput.cwiseProduct(material.color).cwiseProduct(light_color);
+                    if (contribution.maxCoeff() > 0)
+                    {
+                        Vector3d shadow_origin = position + tracer.epsilon * to_light;
+                        shadows.ox[i] = shadow_origin(0); shadows.oy[i] = shadow_origin(1); shadows.oz[i] = shadow_origin(2);
+                        shadows.dx[i] = to_light(0); shadows.dy[i] = to_light(1); shadows.dz[i] = to_light(2);
+                        shadows.distance[i] = distance - 2 * tracer.epsilon;
+                        shadows.r[i] = contribution(0); shadows.g[i] = contribution(1); shadows.b[i] = contribution(2);
+                        shadows.slot[i] = slot;
+                    }
+                }
+
+                if (depth >= settings.max_depth)
+                    continue;
+
+                // Continue along one of the diffuse, mirror and refracted parts, chosen in proportion to their weights,
+                // so the throughput is only multiplied by their sum
+                double total = local + reflected + transmitted;
+                if (total <= 0)
+                    continue;
+                double choice = next_random(random_state) * total;
+                Vector3d next_direction;
+                if (choice < local)
+                {
+                    next_direction = cosine_direction(facing_normal, next_random(random_state), next_random(random_state));
+                    throughput = throughput.cwiseProduct(material.color);
+                    paths.is_specular[i] = 0;
+                    is_guide_final[slot] = 1;
+                }
+                else if (choice < local + reflected)
+                {
+                    next_direction = ray_direction - 2 * ray_direction.dot(normal) * normal;
+                    paths.is_specular[i] = 1;
+                }
+                else
+                {
+                    next_direction = refracted_direction;
+                    paths.is_specular[i] = 1;
+                }
+                throughput *= total;
+
+                // Russian roulette on the paths that bring little light
+                if (depth + 1 >= roulette_depth)
+                {
+                    double survival = min(1., throughput.maxCoeff());
+                    if (next_random(random_state) >= survival)
+                        continue;
+                    throughput /= survival;
+                }
+
+                paths.set_ray(i, position + tracer.epsilon * next_direction, next_direction);
+                paths.tr[i] = throughput(0);
+                paths.tg[i] = throughput(1);
+                paths.tb[i] = throughput(2);
+                is_alive[i] = 1;
+            }
+        });
+        times.shade += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    void WavefrontRenderer::trace_shadows()
+    {
+        auto start = chrono::steady_clock::now();
+        int count = shadows.slot.size();
+        vector<long long> traced(thread_count, 0);
+        parallel_for(count, thread_count, chunk_size, [&](int begin, int end, int thread)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                int slot = shadows.slot[i];
+                if (slot < 0)
+                    continue;
+                traced[thread]++;
+                Vector3d origin(shadows.ox[i], shadows.oy[i], shadows.oz[i]);
+                Vector3d direction(shadows.dx[i], shadows.dy[i], shadows.dz[i]);
+                if (!tracer.occluded(origin, direction, shadows.distance[i], nullptr, &shadow_stats[thread]))
+                    radiance[slot] += Vector3d(shadows.r[i], shadows.g[i], shadows.b[i]);
+            }
+        });
+        for (long long rays : traced)
+            shadow_rays += rays;
+        times.shadow += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    void WavefrontRenderer::accumulate(const int* pixels, int pixel_count, Accumulation& accumulation)
+    {
+        auto start = chrono::steady_clock::now();
+        parallel_for(pixel_count, thread_count, chunk_size, [&](int begin, int end, int)
+        {
+            for (int k = begin; k < end; k++)
+            {
+                Vector3d color = Vector3d::Zero(), normal = Vector3d::Zero(), albedo = Vector3d::Zero();
+                float alpha = 0;
+                double depth = 0;
+                for (int s = first_slots[k]; s < first_slots[k + 1]; s++)
+                {
+                    color += radiance[s];
+                    alpha += coverage[s];
+                    normal += guide_normal[s];
+                    albedo += guide_albedo[s];
+                    depth += guide_depth[s];
+                }
+                Pixel& sum = accumulation.sums[pixels[k]];
+                sum = Pixel(sum.r + color(0), sum.g + color(1), sum.b + color(2), sum.a + alpha);
+                Pixel& normal_depth = accumulation.normal_depth_sums[pixels[k]];
+                normal_depth = Pixel(normal_depth.r + normal(0), normal_depth.g + normal(1), normal_depth.b + normal(2), normal_depth.a + depth);
+                Pixel& albedo_sum = accumulation.albedo_sums[pixels[k]];
+                albedo_sum = Pixel(albedo_sum.r + albedo(0), albedo_sum.g + albedo(1), albedo_sum.b + albedo(2), 0);
+                accumulation.counts[pixels[k]] += first_slots[k + 1] - first_slots[k];
+            }
+        });
+        times.accumulate += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    void WavefrontRenderer::sort_paths(int key_count, bool with_hits)
+    {
+        // Counting sort, stable so that the pixels stay in order within a key
+        int count = paths.size();
+        vector<int> starts(key_count + 2, 0);
+        for (int i = 0; i < count; i++)
+            starts[keys[i] + 1]++;
+        for (int key = 0; key <= key_count; key++)
+            starts[key + 1] += starts[key];
+        int kept = starts[key_count];
+        order.resize(count);
+        for (int i = 0; i < count; i++)
+            order[starts[keys[i]]++] = i;
+
+        // Gather the kept paths one array at a time
+        sorted_paths.resize(kept);
+        parallel_for(kept, thread_count, chunk_size, [&](int begin, int end, int)
+        {
+            for (auto field : {&PathQueue::ox, &PathQueue::oy, &PathQueue::oz, &PathQueue::dx, &PathQueue::dy, &PathQueue::dz,
+                               &PathQueue::tr, &PathQueue::tg, &PathQueue::tb})
+                for (int k = begin; k < end; k++)
+                    (sorted_paths.*field)[k] = (paths.*field)[order[k]];
+            for (int k = begin; k < end; k++)
+            {
+                sorted_paths.slot[k] = paths.slot[order[k]];
+                sorted_paths.random_state[k] = paths.random_state[order[k]];
+                sorted_paths.is_specular[k] = paths.is_specular[order[k]];
+            }
+            if (with_hits)
+            {
+                for (int k = begin; k < end; k++)
+                {
+                    sorted_paths.hit[k] = paths.hit[order[k]];
+                    sorted_paths.light[k] = paths.light[order[k]];
+                    sorted_paths.is_hit[k] = paths.is_hit[order[k]];
+                }
+            }
+        });
+        swap(paths, sorted_paths);
+    }
+
+    void WavefrontRenderer::print_stats(double seconds) const
+    {
+        long long samples = camera_rays;
+        std::cout << "Path tracing: " << settings.samples_per_pixel << " samples per pixel in passes of " << settings.pass_samples << ", at most "
+                  << settings.max_depth << " bounces, wavefronts of " << max(1, settings.wavefront_size / settings.pass_samples) * settings.pass_samples << " paths, "
+                  << (settings.sort_rays ? "sorted by direction and material" : "not sorted") << std::endl;
+        std::cout << samples << " samples in " << seconds << " s on " << thread_count << " threads: " << samples / seconds / 1e6 << " Msamples/s, "
+                  << samples / seconds / thread_count / 1e6 << " Msamples/s per core" << std::endl;
+
+        TraversalStats intersect_totals, shadow_totals;
+        for (const TraversalStats& stats : intersect_stats)
+            intersect_totals += stats;
+        for (const TraversalStats& stats : shadow_stats)
+            shadow_totals += stats;
+        long long rays = camera_rays + bounce_rays + shadow_rays;
+        std::cout << "Rays: " << camera_rays << " camera, " << bounce_rays << " bounces, " << shadow_rays << " shadow, " << rays / seconds / 1e6
+                  << " Mrays/s. BVH nodes visited per ray: " << double(intersect_totals.nodes_visited) / max(1LL, intersect_totals.rays)
+                  << " (shadow rays " << double(shadow_totals.nodes_visited) / max(1LL, shadow_totals.rays) << ")" << std::endl;
+        std::cout << "Stages: generate " << times.generate * 1000 << " ms, sort " << times.sort * 1000 << " ms, intersect " << times.intersect * 1000
+                  << " ms, shade " << times.shade * 1000 << " ms, shadows " << times.shadow * 1000 << " ms, accumulate " << times.accumulate * 1000
+                  << " ms" << std::endl;
+    }
+}
+
+bool render_path_traced(const Scene& scene, const RenderSettings& settings, RenderStats* stats)
+{
+    if (settings.verbose)
+    {
+        std::cout << "Scene " << scene.path << ": " << scene.mesh_materials.size() << " meshes, " << scene.spheres.size() << " spheres, "
+                  << scene.light_positions.size() << " point lights, " << scene.area_lights.size() << " area lights" << std::endl;
+        scene.bvh.print_summary();
+        scene.instances.print_summary();
+    }
+
+    // Resume from the checkpoint if there is one, a checkpoint of another scene is an error rather than overwritten
+    Accumulation accumulation(scene.camera.width, scene.camera.height);
+    uint64_t fingerprint = checkpoint_fingerprint(scene.path, scene.mesh_files, {double(scene.camera.width), double(scene.camera.height), double(settings.max_depth)});
+    if (!settings.checkpoint.empty() && ifstream(settings.checkpoint))
+    {
+        string error;
+        if (!accumulation.load(settings.checkpoint, fingerprint, error))
+        {
+            std::cerr << "Cannot resume: " << error << std::endl;
+            return false;
+        }
+        if (settings.verbose)
+            std::cout << "Resumed from " << settings.checkpoint << " with " << accumulation.total_samples() << " samples, at least "
+                      << accumulation.min_count() << " per pixel" << std::endl;
+    }
+
+    int thread_count = settings.thread_count > 0 ? settings.thread_count : max(1u, thread::hardware_concurrency());
+    WavefrontRenderer renderer(scene, settings, thread_count);
+    Framebuffer image(scene.camera.width, scene.camera.height);
+
+    // The image is denoised every time it is written, the previews too
+    Framebuffer normal_depth(image.width, image.height), albedo(image.width, image.height), denoised(image.width, image.height);
+    DenoiseParameters denoise_parameters;
+    denoise_parameters.passes = settings.denoise_passes;
+    DenoiseStats denoise_stats = {};
+    auto write_image = [&]()
+    {
+        accumulation.resolve(image);
+        if (settings.denoise_passes <= 0)
+            return image.write(scene.output, settings.output_bits);
+        accumulation.resolve_guides(normal_depth, albedo);
+        denoise_stats = denoise(image, normal_depth, albedo, denoised, denoise_parameters, thread_count);
+        return denoised.write(scene.output, settings.output_bits);
+    };
+
+    // Passes add pass_samples to every pixel short of samples_per_pixel, in batches of pixels that fill a wavefront.
+    // The time budget is checked between the batches, so a render stops at most one batch late.
+    auto start = chrono::steady_clock::now();
+    auto elapsed = [&]() { return chrono::duration<double>(chrono::steady_clock::now() - start).count(); };
+    int batch_pixels = max(1, settings.wavefront_size / settings.pass_samples);
+    bool is_out_of_time = false;
+    double last_save = 0;
+    vector<int> pending;
+    while (!is_out_of_time && accumulation.min_count() < unsigned(settings.samples_per_pixel))
+    {
+        pending.clear();
+        for (int p = 0; p < int(accumulation.counts.size()); p++)
+            if (accumulation.counts[p] < unsigned(settings.samples_per_pixel))
+                pending.push_back(p);
+
+        for (int first = 0; first < int(pending.size()); first += batch_pixels)
+        {
+            if (settings.time_budget > 0 && elapsed() >= settings.time_budget)
+            {
+                is_out_of_time = true;
+                break;
+            }
+            renderer.trace_batch(pending.data() + first, min(batch_pixels, int(pending.size()) - first), settings.pass_samples,
+                                 settings.samples_per_pixel, accumulation);
+
+            if (settings.save_interval > 0 && elapsed() - last_save >= settings.save_interval)
+            {
+                last_save = elapsed();
+                write_image();
+                string error;
+                if (!settings.checkpoint.empty() && !accumulation.save(settings.checkpoint, fingerprint, error))
+                    std::cerr << "Cannot save the checkpoint: " << error << std::endl;
+                if (settings.verbose)
+                    std::cout << "Preview after " << last_save << " s: at least " << accumulation.min_count() << " samples per pixel" << std::endl;
+            }
+        }
+    }
+
+    double seconds = elapsed();
+    bool is_written = write_image();
+    if (settings.denoise_passes > 0)
+        is_written = image.write(sibling_path(scene.output, "_noisy.png"), settings.output_bits) && is_written;
+    if (settings.write_guides)
+    {
+        // Normals mapped from [-1, 1] to [0, 1], depths divided by the largest
+        accumulation.resolve_guides(normal_depth, albedo);
+        float max_depth = 0;
+        for (const Pixel& pixel : normal_depth.pixels)
+            max_depth = max(max_depth, pixel.a);
+        Framebuffer normals(image.width, image.height), depths(image.width, image.height);
+        for (size_t k = 0; k < image.pixels.size(); k++)
+        {
+            const Pixel& pixel = normal_depth.pixels[k];
+            float depth = max_depth > 0 ? pixel.a / max_depth : 0;
+            normals.pixels[k] = Pixel(pixel.r * 0.5f + 0.5f, pixel.g * 0.5f + 0.5f, pixel.b * 0.5f + 0.5f, 1);
+            depths.pixels[k] = Pixel(depth, depth, depth, 1);
+        }
+        is_written = normals.write(sibling_path(scene.output, "_normal.png"), settings.output_bits) && is_written;
+        is_written = depths.write(sibling_path(scene.output, "_depth.png"), settings.output_bits) && is_written;
+        is_written = albedo.write(sibling_path(scene.output, "_albedo.png"), settings.output_bits) && is_written;
+    }
+    if (!settings.checkpoint.empty())
+    {
+        string error;
+        if (!accumulation.save(settings.checkpoint, fingerprint, error))
+        {
+            std::cerr << "Cannot save the checkpoint: " << error << std::endl;
+            is_written = false;
+        }
+    }
+
+    if (stats)
+    {
+        stats->render_time = seconds;
+        stats->primary_rays = renderer.camera_rays;
+        stats->secondary_rays = renderer.bounce_rays;
+        stats->shadow_rays = renderer.shadow_rays;
+        stats->peak_image_bytes = image.pixels.size() * sizeof(Pixel) + accumulation.sums.size() * sizeof(Pixel) + accumulation.counts.size() * sizeof(unsigned);
+    }
+    if (settings.verbose)
+    {
+        if (is_out_of_time)
+            std::cout << "Stopped by the time budget of " << settings.time_budget << " s at " << accumulation.min_count() << " to "
+                      << *max_element(accumulation.counts.begin(), accumulation.counts.end()) << " samples per pixel" << std::endl;
+        renderer.print_stats(seconds);
+        if (settings.denoise_passes > 0)
+        {
+            double denoise_time = denoise_stats.setup_time + denoise_stats.filter_time;
+            std::cout << "Denoised in " << denoise_time * 1000 << " ms (" << denoise_stats.setup_time * 1000 << " ms to set up, "
+                      << denoise_stats.filter_time * 1000 << " ms for " << denoise_stats.passes << " passes, "
+                      << (denoise_stats.is_vectorized ? "AVX2" : "scalar") << " on " << thread_count << " threads): "
+                      << image.pixels.size() / denoise_time / 1e6 << " Mpixels/s, "
+                      << denoise_time / seconds * 100 << "% of the render time" << std::endl;
+        }
+    }
+    return is_written;
+}
@@ -0,0 +1,28 @@
+#ifndef PATHTRACER_H
+#define PATHTRACER_H
+
+#include "renderer.h"
+#include "scene.h"
+
+// Monte Carlo path tracer over the scenes of the Whitted renderer, with diffuse bounces, area lights and depth of field.
+// Instead of following one path at a time, it works on wavefronts: the camera rays of a batch of whole pixels are
+// generated at once, then every bounce of all the live paths runs as a sequence of stages over queues held as
+// structures of arrays:
+//   compact and sort by direction -> intersect -> sort by material -> shade -> trace the shadow rays
+// Each stage runs one small loop over many rays on all the cores, so the BVH nodes, the triangles and the materials
+// used by neighbouring rays stay in the caches. Sorting puts the rays that go the same way next to each other before
+// they walk the BVH, and the hits of the same mesh next to each other before they are shaded.
+//
+// Shading follows the materials of the Whitted renderer: the part that is not mirrored or refracted is diffuse.
+// A diffuse hit samples one light (next event estimation) and bounces in a cosine weighted direction, a mirror or a
+// refraction continues the path as in the Whitted renderer. Point lights keep its convention, they light a surface
+// facing them with an irradiance of 1 whatever their distance. Paths stop after settings.max_depth bounces, or
+// earlier by Russian roulette once their throughput is low.
+//
+// The render is progressive: passes add settings.pass_samples to every pixel until each has samples_per_pixel, into
+// sums that are averaged into the image. Every settings.save_interval seconds the image is written as a preview and
+// the sums are saved to settings.checkpoint, from which a later run resumes, also with more samples per pixel. Once
+// settings.time_budget seconds have passed the render stops and writes what it has. Prints samples per second per core.
+bool render_path_traced(const Scene& scene, const RenderSettings& settings, RenderStats* stats = nullptr);
+
+#endif
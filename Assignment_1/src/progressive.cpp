@@ -0,0 +1,184 @@
+#include "progressive.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace
+{
+    const uint32_t checkpoint_magic = 0x54504b43; // "CKPT"
+    const uint32_t checkpoint_version = 2;
+
+    struct CheckpointHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint64_t fingerprint;
+        uint64_t total_samples; // Sum of the counts, checked after reading them
+    };
+
+    void hash_bytes(uint64_t& hash, const char* data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= uint8_t(data[i]);
+            hash *= 1099511628211ull;
+        }
+    }
+}
+
+void Accumulation::resolve(Framebuffer& image) const
+{
+    for (size_t k = 0; k < sums.size(); k++)
+    {
+        float scale = counts[k] > 0 ? 1.f / counts[k] : 0;
+        image.pixels[k] = Pixel(sums[k].r * scale, sums[k].g * scale, sums[k].b * scale, sums[k].a * scale);
+    }
+}
+
+void Accumulation::resolve_guides(Framebuffer& normal_depth, Framebuffer& albedo) const
+{
+    for (size_t k = 0; k < sums.size(); k++)
+    {
+        const Pixel& n = normal_depth_sums[k];
+        const Pixel& a = albedo_sums[k];
+        float length = sqrt(n.r * n.r + n.g * n.g + n.b * n.b);
+        float normal_scale = length > 0 ? 1 / length : 0;
+        float scale = counts[k] > 0 ? 1.f / counts[k] : 0;
+        normal_depth.pixels[k] = Pixel(n.r * normal_scale, n.g * normal_scale, n.b * normal_scale, n.a * scale);
+        albedo.pixels[k] = Pixel(a.r * scale, a.g * scale, a.b * scale, 1);
+    }
+}
+
+unsigned Accumulation::min_count() const
+{
+    return counts.empty() ? 0 : *min_element(counts.begin(), counts.end());
+}
+
+long long Accumulation::total_samples() const
+{
+    long long total = 0;
+    for (unsigned count : counts)
+        total += count;
+    return total;
+}
+
+bool Accumulation::save(const string& path, uint64_t fingerprint, string& error) const
+{
+    CheckpointHeader header = {};
+    header.magic = checkpoint_magic;
+    header.version = checkpoint_version;
+    header.width = width;
+    header.height = height;
+    header.fingerprint = fingerprint;
+    header.total_samples = total_samples();
+
+    const string temporary_path = path + ".tmp";
+    {
+        ofstream file(temporary_path, ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(Pixel));
+        file.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(unsigned));
+        file.write(reinterpret_cast<const char*>(normal_depth_sums.data()), normal_depth_sums.size() * sizeof(Pixel));
+        file.write(reinterpret_cast<const char*>(albedo_sums.data()), albedo_sums.size() * sizeof(Pixel));
+        if (!file)
+        {
+            file.close();
+            remove(temporary_path.c_str());
+            error = "cannot write " + temporary_path;
+            return false;
+        }
+    }
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    if (rename(temporary_path.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary_path.c_str());
+        error = "cannot rename " + temporary_path + " to " + path;
+        return false;
+    }
+    return true;
+}
+
+bool Accumulation::load(const string& path, uint64_t fingerprint, string& error)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    CheckpointHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != checkpoint_magic || header.version != checkpoint_version)
+    {
+        error = path + " is not a checkpoint";
+        return false;
+    }
+    if (header.width != uint32_t(width) || header.height != uint32_t(height))
+    {
+        error = path + " is a checkpoint of a " + to_string(header.width) + "x" + to_string(header.height) + " image";
+        return false;
+    }
+    if (header.fingerprint != fingerprint)
+    {
+        error = path + " was written for another scene file, other mesh files or other render settings";
+        return false;
+    }
+
+    vector<Pixel> file_sums(sums.size());
+    vector<unsigned> file_counts(counts.size());
+    vector<Pixel> file_normal_depth_sums(sums.size()), file_albedo_sums(sums.size());
+    file.read(reinterpret_cast<char*>(file_sums.data()), file_sums.size() * sizeof(Pixel));
+    file.read(reinterpret_cast<char*>(file_counts.data()), file_counts.size() * sizeof(unsigned));
+    file.read(reinterpret_cast<char*>(file_normal_depth_sums.data()), file_normal_depth_sums.size() * sizeof(Pixel));
+    file.read(reinterpret_cast<char*>(file_albedo_sums.data()), file_albedo_sums.size() * sizeof(Pixel));
+    long long total = 0;
+    for (unsigned count : file_counts)
+        total += count;
+    if (!file || file.peek() != EOF || uint64_t(total) != header.total_samples)
+    {
+        error = path + " is damaged";
+        return false;
+    }
+    sums.swap(file_sums);
+    counts.swap(file_counts);
+    normal_depth_sums.swap(file_normal_depth_sums);
+    albedo_sums.swap(file_albedo_sums);
+    return true;
+}
+
+uint64_t checkpoint_fingerprint(const string& scene_path, const vector<string>& mesh_paths, const vector<double>& settings)
+{
+    uint64_t hash = 14695981039346656037ull;
+    ifstream file(scene_path, ios::binary);
+    if (file)
+    {
+        string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        hash_bytes(hash, text.data(), text.size());
+    }
+
+    // A mesh can be large, its size and modification time stand for its content
+    for (const string& mesh_path : mesh_paths)
+    {
+        struct stat status;
+        if (stat(mesh_path.c_str(), &status) != 0)
+            continue;
+        int64_t size = status.st_size, mtime = status.st_mtime;
+        hash_bytes(hash, mesh_path.data(), mesh_path.size());
+        hash_bytes(hash, reinterpret_cast<const char*>(&size), sizeof(size));
+        hash_bytes(hash, reinterpret_cast<const char*>(&mtime), sizeof(mtime));
+    }
+    for (double value : settings)
+        hash_bytes(hash, reinterpret_cast<const char*>(&value), sizeof(value));
+    return hash;
+}
@@ -0,0 +1,51 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "image.h"
+
+// Sums of the samples of every pixel of a progressive render and how many samples each pixel has. The random numbers
+// of a sample follow from its pixel and its number, so the counts are all the state needed to continue the render:
+// sample n of a pixel is the same whether it is traced in one run or after a resume.
+class Accumulation
+{
+public:
+    int width;
+    int height;
+    std::vector<Pixel> sums; // Color and coverage, not divided by the counts
+    std::vector<unsigned> counts;
+
+    // Sums of the guides of the denoiser: normal and depth, and albedo, of the first diffuse surface of every sample
+    std::vector<Pixel> normal_depth_sums;
+    std::vector<Pixel> albedo_sums;
+
+    Accumulation(int width, int height)
+        : width(width), height(height), sums(std::size_t(width) * height), counts(std::size_t(width) * height, 0),
+          normal_depth_sums(std::size_t(width) * height), albedo_sums(std::size_t(width) * height) {}
+
+    // Average of the samples of every pixel, pixels without samples are transparent black
+    void resolve(Framebuffer& image) const;
+
+    // Average of the guides of every pixel, with the normals scaled back to unit length
+    void resolve_guides(Framebuffer& normal_depth, Framebuffer& albedo) const;
+
+    unsigned min_count() const;
+    long long total_samples() const;
+
+    // Binary checkpoint: a header with the size, the fingerprint and the samples, then the sums, the counts and the
+    // sums of the guides in the byte order of the machine. It is written to path + ".tmp" and renamed, so a render killed while it saves keeps
+    // the previous checkpoint.
+    bool save(const std::string& path, std::uint64_t fingerprint, std::string& error) const;
+
+    // Returns false with a message if the file cannot be read, is damaged, or was written for another fingerprint or size
+    bool load(const std::string& path, std::uint64_t fingerprint, std::string& error);
+};
+
+// FNV-1a hash of the scene file, of the paths, sizes and modification times of its mesh files, then of the given
+// numbers. Files that cannot be read are skipped. Ties a checkpoint to the scene, to the meshes it reads and to the
+// settings that change what a sample is.
+std::uint64_t checkpoint_fingerprint(const std::string& scene_path, const std::vector<std::string>& mesh_paths, const std::vector<double>& settings);
+
+#endif
@@ -0,0 +1,363 @@
+#include "renderer.h"
+#include "antialias.h"
+#include "image.h"
+#include "instrument.h"
+#include "pathtracer.h"
+#include "tracer.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // The geometry of a scene in the precision of copy: the geometry itself if it already is, otherwise copy made from it
+    template <typename Geometry, typename Copy>
+    const Copy& in_precision(const Geometry& geometry, Copy& copy)
+    {
+        if constexpr (is_base_of<Copy, Geometry>::value)
+            return geometry;
+        else
+        {
+            copy.assign(geometry);
+            return copy;
+        }
+    }
+}
+
+void print_ray_throughput(long long rays, chrono::steady_clock::time_point start, int packet_size)
+{
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << rays << " primary rays in " << seconds * 1000 << " ms: " << rays / seconds / 1e6 << " Mrays/s";
+    if (packet_size > 1)
+        std::cout << " (packets of " << packet_size << " rays)" << std::endl;
+    else
+        std::cout << " (single rays)" << std::endl;
+}
+
+bool render_region(const Camera& camera, const RenderSettings& settings, Tile& region, string& error)
+{
+    region = Tile{0, camera.width, 0, camera.height, 0};
+    const Tile& crop = settings.crop;
+    if (crop.x_end <= crop.x_begin || crop.y_end <= crop.y_begin)
+        return true;
+    if (crop.x_begin < 0 || crop.y_begin < 0 || crop.x_end > camera.width || crop.y_end > camera.height)
+    {
+        error = "crop window " + to_string(crop.x_begin) + " " + to_string(crop.y_begin) + " " + to_string(crop.x_end - crop.x_begin) + " "
+              + to_string(crop.y_end - crop.y_begin) + " is not inside the " + to_string(camera.width) + "x" + to_string(camera.height) + " image";
+        return false;
+    }
+    region = crop;
+    region.thread = 0;
+    return true;
+}
+
+template <typename Scalar>
+BasicTileRenderer<Scalar>::BasicTileRenderer(const Scene& scene, const RenderSettings& settings, const Tile& region, int thread_count)
+    : bvh(in_precision(scene.bvh, bvh_copy)), instances(in_precision(scene.instances, instances_copy)),
+      tracer(bvh, scene.mesh_materials, scene.light_positions, scene.light_powers, thread_count),
+      sampler(region, settings.max_samples, settings.aa_threshold, settings.aa_time_budget, settings.sample_map),
+      thread_stats(thread_count),
+#ifdef INSTRUMENT_RENDER
+      costs(region),
+#endif
+      scene(scene), settings(settings)
+{
+    // Lights, shadows, reflections and refractions
+    tracer.instances = &instances;
+    tracer.instance_materials = scene.instance_materials;
+    for (const Vector4d& sphere : scene.spheres)
+        tracer.spheres.push_back(sphere.cast<Scalar>());
+    tracer.sphere_materials = scene.sphere_materials;
+    tracer.budget.max_depth = settings.max_depth;
+    tracer.budget.max_rays = settings.ray_budget;
+    tracer.budget.roulette_weight = settings.roulette_weight;
+    tracer.light_selection.lights = settings.light_samples;
+    tracer.light_selection.is_top_k = settings.light_top_k;
+    tracer.fit_epsilon();
+
+    origin = scene.camera.position;
+    ray_origin = origin.cast<Scalar>();
+    scene.camera.pixel_rays(direction, x_displacement, y_displacement);
+}
+
+template <typename Scalar>
+void BasicTileRenderer<Scalar>::shade(Pixel& pixel, int thread, unsigned seed, const Vector3& ray_direction, bool is_intersected, const Hit& hit)
+{
+    if(is_intersected)
+    {
+        Vector3 color = tracer.shade(thread, seed, ray_origin, ray_direction, hit);
+
+        // Disable the alpha mask for this pixel
+        pixel = Pixel(color(0), color(1), color(2), 1);
+    }
+}
+
+template <typename Scalar>
+void BasicTileRenderer<Scalar>::render(const Tile& tile, BandPixels& pixels)
+{
+    const Camera& camera = scene.camera;
+    unsigned pixel_count = unsigned(camera.width) * camera.height;
+
+    // With anti-aliasing the first samples are kept for a ring of pixels around the tile too, then refined
+    unique_ptr<SampleTile> first;
+    if (sampler.is_enabled())
+        first.reset(new SampleTile(tile, camera.width, camera.height));
+    const Tile& traced = first ? first->traced : tile;
+    auto first_sample = [&](unsigned i, unsigned j) -> Pixel& { return first ? (*first)(i, j) : pixels(i, j); };
+
+#ifdef INSTRUMENT_RENDER
+    // The ring belongs to the neighbouring tiles, what it costs is not counted
+    CostProbe<Scalar> probe(costs, tracer, thread_stats[tile.thread], tile.thread);
+    auto is_in_tile = [&](unsigned i, unsigned j) { return int(i) >= tile.x_begin && int(i) < tile.x_end && int(j) >= tile.y_begin && int(j) < tile.y_end; };
+    auto stop_probe = [&](const unsigned* i, const unsigned* j, int count)
+    {
+        unsigned tile_i[max_packet_size], tile_j[max_packet_size];
+        int tile_count = 0;
+        for (int k = 0; k < count; k++)
+        {
+            if (is_in_tile(i[k], j[k]))
+            {
+                tile_i[tile_count] = i[k];
+                tile_j[tile_count++] = j[k];
+            }
+        }
+        if (tile_count > 0)
+            probe.stop(tile_i, tile_j, tile_count);
+        else
+            probe.start();
+    };
+    auto set_mesh = [&](unsigned i, unsigned j, bool is_intersected, const Hit& hit)
+    {
+        if (is_in_tile(i, j))
+            costs(i, j).mesh = is_intersected ? hit.mesh : CostMap::background;
+    };
+#endif
+    trace_primary_rays<Scalar>(traced, settings.packet_size, origin, direction, x_displacement, y_displacement,
+        [&](unsigned i, unsigned j, const Vector3d& direction)
+        {
+            // Get the nearest triangle from the BVH, or a closer sphere
+            Vector3 ray_direction = direction.cast<Scalar>();
+            Hit hit;
+            bool is_intersected = tracer.intersect(ray_origin, ray_direction, 100, hit, &thread_stats[tile.thread]);
+            shade(first_sample(i, j), tile.thread, j * camera.width + i, ray_direction, is_intersected, hit);
+#ifdef INSTRUMENT_RENDER
+            set_mesh(i, j, is_intersected, hit);
+            stop_probe(&i, &j, 1);
+#endif
+        },
+        [&](const auto& packet, const unsigned* i, const unsigned* j)
+        {
+            Hit hit[max_packet_size];
+            bool is_intersected[max_packet_size];
+            bvh.intersect_packet(packet, 100, hit, is_intersected, &thread_stats[tile.thread]);
+#ifdef INSTRUMENT_RENDER
+            // The lanes share the traversal of the packet, then pay for their own shading
+            stop_probe(i, j, packet.size);
+#endif
+            for (int lane = 0; lane < packet.size; lane++)
+            {
+                Vector3 ray_direction(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+                tracer.intersect_instances_and_spheres(ray_origin, ray_direction, 100, hit[lane], is_intersected[lane], &thread_stats[tile.thread]);
+                shade(first_sample(i[lane], j[lane]), tile.thread, j[lane] * camera.width + i[lane], ray_direction, is_intersected[lane], hit[lane]);
+#ifdef INSTRUMENT_RENDER
+                set_mesh(i[lane], j[lane], is_intersected[lane], hit[lane]);
+                stop_probe(&i[lane], &j[lane], 1);
+#endif
+            }
+        });
+
+    if (first)
+    {
+        sampler.refine(tile, *first, pixels, [&](int i, int j, float u, float v, int sample)
+        {
+            Vector3 ray_direction = (direction + (i + u) * x_displacement + (j + v) * y_displacement).normalized().template cast<Scalar>();
+            Hit hit;
+            bool is_intersected = tracer.intersect(ray_origin, ray_direction, 100, hit, &thread_stats[tile.thread]);
+            Pixel pixel;
+            shade(pixel, tile.thread, j * camera.width + i + sample * pixel_count, ray_direction, is_intersected, hit);
+#ifdef INSTRUMENT_RENDER
+            unsigned pixel_i = i, pixel_j = j;
+            probe.stop(&pixel_i, &pixel_j, 1);
+#endif
+            return pixel;
+        });
+    }
+}
+
+template class BasicTileRenderer<double>;
+template class BasicTileRenderer<float>;
+
+namespace
+{
+    template <typename Scalar>
+    bool render_scene_in(const Scene& scene, const RenderSettings& settings, RenderStats* stats)
+    {
+        if (settings.verbose)
+        {
+            std::cout << "Scene " << scene.path << ": " << scene.mesh_materials.size() << " meshes, " << scene.spheres.size() << " spheres, "
+                      << scene.light_positions.size() << " lights" << std::endl;
+            scene.bvh.print_summary();
+            scene.instances.print_summary();
+        }
+
+        const Camera& camera = scene.camera;
+        string error;
+        Tile region;
+        unique_ptr<ImageWriter> writer;
+        if (render_region(camera, settings, region, error))
+            writer = open_image_writer(scene.output, region.x_end - region.x_begin, region.y_end - region.y_begin, settings.output_bits, error);
+        if (!writer)
+        {
+            std::cerr << scene.path << ": " << error << std::endl;
+            return false;
+        }
+        const long long pixel_count = (long long)(region.x_end - region.x_begin) * (region.y_end - region.y_begin);
+
+        // The rows of tiles are finished from top to bottom and written as soon as they are done,
+        // so the whole image is never in memory. With strips, the rows being rendered are those of one strip.
+        TileScheduler scheduler(settings.thread_count, settings.tile_size);
+        scheduler.scanline_order = true;
+        scheduler.strip_height = settings.strip_height;
+        StreamingFramebuffer framebuffer(region, scheduler.tile_size, *writer);
+
+        // One set of counters per thread, merged after rendering
+        auto copy_start = chrono::steady_clock::now();
+        BasicTileRenderer<Scalar> renderer(scene, settings, region, scheduler.thread_count);
+        const BasicTracer<Scalar>& tracer = renderer.tracer;
+        const AdaptiveSampler& sampler = renderer.sampler;
+        if (settings.verbose && renderer.copy_bytes() > 0)
+            std::cout << "Tracing in float: geometry copied in " << chrono::duration<double, milli>(chrono::steady_clock::now() - copy_start).count()
+                      << " ms, " << renderer.copy_bytes() / 1e6 << " MB, ray epsilon " << tracer.epsilon << std::endl;
+
+        auto start = chrono::steady_clock::now();
+        scheduler.render(region, [&](const Tile& tile)
+        {
+            BandPixels pixels = framebuffer.begin_tile(tile);
+            renderer.render(tile, pixels);
+            framebuffer.end_tile(tile);
+        });
+        bool is_written = framebuffer.close();
+        double render_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (stats)
+        {
+            stats->render_time = render_time;
+            stats->primary_rays = pixel_count + sampler.rays_added();
+            BounceStats bounce_stats = tracer.bounce_totals();
+            stats->secondary_rays = 0;
+            for (int depth = 1; depth < bounce_stats.rays.size(); depth++)
+                stats->secondary_rays += bounce_stats.rays[depth];
+            stats->shadow_rays = tracer.shadow_totals().rays;
+            stats->peak_image_bytes = framebuffer.peak_bytes();
+        }
+
+        if (settings.verbose)
+        {
+            print_ray_throughput(pixel_count + sampler.rays_added(), start, settings.packet_size);
+            scheduler.print_timings();
+            if (sampler.is_enabled())
+                sampler.print_stats();
+
+            TraversalStats traversal_stats;
+            for (const TraversalStats& stats : renderer.thread_stats)
+                traversal_stats += stats;
+            std::cout << "Average BVH nodes visited per ray: " << double(traversal_stats.nodes_visited) / traversal_stats.rays
+                      << ", triangle tests per ray: " << double(traversal_stats.triangle_tests) / traversal_stats.rays << std::endl;
+
+            tracer.print_stats();
+
+            std::cout << "Image written while rendering, at most " << framebuffer.peak_bytes() / 1e6 << " MB of it in memory" << std::endl;
+        }
+        if (settings.sample_map && sampler.is_enabled())
+            is_written = sampler.write_sample_map(sibling_path(scene.output, "_samples.png")) && is_written;
+#ifdef INSTRUMENT_RENDER
+        // Heatmaps next to the image, and which meshes the primary rays hit and what tracing them cost
+        is_written = renderer.costs.write_heatmaps(scene.output) && is_written;
+        if (settings.verbose)
+        {
+            TraversalStats all_rays = tracer.secondary_totals();
+            all_rays += tracer.shadow_totals();
+            for (const TraversalStats& stats : renderer.thread_stats)
+                all_rays += stats;
+            renderer.costs.print_mesh_table(scene, all_rays);
+        }
+#endif
+
+        if (!is_written)
+            std::cerr << "Could not write " << scene.output << std::endl;
+        return is_written;
+    }
+}
+
+bool render_scene(const Scene& scene, const RenderSettings& settings, RenderStats* stats)
+{
+    return settings.float_precision ? render_scene_in<float>(scene, settings, stats) : render_scene_in<double>(scene, settings, stats);
+}
+
+bool render_animation(Scene& scene, const RenderSettings& settings)
+{
+    if (settings.verbose)
+    {
+        std::cout << "Animation " << scene.path << ": " << scene.frames << " frames, " << scene.animations.size() << " moving meshes of "
+                  << scene.mesh_materials.size() << ", subtrees rebuilt above " << settings.rebuild_threshold * 100 << "% more SAH cost" << std::endl;
+        scene.bvh.print_summary();
+        scene.instances.print_summary();
+    }
+
+    // The frames print one line each instead of the statistics of a render
+    RenderSettings frame_settings = settings;
+    frame_settings.verbose = false;
+
+    double refit_time = 0, rebuild_time = 0, trace_time = 0;
+    int full_rebuilds = 0;
+    bool is_written = true;
+    for (int frame = 0; frame < scene.frames; frame++)
+    {
+        BVHUpdate update;
+        if (frame > 0)
+            update = animate_scene(scene, frame, settings.rebuild_threshold);
+        refit_time += update.refit_time;
+        rebuild_time += update.rebuild_time;
+        full_rebuilds += update.is_full_rebuild;
+
+        string output = frame_output(scene, frame);
+        swap(scene.output, output);
+        if (!settings.checkpoint.empty())
+        {
+            // One checkpoint per frame, so an interrupted animation resumes every frame where it stopped
+            string number = to_string(frame);
+            frame_settings.checkpoint = settings.checkpoint + "_" + string(max(0, 4 - int(number.size())), '0') + number;
+        }
+        RenderStats stats;
+        bool is_frame_written = settings.path_tracing ? render_path_traced(scene, frame_settings, &stats) : render_scene(scene, frame_settings, &stats);
+        is_written = is_frame_written && is_written;
+        swap(scene.output, output);
+        trace_time += stats.render_time;
+
+        std::cout << "Frame " << frame << ": ";
+        if (frame == 0)
+            std::cout << "BVH built in " << scene.bvh.build_time * 1000 << " ms";
+        else
+        {
+            std::cout << "refit in " << update.refit_time * 1000 << " ms, SAH cost x" << update.refit_cost;
+            if (update.is_full_rebuild)
+                std::cout << ", full rebuild in " << update.rebuild_time * 1000 << " ms";
+            else if (update.subtrees_rebuilt > 0)
+                std::cout << ", " << update.subtrees_rebuilt << " subtrees of " << update.triangles_rebuilt << " triangles rebuilt in "
+                          << update.rebuild_time * 1000 << " ms";
+            if (update.is_full_rebuild || update.subtrees_rebuilt > 0)
+                std::cout << ", then x" << update.cost;
+        }
+        std::cout << ", traced in " << stats.render_time * 1000 << " ms" << std::endl;
+    }
+
+    std::cout << scene.frames << " frames: refit " << refit_time * 1000 << " ms, rebuild " << rebuild_time * 1000 << " ms (" << full_rebuilds
+              << " full rebuilds), trace " << trace_time * 1000 << " ms" << std::endl;
+    return is_written;
+}
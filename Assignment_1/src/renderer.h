@@ -0,0 +1,180 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include "antialias.h"
+#include "image.h"
+#include "instrument.h"
+#include "packet.h"
+#include "parallel.h"
+#include "scene.h"
+
+// Options of the renderer, set from the command line
+struct RenderSettings
+{
+    int thread_count; // Render threads, 0 uses all the cores
+    int tile_size;    // Tile side in pixels
+    int packet_size;  // Primary rays traced together: 1 (single rays), 4 (2x2 pixels) or 8 (4x2 pixels)
+    int max_depth;    // Bounces after the primary ray
+    int ray_budget;   // Secondary rays per pixel
+    double roulette_weight; // Weight below which the Whitted renderer plays Russian roulette with secondary rays, 0 for never
+    int output_bits;  // Bits per channel of the PNG and PPM images
+    bool verbose;     // Print the statistics of every render
+    double rebuild_threshold; // Growth of the SAH cost of a subtree after a refit above which it is rebuilt, 0.3 is 30%
+    int max_samples;          // Samples of the pixels refined by the adaptive anti-aliasing: 1 (off), 4, 16 or 64
+    double aa_threshold;      // Difference of a channel with a neighbour, then standard error, above which a pixel is refined
+    double aa_time_budget;    // Seconds after which no more pixels are refined, 0 for no limit
+    bool sample_map;          // Write the samples of every pixel next to the image, as <name>_samples.png
+    bool path_tracing;        // Render with the wavefront path tracer instead of the Whitted renderer
+    int samples_per_pixel;    // Paths per pixel of the path tracer
+    int wavefront_size;       // Paths traced together by the path tracer
+    bool sort_rays;           // Sort the rays of the path tracer by direction and by material between the stages
+    int pass_samples;         // Samples added to every pixel by a pass of the path tracer
+    double time_budget;       // Seconds after which the path tracer stops and writes the samples it has, 0 for no limit
+    double save_interval;     // Seconds between the preview images and checkpoints of the path tracer, 0 for none
+    std::string checkpoint;   // File the path tracer resumes from if it exists and saves to, empty for none
+    int denoise_passes;       // Passes of the denoiser over the path traced images, 0 for none
+    bool write_guides;        // Write the normals, depths and albedos of the path tracer next to the image
+    int workers;              // Worker processes started to render the tiles, 0 for none
+    std::string listen_address; // Where the coordinator waits for workers, a Unix socket path or [host:]port
+    double worker_timeout;    // Seconds a worker may spend on a tile before it is dropped, 0 for no limit
+    int fail_after;           // Tiles after which a worker exits, for tests, 0 for never
+    double tile_delay;        // Seconds a worker sleeps after every tile, for tests
+    int width, height;        // Image size replacing the resolution of the scene files, 0 to keep it
+    Tile crop;                // Pixels of the camera image that are rendered and written, all of them when empty
+    int strip_height;         // Rows of the image rendered at a time by the Whitted renderer, 0 for all of them
+    bool float_precision;     // Trace and shade in float instead of double with the Whitted renderer
+    int light_samples;        // Point lights evaluated per shading point by the Whitted renderer, chosen with a light tree, 0 for all of them
+    bool light_top_k;         // Evaluate the light_samples most important lights instead of drawing them at random
+
+    RenderSettings() : thread_count(0), tile_size(32), packet_size(1), max_depth(8), ray_budget(16), roulette_weight(0), output_bits(8), verbose(true), rebuild_threshold(0.3),
+                       max_samples(1), aa_threshold(0.1), aa_time_budget(0), sample_map(false), path_tracing(false), samples_per_pixel(16),
+                       wavefront_size(1 << 18), sort_rays(true), pass_samples(1), time_budget(0), save_interval(30),
+                       denoise_passes(0), write_guides(false), workers(0), worker_timeout(30), fail_after(0), tile_delay(0),
+                       width(0), height(0), crop(), strip_height(0), float_precision(false), light_samples(0), light_top_k(false) {}
+};
+
+// Measurements of one call to render_scene()
+struct RenderStats
+{
+    double render_time; // Seconds spent tracing and writing the image, without loading the scene
+    long long primary_rays; // With the ring around the tiles and the samples added by the anti-aliasing
+    long long secondary_rays; // Reflected and refracted rays
+    long long shadow_rays;
+    std::size_t peak_image_bytes;
+
+    RenderStats() : render_time(0), primary_rays(0), secondary_rays(0), shadow_rays(0), peak_image_bytes(0) {}
+};
+
+// Generate the perspective rays of the pixels of a tile in packets of N rays, Width pixels wide.
+// The directions are computed in double and stored in Scalar.
+template <int N, int Width, typename Scalar, typename TracePacket>
+void trace_packets(const Tile& tile, const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const Eigen::Vector3d& x_displacement, const Eigen::Vector3d& y_displacement, TracePacket& trace_packet)
+{
+    for (unsigned i0=tile.x_begin;i0<tile.x_end;i0+=Width)
+    {
+        for (unsigned j0=tile.y_begin;j0<tile.y_end;j0+=N/Width)
+        {
+            RayPacket<N, Scalar> packet;
+            unsigned i[N], j[N];
+            for (int lane = 0; lane < N; lane++)
+            {
+                // Lanes that fall outside of the tile repeat its last pixel
+                i[lane] = std::min(i0 + lane % Width, unsigned(tile.x_end - 1));
+                j[lane] = std::min(j0 + lane / Width, unsigned(tile.y_end - 1));
+                Eigen::Vector3d ray_direction = (direction + double(i[lane])*x_displacement + double(j[lane])*y_displacement).normalized();
+                packet.ox[lane] = origin(0);
+                packet.oy[lane] = origin(1);
+                packet.oz[lane] = origin(2);
+                packet.dx[lane] = ray_direction(0);
+                packet.dy[lane] = ray_direction(1);
+                packet.dz[lane] = ray_direction(2);
+            }
+            trace_packet(packet, i, j);
+        }
+    }
+}
+
+// Trace the perspective rays of the pixels of a tile, one at a time with trace_ray(i, j, ray_direction)
+// or in packets of packet_size rays with trace_packet(packet, i, j) where i and j hold the pixel of each lane.
+// The packets are in Scalar, the single rays in double.
+template <typename Scalar = double, typename TraceRay, typename TracePacket>
+void trace_primary_rays(const Tile& tile, int packet_size, const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const Eigen::Vector3d& x_displacement, const Eigen::Vector3d& y_displacement, TraceRay trace_ray, TracePacket trace_packet)
+{
+    if (packet_size == 4)
+        trace_packets<4, 2, Scalar>(tile, origin, direction, x_displacement, y_displacement, trace_packet);
+    else if (packet_size == 8)
+        trace_packets<8, 4, Scalar>(tile, origin, direction, x_displacement, y_displacement, trace_packet);
+    else
+    {
+        for (unsigned i=tile.x_begin;i<tile.x_end;i++)
+            for (unsigned j=tile.y_begin;j<tile.y_end;j++)
+                trace_ray(i, j, (direction + double(i)*x_displacement + double(j)*y_displacement).normalized());
+    }
+}
+
+// Pixels of the camera image rendered with the settings: the crop window, or the whole image. The rays of a crop are
+// those of its pixels in the whole image, so it is the same as that part of a render of the whole image.
+// Returns false with a message if the crop window is not inside the image.
+bool render_region(const Camera& camera, const RenderSettings& settings, Tile& region, std::string& error);
+
+// Print how many millions of primary rays per second were traced since start
+void print_ray_throughput(long long rays, std::chrono::steady_clock::time_point start, int packet_size);
+
+// Renders tiles of a scene with the Tracer: the primary rays, one at a time or in packets, their shading, and the
+// samples added by the adaptive anti-aliasing. The tiles are independent, any of thread_count threads renders one.
+// Tiles are in the pixels of the camera image, region holds those of the sample map and of the cost map.
+// Scalar is the precision of the rays, double or float; a float renderer traces its own copy of the geometry.
+template <typename Scalar>
+class BasicTileRenderer
+{
+    // The BVH and the instances of the scene in Scalar, the copies are empty in double
+    BasicBVH<Scalar> bvh_copy;
+    BasicInstanceBVH<Scalar> instances_copy;
+    const BasicBVH<Scalar>& bvh;
+    const BasicInstanceBVH<Scalar>& instances;
+
+public:
+    typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+
+    BasicTracer<Scalar> tracer;
+    AdaptiveSampler sampler;
+    std::vector<TraversalStats> thread_stats; // Of the primary rays, per thread
+#ifdef INSTRUMENT_RENDER
+    CostMap costs; // Time and traversal work of every pixel
+#endif
+
+    BasicTileRenderer(const Scene& scene, const RenderSettings& settings, const Tile& region, int thread_count);
+
+    // Render the pixels of a tile, they must be transparent black
+    void render(const Tile& tile, BandPixels& pixels);
+
+    // Bytes of the copies of the geometry, 0 in double
+    std::size_t copy_bytes() const { return bvh_copy.memory_bytes() + instances_copy.memory_bytes(); }
+
+private:
+    const Scene& scene;
+    const RenderSettings& settings;
+    Eigen::Vector3d origin, direction, x_displacement, y_displacement;
+    Vector3 ray_origin;
+
+    // Shade a sample from the nearest triangle or sphere hit by its ray, seed numbers the sample in the image
+    void shade(Pixel& pixel, int thread, unsigned seed, const Vector3& ray_direction, bool is_intersected, const Hit& hit);
+};
+
+typedef BasicTileRenderer<double> TileRenderer;
+
+// Render a scene with the Tracer, in float with settings.float_precision. Its image is written while it is rendered.
+// Returns false if it cannot be written.
+bool render_scene(const Scene& scene, const RenderSettings& settings, RenderStats* stats = nullptr);
+
+// Render every frame of an animated scene, moving its meshes and updating the BVH between frames.
+// Prints the time spent building, refitting, rebuilding and tracing for each frame and for the whole animation.
+bool render_animation(Scene& scene, const RenderSettings& settings);
+
+#endif
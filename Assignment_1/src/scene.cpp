@@ -0,0 +1,635 @@
+#include "scene.h"
+#include "mesh_io.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <Eigen/Geometry>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Directory of a file, with its trailing separator, empty for a file in the working directory
+    string directory_of(const string& path)
+    {
+        size_t separator = path.find_last_of("/\\");
+        return separator == string::npos ? string() : path.substr(0, separator + 1);
+    }
+
+    bool is_absolute(const string& path)
+    {
+        return !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+    }
+
+    bool read_vector(istringstream& line, Vector3d& v)
+    {
+        return bool(line >> v(0) >> v(1) >> v(2));
+    }
+
+    // Reads a scene file statement by statement, the first error stops the parse
+    class SceneParser
+    {
+    public:
+        SceneParser(const string& path, MeshLibrary& library, Scene& scene)
+            : path(path), library(library), scene(scene) {}
+
+        bool parse(istream& file, string& error);
+
+    private:
+        const string& path;
+        MeshLibrary& library;
+        Scene& scene;
+
+        map<string, Material> materials;
+        vector<MatrixXd> vertices;
+        vector<MatrixXi> faces;
+
+        // Meshes placed by instance statements, by path, in the order of their first instance
+        map<string, int> instanced_meshes;
+        vector<const Mesh*> instanced_mesh_data;
+        vector<string> instanced_mesh_names;
+
+        // Shapes of the shape statements, by their index in the instances
+        vector<Shape> shapes;
+        vector<string> shape_names;
+
+        bool parse_camera(istringstream& line, string& error);
+        bool parse_material(istringstream& line, string& error);
+        bool parse_light(istringstream& line, string& error);
+        bool parse_mesh(istringstream& line, string& error);
+        bool parse_instance(istringstream& line, string& error);
+        bool parse_shape(istringstream& line, string& error);
+
+        // Transforms of a mesh, an instance or a shape, in the order they are applied, composed into x -> linear * x + translation.
+        // The repeat of an instance is read only if repeat_count is given.
+        // The motions of an animated mesh are read only if animation is given.
+        bool read_transforms(istringstream& line, const MatrixXd& vertices, Matrix3d& linear, Vector3d& translation, Vector3i* repeat_count, Vector3d* repeat_step, MeshAnimation* animation, string& error);
+        bool find_material(const string& name, Material& material, string& error) const;
+
+        // Record a file in Scene::mesh_files unless it is there already
+        void add_mesh_file(const string& mesh_path);
+    };
+
+    bool SceneParser::parse(istream& file, string& error)
+    {
+        string text;
+        for (int line_number = 1; getline(file, text); line_number++)
+        {
+            size_t comment = text.find('#');
+            if (comment != string::npos)
+                text.erase(comment);
+            istringstream line(text);
+            string keyword;
+            if (!(line >> keyword))
+                continue;
+
+            bool is_valid = true;
+            if (keyword == "output")
+                is_valid = bool(line >> scene.output);
+            else if (keyword == "frames")
+                is_valid = line >> scene.frames && scene.frames > 0;
+            else if (keyword == "resolution")
+                is_valid = line >> scene.camera.width >> scene.camera.height && scene.camera.width > 0 && scene.camera.height > 0;
+            else if (keyword == "camera")
+                is_valid = parse_camera(line, error);
+            else if (keyword == "light")
+                is_valid = parse_light(line, error);
+            else if (keyword == "area_light")
+            {
+                AreaLight light;
+                is_valid = read_vector(line, light.corner) && read_vector(line, light.edge1) && read_vector(line, light.edge2) && read_vector(line, light.radiance)
+                           && light.edge1.cross(light.edge2).norm() > 0;
+                scene.area_lights.push_back(light);
+            }
+            else if (keyword == "material")
+                is_valid = parse_material(line, error);
+            else if (keyword == "sphere")
+            {
+                Vector4d sphere;
+                string material_name;
+                Material material;
+                is_valid = line >> sphere(0) >> sphere(1) >> sphere(2) >> sphere(3) >> material_name && find_material(material_name, material, error);
+                scene.spheres.push_back(sphere);
+                scene.sphere_materials.push_back(material);
+            }
+            else if (keyword == "mesh")
+                is_valid = parse_mesh(line, error);
+            else if (keyword == "instance")
+                is_valid = parse_instance(line, error);
+            else if (keyword == "shape")
+                is_valid = parse_shape(line, error);
+            else if (keyword == "quad")
+            {
+                MatrixXd quad_vertices(4, 3);
+                string material_name;
+                Material material;
+                for (int k = 0; k < 4 && is_valid; k++)
+                    is_valid = bool(line >> quad_vertices(k, 0) >> quad_vertices(k, 1) >> quad_vertices(k, 2));
+                is_valid = is_valid && line >> material_name && find_material(material_name, material, error);
+                MatrixXi quad_faces(2, 3);
+                quad_faces << 0, 1, 2,
+                              0, 2, 3;
+                vertices.push_back(quad_vertices);
+                faces.push_back(quad_faces);
+                scene.mesh_materials.push_back(material);
+                scene.mesh_names.push_back("quad");
+            }
+            else
+                error = "unknown statement \"" + keyword + "\"";
+
+            string extra;
+            if (is_valid && error.empty() && line >> extra)
+                error = "unexpected \"" + extra + "\"";
+            if (!is_valid || !error.empty())
+            {
+                if (error.empty())
+                    error = "invalid " + keyword + " statement";
+                error = path + ":" + to_string(line_number) + ": " + error;
+                return false;
+            }
+        }
+
+        if (scene.output.empty())
+        {
+            error = path + ": no output image";
+            return false;
+        }
+
+        scene.bvh.build(vertices, faces);
+        if (!scene.animations.empty())
+        {
+            scene.mesh_vertices = move(vertices);
+            scene.mesh_faces = move(faces);
+        }
+
+        // The instanced meshes are numbered after the others, so that every mesh of the scene has its own Hit::mesh
+        for (int k = 0; k < instanced_mesh_data.size(); k++)
+        {
+            scene.instances.add_mesh(instanced_mesh_data[k]->vertices, instanced_mesh_data[k]->faces, scene.mesh_names.size());
+            scene.mesh_names.push_back(instanced_mesh_names[k]);
+        }
+
+        // Then every shape statement
+        for (int k = 0; k < shapes.size(); k++)
+        {
+            shapes[k].mesh = scene.mesh_names.size();
+            scene.instances.add_shape(shapes[k]);
+            scene.mesh_names.push_back(shape_names[k]);
+        }
+        scene.instances.build();
+        return true;
+    }
+
+    bool SceneParser::parse_camera(istringstream& line, string& error)
+    {
+        string word;
+        while (line >> word)
+        {
+            bool is_valid;
+            if (word == "position")
+                is_valid = read_vector(line, scene.camera.position);
+            else if (word == "target")
+                is_valid = read_vector(line, scene.camera.target);
+            else if (word == "up")
+                is_valid = read_vector(line, scene.camera.up);
+            else if (word == "fov")
+                is_valid = line >> scene.camera.field_of_view && scene.camera.field_of_view > 0 && scene.camera.field_of_view < 180;
+            else if (word == "aperture")
+                is_valid = line >> scene.camera.aperture && scene.camera.aperture >= 0;
+            else if (word == "focus")
+                is_valid = line >> scene.camera.focus_distance && scene.camera.focus_distance > 0;
+            else
+            {
+                error = "unknown camera setting \"" + word + "\"";
+                return false;
+            }
+            if (!is_valid)
+                return false;
+        }
+        return true;
+    }
+
+    bool SceneParser::parse_light(istringstream& line, string& error)
+    {
+        Vector3d position;
+        if (!read_vector(line, position))
+            return false;
+        double power = 0;
+        Vector3i repeat_count(1, 1, 1);
+        Vector3d repeat_step(0, 0, 0);
+        string word;
+        while (line >> word)
+        {
+            bool is_valid;
+            if (word == "power")
+                is_valid = line >> power && power > 0;
+            else if (word == "repeat")
+                is_valid = line >> repeat_count(0) >> repeat_count(1) >> repeat_count(2) && read_vector(line, repeat_step) && repeat_count.minCoeff() > 0;
+            else
+            {
+                error = "unknown light setting \"" + word + "\"";
+                return false;
+            }
+            if (!is_valid)
+                return false;
+        }
+
+        for (int x = 0; x < repeat_count(0); x++)
+            for (int y = 0; y < repeat_count(1); y++)
+                for (int z = 0; z < repeat_count(2); z++)
+                {
+                    scene.light_positions.push_back(position + repeat_step.cwiseProduct(Vector3d(x, y, z)));
+                    scene.light_powers.push_back(power);
+                }
+        return true;
+    }
+
+    bool SceneParser::parse_material(istringstream& line, string& error)
+    {
+        string name;
+        Vector3d color;
+        if (!(line >> name) || !read_vector(line, color))
+            return false;
+
+        Material material(color);
+        string word;
+        while (line >> word)
+        {
+            bool is_valid;
+            if (word == "reflect")
+                is_valid = bool(line >> material.reflectivity);
+            else if (word == "transmit")
+                is_valid = bool(line >> material.transmission);
+            else if (word == "ior")
+                is_valid = line >> material.refractive_index && material.refractive_index > 0;
+            else
+            {
+                error = "unknown material setting \"" + word + "\"";
+                return false;
+            }
+            if (!is_valid)
+                return false;
+        }
+        if (material.reflectivity < 0 || material.transmission < 0 || material.reflectivity + material.transmission > 1)
+        {
+            error = "reflect and transmit must be positive and add up to at most 1";
+            return false;
+        }
+        materials[name] = material;
+        return true;
+    }
+
+    bool SceneParser::parse_mesh(istringstream& line, string& error)
+    {
+        string file_name, material_name;
+        Material material;
+        if (!(line >> file_name >> material_name) || !find_material(material_name, material, error))
+            return false;
+
+        string mesh_path = is_absolute(file_name) ? file_name : directory_of(path) + file_name;
+        const Mesh* mesh = library.get(mesh_path);
+        if (!mesh)
+        {
+            error = "cannot read " + file_name;
+            return false;
+        }
+        add_mesh_file(mesh_path);
+
+        // The transforms are composed, then applied to a copy of the vertices
+        Matrix3d linear;
+        Vector3d translation;
+        MeshAnimation animation;
+        if (!read_transforms(line, mesh->vertices, linear, translation, nullptr, nullptr, &animation, error))
+            return false;
+        MatrixXd V = (mesh->vertices * linear.transpose()).rowwise() + translation.transpose();
+        if (animation.move != Vector3d::Zero() || animation.spin != 0 || animation.wave_amplitude != 0)
+        {
+            animation.mesh = vertices.size();
+            animation.vertices = V;
+            scene.animations.push_back(animation);
+        }
+
+        vertices.push_back(V);
+        faces.push_back(mesh->faces);
+        scene.mesh_materials.push_back(material);
+        scene.mesh_names.push_back(file_name);
+        return true;
+    }
+
+    bool SceneParser::parse_instance(istringstream& line, string& error)
+    {
+        string file_name, material_name;
+        Material material;
+        if (!(line >> file_name >> material_name) || !find_material(material_name, material, error))
+            return false;
+
+        string mesh_path = is_absolute(file_name) ? file_name : directory_of(path) + file_name;
+        const Mesh* mesh = library.get(mesh_path);
+        if (!mesh)
+        {
+            error = "cannot read " + file_name;
+            return false;
+        }
+        add_mesh_file(mesh_path);
+
+        Matrix3d linear;
+        Vector3d translation;
+        Vector3i repeat_count(1, 1, 1);
+        Vector3d repeat_step(0, 0, 0);
+        if (!read_transforms(line, mesh->vertices, linear, translation, &repeat_count, &repeat_step, nullptr, error))
+            return false;
+        if (fabs(linear.determinant()) < 1e-12)
+        {
+            error = "the transform of an instance must be invertible";
+            return false;
+        }
+
+        // The BVH of a mesh is built at the end, once the meshes that are not instanced are counted
+        auto found = instanced_meshes.find(mesh_path);
+        if (found == instanced_meshes.end())
+        {
+            found = instanced_meshes.emplace(mesh_path, instanced_mesh_data.size()).first;
+            instanced_mesh_data.push_back(mesh);
+            instanced_mesh_names.push_back(file_name);
+        }
+
+        int material_i = scene.instance_materials.size();
+        scene.instance_materials.push_back(material);
+        for (int x = 0; x < repeat_count(0); x++)
+            for (int y = 0; y < repeat_count(1); y++)
+                for (int z = 0; z < repeat_count(2); z++)
+                    scene.instances.add_instance(found->second, linear, translation + repeat_step.cwiseProduct(Vector3d(x, y, z)), material_i);
+        return true;
+    }
+
+    bool SceneParser::parse_shape(istringstream& line, string& error)
+    {
+        const char* const type_names[] = {"sphere", "cylinder", "cone", "torus", "revolution"};
+        string type_name, material_name;
+        if (!(line >> type_name))
+            return false;
+        int type = find(begin(type_names), end(type_names), type_name) - begin(type_names);
+        if (type == int(size(type_names)))
+        {
+            error = "unknown shape \"" + type_name + "\"";
+            return false;
+        }
+
+        double minor_radius = 0.25;
+        vector<Vector2d> profile;
+        if (type == torus_shape && !(line >> minor_radius && minor_radius > 0))
+            return false;
+        if (type == revolution_shape)
+        {
+            int count;
+            if (!(line >> count) || count < 2)
+                return false;
+            profile.resize(count);
+            for (Vector2d& point : profile)
+                if (!(line >> point(0) >> point(1)) || point(0) < 0)
+                    return false;
+        }
+        Material material;
+        if (!(line >> material_name) || !find_material(material_name, material, error))
+            return false;
+
+        // ground puts the lowest corner of the box of the shape at its height
+        Shape shape(ShapeType(type), -1, minor_radius, profile);
+        MatrixXd corners(8, 3);
+        for (int corner = 0; corner < 8; corner++)
+            corners.row(corner) << ((corner & 1) ? shape.box_max(0) : shape.box_min(0)), ((corner & 2) ? shape.box_max(1) : shape.box_min(1)),
+                                   ((corner & 4) ? shape.box_max(2) : shape.box_min(2));
+
+        Matrix3d linear;
+        Vector3d translation;
+        Vector3i repeat_count(1, 1, 1);
+        Vector3d repeat_step(0, 0, 0);
+        if (!read_transforms(line, corners, linear, translation, &repeat_count, &repeat_step, nullptr, error))
+            return false;
+        if (fabs(linear.determinant()) < 1e-12)
+        {
+            error = "the transform of a shape must be invertible";
+            return false;
+        }
+
+        // The shapes get their Hit::mesh at the end, after the instanced meshes
+        int shape_i = shapes.size();
+        shapes.push_back(shape);
+        shape_names.push_back(type_name);
+
+        int material_i = scene.instance_materials.size();
+        scene.instance_materials.push_back(material);
+        for (int x = 0; x < repeat_count(0); x++)
+            for (int y = 0; y < repeat_count(1); y++)
+                for (int z = 0; z < repeat_count(2); z++)
+                    scene.instances.add_shape_instance(shape_i, linear, translation + repeat_step.cwiseProduct(Vector3d(x, y, z)), material_i);
+        return true;
+    }
+
+    bool SceneParser::read_transforms(istringstream& line, const MatrixXd& vertices, Matrix3d& linear, Vector3d& translation, Vector3i* repeat_count, Vector3d* repeat_step, MeshAnimation* animation, string& error)
+    {
+        linear.setIdentity();
+        translation.setZero();
+        string word;
+        while (line >> word)
+        {
+            if (word == "scale")
+            {
+                double scale;
+                if (!(line >> scale))
+                    return false;
+
+                // One factor, or one per axis
+                Vector3d axis_scale(scale, 0, 0);
+                streampos position = line.tellg();
+                if (!line.eof() && line >> axis_scale(1) >> axis_scale(2))
+                {
+                    linear = axis_scale.asDiagonal() * linear;
+                    translation = axis_scale.cwiseProduct(translation);
+                    continue;
+                }
+                line.clear();
+                line.seekg(position);
+                linear *= scale;
+                translation *= scale;
+            }
+            else if (word == "rotate")
+            {
+                string axis;
+                double degrees;
+                if (!(line >> axis >> degrees) || (axis != "x" && axis != "y" && axis != "z"))
+                    return false;
+                Vector3d axis_vector = Vector3d::Unit(axis[0] - 'x');
+                Matrix3d rotation = AngleAxisd(degrees * EIGEN_PI / 180, axis_vector).toRotationMatrix();
+                linear = rotation * linear;
+                translation = rotation * translation;
+            }
+            else if (word == "translate")
+            {
+                Vector3d offset;
+                if (!read_vector(line, offset))
+                    return false;
+                translation += offset;
+            }
+            else if (word == "ground")
+            {
+                double ground;
+                if (!(line >> ground))
+                    return false;
+                if (vertices.rows() > 0)
+                    translation(1) += ground - ((vertices * linear.row(1).transpose()).minCoeff() + translation(1));
+            }
+            else if (word == "repeat" && repeat_count)
+            {
+                if (!(line >> (*repeat_count)(0) >> (*repeat_count)(1) >> (*repeat_count)(2)) || !read_vector(line, *repeat_step) || repeat_count->minCoeff() < 1)
+                    return false;
+            }
+            else if (word == "move" && animation)
+            {
+                if (!read_vector(line, animation->move))
+                    return false;
+            }
+            else if (word == "spin" && animation)
+            {
+                string axis;
+                if (!(line >> axis >> animation->spin) || (axis != "x" && axis != "y" && axis != "z"))
+                    return false;
+                animation->spin_axis = axis[0] - 'x';
+            }
+            else if (word == "wave" && animation)
+            {
+                if (!(line >> animation->wave_amplitude >> animation->wave_length) || animation->wave_length <= 0)
+                    return false;
+            }
+            else
+            {
+                error = "unknown " + string(repeat_count ? "instance" : "mesh") + " transform \"" + word + "\"";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool SceneParser::find_material(const string& name, Material& material, string& error) const
+    {
+        auto found = materials.find(name);
+        if (found == materials.end())
+        {
+            error = "unknown material \"" + name + "\"";
+            return false;
+        }
+        material = found->second;
+        return true;
+    }
+
+    void SceneParser::add_mesh_file(const string& mesh_path)
+    {
+        if (find(scene.mesh_files.begin(), scene.mesh_files.end(), mesh_path) == scene.mesh_files.end())
+            scene.mesh_files.push_back(mesh_path);
+    }
+}
+
+void Camera::pixel_rays(Vector3d& direction, Vector3d& x_displacement, Vector3d& y_displacement) const
+{
+    Vector3d forward = (target - position).normalized();
+    Vector3d right = forward.cross(up).normalized();
+    Vector3d image_up = right.cross(forward);
+
+    // Half extents of the image plane at a distance of 1
+    double half_height = tan(field_of_view * EIGEN_PI / 360);
+    double half_width = half_height * width / height;
+
+    direction = forward - half_width * right + half_height * image_up;
+    x_displacement = (2 * half_width / width) * right;
+    y_displacement = (-2 * half_height / height) * image_up;
+}
+
+const Mesh* MeshLibrary::get(const string& path)
+{
+    auto found = meshes.find(path);
+    if (found != meshes.end())
+    {
+        files_reused += found->second != nullptr;
+        return found->second.get();
+    }
+
+    unique_ptr<Mesh> mesh(new Mesh);
+    if (load_off(path, mesh->vertices, mesh->faces))
+        files_loaded++;
+    else
+        mesh.reset();
+    return (meshes[path] = move(mesh)).get();
+}
+
+void MeshLibrary::add(const string& path, const Mesh& mesh)
+{
+    meshes[path].reset(new Mesh(mesh));
+}
+
+bool parse_scene(istream& text, const string& path, MeshLibrary& library, Scene& scene, string& error)
+{
+    scene = Scene();
+    scene.path = path;
+    error.clear();
+    SceneParser parser(path, library, scene);
+    return parser.parse(text, error);
+}
+
+string frame_output(const Scene& scene, int frame)
+{
+    if (scene.frames <= 1)
+        return scene.output;
+    string number = to_string(frame);
+    number.insert(0, max(0, 4 - int(number.size())), '0');
+    size_t extension = scene.output.find_last_of('.');
+    size_t separator = scene.output.find_last_of("/\\");
+    if (extension == string::npos || (separator != string::npos && extension < separator))
+        return scene.output + "_" + number;
+    return scene.output.substr(0, extension) + "_" + number + scene.output.substr(extension);
+}
+
+BVHUpdate animate_scene(Scene& scene, int frame, double rebuild_threshold)
+{
+    if (scene.animations.empty())
+        return BVHUpdate();
+
+    for (const MeshAnimation& animation : scene.animations)
+    {
+        MatrixXd& V = scene.mesh_vertices[animation.mesh];
+        V = animation.vertices;
+        if (V.rows() == 0)
+            continue;
+
+        // Turn around the center of the box of the first frame, then move
+        if (animation.spin != 0)
+        {
+            RowVector3d center = (V.colwise().minCoeff() + V.colwise().maxCoeff()) / 2;
+            Matrix3d rotation = AngleAxisd(animation.spin * frame * EIGEN_PI / 180, Vector3d::Unit(animation.spin_axis)).toRotationMatrix();
+            V = ((V.rowwise() - center) * rotation.transpose()).rowwise() + center;
+        }
+        V.rowwise() += frame * animation.move.transpose();
+
+        if (animation.wave_amplitude != 0)
+        {
+            double phase = 2 * EIGEN_PI * frame / scene.frames;
+            for (int k = 0; k < V.rows(); k++)
+                V(k, 1) += animation.wave_amplitude * sin(2 * EIGEN_PI * V(k, 0) / animation.wave_length - phase);
+        }
+    }
+    return scene.bvh.update(scene.mesh_vertices, scene.mesh_faces, rebuild_threshold);
+}
+
+bool load_scene(const string& path, MeshLibrary& library, Scene& scene, string& error)
+{
+    ifstream file(path);
+    if (!file)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+    return parse_scene(file, path, library, scene, error);
+}
@@ -0,0 +1,176 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <istream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include "bvh.h"
+#include "instances.h"
+#include "tracer.h"
+
+// Scene files are text, one statement per line, # starts a comment. Numbers are separated by spaces.
+//
+//   output part1_4.png                         Image written by the render, relative to the working directory
+//   resolution 800 800                         Width and height in pixels
+//   camera position 0 0 2 target 0 0 1 up 0 1 0 fov 90
+//                                              Perspective camera, fov is the vertical field of view in degrees
+//                                              with aperture a and focus d for depth of field in the path tracer
+//   light -1 1 1                               Point light
+//   light 0 3 -4 power 2 repeat 64 1 64 0.1 0 0.1
+//                                              With power P, the light falls off with the square of the distance and
+//                                              is P at a distance of 1. The optional repeat places nx * ny * nz lights
+//                                              like the copies of an instance.
+//   area_light -0.5 1.5 -1  1 0 0  0 0 1  4 4 4
+//                                              Corner, two edges and RGB radiance of a parallelogram light, seen and
+//                                              sampled by the path tracer only. It emits on the side of edge1 x edge2.
+//   material glass 1 0.8 0.3 transmit 0.8 ior 1.5
+//                                              Named color, with optional reflect, transmit and ior values
+//   sphere 0.3 0.3 0.3 0.3 glass               Center, radius and material
+//   mesh ../data/bunny.off blue scale 8 translate -0.4 0 -1.2 ground -1
+//                                              OFF file relative to the scene file, then its transforms in the order
+//                                              they are applied: scale s or scale x y z, rotate x|y|z degrees,
+//                                              translate x y z, and ground y which moves the mesh vertically until its
+//                                              lowest point is at y
+//   instance ../data/bunny.off blue scale 2 ground -1 repeat 40 1 40 0.5 0 0.5
+//                                              Copies of a mesh that share its triangles, with the transforms of mesh.
+//                                              The optional repeat nx ny nz dx dy dz places nx * ny * nz copies,
+//                                              the copy (i,j,k) moved by (i dx, j dy, k dz).
+//   shape torus 0.3 green rotate x 60 scale 0.3 translate 0.4 0 -1.2
+//                                              Analytic shape (see Shape) with the transforms and the repeat of an
+//                                              instance: sphere, cylinder, cone, torus r where r is the radius of the
+//                                              tube, or revolution n r1 y1 ... rn yn for a profile of n points.
+//                                              ground puts the lowest corner of its box at y.
+//   quad -4 -1 -8  -4 -1 2  4 -1 2  4 -1 -8 mirror
+//                                              Two triangles, the front side sees the corners counter-clockwise
+//   frames 48                                  Render an animation of 48 images, output_0000.png to output_0047.png
+//
+// Meshes move in an animation when their transforms are followed by motions, per frame from where the transforms put them:
+//   mesh ../data/bunny.off blue scale 8 ground -1 move 0 0 0.02 spin y 5 wave 0.05 0.5
+//                                              move x y z translates it, spin x|y|z degrees turns it around the center
+//                                              of its box, wave amplitude wavelength ripples it vertically along x,
+//                                              one wavelength over the whole animation
+//
+// Materials must be defined before they are used.
+
+// Perspective camera looking from position at target
+struct Camera
+{
+    Eigen::Vector3d position;
+    Eigen::Vector3d target;
+    Eigen::Vector3d up;
+    double field_of_view; // Vertical, in degrees
+    int width;
+    int height;
+
+    // Thin lens of the path tracer: diameter of the lens, 0 for a pinhole, and distance of the sharp plane,
+    // 0 for the distance to target
+    double aperture;
+    double focus_distance;
+
+    // The camera of part1_3 and part1_4: at (0,0,2), looking at -z, the image covers the unit square (-1,1) in x and y at z = 1
+    Camera() : position(0, 0, 2), target(0, 0, 1), up(0, 1, 0), field_of_view(90), width(800), height(800), aperture(0), focus_distance(0) {}
+
+    // The ray of the pixel (i,j) starts at position and goes along direction + i * x_displacement + j * y_displacement
+    void pixel_rays(Eigen::Vector3d& direction, Eigen::Vector3d& x_displacement, Eigen::Vector3d& y_displacement) const;
+};
+
+// Parallelogram corner + u edge1 + v edge2 for u and v in [0, 1], emitting radiance on the side of edge1 x edge2
+struct AreaLight
+{
+    Eigen::Vector3d corner;
+    Eigen::Vector3d edge1;
+    Eigen::Vector3d edge2;
+    Eigen::Vector3d radiance;
+};
+
+// Triangles of an OFF file as loaded, before the transforms of a scene
+struct Mesh
+{
+    Eigen::MatrixXd vertices;
+    Eigen::MatrixXi faces;
+};
+
+// Every OFF file is loaded once and kept for the following scenes
+class MeshLibrary
+{
+public:
+    // Counters since the library was created
+    int files_loaded;
+    int files_reused;
+
+    MeshLibrary() : files_loaded(0), files_reused(0) {}
+
+    // Mesh of the file, nullptr if it cannot be read
+    const Mesh* get(const std::string& path);
+
+    // Make a mesh built in code available to the scenes under the path of a file
+    void add(const std::string& path, const Mesh& mesh);
+
+private:
+    // A null pointer records a file that could not be read
+    std::map<std::string, std::unique_ptr<Mesh>> meshes;
+};
+
+// Motion of a mesh of the BVH in an animation, from the vertices it has in the first frame
+struct MeshAnimation
+{
+    int mesh;
+    Eigen::MatrixXd vertices; // Frame 0
+    Eigen::Vector3d move;     // Per frame
+    int spin_axis;            // 0, 1 or 2 for x, y or z
+    double spin;              // Degrees per frame
+    double wave_amplitude;
+    double wave_length;
+
+    MeshAnimation() : mesh(0), move(0, 0, 0), spin_axis(1), spin(0), wave_amplitude(0), wave_length(1) {}
+};
+
+// A scene ready to be rendered: the meshes are transformed and the BVH is built over all of them,
+// the instanced meshes get one BVH each and the instances and the shapes a BVH of their own
+struct Scene
+{
+    std::string path;
+    std::string output;
+    std::vector<std::string> mesh_files; // OFF files read by the mesh and instance statements, each one once
+    Camera camera;
+    std::vector<Eigen::Vector3d> light_positions;
+    std::vector<double> light_powers; // One per light, 0 for the lights without falloff
+    std::vector<AreaLight> area_lights;
+
+    BVH bvh;
+    std::vector<Material> mesh_materials; // One per mesh of the BVH, in the order of the file
+    std::vector<std::string> mesh_names;  // By Hit::mesh: the meshes of the BVH ("quad" for a quad), then the instanced ones and the shapes
+
+    InstanceBVH instances;
+    std::vector<Material> instance_materials; // One per instance or shape statement
+
+    // Frames of an animation, 1 for a still image. The vertices and faces of the meshes of the BVH are only kept
+    // when some of them move, for BVH::update().
+    int frames;
+    std::vector<MeshAnimation> animations;
+    std::vector<Eigen::MatrixXd> mesh_vertices;
+    std::vector<Eigen::MatrixXi> mesh_faces;
+
+    std::vector<Eigen::Vector4d> spheres; // (x,y,z,r)
+    std::vector<Material> sphere_materials;
+
+    Scene() : frames(1) {}
+};
+
+// Read a scene file and build its BVH, the OFF files are taken from the library.
+// Returns false with a message naming the line on error.
+bool load_scene(const std::string& path, MeshLibrary& library, Scene& scene, std::string& error);
+
+// Same for the text of a scene, path names it in the messages and the meshes are relative to its directory
+bool parse_scene(std::istream& text, const std::string& path, MeshLibrary& library, Scene& scene, std::string& error);
+
+// Image of a frame: the output of the scene, with the frame number before the extension for an animation
+std::string frame_output(const Scene& scene, int frame);
+
+// Move the animated meshes to where they are in a frame and update the BVH (see BVH::update())
+BVHUpdate animate_scene(Scene& scene, int frame, double rebuild_threshold);
+
+#endif
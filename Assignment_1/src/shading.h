@@ -0,0 +1,84 @@
+#ifndef SHADING_H
+#define SHADING_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <Eigen/Core>
+
+// x to a power known at compile time, by squaring: x^100 takes 8 multiplications instead of a call to pow()
+template <unsigned Exponent, typename Scalar>
+inline Scalar power(Scalar x)
+{
+    if constexpr (Exponent == 0)
+        return Scalar(1);
+    else if constexpr (Exponent == 1)
+        return x;
+    else if constexpr (Exponent % 2 == 1)
+        return x * power<Exponent - 1>(x);
+    else
+    {
+        Scalar half = power<Exponent / 2>(x);
+        return half * half;
+    }
+}
+
+// Shading models, each one a specialization of SurfaceShader. A batch of hits of one model is shaded without
+// testing the model again for every pixel, and with the exponent and the number of lights as constants.
+enum ShadingModel { diffuse_model, blinn_phong_model, shading_model_count };
+
+struct Diffuse {};
+template <unsigned Exponent> struct BlinnPhong {};
+
+template <typename Model>
+struct SurfaceShader;
+
+// Lambert term of a light
+template <>
+struct SurfaceShader<Diffuse>
+{
+    template <typename Scalar>
+    static Scalar light(const Eigen::Matrix<Scalar, 3, 1>& normal, const Eigen::Matrix<Scalar, 3, 1>& ray_light, const Eigen::Matrix<Scalar, 3, 1>&)
+    {
+        return std::max(Scalar(0), normal.dot(ray_light));
+    }
+};
+
+// Lambert term plus the specular term of the half angle of the view and the light
+template <unsigned Exponent>
+struct SurfaceShader<BlinnPhong<Exponent>>
+{
+    template <typename Scalar>
+    static Scalar light(const Eigen::Matrix<Scalar, 3, 1>& normal, const Eigen::Matrix<Scalar, 3, 1>& ray_light, const Eigen::Matrix<Scalar, 3, 1>& view)
+    {
+        Eigen::Matrix<Scalar, 3, 1> half_angle = (view + ray_light).normalized();
+        return std::max(Scalar(0), normal.dot(ray_light)) + std::max(Scalar(0), power<Exponent>(normal.dot(half_angle)));
+    }
+};
+
+// A primary ray hit waiting to be shaded with the others of its model. view and normal are normalized.
+struct SurfaceHit
+{
+    unsigned i, j;
+    int material; // Index of the color of the surface
+    Eigen::Vector3d position, normal, view;
+};
+
+// Light of every point light on a hit, without shadows, summed in the order of the lights
+template <typename Model, std::size_t LightCount, std::size_t... Lights>
+double sum_lights(const std::array<Eigen::Vector3d, LightCount>& lights, const SurfaceHit& hit, std::index_sequence<Lights...>)
+{
+    return (0. + ... + SurfaceShader<Model>::light(hit.normal, Eigen::Vector3d((lights[Lights] - hit.position).normalized()), hit.view));
+}
+
+// Shade a batch of hits of one model, write(hit, lightness) stores each result. The light loop is unrolled.
+template <typename Model, std::size_t LightCount, typename Write>
+void shade_batch(const std::vector<SurfaceHit>& hits, const std::array<Eigen::Vector3d, LightCount>& lights, double ambient, Write write)
+{
+    for (const SurfaceHit& hit : hits)
+        write(hit, sum_lights<Model>(lights, hit, std::make_index_sequence<LightCount>()) + ambient);
+}
+
+#endif
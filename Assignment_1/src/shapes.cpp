@@ -0,0 +1,305 @@
+#include "shapes.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Steps of the search of a root in its bracket, more than the bisections down to the precision of a double
+    const int max_root_steps = 100;
+
+    // Range of t where the ray is inside the box, clipped to (0, t_max). Returns false if it is empty.
+    bool box_range(const Vector3d& box_min, const Vector3d& box_max, const Vector3d& ray_origin, const Vector3d& ray_direction, double t_max, double& t_near, double& t_far)
+    {
+        t_near = 0;
+        t_far = t_max;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (ray_direction(axis) == 0)
+            {
+                if (ray_origin(axis) < box_min(axis) || ray_origin(axis) > box_max(axis))
+                    return false;
+                continue;
+            }
+            double t0 = (box_min(axis) - ray_origin(axis)) / ray_direction(axis);
+            double t1 = (box_max(axis) - ray_origin(axis)) / ray_direction(axis);
+            if (t0 > t1)
+                swap(t0, t1);
+            t_near = max(t_near, t0);
+            t_far = min(t_far, t1);
+        }
+        return t_near <= t_far;
+    }
+
+    // Roots t0 <= t1 of a t^2 + 2 b t + c = 0, false if there are none. q avoids the cancellation of b with the root
+    // of the discriminant, which loses the small root of a ray that starts close to the surface.
+    bool solve_quadratic(double a, double b, double c, double& t0, double& t1)
+    {
+        if (a == 0)
+        {
+            if (b == 0)
+                return false;
+            t0 = t1 = -c / (2 * b);
+            return true;
+        }
+        double discriminant = b * b - a * c;
+        if (discriminant < 0)
+            return false;
+        double q = -(b + copysign(sqrt(discriminant), b));
+        t0 = q / a;
+        t1 = q != 0 ? c / q : t0;
+        if (t0 > t1)
+            swap(t0, t1);
+        return true;
+    }
+
+    // Closest crossing with 0 < t < t_max of the surface swept by the segment p0 p1 of a profile: a flat ring when the
+    // heights are equal, otherwise x^2 + z^2 = r(y)^2 with r linear in y, kept between the heights of the segment
+    bool segment_crossing(const Vector2d& p0, const Vector2d& p1, const Vector3d& ray_origin, const Vector3d& ray_direction, double t_max, double& t)
+    {
+        if (p0(1) == p1(1))
+        {
+            if (ray_direction(1) == 0)
+                return false;
+            double t_plane = (p0(1) - ray_origin(1)) / ray_direction(1);
+            if (!(t_plane > 0 && t_plane < t_max))
+                return false;
+            double squared_radius = Vector2d(ray_origin(0) + t_plane * ray_direction(0), ray_origin(2) + t_plane * ray_direction(2)).squaredNorm();
+            double r_min = min(p0(0), p1(0)), r_max = max(p0(0), p1(0));
+            if (squared_radius < r_min * r_min || squared_radius > r_max * r_max)
+                return false;
+            t = t_plane;
+            return true;
+        }
+
+        // The radius along the ray is radius + t radius_step
+        double slope = (p1(0) - p0(0)) / (p1(1) - p0(1));
+        double radius = p0(0) + slope * (ray_origin(1) - p0(1));
+        double radius_step = slope * ray_direction(1);
+        double a = ray_direction(0) * ray_direction(0) + ray_direction(2) * ray_direction(2) - radius_step * radius_step;
+        double b = ray_origin(0) * ray_direction(0) + ray_origin(2) * ray_direction(2) - radius * radius_step;
+        double c = ray_origin(0) * ray_origin(0) + ray_origin(2) * ray_origin(2) - radius * radius;
+        double roots[2];
+        if (!solve_quadratic(a, b, c, roots[0], roots[1]))
+            return false;
+
+        // Both nappes of the cone solve the equation, the one of the segment is between its heights
+        double y_min = min(p0(1), p1(1)), y_max = max(p0(1), p1(1));
+        for (double root : roots)
+        {
+            double y = ray_origin(1) + root * ray_direction(1);
+            if (root > 0 && root < t_max && y >= y_min && y <= y_max)
+            {
+                t = root;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Sum of coefficients[k] x^k up to the degree
+    double evaluate(const double* coefficients, int degree, double x)
+    {
+        double value = coefficients[degree];
+        for (int k = degree - 1; k >= 0; k--)
+            value = value * x + coefficients[k];
+        return value;
+    }
+
+    // Root of a polynomial in [low, high], where its values at the ends have opposite signs. Newton steps fall back to
+    // bisection when they leave the bracket, which always holds the root: if the steps run out, its middle is returned.
+    double bracketed_root(const double* coefficients, const double* derivative, int degree, double low, double high)
+    {
+        bool is_low_negative = evaluate(coefficients, degree, low) < 0;
+        double x = (low + high) / 2;
+        for (int step = 0; step < max_root_steps; step++)
+        {
+            double value = evaluate(coefficients, degree, x);
+            if (value == 0)
+                return x;
+            if ((value < 0) == is_low_negative)
+                low = x;
+            else
+                high = x;
+            double slope = evaluate(derivative, degree - 1, x);
+            double next = slope != 0 ? x - value / slope : low;
+            if (!(next > low && next < high))
+                next = (low + high) / 2;
+            if (next == x || !(next > low && next < high))
+                break;
+            x = next;
+        }
+        return x;
+    }
+
+    // Real roots in [low, high] of a polynomial of degree 1 to 4 whose leading coefficient is not 0, in increasing
+    // order. Between the roots of its derivative the polynomial is monotonic, so each of those intervals holds at most
+    // one root, and it is bracketed by the signs at the ends. A root where the polynomial only touches 0 can be missed.
+    int polynomial_roots(const double* coefficients, int degree, double low, double high, double* roots)
+    {
+        if (degree == 1)
+        {
+            double x = -coefficients[0] / coefficients[1];
+            roots[0] = x;
+            return x >= low && x <= high ? 1 : 0;
+        }
+
+        double derivative[4];
+        for (int k = 1; k <= degree; k++)
+            derivative[k - 1] = k * coefficients[k];
+        double bounds[6];
+        bounds[0] = low;
+        int bound_count = 1 + polynomial_roots(derivative, degree - 1, low, high, bounds + 1);
+        bounds[bound_count++] = high;
+
+        int count = 0;
+        double value = evaluate(coefficients, degree, low);
+        for (int k = 0; k + 1 < bound_count; k++)
+        {
+            double next_value = evaluate(coefficients, degree, bounds[k + 1]);
+            if (value == 0)
+            {
+                if (count == 0 || roots[count - 1] != bounds[k])
+                    roots[count++] = bounds[k];
+            }
+            else if (next_value != 0 && (value < 0) != (next_value < 0))
+                roots[count++] = bracketed_root(coefficients, derivative, degree, bounds[k], bounds[k + 1]);
+            value = next_value;
+        }
+        if (value == 0 && (count == 0 || roots[count - 1] != high))
+            roots[count++] = high;
+        return count;
+    }
+
+    // Unit direction away from the y axis in the plane xz, any one on the axis
+    Vector2d radial_direction(const Vector3d& position)
+    {
+        Vector2d radial(position(0), position(2));
+        double length = radial.norm();
+        return length > 0 ? Vector2d(radial / length) : Vector2d(1, 0);
+    }
+}
+
+Shape::Shape(ShapeType type, int mesh, double minor_radius, const vector<Vector2d>& profile)
+    : type(type), mesh(mesh), minor_radius(minor_radius), profile(profile)
+{
+    if (type == cylinder_shape)
+        this->profile = {Vector2d(0, 0), Vector2d(1, 0), Vector2d(1, 1), Vector2d(0, 1)};
+    else if (type == cone_shape)
+        this->profile = {Vector2d(0, 0), Vector2d(1, 0), Vector2d(0, 1)};
+
+    if (type == sphere_shape)
+    {
+        box_min = Vector3d::Constant(-1);
+        box_max = Vector3d::Constant(1);
+    }
+    else if (type == torus_shape)
+    {
+        box_max = Vector3d(1 + minor_radius, minor_radius, 1 + minor_radius);
+        box_min = -box_max;
+    }
+    else
+    {
+        // An empty profile gets an empty box
+        double r_max = -numeric_limits<double>::infinity();
+        double y_min = numeric_limits<double>::infinity(), y_max = -y_min;
+        for (const Vector2d& point : this->profile)
+        {
+            r_max = max(r_max, point(0));
+            y_min = min(y_min, point(1));
+            y_max = max(y_max, point(1));
+        }
+        box_min = Vector3d(-r_max, y_min, -r_max);
+        box_max = Vector3d(r_max, y_max, r_max);
+    }
+}
+
+bool Shape::intersect(const Vector3d& ray_origin, const Vector3d& ray_direction, double& t_max, int& part) const
+{
+    if (type == sphere_shape)
+    {
+        double t0, t1;
+        if (!solve_quadratic(ray_direction.squaredNorm(), ray_origin.dot(ray_direction), ray_origin.squaredNorm() - 1, t0, t1))
+            return false;
+        double t = t0 > 0 ? t0 : t1;
+        if (!(t > 0 && t < t_max))
+            return false;
+        t_max = t;
+        part = 0;
+        return true;
+    }
+
+    double t_near, t_far;
+    if (!box_range(box_min, box_max, ray_origin, ray_direction, t_max, t_near, t_far))
+        return false;
+
+    if (type == torus_shape)
+    {
+        // The quartic (|p|^2 + 1 - r^2)^2 = 4 (x^2 + z^2) in the distance s along the ray from where it enters the box,
+        // with a unit direction, so that its coefficients stay of the size of the torus. With |p|^2 + 1 - r^2 =
+        // s^2 + a s + b and x^2 + z^2 = c s^2 + e s + f, it is negative inside the tube.
+        double length = ray_direction.norm();
+        Vector3d direction = ray_direction / length;
+        Vector3d origin = ray_origin + t_near * ray_direction;
+        double a = 2 * origin.dot(direction);
+        double b = origin.squaredNorm() + 1 - minor_radius * minor_radius;
+        double c = direction(0) * direction(0) + direction(2) * direction(2);
+        double e = 2 * (origin(0) * direction(0) + origin(2) * direction(2));
+        double f = origin(0) * origin(0) + origin(2) * origin(2);
+        const double coefficients[5] = {b * b - 4 * f, 2 * a * b - 4 * e, a * a + 2 * b - 4 * c, 2 * a, 1};
+        double roots[4];
+        int count = polynomial_roots(coefficients, 4, 0, (t_far - t_near) * length, roots);
+        for (int k = 0; k < count; k++)
+        {
+            double t = t_near + roots[k] / length;
+            if (t > 0 && t < t_max)
+            {
+                t_max = t;
+                part = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Only the segments between the heights at which the ray enters and leaves the box, with some slack for the
+    // rings on its faces
+    double slack = 1e-9 * (box_max(1) - box_min(1));
+    double y_near = ray_origin(1) + t_near * ray_direction(1), y_far = ray_origin(1) + t_far * ray_direction(1);
+    double y_low = min(y_near, y_far) - slack, y_high = max(y_near, y_far) + slack;
+    bool is_intersected = false;
+    for (int k = 0; k + 1 < profile.size(); k++)
+    {
+        const Vector2d& p0 = profile[k];
+        const Vector2d& p1 = profile[k + 1];
+        if (max(p0(1), p1(1)) < y_low || min(p0(1), p1(1)) > y_high)
+            continue;
+        double t;
+        if (segment_crossing(p0, p1, ray_origin, ray_direction, t_max, t))
+        {
+            t_max = t;
+            part = k;
+            is_intersected = true;
+        }
+    }
+    return is_intersected;
+}
+
+Vector3d Shape::normal(const Vector3d& position, int part) const
+{
+    if (type == sphere_shape)
+        return position;
+
+    Vector2d radial = radial_direction(position);
+    if (type == torus_shape)
+        return position - Vector3d(radial(0), 0, radial(1));
+
+    // The segment turned clockwise in the plane (radius, height)
+    Vector2d along = profile[part + 1] - profile[part];
+    return Vector3d(along(1) * radial(0), -along(0), along(1) * radial(1));
+}
@@ -0,0 +1,41 @@
+#ifndef SHAPES_H
+#define SHAPES_H
+
+#include <vector>
+#include <Eigen/Core>
+
+enum ShapeType { sphere_shape, cylinder_shape, cone_shape, torus_shape, revolution_shape };
+
+// An analytic surface in its own space, around the y axis. Shapes are placed in a scene by the transform of an Instance,
+// like the instanced meshes, so a sphere can also become an ellipsoid. In their own space:
+//   sphere      radius 1 around the origin
+//   cylinder    radius 1 from y = 0 to y = 1, closed by its caps
+//   cone        base of radius 1 at y = 0, apex at y = 1, closed by its base
+//   torus       tube of radius minor_radius around the circle of radius 1 in the plane y = 0
+//   revolution  polyline of (radius, height) points turned around the y axis, e.g. the outline of a vase from its foot.
+//               The inside is on the left of the profile going from one point to the next, where the normals point away.
+// Cylinders and cones are the revolutions of (0 0, 1 0, 1 1, 0 1) and (0 0, 1 0, 0 1). Every segment of a profile is
+// a cone frustum, a cylinder or a flat ring, crossed by solving a quadratic. The torus is crossed at the roots of a
+// quartic inside its box, each one isolated between the roots of the derivatives and refined in its bracket.
+struct Shape
+{
+    ShapeType type;
+    int mesh;                             // Hit::mesh of its hits
+    double minor_radius;                  // Torus
+    std::vector<Eigen::Vector2d> profile; // Revolution, cylinder and cone: (radius, height) points
+    Eigen::Vector3d box_min, box_max;
+
+    // The profile of a revolution is used as is, the radii must not be negative
+    Shape(ShapeType type, int mesh = -1, double minor_radius = 0.25, const std::vector<Eigen::Vector2d>& profile = std::vector<Eigen::Vector2d>());
+
+    // Closest point where the ray crosses the surface with 0 < t < t_max, entering or leaving it, like
+    // nearest_sphere_crossing(). The direction need not be normalized. Returns false if there is none, otherwise
+    // lowers t_max to its distance and stores in part the segment of the profile that was hit.
+    bool intersect(const Eigen::Vector3d& ray_origin, const Eigen::Vector3d& ray_direction, double& t_max, int& part) const;
+
+    // Normal of the surface at a point of it found by intersect(), pointing out of the shape, not normalized.
+    // The normal of a profile is the same along each segment, like the one of a triangle.
+    Eigen::Vector3d normal(const Eigen::Vector3d& position, int part) const;
+};
+
+#endif
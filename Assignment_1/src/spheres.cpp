@@ -0,0 +1,111 @@
+#include "spheres.h"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+using namespace Eigen;
+
+bool intersect_spheres(const vector<Vector4d>& spheres, const Vector3d& ray_origin, const Vector3d& ray_direction, double& nearest_t, int& sphere_number)
+{
+    bool is_intersected = false;
+    for (int index = 0; index < spheres.size(); index++)
+    {
+        // Written out component by component, in the same order as the packet version
+        double to_center_x = spheres[index](0) - ray_origin(0);
+        double to_center_y = spheres[index](1) - ray_origin(1);
+        double to_center_z = spheres[index](2) - ray_origin(2);
+        double origin_to_perpendicular = ray_direction(0) * to_center_x + ray_direction(1) * to_center_y + ray_direction(2) * to_center_z;
+        double squared_distance = to_center_x * to_center_x + to_center_y * to_center_y + to_center_z * to_center_z;
+        double perpendicular_height = sqrt(squared_distance - origin_to_perpendicular * origin_to_perpendicular);
+        if (perpendicular_height <= spheres[index](3))
+        {
+            is_intersected = true;
+            double intersection_to_perpendicular = sqrt(spheres[index](3) * spheres[index](3) - perpendicular_height * perpendicular_height);
+            double origin_to_intersection_length = origin_to_perpendicular - intersection_to_perpendicular;
+            if (origin_to_intersection_length < nearest_t)
+            {
+                nearest_t = origin_to_intersection_length;
+                sphere_number = index;
+            }
+        }
+    }
+    return is_intersected;
+}
+
+template <typename Scalar>
+bool nearest_sphere_crossing(const vector<Matrix<Scalar, 4, 1>>& spheres, const Matrix<Scalar, 3, 1>& ray_origin, const Matrix<Scalar, 3, 1>& ray_direction, Scalar& t_max, int& sphere_number)
+{
+    bool is_intersected = false;
+    for (int index = 0; index < spheres.size(); index++)
+    {
+        Matrix<Scalar, 3, 1> to_center = spheres[index].template head<3>() - ray_origin;
+        Scalar origin_to_perpendicular = ray_direction.dot(to_center);
+        Scalar squared_height = to_center.squaredNorm() - origin_to_perpendicular * origin_to_perpendicular;
+        Scalar squared_half_chord = spheres[index](3) * spheres[index](3) - squared_height;
+        if (squared_half_chord < 0)
+            continue;
+
+        // The entry point, or the exit point if the ray starts inside the sphere
+        Scalar half_chord = sqrt(squared_half_chord);
+        Scalar t = origin_to_perpendicular - half_chord;
+        if (t <= 0)
+            t = origin_to_perpendicular + half_chord;
+        if (t > 0 && t < t_max)
+        {
+            t_max = t;
+            sphere_number = index;
+            is_intersected = true;
+        }
+    }
+    return is_intersected;
+}
+
+template bool nearest_sphere_crossing<double>(const vector<Vector4d>&, const Vector3d&, const Vector3d&, double&, int&);
+template bool nearest_sphere_crossing<float>(const vector<Vector4f>&, const Vector3f&, const Vector3f&, float&, int&);
+
+template <int N>
+void intersect_spheres_packet(const vector<Vector4d>& spheres, const RayPacket<N>& packet, bool is_intersected[N], double nearest_t[N], int sphere_number[N])
+{
+    for (int lane = 0; lane < N; lane++)
+        is_intersected[lane] = false;
+
+    // One sphere at a time against all the lanes, the lane loops have no branches so that they vectorize
+    for (int index = 0; index < spheres.size(); index++)
+    {
+        const double center_x = spheres[index](0);
+        const double center_y = spheres[index](1);
+        const double center_z = spheres[index](2);
+        const double radius = spheres[index](3);
+
+        double perpendicular_height[N], origin_to_intersection_length[N];
+        for (int lane = 0; lane < N; lane++)
+        {
+            double to_center_x = center_x - packet.ox[lane];
+            double to_center_y = center_y - packet.oy[lane];
+            double to_center_z = center_z - packet.oz[lane];
+            double origin_to_perpendicular = packet.dx[lane] * to_center_x + packet.dy[lane] * to_center_y + packet.dz[lane] * to_center_z;
+            double squared_distance = to_center_x * to_center_x + to_center_y * to_center_y + to_center_z * to_center_z;
+            perpendicular_height[lane] = sqrt(squared_distance - origin_to_perpendicular * origin_to_perpendicular);
+            // Clamped so that the lanes that miss do not take the slow path of sqrt on a negative argument,
+            // the lanes that hit have a non-negative argument and get the same value as intersect_spheres()
+            origin_to_intersection_length[lane] = origin_to_perpendicular - sqrt(max(0., radius * radius - perpendicular_height[lane] * perpendicular_height[lane]));
+        }
+
+        for (int lane = 0; lane < N; lane++)
+        {
+            if (perpendicular_height[lane] <= radius)
+            {
+                is_intersected[lane] = true;
+                if (origin_to_intersection_length[lane] < nearest_t[lane])
+                {
+                    nearest_t[lane] = origin_to_intersection_length[lane];
+                    sphere_number[lane] = index;
+                }
+            }
+        }
+    }
+}
+
+template void intersect_spheres_packet<4>(const vector<Vector4d>&, const RayPacket<4>&, bool[4], double[4], int[4]);
+template void intersect_spheres_packet<8>(const vector<Vector4d>&, const RayPacket<8>&, bool[8], double[8], int[8]);
@@ -0,0 +1,24 @@
+#ifndef SPHERES_H
+#define SPHERES_H
+
+#include <vector>
+#include <Eigen/Core>
+#include "packet.h"
+
+// Geometric ray-sphere test against all the spheres (x,y,z,r). The ray direction must be normalized.
+// Returns true if the line of the ray crosses a sphere; the nearest entry distance below nearest_t
+// is then stored in nearest_t and the index of its sphere in sphere_number.
+bool intersect_spheres(const std::vector<Eigen::Vector4d>& spheres, const Eigen::Vector3d& ray_origin, const Eigen::Vector3d& ray_direction, double& nearest_t, int& sphere_number);
+
+// Same test for the N rays of a packet at once, lane by lane the results are identical to intersect_spheres()
+// Closest point where the ray crosses the surface of a sphere with 0 < t < t_max, entering or leaving it, so that rays
+// starting inside a sphere (refracted and shadow rays) find it too. The ray direction must be normalized.
+// Returns false if there is none, otherwise lowers t_max to its distance and stores the index of its sphere in sphere_number.
+// Scalar is double or float.
+template <typename Scalar>
+bool nearest_sphere_crossing(const std::vector<Eigen::Matrix<Scalar, 4, 1>>& spheres, const Eigen::Matrix<Scalar, 3, 1>& ray_origin, const Eigen::Matrix<Scalar, 3, 1>& ray_direction, Scalar& t_max, int& sphere_number);
+
+template <int N>
+void intersect_spheres_packet(const std::vector<Eigen::Vector4d>& spheres, const RayPacket<N>& packet, bool is_intersected[N], double nearest_t[N], int sphere_number[N]);
+
+#endif
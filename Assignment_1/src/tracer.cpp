@@ -0,0 +1,428 @@
+#include "tracer.h"
+#include "shading.h"
+#include "spheres.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <Eigen/Geometry>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Uniform number in [0, 1) from a xorshift generator
+    double next_random(unsigned& state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state * (1.0 / 4294967296.0);
+    }
+}
+
+template <typename Scalar>
+BasicTracer<Scalar>::BasicTracer(const BasicBVH<Scalar>& bvh, const vector<Material>& materials, const vector<Vector3d>& light_positions,
+                                 const vector<double>& light_powers, int thread_count)
+    : instances(nullptr), epsilon(1e-6), bvh(bvh), materials(materials), threads(thread_count)
+{
+    for (const Vector3d& light : light_positions)
+        this->light_positions.push_back(light.cast<Scalar>());
+    for (double power : light_powers)
+        this->light_powers.push_back(Scalar(power));
+    light_tree.build(light_positions, light_powers);
+    for (ThreadState& state : threads)
+    {
+        state.shadow_stats.resize(light_positions.size());
+        state.last_occluders.assign(light_positions.size(), -1);
+    }
+}
+
+template <typename Scalar>
+void BasicTracer<Scalar>::fit_epsilon()
+{
+    // Largest coordinate of the scene, a point on a surface is rounded by about its epsilon times this
+    double extent = 0;
+    auto include_tree = [&](const BasicBVH<Scalar>& tree)
+    {
+        if (!tree.nodes.empty())
+            extent = max({extent, double(tree.nodes[0].box_min.cwiseAbs().maxCoeff()), double(tree.nodes[0].box_max.cwiseAbs().maxCoeff())});
+    };
+    include_tree(bvh);
+    if (instances)
+        include_tree(instances->top);
+    for (const Vector4& sphere : spheres)
+        extent = max(extent, double(sphere.template head<3>().cwiseAbs().maxCoeff() + sphere(3)));
+
+    epsilon = Scalar(max(1e-6, 64 * numeric_limits<Scalar>::epsilon() * extent));
+}
+
+template <typename Scalar>
+bool BasicTracer<Scalar>::intersect(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, TraversalStats* stats) const
+{
+    bool is_intersected = bvh.intersect(ray_origin, ray_direction, t_max, hit, stats);
+    intersect_instances_and_spheres(ray_origin, ray_direction, t_max, hit, is_intersected, stats);
+    return is_intersected;
+}
+
+template <typename Scalar>
+void BasicTracer<Scalar>::intersect_instances_and_spheres(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, bool& is_intersected, TraversalStats* stats) const
+{
+    if (is_intersected)
+        t_max = hit.t;
+    if (instances && instances->intersect(ray_origin, ray_direction, t_max, hit, stats))
+    {
+        hit.t = t_max;
+        is_intersected = true;
+    }
+    int sphere_number;
+    if (nearest_sphere_crossing(spheres, ray_origin, ray_direction, t_max, sphere_number))
+    {
+        hit.t = t_max;
+        hit.mesh = -1;
+        hit.face = sphere_number;
+        hit.primitive = -1;
+        hit.instance = -1;
+        is_intersected = true;
+    }
+}
+
+template <typename Scalar>
+typename BasicTracer<Scalar>::Vector3 BasicTracer<Scalar>::shade(int thread, unsigned pixel, const Vector3& ray_origin, const Vector3& ray_direction, const Hit& hit)
+{
+    ThreadState& state = threads[thread];
+    if (state.bounce_stats.rays.empty())
+        state.bounce_stats.rays.resize(1, 0);
+    state.bounce_stats.rays[0]++;
+
+    PathState path;
+    path.rays_left = budget.max_rays;
+    path.random_state = pixel * 2654435761u + 1;
+    if (path.random_state == 0)
+        path.random_state = 1;
+    path.is_light_checked = light_selection.lights > 0 && pixel % light_selection.check_interval == 0;
+    return shade_hit(state, path, 0, 1, ray_origin, ray_direction, hit);
+}
+
+template <typename Scalar>
+void split_reflection(const Material& material, const Matrix<Scalar, 3, 1>& normal, const Matrix<Scalar, 3, 1>& ray_direction, Scalar& reflected, Scalar& transmitted, Matrix<Scalar, 3, 1>& refracted_direction)
+{
+    reflected = Scalar(material.reflectivity);
+    transmitted = Scalar(material.transmission);
+    if (transmitted > 0)
+    {
+        // The normal points out of the mesh, a ray going against it enters the mesh
+        Scalar cos_incident = -normal.dot(ray_direction);
+        bool is_entering = cos_incident > 0;
+        Scalar eta = Scalar(is_entering ? 1 / material.refractive_index : material.refractive_index);
+        Matrix<Scalar, 3, 1> facing_normal = is_entering ? normal : Matrix<Scalar, 3, 1>(-normal);
+        cos_incident = fabs(cos_incident);
+
+        Scalar sin2_refracted = eta * eta * (1 - cos_incident * cos_incident);
+        if (sin2_refracted >= 1)
+        {
+            // Total internal reflection
+            reflected += transmitted;
+            transmitted = 0;
+        }
+        else
+        {
+            // Schlick's approximation of the Fresnel reflectance, on the side of the larger angle
+            Scalar cos_refracted = sqrt(1 - sin2_refracted);
+            Scalar r0 = Scalar(power<2>((1 - material.refractive_index) / (1 + material.refractive_index)));
+            Scalar fresnel = r0 + (1 - r0) * power<5>(1 - (is_entering ? cos_incident : cos_refracted));
+            reflected += transmitted * fresnel;
+            transmitted *= 1 - fresnel;
+            refracted_direction = (eta * ray_direction + (eta * cos_incident - cos_refracted) * facing_normal).normalized();
+        }
+    }
+}
+
+template void split_reflection<double>(const Material&, const Vector3d&, const Vector3d&, double&, double&, Vector3d&);
+template void split_reflection<float>(const Material&, const Vector3f&, const Vector3f&, float&, float&, Vector3f&);
+
+template <typename Scalar>
+void BasicTracer<Scalar>::surface(const Hit& hit, const Vector3& position, Material& material, Vector3& normal) const
+{
+    const bool is_sphere = hit.mesh < 0;
+    const bool is_instance = hit.instance >= 0;
+    material = Material();
+    if (is_sphere && hit.face < sphere_materials.size())
+        material = sphere_materials[hit.face];
+    else if (is_instance && instances->instances[hit.instance].material < instance_materials.size())
+        material = instance_materials[instances->instances[hit.instance].material];
+    else if (!is_sphere && !is_instance && hit.mesh < materials.size())
+        material = materials[hit.mesh];
+
+    // The normal of a triangle is precomputed with it (and moved to world space for an instance),
+    // the one of a sphere points away from its center and the one of a shape is found at the position
+    if (is_sphere)
+        normal = (position - spheres[hit.face].template head<3>()).normalized();
+    else if (is_instance)
+        normal = instances->normal(hit, position);
+    else
+        normal = bvh.triangles.normal(hit.primitive);
+}
+
+template <typename Scalar>
+bool BasicTracer<Scalar>::occluded(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, int* last_occluder, TraversalStats* stats) const
+{
+    if (bvh.occluded(ray_origin, ray_direction, t_max, last_occluder, stats))
+        return true;
+    if (instances && instances->occluded(ray_origin, ray_direction, t_max, stats))
+        return true;
+    int sphere_number;
+    return nearest_sphere_crossing(spheres, ray_origin, ray_direction, t_max, sphere_number);
+}
+
+template <typename Scalar>
+typename BasicTracer<Scalar>::Vector3 BasicTracer<Scalar>::shade_hit(ThreadState& state, PathState& path, int depth, Scalar weight, const Vector3& ray_origin, const Vector3& ray_direction, const Hit& hit)
+{
+    Vector3 position = ray_origin + Scalar(hit.t) * ray_direction;
+    Material material;
+    Vector3 normal;
+    surface(hit, position, material, normal);
+
+    Scalar reflected, transmitted;
+    Vector3 refracted_direction;
+    split_reflection(material, normal, ray_direction, reflected, transmitted, refracted_direction);
+
+    Vector3 color = Vector3::Zero();
+    Scalar local = Scalar(1 - material.reflectivity - material.transmission);
+    if (local > 0)
+        color += local * direct_light(state, path, depth, position, normal, -ray_direction) * material.color.cast<Scalar>();
+
+    if (reflected > 0)
+    {
+        Vector3 reflected_direction = ray_direction - 2 * ray_direction.dot(normal) * normal;
+        color += reflected * trace(state, path, depth + 1, weight * reflected, position, reflected_direction);
+    }
+    if (transmitted > 0)
+        color += transmitted * trace(state, path, depth + 1, weight * transmitted, position, refracted_direction);
+    return color;
+}
+
+template <typename Scalar>
+typename BasicTracer<Scalar>::Vector3 BasicTracer<Scalar>::trace(ThreadState& state, PathState& path, int depth, Scalar weight, const Vector3& ray_origin, const Vector3& ray_direction)
+{
+    BounceStats& stats = state.bounce_stats;
+    if (depth > budget.max_depth)
+    {
+        stats.stopped_by_depth++;
+        return Vector3::Zero();
+    }
+    if (path.rays_left <= 0)
+    {
+        stats.stopped_by_budget++;
+        return Vector3::Zero();
+    }
+
+    // Russian roulette: a ray that can only bring a small weight survives with a probability proportional to it,
+    // and what it brings back is scaled up so that the expected color is unchanged
+    Scalar scale = 1;
+    if (depth >= budget.roulette_depth && weight < budget.roulette_weight)
+    {
+        Scalar survival = weight / Scalar(budget.roulette_weight);
+        if (next_random(path.random_state) >= survival)
+        {
+            stats.stopped_by_roulette++;
+            return Vector3::Zero();
+        }
+        scale = 1 / survival;
+    }
+
+    path.rays_left--;
+    if (stats.rays.size() <= depth)
+        stats.rays.resize(depth + 1, 0);
+    stats.rays[depth]++;
+
+    Vector3 origin = ray_origin + epsilon * ray_direction;
+    Hit hit;
+    if (!intersect(origin, ray_direction, numeric_limits<Scalar>::infinity(), hit, &state.secondary_stats))
+        return Vector3::Zero();
+    return scale * shade_hit(state, path, depth, weight, origin, ray_direction, hit);
+}
+
+template <typename Scalar>
+Scalar BasicTracer<Scalar>::light_from(ThreadState& state, int light_i, const Vector3& position, const Vector3& normal, const Vector3& view, bool is_counted)
+{
+    Vector3 to_light = light_positions[light_i] - position;
+    Vector3 ray_light = to_light.normalized();
+
+    // Skip the lights hidden by another triangle, an instance or a sphere
+    Scalar light_distance = to_light.norm() - epsilon;
+    Vector3 shadow_origin = position + epsilon * ray_light;
+    if (occluded(shadow_origin, ray_light, light_distance, &state.last_occluders[light_i], is_counted ? &state.shadow_stats[light_i] : nullptr))
+        return 0;
+
+    Scalar light = SurfaceShader<BlinnPhong<100>>::light(normal, ray_light, view);
+    if (light_powers[light_i] > 0)
+        light *= light_powers[light_i] / to_light.squaredNorm();
+    return light;
+}
+
+template <typename Scalar>
+Scalar BasicTracer<Scalar>::direct_light(ThreadState& state, PathState& path, int depth, const Vector3& position, const Vector3& normal, const Vector3& view)
+{
+    auto all_lights = [&](bool is_counted)
+    {
+        Scalar lightness = 0;
+        for (int light_i = 0; light_i < light_positions.size(); light_i++)
+            lightness += light_from(state, light_i, position, normal, view, is_counted);
+        return lightness;
+    };
+    const int selected = light_selection.lights;
+    if (selected <= 0 || selected >= light_positions.size())
+        return all_lights(true);
+
+    // The representatives of the most important nodes weighted by the power of their node, or lights drawn in
+    // proportion to their importance and weighted by the inverse of their probability, so that the expected light
+    // is that of all the lights
+    Scalar lightness = 0;
+    Vector3d tree_position = position.template cast<double>(), tree_normal = normal.template cast<double>();
+    if (light_selection.is_top_k)
+    {
+        light_tree.light_cut(tree_position, tree_normal, selected, state.light_cut);
+        for (const pair<double, int>& node : state.light_cut)
+        {
+            const LightTree::Node& cluster = light_tree.nodes[node.second];
+            lightness += Scalar(cluster.weight) * light_from(state, cluster.representative, position, normal, view, true);
+        }
+    }
+    else
+    {
+        for (int sample = 0; sample < selected; sample++)
+        {
+            double probability;
+            int light_i = light_tree.sample(tree_position, tree_normal, next_random(path.random_state), probability);
+            lightness += light_from(state, light_i, position, normal, view, true) / Scalar(probability * selected);
+        }
+    }
+
+    if (depth == 0 && path.is_light_checked)
+    {
+        Scalar exact = all_lights(false);
+        LightError& error = state.light_error;
+        error.points++;
+        error.selected += lightness;
+        error.exact += exact;
+        error.squared_error += double(lightness - exact) * (lightness - exact);
+    }
+    return lightness;
+}
+
+template <typename Scalar>
+BounceStats BasicTracer<Scalar>::bounce_totals() const
+{
+    BounceStats totals;
+    for (const ThreadState& state : threads)
+        totals += state.bounce_stats;
+    return totals;
+}
+
+template <typename Scalar>
+TraversalStats BasicTracer<Scalar>::secondary_totals() const
+{
+    TraversalStats totals;
+    for (const ThreadState& state : threads)
+        totals += state.secondary_stats;
+    return totals;
+}
+
+template <typename Scalar>
+TraversalStats BasicTracer<Scalar>::shadow_totals() const
+{
+    TraversalStats totals;
+    for (const ThreadState& state : threads)
+        for (const TraversalStats& stats : state.shadow_stats)
+            totals += stats;
+    return totals;
+}
+
+template <typename Scalar>
+LightError BasicTracer<Scalar>::light_error_totals() const
+{
+    LightError totals;
+    for (const ThreadState& state : threads)
+        totals += state.light_error;
+    return totals;
+}
+
+#ifdef INSTRUMENT_RENDER
+template <typename Scalar>
+void BasicTracer<Scalar>::thread_counters(int thread, long long& nodes_visited, long long& triangle_tests, long long& shadow_rays) const
+{
+    const ThreadState& state = threads[thread];
+    nodes_visited = state.secondary_stats.nodes_visited;
+    triangle_tests = state.secondary_stats.triangle_tests;
+    shadow_rays = 0;
+    for (const TraversalStats& stats : state.shadow_stats)
+    {
+        nodes_visited += stats.nodes_visited;
+        triangle_tests += stats.triangle_tests;
+        shadow_rays += stats.rays;
+    }
+}
+#endif
+
+template <typename Scalar>
+void BasicTracer<Scalar>::print_stats() const
+{
+    BounceStats bounce_stats = bounce_totals();
+    TraversalStats secondary_stats = secondary_totals();
+
+    std::cout << "Rays per bounce (depth limit " << budget.max_depth << ", " << budget.max_rays << " secondary rays per pixel, ";
+    if (budget.roulette_weight > 0)
+        std::cout << "roulette below a weight of " << budget.roulette_weight << " from bounce " << budget.roulette_depth << "):";
+    else
+        std::cout << "no roulette):";
+    for (int depth = 0; depth < bounce_stats.rays.size(); depth++)
+        std::cout << " " << bounce_stats.rays[depth];
+    std::cout << std::endl;
+    std::cout << "Paths stopped by the roulette: " << bounce_stats.stopped_by_roulette << ", by the ray budget: " << bounce_stats.stopped_by_budget
+              << ", by the depth limit: " << bounce_stats.stopped_by_depth << std::endl;
+    if (secondary_stats.rays > 0)
+        std::cout << "Average BVH nodes visited per secondary ray: " << double(secondary_stats.nodes_visited) / secondary_stats.rays
+                  << ", triangle tests per ray: " << double(secondary_stats.triangle_tests) / secondary_stats.rays << std::endl;
+
+    // One line per light, or one for all of them when there are many
+    const int printed_lights = 8;
+    auto print_shadow_stats = [](const string& name, const TraversalStats& shadow_stats)
+    {
+        double rays = max(1LL, shadow_stats.rays);
+        std::cout << name << ": " << shadow_stats.rays << " shadow rays, " << 100 * shadow_stats.occluded / rays << "% occluded ("
+                  << 100 * shadow_stats.cache_hits / rays << "% by the last occluder), " << shadow_stats.nodes_visited / rays << " nodes and "
+                  << shadow_stats.triangle_tests / rays << " triangle tests per ray" << std::endl;
+    };
+    if (light_positions.size() > printed_lights)
+        print_shadow_stats("All " + to_string(light_positions.size()) + " lights", shadow_totals());
+    else
+    {
+        for (int light_i = 0; light_i < light_positions.size(); light_i++)
+        {
+            TraversalStats shadow_stats;
+            for (const ThreadState& state : threads)
+                shadow_stats += state.shadow_stats[light_i];
+            print_shadow_stats("Light " + to_string(light_i), shadow_stats);
+        }
+    }
+
+    // Root mean square error of the direct light of the checked points, relative to their mean, and the bias of the mean
+    LightError error = light_error_totals();
+    if (light_selection.lights > 0 && light_selection.lights < light_positions.size())
+    {
+        std::cout << "Light selection: " << light_selection.lights << " of " << light_positions.size() << " lights per point, "
+                  << (light_selection.is_top_k ? "a cut of the light tree" : "drawn from the light tree");
+        if (error.points > 0 && error.exact > 0)
+            std::cout << ". Against all the lights on " << error.points << " primary hits: RMS error " << 100 * sqrt(error.squared_error / error.points) / (error.exact / error.points)
+                      << "% of the mean direct light, mean " << showpos << 100 * (error.selected / error.exact - 1) << noshowpos << "%";
+        std::cout << std::endl;
+    }
+}
+
+template class BasicTracer<double>;
+template class BasicTracer<float>;
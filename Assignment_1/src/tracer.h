@@ -0,0 +1,199 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <vector>
+#include <Eigen/Core>
+#include "bvh.h"
+#include "instances.h"
+#include "light_tree.h"
+
+// Surface properties of a mesh. The light that is neither reflected nor transmitted is shaded with
+// the diffuse and specular terms of the lights.
+struct Material
+{
+    Eigen::Vector3d color;
+    double reflectivity; // Fraction mirrored, e.g. 0.8 for the floor mirror
+    double transmission; // Fraction refracted through the surface, split with the reflection by the Fresnel term
+    double refractive_index;
+
+    Material(const Eigen::Vector3d& color = Eigen::Vector3d::Ones(), double reflectivity = 0, double transmission = 0, double refractive_index = 1.5)
+        : color(color), reflectivity(reflectivity), transmission(transmission), refractive_index(refractive_index) {}
+};
+
+// Split what leaves a surface hit along ray_direction between the mirror and the refraction. They start as the
+// reflectivity and the transmission of the material, then the Fresnel term moves part of the transmission to the
+// reflection, all of it on a total internal reflection. refracted_direction is set when transmitted > 0.
+template <typename Scalar>
+void split_reflection(const Material& material, const Eigen::Matrix<Scalar, 3, 1>& normal, const Eigen::Matrix<Scalar, 3, 1>& ray_direction, Scalar& reflected, Scalar& transmitted, Eigen::Matrix<Scalar, 3, 1>& refracted_direction);
+
+// Limits on the secondary rays spawned from one pixel
+struct RayBudget
+{
+    int max_depth;      // Bounces after the primary ray
+    int max_rays;       // Secondary rays per pixel, over all the bounces
+    int roulette_depth; // From this bounce on, the Russian roulette may drop rays
+    double roulette_weight; // Rays whose weight is below this survive with probability weight / roulette_weight, 0 for no roulette
+
+    // The roulette is off: with one sample per pixel, the rays it boosts leave speckles on mirrors and glass
+    RayBudget() : max_depth(8), max_rays(16), roulette_depth(2), roulette_weight(0) {}
+};
+
+// Point lights evaluated at each shading point, chosen with a LightTree when there are more of them
+struct LightSelection
+{
+    int lights;         // Lights per shading point, 0 for all of them
+    bool is_top_k;      // The lights of the k most important nodes of the tree instead of a random draw in proportion to importance
+    int check_interval; // One primary hit in check_interval is also shaded with all the lights, to measure the error
+
+    LightSelection() : lights(0), is_top_k(false), check_interval(1024) {}
+};
+
+// Direct light of the checked points with the selected lights and with all of them
+struct LightError
+{
+    long long points;
+    double selected, exact; // Sums over the points
+    double squared_error;
+
+    LightError() : points(0), selected(0), exact(0), squared_error(0) {}
+
+    LightError& operator+=(const LightError& other)
+    {
+        points += other.points;
+        selected += other.selected;
+        exact += other.exact;
+        squared_error += other.squared_error;
+        return *this;
+    }
+};
+
+// Rays traced at each bounce level (0 is the primary ray) and why the paths stopped
+struct BounceStats
+{
+    std::vector<long long> rays;
+    long long stopped_by_roulette;
+    long long stopped_by_budget;
+    long long stopped_by_depth;
+
+    BounceStats() : stopped_by_roulette(0), stopped_by_budget(0), stopped_by_depth(0) {}
+
+    BounceStats& operator+=(const BounceStats& other)
+    {
+        if (rays.size() < other.rays.size())
+            rays.resize(other.rays.size(), 0);
+        for (int depth = 0; depth < other.rays.size(); depth++)
+            rays[depth] += other.rays[depth];
+        stopped_by_roulette += other.stopped_by_roulette;
+        stopped_by_budget += other.stopped_by_budget;
+        stopped_by_depth += other.stopped_by_depth;
+        return *this;
+    }
+};
+
+// Whitted style shading of the triangle meshes of a BVH and of a list of spheres: lights with shadows, then mirror
+// reflection and refraction rays bounded by a RayBudget. Every thread of the renderer has its own counters and caches.
+// Rays, intersections and shading are in Scalar, double or float; the materials stay in double.
+template <typename Scalar>
+class BasicTracer
+{
+public:
+    typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+    typedef Eigen::Matrix<Scalar, 4, 1> Vector4;
+
+    RayBudget budget;
+    LightSelection light_selection;
+
+    // Instanced meshes and shapes tested after the BVH, nullptr if there are none. Instance::material is an index in instance_materials.
+    const BasicInstanceBVH<Scalar>* instances;
+    std::vector<Material> instance_materials;
+
+    // Spheres (x,y,z,r) tested after the BVH and the instances, with one material each
+    std::vector<Vector4> spheres;
+    std::vector<Material> sphere_materials;
+
+    // Shadow rays start this far from the surface so that they do not hit it again, as do reflected and refracted rays
+    Scalar epsilon;
+
+    // light_powers holds the power of each light with an inverse square falloff, 0 for the others
+    BasicTracer(const BasicBVH<Scalar>& bvh, const std::vector<Material>& materials, const std::vector<Eigen::Vector3d>& light_positions,
+                const std::vector<double>& light_powers, int thread_count);
+
+    // Set epsilon for the coordinates of the BVH, the instances and the spheres: 1e-6, unless they are so large that
+    // the rounding of a point on a surface is not far below it, which happens in float from about 10 units.
+    void fit_epsilon();
+
+    // Closest triangle, instance or sphere hit by the ray with 0 < t < t_max, returns false if there is none
+    bool intersect(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, TraversalStats* stats = nullptr) const;
+
+    // Replace the hit found in the BVH for a ray (if is_intersected) by the nearest instance or sphere in front of it.
+    // Used after BVH::intersect_packet() so that packets see them too.
+    void intersect_instances_and_spheres(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, Hit& hit, bool& is_intersected, TraversalStats* stats = nullptr) const;
+
+    // Whether a triangle, an instance or a sphere blocks the ray before t_max, last_occluder is the cache of BVH::occluded()
+    bool occluded(const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max, int* last_occluder = nullptr, TraversalStats* stats = nullptr) const;
+
+    // Material and unit normal at the point position of a hit, the normal points out of the mesh or the sphere
+    void surface(const Hit& hit, const Vector3& position, Material& material, Vector3& normal) const;
+
+    // Color seen along a primary ray that hit the scene. pixel seeds the Russian roulette, so that images
+    // do not depend on the order in which the pixels are rendered.
+    Vector3 shade(int thread, unsigned pixel, const Vector3& ray_origin, const Vector3& ray_direction, const Hit& hit);
+
+    // Print the rays per bounce level, the shadow rays of every light and the error of the light selection
+    void print_stats() const;
+
+    // Counters of all the threads: rays per bounce level, secondary rays, shadow rays of all the lights and error of the light selection
+    BounceStats bounce_totals() const;
+    TraversalStats secondary_totals() const;
+    TraversalStats shadow_totals() const;
+    LightError light_error_totals() const;
+
+#ifdef INSTRUMENT_RENDER
+    // Running counters of one thread over its secondary and shadow rays, read around each pixel to find its cost
+    void thread_counters(int thread, long long& nodes_visited, long long& triangle_tests, long long& shadow_rays) const;
+#endif
+
+private:
+    struct ThreadState
+    {
+        std::vector<TraversalStats> shadow_stats; // Per light
+        std::vector<int> last_occluders;          // Per light
+        TraversalStats secondary_stats;
+        BounceStats bounce_stats;
+        LightError light_error;
+        std::vector<std::pair<double, int>> light_cut;
+    };
+
+    // State of the path of one pixel
+    struct PathState
+    {
+        int rays_left;
+        unsigned random_state;
+        bool is_light_checked; // The primary hit is also shaded with all the lights
+    };
+
+    const BasicBVH<Scalar>& bvh;
+    const std::vector<Material>& materials;
+    std::vector<Vector3> light_positions;
+    std::vector<Scalar> light_powers;
+    LightTree light_tree;
+    std::vector<ThreadState> threads;
+
+    // Color seen along a ray that hit after depth bounces, weight is the product of the reflection and
+    // transmission factors along its path (its contribution to the pixel)
+    Vector3 shade_hit(ThreadState& state, PathState& path, int depth, Scalar weight, const Vector3& ray_origin, const Vector3& ray_direction, const Hit& hit);
+
+    // Trace a secondary ray and shade what it hits, black if it leaves the scene or is dropped by the budget
+    Vector3 trace(ThreadState& state, PathState& path, int depth, Scalar weight, const Vector3& ray_origin, const Vector3& ray_direction);
+
+    // Diffuse and specular light reaching the point from the lights that are not occluded, all of them or those of
+    // light_selection. The point of a checked primary hit is shaded with all the lights too, into the light error.
+    Scalar direct_light(ThreadState& state, PathState& path, int depth, const Vector3& position, const Vector3& normal, const Vector3& view);
+
+    // Light of one light on the point, 0 if it is occluded. The shadow ray is counted in the stats of the light if is_counted.
+    Scalar light_from(ThreadState& state, int light_i, const Vector3& position, const Vector3& normal, const Vector3& view, bool is_counted);
+};
+
+typedef BasicTracer<double> Tracer;
+
+#endif
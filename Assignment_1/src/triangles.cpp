@@ -0,0 +1,358 @@
+#include "triangles.h"
+
+#include <algorithm>
+#include <cmath>
+#include <Eigen/Geometry>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Number of triangles tested together by the vector kernel, a 256-bit register of Scalar
+    template <typename Scalar>
+    constexpr int kernel_lanes()
+    {
+        return 32 / sizeof(Scalar);
+    }
+
+#ifdef __AVX2__
+    // The AVX2 instructions of the kernels for each Scalar, so that the same code tests 4 doubles or 8 floats
+    template <typename Scalar>
+    struct Simd;
+
+    template <>
+    struct Simd<double>
+    {
+        typedef __m256d Vector;
+
+        static Vector set1(double x) { return _mm256_set1_pd(x); }
+        static Vector zero() { return _mm256_setzero_pd(); }
+        static Vector lane_index() { return _mm256_set_pd(3, 2, 1, 0); }
+        static Vector load(const double* p) { return _mm256_loadu_pd(p); }
+        static Vector load(const double* p, Vector mask) { return _mm256_maskload_pd(p, _mm256_castpd_si256(mask)); }
+        static void store(double* p, Vector x) { _mm256_storeu_pd(p, x); }
+        static Vector add(Vector x, Vector y) { return _mm256_add_pd(x, y); }
+        static Vector sub(Vector x, Vector y) { return _mm256_sub_pd(x, y); }
+        static Vector mul(Vector x, Vector y) { return _mm256_mul_pd(x, y); }
+        static Vector fmadd(Vector x, Vector y, Vector z) { return _mm256_fmadd_pd(x, y, z); }
+        static Vector fmsub(Vector x, Vector y, Vector z) { return _mm256_fmsub_pd(x, y, z); }
+        static Vector bit_and(Vector x, Vector y) { return _mm256_and_pd(x, y); }
+        static Vector bit_xor(Vector x, Vector y) { return _mm256_xor_pd(x, y); }
+        static Vector less(Vector x, Vector y) { return _mm256_cmp_pd(x, y, _CMP_LT_OQ); }
+        static Vector less_equal(Vector x, Vector y) { return _mm256_cmp_pd(x, y, _CMP_LE_OQ); }
+        static int movemask(Vector x) { return _mm256_movemask_pd(x); }
+    };
+
+    template <>
+    struct Simd<float>
+    {
+        typedef __m256 Vector;
+
+        static Vector set1(float x) { return _mm256_set1_ps(x); }
+        static Vector zero() { return _mm256_setzero_ps(); }
+        static Vector lane_index() { return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0); }
+        static Vector load(const float* p) { return _mm256_loadu_ps(p); }
+        static Vector load(const float* p, Vector mask) { return _mm256_maskload_ps(p, _mm256_castps_si256(mask)); }
+        static void store(float* p, Vector x) { _mm256_storeu_ps(p, x); }
+        static Vector add(Vector x, Vector y) { return _mm256_add_ps(x, y); }
+        static Vector sub(Vector x, Vector y) { return _mm256_sub_ps(x, y); }
+        static Vector mul(Vector x, Vector y) { return _mm256_mul_ps(x, y); }
+        static Vector fmadd(Vector x, Vector y, Vector z) { return _mm256_fmadd_ps(x, y, z); }
+        static Vector fmsub(Vector x, Vector y, Vector z) { return _mm256_fmsub_ps(x, y, z); }
+        static Vector bit_and(Vector x, Vector y) { return _mm256_and_ps(x, y); }
+        static Vector bit_xor(Vector x, Vector y) { return _mm256_xor_ps(x, y); }
+        static Vector less(Vector x, Vector y) { return _mm256_cmp_ps(x, y, _CMP_LT_OQ); }
+        static Vector less_equal(Vector x, Vector y) { return _mm256_cmp_ps(x, y, _CMP_LE_OQ); }
+        static int movemask(Vector x) { return _mm256_movemask_ps(x); }
+    };
+#endif
+}
+
+template <typename Scalar>
+void BasicTriangleStore<Scalar>::clear()
+{
+    for (vector<Scalar>* component : {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &ngx, &ngy, &ngz, &nx, &ny, &nz})
+        component->clear();
+    mesh.clear();
+    face.clear();
+}
+
+template <typename Scalar>
+template <typename Other>
+void BasicTriangleStore<Scalar>::assign(const BasicTriangleStore<Other>& other)
+{
+    vector<Scalar>* components[] = {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &ngx, &ngy, &ngz, &nx, &ny, &nz};
+    const vector<Other>* other_components[] = {&other.ax, &other.ay, &other.az, &other.e1x, &other.e1y, &other.e1z, &other.e2x, &other.e2y,
+                                               &other.e2z, &other.ngx, &other.ngy, &other.ngz, &other.nx, &other.ny, &other.nz};
+    for (int k = 0; k < 15; k++)
+        components[k]->assign(other_components[k]->begin(), other_components[k]->begin() + other.size());
+    mesh = other.mesh;
+    face = other.face;
+    finalize();
+}
+
+template <typename Scalar>
+void BasicTriangleStore<Scalar>::add(const Vector3d& a, const Vector3d& b, const Vector3d& c, int mesh_i, int face_i)
+{
+    // Drop the padding of a previous finalize()
+    int i = mesh.size();
+    for (vector<Scalar>* component : {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &ngx, &ngy, &ngz, &nx, &ny, &nz})
+        component->resize(i + 1);
+    mesh.push_back(mesh_i);
+    face.push_back(face_i);
+    set(i, a, b, c, mesh_i, face_i);
+}
+
+template <typename Scalar>
+void BasicTriangleStore<Scalar>::set(int i, const Vector3d& a, const Vector3d& b, const Vector3d& c, int mesh_i, int face_i)
+{
+    Vector3d e1 = a - b;
+    Vector3d e2 = c - a;
+    Vector3d ng = (b - a).cross(c - a);
+    Vector3d n = (b - a).cross(c - b).normalized();
+
+    ax[i] = a(0); ay[i] = a(1); az[i] = a(2);
+    e1x[i] = e1(0); e1y[i] = e1(1); e1z[i] = e1(2);
+    e2x[i] = e2(0); e2y[i] = e2(1); e2z[i] = e2(2);
+    ngx[i] = ng(0); ngy[i] = ng(1); ngz[i] = ng(2);
+    nx[i] = n(0); ny[i] = n(1); nz[i] = n(2);
+    mesh[i] = mesh_i;
+    face[i] = face_i;
+}
+
+template <typename Scalar>
+void BasicTriangleStore<Scalar>::finalize()
+{
+    // Degenerate triangles (zero edges) are never hit
+    for (vector<Scalar>* component : {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &ngx, &ngy, &ngz, &nx, &ny, &nz})
+        component->resize(mesh.size() + kernel_lanes<Scalar>() - 1, Scalar(0));
+}
+
+template <typename Scalar>
+int BasicTriangleStore<Scalar>::intersect(int first, int count, const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max) const
+{
+    return intersect_range<false>(first, count, ray_origin, ray_direction, t_max);
+}
+
+template <typename Scalar>
+int BasicTriangleStore<Scalar>::occluded(int first, int count, const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max) const
+{
+    return intersect_range<true>(first, count, ray_origin, ray_direction, t_max);
+}
+
+template <typename Scalar>
+template <bool any_hit>
+int BasicTriangleStore<Scalar>::intersect_range(int first, int count, const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max) const
+{
+    const Scalar dx = ray_direction(0), dy = ray_direction(1), dz = ray_direction(2);
+    const Scalar ox = ray_origin(0), oy = ray_origin(1), oz = ray_origin(2);
+    int nearest = -1;
+    int end = first + count;
+
+    // Work on raw pointers and a local t_max, so that the compiler knows the output does not alias the arrays
+    const Scalar *a_x = ax.data(), *a_y = ay.data(), *a_z = az.data();
+    const Scalar *e1_x = e1x.data(), *e1_y = e1y.data(), *e1_z = e1z.data();
+    const Scalar *e2_x = e2x.data(), *e2_y = e2y.data(), *e2_z = e2z.data();
+    const Scalar *ng_x = ngx.data(), *ng_y = ngy.data(), *ng_z = ngz.data();
+    Scalar t_nearest = t_max;
+
+#ifdef __AVX2__
+    typedef Simd<Scalar> S;
+    typedef typename S::Vector Vector;
+    const int lanes = kernel_lanes<Scalar>();
+    const Vector d_x = S::set1(dx), d_y = S::set1(dy), d_z = S::set1(dz);
+    const Vector o_x = S::set1(ox), o_y = S::set1(oy), o_z = S::set1(oz);
+    const Vector zero = S::zero();
+    const Vector sign_bit = S::set1(-0.);
+    const Vector lane_index = S::lane_index();
+
+    for (int i = first; i < end; i += lanes)
+    {
+        // c = a - o, r = c x d
+        Vector c_x = S::sub(S::load(a_x + i), o_x);
+        Vector c_y = S::sub(S::load(a_y + i), o_y);
+        Vector c_z = S::sub(S::load(a_z + i), o_z);
+        Vector r_x = S::fmsub(c_y, d_z, S::mul(c_z, d_y));
+        Vector r_y = S::fmsub(c_z, d_x, S::mul(c_x, d_z));
+        Vector r_z = S::fmsub(c_x, d_y, S::mul(c_y, d_x));
+
+        // det = d . ng, u = (e2 . r) / det, v = (e1 . r) / det, t = (c . ng) / det
+        Vector n_x = S::load(ng_x + i), n_y = S::load(ng_y + i), n_z = S::load(ng_z + i);
+        Vector det = S::fmadd(n_z, d_z, S::fmadd(n_y, d_y, S::mul(n_x, d_x)));
+        Vector u = S::fmadd(S::load(e2_z + i), r_z, S::fmadd(S::load(e2_y + i), r_y, S::mul(S::load(e2_x + i), r_x)));
+        Vector v = S::fmadd(S::load(e1_z + i), r_z, S::fmadd(S::load(e1_y + i), r_y, S::mul(S::load(e1_x + i), r_x)));
+        Vector t = S::fmadd(n_z, c_z, S::fmadd(n_y, c_y, S::mul(n_x, c_x)));
+
+        // Compare the numerators against |det| instead of dividing, the sign of det is moved to them.
+        // Parallel rays (det = 0) can only pass u = v = 0 and then fail 0 < t < 0
+        Vector det_sign = S::bit_and(det, sign_bit);
+        Vector det_abs = S::bit_xor(det, det_sign);
+        u = S::bit_xor(u, det_sign);
+        v = S::bit_xor(v, det_sign);
+        t = S::bit_xor(t, det_sign);
+        Vector mask = S::bit_and(S::less_equal(zero, u), S::less_equal(zero, v));
+        mask = S::bit_and(mask, S::less_equal(S::add(u, v), det_abs));
+        mask = S::bit_and(mask, S::less(zero, t));
+        mask = S::bit_and(mask, S::less(t, S::mul(S::set1(t_nearest), det_abs)));
+        mask = S::bit_and(mask, S::less(lane_index, S::set1(end - i)));
+
+        // Only the few lanes that pass are divided
+        int hits = S::movemask(mask);
+        if (any_hit && hits)
+        {
+            int lane = 0;
+            while (!(hits & (1 << lane)))
+                lane++;
+            return i + lane;
+        }
+        if (hits)
+        {
+            Scalar t_lanes[lanes], det_lanes[lanes];
+            S::store(t_lanes, t);
+            S::store(det_lanes, det_abs);
+            for (int lane = 0; lane < lanes; lane++)
+            {
+                Scalar t_hit = t_lanes[lane] / det_lanes[lane];
+                if ((hits & (1 << lane)) && t_hit < t_nearest)
+                {
+                    t_nearest = t_hit;
+                    nearest = i + lane;
+                }
+            }
+        }
+    }
+#else
+    for (int i = first; i < end; i++)
+    {
+        // Same test as the vector kernel, without the fused multiply-adds
+        Scalar c_x = a_x[i] - ox;
+        Scalar c_y = a_y[i] - oy;
+        Scalar c_z = a_z[i] - oz;
+        Scalar r_x = c_y * dz - c_z * dy;
+        Scalar r_y = c_z * dx - c_x * dz;
+        Scalar r_z = c_x * dy - c_y * dx;
+
+        Scalar det = ng_x[i] * dx + ng_y[i] * dy + ng_z[i] * dz;
+        Scalar sign = copysign(Scalar(1), det);
+        Scalar det_abs = fabs(det);
+        Scalar u = sign * (e2_x[i] * r_x + e2_y[i] * r_y + e2_z[i] * r_z);
+        Scalar v = sign * (e1_x[i] * r_x + e1_y[i] * r_y + e1_z[i] * r_z);
+        Scalar t = sign * (ng_x[i] * c_x + ng_y[i] * c_y + ng_z[i] * c_z);
+
+        if (any_hit && u >= 0 && v >= 0 && u + v <= det_abs && t > 0 && t < t_nearest * det_abs)
+            return i;
+        if (u >= 0 && v >= 0 && u + v <= det_abs && t > 0 && t < t_nearest * det_abs && t / det_abs < t_nearest)
+        {
+            t_nearest = t / det_abs;
+            nearest = i;
+        }
+    }
+#endif
+
+    t_max = t_nearest;
+    return nearest;
+}
+
+template <typename Scalar>
+template <int N>
+void BasicTriangleStore<Scalar>::intersect_packet(int first, int count, const RayPacket<N, Scalar>& packet, unsigned mask, Scalar t_max[N], int nearest[N]) const
+{
+    int end = first + count;
+
+#ifdef __AVX2__
+    typedef Simd<Scalar> S;
+    typedef typename S::Vector Vector;
+    const int lanes = kernel_lanes<Scalar>();
+    const Vector zero = S::zero();
+    const Vector sign_bit = S::set1(-0.);
+
+    // A packet smaller than a vector, 4 rays in float, is loaded in the lanes of this mask
+    const bool is_partial = N < lanes;
+    const Vector load_mask = S::less(S::lane_index(), S::set1(min(N, lanes)));
+    auto load = [&](const Scalar* p) { return is_partial ? S::load(p, load_mask) : S::load(p); };
+
+    for (int i = first; i < end; i++)
+    {
+        const Vector a_x = S::set1(ax[i]), a_y = S::set1(ay[i]), a_z = S::set1(az[i]);
+        const Vector e1_x = S::set1(e1x[i]), e1_y = S::set1(e1y[i]), e1_z = S::set1(e1z[i]);
+        const Vector e2_x = S::set1(e2x[i]), e2_y = S::set1(e2y[i]), e2_z = S::set1(e2z[i]);
+        const Vector n_x = S::set1(ngx[i]), n_y = S::set1(ngy[i]), n_z = S::set1(ngz[i]);
+
+        for (int group = 0; group < N; group += lanes)
+        {
+            int group_mask = (mask >> group) & ((1u << lanes) - 1);
+            if (!group_mask)
+                continue;
+
+            const Vector d_x = load(packet.dx + group), d_y = load(packet.dy + group), d_z = load(packet.dz + group);
+
+            // Same operations as intersect(), with the triangle broadcast and the rays in the lanes
+            Vector c_x = S::sub(a_x, load(packet.ox + group));
+            Vector c_y = S::sub(a_y, load(packet.oy + group));
+            Vector c_z = S::sub(a_z, load(packet.oz + group));
+            Vector r_x = S::fmsub(c_y, d_z, S::mul(c_z, d_y));
+            Vector r_y = S::fmsub(c_z, d_x, S::mul(c_x, d_z));
+            Vector r_z = S::fmsub(c_x, d_y, S::mul(c_y, d_x));
+
+            Vector det = S::fmadd(n_z, d_z, S::fmadd(n_y, d_y, S::mul(n_x, d_x)));
+            Vector u = S::fmadd(e2_z, r_z, S::fmadd(e2_y, r_y, S::mul(e2_x, r_x)));
+            Vector v = S::fmadd(e1_z, r_z, S::fmadd(e1_y, r_y, S::mul(e1_x, r_x)));
+            Vector t = S::fmadd(n_z, c_z, S::fmadd(n_y, c_y, S::mul(n_x, c_x)));
+
+            Vector det_sign = S::bit_and(det, sign_bit);
+            Vector det_abs = S::bit_xor(det, det_sign);
+            u = S::bit_xor(u, det_sign);
+            v = S::bit_xor(v, det_sign);
+            t = S::bit_xor(t, det_sign);
+            Vector hit_mask = S::bit_and(S::less_equal(zero, u), S::less_equal(zero, v));
+            hit_mask = S::bit_and(hit_mask, S::less_equal(S::add(u, v), det_abs));
+            hit_mask = S::bit_and(hit_mask, S::less(zero, t));
+            hit_mask = S::bit_and(hit_mask, S::less(t, S::mul(load(t_max + group), det_abs)));
+
+            int hits = S::movemask(hit_mask) & group_mask;
+            if (hits)
+            {
+                Scalar t_lanes[lanes], det_lanes[lanes];
+                S::store(t_lanes, t);
+                S::store(det_lanes, det_abs);
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                    Scalar t_hit = t_lanes[lane] / det_lanes[lane];
+                    if ((hits & (1 << lane)) && t_hit < t_max[group + lane])
+                    {
+                        t_max[group + lane] = t_hit;
+                        nearest[group + lane] = i;
+                    }
+                }
+            }
+        }
+    }
+#else
+    for (int lane = 0; lane < N; lane++)
+    {
+        if (mask & (1u << lane))
+        {
+            Vector3 ray_origin(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+            Vector3 ray_direction(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+            int hit = intersect(first, count, ray_origin, ray_direction, t_max[lane]);
+            if (hit >= 0)
+                nearest[lane] = hit;
+        }
+    }
+#endif
+}
+
+template class BasicTriangleStore<double>;
+template class BasicTriangleStore<float>;
+
+template void BasicTriangleStore<float>::assign(const BasicTriangleStore<double>&);
+
+template void BasicTriangleStore<double>::intersect_packet<4>(int, int, const RayPacket<4, double>&, unsigned, double[4], int[4]) const;
+template void BasicTriangleStore<double>::intersect_packet<8>(int, int, const RayPacket<8, double>&, unsigned, double[8], int[8]) const;
+template void BasicTriangleStore<float>::intersect_packet<4>(int, int, const RayPacket<4, float>&, unsigned, float[4], int[4]) const;
+template void BasicTriangleStore<float>::intersect_packet<8>(int, int, const RayPacket<8, float>&, unsigned, float[8], int[8]) const;
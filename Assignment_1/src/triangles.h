@@ -0,0 +1,68 @@
+#ifndef TRIANGLES_H
+#define TRIANGLES_H
+
+#include <vector>
+#include <Eigen/Core>
+#include "packet.h"
+
+// Triangles preprocessed for ray intersection and stored as a structure of arrays, so that
+// the kernel reads the same component of consecutive triangles with a single vector load.
+// Each triangle abc keeps a, the edges a - b and c - a, the geometric normal (b - a) x (c - a) used by
+// the intersection and the unit normal used for shading.
+// Scalar is double, or float for the float renders: a vector then tests 8 triangles instead of 4.
+template <typename Scalar>
+class BasicTriangleStore
+{
+public:
+    typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+
+    std::vector<Scalar> ax, ay, az;
+    std::vector<Scalar> e1x, e1y, e1z;
+    std::vector<Scalar> e2x, e2y, e2z;
+    std::vector<Scalar> ngx, ngy, ngz;
+    std::vector<Scalar> nx, ny, nz;
+
+    // Mesh and face the triangle comes from
+    std::vector<int> mesh, face;
+
+    // Remove all the triangles
+    void clear();
+
+    // Copy the triangles of other, the edges and normals are rounded from those of other rather than recomputed
+    template <typename Other>
+    void assign(const BasicTriangleStore<Other>& other);
+
+    // Add the triangle abc of the given mesh and face, the normal is (b - a) x (c - b) normalized
+    void add(const Eigen::Vector3d& a, const Eigen::Vector3d& b, const Eigen::Vector3d& c, int mesh_i, int face_i);
+
+    // Replace the triangle i, e.g. once its vertices moved. The padding of finalize() is kept.
+    void set(int i, const Eigen::Vector3d& a, const Eigen::Vector3d& b, const Eigen::Vector3d& c, int mesh_i, int face_i);
+
+    // Pad the arrays so that the kernel can load a full vector past the last triangle, call after the last add()
+    void finalize();
+
+    int size() const { return mesh.size(); }
+
+    Vector3 normal(int i) const { return Vector3(nx[i], ny[i], nz[i]); }
+
+    // Möller–Trumbore test (with the precomputed normal) of the triangles [first, first + count).
+    // Returns the index of the closest one hit with 0 < t < t_max and lowers t_max to its distance, -1 if none is hit.
+    int intersect(int first, int count, const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max) const;
+
+    // Same test for shadow rays: returns the first triangle found with 0 < t < t_max, not necessarily the closest, -1 if none is hit
+    int occluded(int first, int count, const Vector3& ray_origin, const Vector3& ray_direction, Scalar t_max) const;
+
+    // Same test for the lanes of a packet whose bit is set in mask, one triangle against 4 rays (8 in float) per vector instruction.
+    // For each lane, lowers t_max[lane] and sets nearest[lane] to the triangle hit; lane by lane the results are identical to intersect().
+    template <int N>
+    void intersect_packet(int first, int count, const RayPacket<N, Scalar>& packet, unsigned mask, Scalar t_max[N], int nearest[N]) const;
+
+private:
+    // Kernel of intersect() and occluded(), with any_hit it returns as soon as a triangle passes
+    template <bool any_hit>
+    int intersect_range(int first, int count, const Vector3& ray_origin, const Vector3& ray_direction, Scalar& t_max) const;
+};
+
+typedef BasicTriangleStore<double> TriangleStore;
+
+#endif
@@ -0,0 +1,576 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Triangles tested together by the float test, and padding of the float arrays for its loads
+    const int lanes = 8;
+
+    // Bound of the relative rounding error of the float test, about 70 times the epsilon of a float. A true hit can
+    // miss by that much, relative to the magnitudes of the terms, and still passes to the test in doubles.
+    const float tolerance = 4e-6f;
+
+    // 2^exponent, as the traversal decodes the boxes
+    inline double power_of_two(int exponent)
+    {
+        uint64_t bits = uint64_t(exponent + 1023) << 52;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // Largest float not above value
+    inline float float_below(double value)
+    {
+        float rounded = float(value);
+        return rounded > value ? nextafterf(rounded, -numeric_limits<float>::infinity()) : rounded;
+    }
+
+    double surface_area(const Vector3d& box_min, const Vector3d& box_max)
+    {
+        Vector3d extent = (box_max - box_min).cwiseMax(0.);
+        return 2 * (extent(0) * extent(1) + extent(1) * extent(2) + extent(2) * extent(0));
+    }
+
+#ifdef INSTRUMENT_RENDER
+    void count_mesh_tests(const TriangleStore& triangles, const vector<int>& primitive, TraversalStats* stats, int first, int count)
+    {
+        if (!stats)
+            return;
+        for (int k = first; k < first + count; k++)
+        {
+            int mesh = triangles.mesh[primitive[k]];
+            if (stats->mesh_triangle_tests.size() <= mesh)
+                stats->mesh_triangle_tests.resize(mesh + 1, 0);
+            stats->mesh_triangle_tests[mesh]++;
+        }
+    }
+#endif
+}
+
+// A child while the tree is collapsed: a node of the binary tree, or a range of the triangles of a leaf that has more
+// than a child can hold
+template <int Width>
+struct WideBVH<Width>::Child
+{
+    int node; // In BVH::nodes, -1 for a part of a leaf
+    int first, count; // Triangles of a leaf or of a part of one, count is 0 for an inner node
+    Vector3d box_min, box_max;
+};
+
+// The ray as both tests need it
+template <int Width>
+struct WideBVH<Width>::Ray
+{
+    double origin[3], inverse[3];
+    float origin_f[3], direction_f[3];
+
+    // |x| + |y| + |z| of the direction, and of the origin plus the magnitude of the vertices
+    float direction_norm, offset_norm;
+
+    Ray(const Vector3d& ray_origin, const Vector3d& ray_direction, float magnitude)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            origin[axis] = ray_origin(axis);
+            inverse[axis] = 1. / ray_direction(axis);
+            origin_f[axis] = float(ray_origin(axis));
+            direction_f[axis] = float(ray_direction(axis));
+        }
+        direction_norm = float(ray_direction.cwiseAbs().sum());
+        offset_norm = float(ray_origin.cwiseAbs().sum()) + magnitude;
+    }
+};
+
+template <int Width>
+void WideBVH<Width>::build(const BVH& bvh)
+{
+    nodes.clear();
+    for (vector<float>* component : {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z})
+        component->clear();
+    primitive.clear();
+    magnitude = 0;
+    if (bvh.nodes.empty() || bvh.triangles.size() == 0)
+        return;
+
+    const TriangleStore& triangles = bvh.triangles;
+    for (int i = 0; i < triangles.size(); i++)
+    {
+        // Bounds the corners a, b = a - e1 and c = a + e2
+        double bound = fabs(triangles.ax[i]) + fabs(triangles.ay[i]) + fabs(triangles.az[i]) + fabs(triangles.e1x[i]) + fabs(triangles.e1y[i])
+                     + fabs(triangles.e1z[i]) + fabs(triangles.e2x[i]) + fabs(triangles.e2y[i]) + fabs(triangles.e2z[i]);
+        magnitude = max(magnitude, float(bound));
+    }
+
+    const BVH::Node& root = bvh.nodes[0];
+    Child root_child = {0, root.count > 0 ? root.first : 0, root.count, root.box_min, root.box_max};
+    nodes.reserve(bvh.nodes.size() / 2 + 1);
+    nodes.push_back(Node());
+    build_node(bvh, 0, expand(bvh, root_child));
+    nodes.shrink_to_fit();
+
+    for (vector<float>* component : {&ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z})
+        component->resize(primitive.size() + lanes - 1, 0.f);
+}
+
+template <int Width>
+vector<typename WideBVH<Width>::Child> WideBVH<Width>::expand(const BVH& bvh, const Child& child) const
+{
+    const int max_leaf_size = 255;
+    vector<Child> children;
+
+    // A leaf that fits is its own child, a bigger one is cut into Width parts that are cut again if needed
+    if (child.count > 0)
+    {
+        if (child.count <= max_leaf_size)
+            return {child};
+        int parts = min(Width, (child.count + max_leaf_size - 1) / max_leaf_size);
+        for (int part = 0; part < parts; part++)
+        {
+            int first = child.first + long(child.count) * part / parts;
+            int end = child.first + long(child.count) * (part + 1) / parts;
+            children.push_back({-1, first, end - first, child.box_min, child.box_max});
+        }
+        return children;
+    }
+
+    // Pull up the children of the largest inner child until the node is full
+    const BVH::Node& node = bvh.nodes[child.node];
+    for (int k = 0; k < 2; k++)
+    {
+        const BVH::Node& binary_child = bvh.nodes[node.first + k];
+        children.push_back({node.first + k, binary_child.first, binary_child.count, binary_child.box_min, binary_child.box_max});
+    }
+    while (children.size() < Width)
+    {
+        int largest = -1;
+        double largest_area = -1;
+        for (int k = 0; k < children.size(); k++)
+        {
+            double area = surface_area(children[k].box_min, children[k].box_max);
+            if (children[k].count == 0 && area > largest_area)
+            {
+                largest = k;
+                largest_area = area;
+            }
+        }
+        if (largest < 0)
+            break;
+
+        const BVH::Node& pulled = bvh.nodes[children[largest].node];
+        const BVH::Node& left = bvh.nodes[pulled.first];
+        const BVH::Node& right = bvh.nodes[pulled.first + 1];
+        children[largest] = {pulled.first, left.first, left.count, left.box_min, left.box_max};
+        children.insert(children.begin() + largest + 1, {pulled.first + 1, right.first, right.count, right.box_min, right.box_max});
+    }
+    return children;
+}
+
+template <int Width>
+void WideBVH<Width>::build_node(const BVH& bvh, int index, const vector<Child>& children)
+{
+    Node node;
+    memset(&node, 0, sizeof(node));
+    node.child_count = children.size();
+
+    Vector3d box_min = children[0].box_min, box_max = children[0].box_max;
+    for (const Child& child : children)
+    {
+        box_min = box_min.cwiseMin(child.box_min);
+        box_max = box_max.cwiseMax(child.box_max);
+    }
+
+    // The smallest power of two that spans the box in 255 steps from a float origin below it. The decoded planes are
+    // exact in doubles, and every one is moved outwards until it holds the box of the child.
+    for (int axis = 0; axis < 3; axis++)
+    {
+        node.origin[axis] = float_below(box_min(axis));
+        double origin = node.origin[axis];
+        double extent = box_max(axis) - origin;
+        int exponent = extent > 0 ? max(-126, int(ceil(log2(extent / 255)))) : -126;
+        while (exponent > -126 && origin + 255 * power_of_two(exponent - 1) >= box_max(axis))
+            exponent--;
+        while (origin + 255 * power_of_two(exponent) < box_max(axis))
+            exponent++;
+        node.exponent[axis] = exponent;
+
+        double scale = power_of_two(exponent);
+        for (int k = 0; k < Width; k++)
+        {
+            if (k >= children.size())
+            {
+                node.lo[axis][k] = 255;
+                node.hi[axis][k] = 0;
+                continue;
+            }
+            int lo = int(clamp(floor((children[k].box_min(axis) - origin) / scale), 0., 255.));
+            int hi = int(clamp(ceil((children[k].box_max(axis) - origin) / scale), 0., 255.));
+            while (lo > 0 && origin + lo * scale > children[k].box_min(axis))
+                lo--;
+            while (hi < 255 && origin + hi * scale < children[k].box_max(axis))
+                hi++;
+            node.lo[axis][k] = lo;
+            node.hi[axis][k] = hi;
+        }
+    }
+
+    // Copy the triangles of the leaf children, then make room for the inner ones
+    const TriangleStore& triangles = bvh.triangles;
+    node.first_triangle = primitive.size();
+    int inner_count = 0;
+    for (int k = 0; k < children.size(); k++)
+    {
+        const Child& child = children[k];
+        bool is_leaf = child.count > 0 && child.count <= 255;
+        inner_count += !is_leaf;
+        if (!is_leaf)
+            continue;
+
+        node.triangle_count[k] = child.count;
+        for (int i = child.first; i < child.first + child.count; i++)
+        {
+            ax.push_back(triangles.ax[i]); ay.push_back(triangles.ay[i]); az.push_back(triangles.az[i]);
+            e1x.push_back(triangles.e1x[i]); e1y.push_back(triangles.e1y[i]); e1z.push_back(triangles.e1z[i]);
+            e2x.push_back(triangles.e2x[i]); e2y.push_back(triangles.e2y[i]); e2z.push_back(triangles.e2z[i]);
+            primitive.push_back(i);
+        }
+    }
+    node.first_child = nodes.size();
+    nodes.resize(nodes.size() + inner_count);
+    nodes[index] = node;
+
+    int inner = 0;
+    for (const Child& child : children)
+    {
+        if (child.count == 0 || child.count > 255)
+            build_node(bvh, node.first_child + inner++, expand(bvh, child));
+    }
+}
+
+template <int Width>
+unsigned WideBVH<Width>::intersect_children(const Node& node, const Ray& ray, double t_max, double t_entries[Width]) const
+{
+#ifdef __AVX2__
+    // 4 children per vector, with the arithmetic of BVH::intersect_box() on the decoded planes. The order of the
+    // operands of min and max makes them skip the NaN of a ray that lies in a plane, as intersect_box() does.
+    unsigned mask = 0;
+    for (int group = 0; group < Width; group += 4)
+    {
+        __m256d t_near = _mm256_setzero_pd();
+        __m256d t_far = _mm256_set1_pd(t_max);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const __m256d scale = _mm256_set1_pd(power_of_two(node.exponent[axis]));
+            const __m256d origin = _mm256_set1_pd(node.origin[axis]);
+            const __m256d ray_origin = _mm256_set1_pd(ray.origin[axis]);
+            const __m256d inverse = _mm256_set1_pd(ray.inverse[axis]);
+            int lo_bytes, hi_bytes;
+            memcpy(&lo_bytes, node.lo[axis] + group, 4);
+            memcpy(&hi_bytes, node.hi[axis] + group, 4);
+            __m256d lo = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(lo_bytes)));
+            __m256d hi = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(hi_bytes)));
+            __m256d t_0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_fmadd_pd(lo, scale, origin), ray_origin), inverse);
+            __m256d t_1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_fmadd_pd(hi, scale, origin), ray_origin), inverse);
+            t_near = _mm256_max_pd(_mm256_min_pd(t_1, t_0), t_near);
+            t_far = _mm256_min_pd(_mm256_max_pd(t_0, t_1), t_far);
+        }
+        _mm256_storeu_pd(t_entries + group, t_near);
+        mask |= _mm256_movemask_pd(_mm256_cmp_pd(t_near, t_far, _CMP_LE_OQ)) << group;
+    }
+    return mask & ((1u << node.child_count) - 1);
+#else
+    unsigned mask = 0;
+    for (int k = 0; k < node.child_count; k++)
+    {
+        double t_near = 0;
+        double t_far = t_max;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double scale = power_of_two(node.exponent[axis]);
+            double t_0 = (node.origin[axis] + node.lo[axis][k] * scale - ray.origin[axis]) * ray.inverse[axis];
+            double t_1 = (node.origin[axis] + node.hi[axis][k] * scale - ray.origin[axis]) * ray.inverse[axis];
+            if (t_0 > t_1)
+                swap(t_0, t_1);
+            t_near = max(t_near, t_0);
+            t_far = min(t_far, t_1);
+        }
+        t_entries[k] = t_near;
+        if (t_near <= t_far)
+            mask |= 1u << k;
+    }
+    return mask;
+#endif
+}
+
+template <int Width>
+unsigned WideBVH<Width>::candidates(int first, int count, const Ray& ray, double t_max) const
+{
+    // Möller–Trumbore as in TriangleStore, with the normal e2 x e1 computed from the edges. Each comparison is loosened
+    // by the rounding error bound of its terms: |c| + offset_norm for c = a - o, the norm of the edges and of d.
+    float t_limit = float(min(t_max, double(numeric_limits<float>::max())));
+    if (t_limit < t_max)
+        t_limit = nextafterf(t_limit, numeric_limits<float>::infinity());
+    const float dx = ray.direction_f[0], dy = ray.direction_f[1], dz = ray.direction_f[2];
+    const float ox = ray.origin_f[0], oy = ray.origin_f[1], oz = ray.origin_f[2];
+
+#ifdef __AVX2__
+    const __m256 d_x = _mm256_set1_ps(dx), d_y = _mm256_set1_ps(dy), d_z = _mm256_set1_ps(dz);
+    const __m256 sign_bit = _mm256_set1_ps(-0.f);
+    auto abs = [&](__m256 x) { return _mm256_andnot_ps(sign_bit, x); };
+
+    int i = first;
+    __m256 c_x = _mm256_sub_ps(_mm256_loadu_ps(ax.data() + i), _mm256_set1_ps(ox));
+    __m256 c_y = _mm256_sub_ps(_mm256_loadu_ps(ay.data() + i), _mm256_set1_ps(oy));
+    __m256 c_z = _mm256_sub_ps(_mm256_loadu_ps(az.data() + i), _mm256_set1_ps(oz));
+    __m256 r_x = _mm256_fmsub_ps(c_y, d_z, _mm256_mul_ps(c_z, d_y));
+    __m256 r_y = _mm256_fmsub_ps(c_z, d_x, _mm256_mul_ps(c_x, d_z));
+    __m256 r_z = _mm256_fmsub_ps(c_x, d_y, _mm256_mul_ps(c_y, d_x));
+
+    __m256 e1_x = _mm256_loadu_ps(e1x.data() + i), e1_y = _mm256_loadu_ps(e1y.data() + i), e1_z = _mm256_loadu_ps(e1z.data() + i);
+    __m256 e2_x = _mm256_loadu_ps(e2x.data() + i), e2_y = _mm256_loadu_ps(e2y.data() + i), e2_z = _mm256_loadu_ps(e2z.data() + i);
+    __m256 n_x = _mm256_fmsub_ps(e2_y, e1_z, _mm256_mul_ps(e2_z, e1_y));
+    __m256 n_y = _mm256_fmsub_ps(e2_z, e1_x, _mm256_mul_ps(e2_x, e1_z));
+    __m256 n_z = _mm256_fmsub_ps(e2_x, e1_y, _mm256_mul_ps(e2_y, e1_x));
+
+    __m256 det = _mm256_fmadd_ps(n_z, d_z, _mm256_fmadd_ps(n_y, d_y, _mm256_mul_ps(n_x, d_x)));
+    __m256 u = _mm256_fmadd_ps(e2_z, r_z, _mm256_fmadd_ps(e2_y, r_y, _mm256_mul_ps(e2_x, r_x)));
+    __m256 v = _mm256_fmadd_ps(e1_z, r_z, _mm256_fmadd_ps(e1_y, r_y, _mm256_mul_ps(e1_x, r_x)));
+    __m256 t = _mm256_fmadd_ps(n_z, c_z, _mm256_fmadd_ps(n_y, c_y, _mm256_mul_ps(n_x, c_x)));
+
+    __m256 det_sign = _mm256_and_ps(det, sign_bit);
+    __m256 det_abs = _mm256_xor_ps(det, det_sign);
+    u = _mm256_xor_ps(u, det_sign);
+    v = _mm256_xor_ps(v, det_sign);
+    t = _mm256_xor_ps(t, det_sign);
+
+    __m256 edges = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(abs(e1_x), abs(e1_y)), _mm256_add_ps(abs(e1_z), abs(e2_x))), _mm256_add_ps(abs(e2_y), abs(e2_z)));
+    __m256 offset = _mm256_add_ps(_mm256_add_ps(abs(c_x), abs(c_y)), _mm256_add_ps(abs(c_z), _mm256_set1_ps(ray.offset_norm)));
+    __m256 pad_uv = _mm256_mul_ps(_mm256_set1_ps(tolerance * ray.direction_norm), _mm256_mul_ps(offset, edges));
+    __m256 pad_det = _mm256_mul_ps(_mm256_set1_ps(tolerance * ray.direction_norm), _mm256_mul_ps(edges, edges));
+    __m256 pad_t = _mm256_mul_ps(_mm256_set1_ps(tolerance), _mm256_mul_ps(offset, _mm256_mul_ps(edges, edges)));
+
+    __m256 mask = _mm256_and_ps(_mm256_cmp_ps(u, _mm256_sub_ps(_mm256_setzero_ps(), pad_uv), _CMP_GE_OQ),
+                                _mm256_cmp_ps(v, _mm256_sub_ps(_mm256_setzero_ps(), pad_uv), _CMP_GE_OQ));
+    __m256 det_limit = _mm256_add_ps(det_abs, pad_det);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_fmadd_ps(_mm256_set1_ps(2.f), pad_uv, det_limit), _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_sub_ps(_mm256_setzero_ps(), pad_t), _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_fmadd_ps(_mm256_set1_ps(t_limit), det_limit, pad_t), _CMP_LT_OQ));
+    return _mm256_movemask_ps(mask) & ((1u << count) - 1);
+#else
+    unsigned mask = 0;
+    for (int k = 0; k < count; k++)
+    {
+        int i = first + k;
+        float c_x = ax[i] - ox, c_y = ay[i] - oy, c_z = az[i] - oz;
+        float r_x = c_y * dz - c_z * dy;
+        float r_y = c_z * dx - c_x * dz;
+        float r_z = c_x * dy - c_y * dx;
+        float n_x = e2y[i] * e1z[i] - e2z[i] * e1y[i];
+        float n_y = e2z[i] * e1x[i] - e2x[i] * e1z[i];
+        float n_z = e2x[i] * e1y[i] - e2y[i] * e1x[i];
+
+        float det = n_x * dx + n_y * dy + n_z * dz;
+        float sign = copysignf(1.f, det);
+        float det_abs = fabsf(det);
+        float u = sign * (e2x[i] * r_x + e2y[i] * r_y + e2z[i] * r_z);
+        float v = sign * (e1x[i] * r_x + e1y[i] * r_y + e1z[i] * r_z);
+        float t = sign * (n_x * c_x + n_y * c_y + n_z * c_z);
+
+        float edges = fabsf(e1x[i]) + fabsf(e1y[i]) + fabsf(e1z[i]) + fabsf(e2x[i]) + fabsf(e2y[i]) + fabsf(e2z[i]);
+        float offset = fabsf(c_x) + fabsf(c_y) + fabsf(c_z) + ray.offset_norm;
+        float pad_uv = tolerance * ray.direction_norm * offset * edges;
+        float pad_det = tolerance * ray.direction_norm * edges * edges;
+        float pad_t = tolerance * offset * edges * edges;
+        if (u >= -pad_uv && v >= -pad_uv && u + v <= det_abs + pad_det + 2 * pad_uv && t > -pad_t && t < t_limit * (det_abs + pad_det) + pad_t)
+            mask |= 1u << k;
+    }
+    return mask;
+#endif
+}
+
+template <int Width>
+bool WideBVH<Width>::intersect(const TriangleStore& triangles, const Vector3d& ray_origin, const Vector3d& ray_direction, double& t_max, Hit& hit, TraversalStats* stats) const
+{
+    if (nodes.empty())
+        return false;
+    Ray ray(ray_origin, ray_direction, magnitude);
+
+    struct StackEntry
+    {
+        int node;
+        double t_entry;
+    };
+    // The wide tree is not deeper than the binary one, but for the few levels that cut the leaves of more than 255
+    // triangles, and each of its levels leaves at most Width - 1 entries on the stack
+    StackEntry stack[traversal_stack_size * Width];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0.};
+
+    int nearest = -1;
+    double smallest_t = t_max;
+    long long nodes_visited = 0;
+    long long triangle_tests = 0;
+
+    while (stack_size > 0)
+    {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_entry >= smallest_t)
+            continue;
+
+        const Node& node = nodes[entry.node];
+        nodes_visited++;
+        double t_entries[Width];
+        unsigned mask = intersect_children(node, ray, smallest_t, t_entries);
+
+        // Children hit, nearest first
+        int order[Width];
+        int hit_count = 0;
+        for (int k = 0; k < node.child_count; k++)
+        {
+            if (!(mask & (1u << k)))
+                continue;
+            int position = hit_count++;
+            while (position > 0 && t_entries[order[position - 1]] > t_entries[k])
+            {
+                order[position] = order[position - 1];
+                position--;
+            }
+            order[position] = k;
+        }
+
+        // The leaves first, so that their hits cull the inner children before these are pushed
+        int first_triangles[Width];
+        for (int k = 0, first = node.first_triangle; k < node.child_count; k++)
+        {
+            first_triangles[k] = first;
+            first += node.triangle_count[k];
+        }
+        for (int position = 0; position < hit_count; position++)
+        {
+            int k = order[position];
+            int count = node.triangle_count[k];
+            if (count == 0 || t_entries[k] >= smallest_t)
+                continue;
+            triangle_tests += count;
+#ifdef INSTRUMENT_RENDER
+            count_mesh_tests(triangles, primitive, stats, first_triangles[k], count);
+#endif
+            for (int first = first_triangles[k]; first < first_triangles[k] + count; first += lanes)
+            {
+                unsigned passed = candidates(first, min(lanes, first_triangles[k] + count - first), ray, smallest_t);
+                for (int lane = 0; passed; lane++, passed >>= 1)
+                {
+                    if ((passed & 1) && triangles.intersect(primitive[first + lane], 1, ray_origin, ray_direction, smallest_t) >= 0)
+                        nearest = primitive[first + lane];
+                }
+            }
+        }
+
+        // Push the far children first
+        assert(stack_size + Width <= traversal_stack_size * Width);
+        int inner_index = node.first_child;
+        int inner_nodes[Width];
+        for (int k = 0; k < node.child_count; k++)
+            inner_nodes[k] = node.triangle_count[k] == 0 ? inner_index++ : -1;
+        for (int position = hit_count - 1; position >= 0; position--)
+        {
+            int k = order[position];
+            if (inner_nodes[k] >= 0 && t_entries[k] < smallest_t)
+                stack[stack_size++] = {inner_nodes[k], t_entries[k]};
+        }
+    }
+
+    if (stats)
+    {
+        stats->nodes_visited += nodes_visited;
+        stats->triangle_tests += triangle_tests;
+    }
+    if (nearest < 0)
+        return false;
+    t_max = smallest_t;
+    hit.t = smallest_t;
+    hit.mesh = triangles.mesh[nearest];
+    hit.face = triangles.face[nearest];
+    hit.primitive = nearest;
+    hit.instance = -1;
+    return true;
+}
+
+template <int Width>
+int WideBVH<Width>::find_occluder(const TriangleStore& triangles, const Vector3d& ray_origin, const Vector3d& ray_direction, double t_max, TraversalStats* stats) const
+{
+    if (nodes.empty())
+        return -1;
+    Ray ray(ray_origin, ray_direction, magnitude);
+
+    int stack[traversal_stack_size * Width];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    int occluder = -1;
+    long long nodes_visited = 0;
+    long long triangle_tests = 0;
+
+    while (stack_size > 0 && occluder < 0)
+    {
+        const Node& node = nodes[stack[--stack_size]];
+        nodes_visited++;
+        double t_entries[Width];
+        unsigned mask = intersect_children(node, ray, t_max, t_entries);
+
+        // Any occluder will do: the leaves first, then the inner children in their order
+        assert(stack_size + Width <= traversal_stack_size * Width);
+        int first = node.first_triangle, inner = node.first_child;
+        for (int k = 0; k < node.child_count && occluder < 0; k++)
+        {
+            int count = node.triangle_count[k];
+            if (count == 0)
+            {
+                if (mask & (1u << k))
+                    stack[stack_size++] = inner;
+                inner++;
+                continue;
+            }
+            if (mask & (1u << k))
+            {
+                triangle_tests += count;
+#ifdef INSTRUMENT_RENDER
+                count_mesh_tests(triangles, primitive, stats, first, count);
+#endif
+                for (int i = first; i < first + count && occluder < 0; i += lanes)
+                {
+                    unsigned passed = candidates(i, min(lanes, first + count - i), ray, t_max);
+                    for (int lane = 0; passed && occluder < 0; lane++, passed >>= 1)
+                    {
+                        if ((passed & 1) && triangles.occluded(primitive[i + lane], 1, ray_origin, ray_direction, t_max) >= 0)
+                            occluder = primitive[i + lane];
+                    }
+                }
+            }
+            first += count;
+        }
+    }
+
+    if (stats)
+    {
+        stats->nodes_visited += nodes_visited;
+        stats->triangle_tests += triangle_tests;
+    }
+    return occluder;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
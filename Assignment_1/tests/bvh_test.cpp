@@ -0,0 +1,124 @@
+// Checks the traversals of a BVH whose SAH build would be far deeper than their stacks: triangles across the x axis
+// at x = 2^k, which the binned SAH peels off one at a time. Its leaves must stay within traversal_stack_size - 1
+// levels of the root and every query must find the triangle that brute force finds. Exits with 1 on a mismatch.
+//
+// The queries walk the binary tree even with COMPACT_BVH, whose float triangles do not reach 2^299.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "bvh.h"
+#include "packet.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    const int triangle_count = 300;
+
+    struct Check
+    {
+        const char* name;
+        int queries, mismatches;
+    };
+
+    void expect(bool is_correct, Check& check, const string& query)
+    {
+        check.queries++;
+        if (!is_correct && check.mismatches++ < 5)
+            cout << check.name << ": wrong result for " << query << endl;
+    }
+
+    // Levels of the subtree of node, a leaf has 1
+    int depth(const BVH& bvh, int node)
+    {
+        const BVH::Node& n = bvh.nodes[node];
+        return n.count > 0 ? 1 : 1 + max(depth(bvh, n.first), depth(bvh, n.first + 1));
+    }
+
+    bool is_close(double t, double expected_t)
+    {
+        return abs(t - expected_t) <= 1e-9 * expected_t;
+    }
+}
+
+int main()
+{
+    // The triangle k covers the square [-1, 1]^2 of the plane x = 2^k
+    MatrixXd V(3 * triangle_count, 3);
+    MatrixXi F(triangle_count, 3);
+    for (int k = 0; k < triangle_count; k++)
+    {
+        double x = ldexp(1., k);
+        V.row(3 * k) << x, -1, -1;
+        V.row(3 * k + 1) << x, 2, -1;
+        V.row(3 * k + 2) << x, -1, 2;
+        F.row(k) << 3 * k, 3 * k + 1, 3 * k + 2;
+    }
+    vector<MatrixXd> vertices = {V};
+    vector<MatrixXi> faces = {F};
+    BVH bvh;
+    bvh.build(vertices, faces);
+
+    Check depth_check = {"depth", 0, 0};
+    int levels = depth(bvh, 0);
+    expect(levels <= traversal_stack_size, depth_check, "the tree of " + to_string(levels) + " levels");
+
+    // From just before each plane towards +x, the closest triangle is the one of the plane; towards -x it is the
+    // previous one. Every plane further along is in the box of the ray, so the traversal keeps one sibling per level.
+    Check closest_check = {"closest", 0, 0};
+    Check occluded_check = {"occluded", 0, 0};
+    for (int k = 0; k < triangle_count; k++)
+    {
+        double x = ldexp(1., k);
+        Vector3d origin(0.75 * x, 0.1, 0.2);
+        Hit hit;
+        bool is_hit = bvh.intersect_binary(origin, Vector3d(1, 0, 0), numeric_limits<double>::infinity(), hit);
+        expect(is_hit && hit.face == k && is_close(hit.t, x - origin(0)), closest_check, "+x before plane " + to_string(k));
+
+        is_hit = bvh.intersect_binary(origin, Vector3d(-1, 0, 0), numeric_limits<double>::infinity(), hit);
+        expect(k == 0 ? !is_hit : is_hit && hit.face == k - 1, closest_check, "-x before plane " + to_string(k));
+
+        expect(bvh.occluded_binary(origin, Vector3d(1, 0, 0), x), occluded_check, "+x before plane " + to_string(k));
+        expect(!bvh.occluded_binary(origin, Vector3d(1, 0, 0), 0.2 * x), occluded_check, "+x short of plane " + to_string(k));
+    }
+
+    // Packets of 4 parallel rays, which stay together down to the leaves. With COMPACT_BVH each of them walks the
+    // compact tree instead.
+    Check packet_check = {"packet", 0, 0};
+#ifndef COMPACT_BVH
+    for (int k = 0; k < triangle_count; k += 10)
+    {
+        RayPacket<4> packet;
+        for (int lane = 0; lane < 4; lane++)
+        {
+            packet.ox[lane] = 0.5 * ldexp(1., k);
+            packet.oy[lane] = 0.1 * lane;
+            packet.oz[lane] = 0.1;
+            packet.dx[lane] = 1;
+            packet.dy[lane] = 0;
+            packet.dz[lane] = 0;
+        }
+        Hit hits[4];
+        bool is_intersected[4];
+        bvh.intersect_packet(packet, numeric_limits<double>::infinity(), hits, is_intersected);
+        for (int lane = 0; lane < 4; lane++)
+            expect(is_intersected[lane] && hits[lane].face == k, packet_check, "packet before plane " + to_string(k));
+    }
+#endif
+
+    int mismatches = 0;
+    for (const Check& check : {depth_check, closest_check, occluded_check, packet_check})
+    {
+        cout << check.name << ": " << check.queries << " queries, " << check.mismatches << " wrong" << endl;
+        mismatches += check.mismatches;
+    }
+    return mismatches == 0 ? 0 : 1;
+}
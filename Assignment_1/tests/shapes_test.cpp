@@ -0,0 +1,141 @@
+// Checks Shape::intersect() on a torus against brute-force marching along the rays: random rays, rays through the
+// middle of the tube and rays that graze it, whose distance to the surface shrinks slowly. Exits with 1 on a mismatch.
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include "shapes.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    const double minor_radius = 0.3;
+    const double march_step = 1e-3;
+
+    double torus_distance(const Vector3d& position)
+    {
+        return Vector2d(Vector2d(position(0), position(2)).norm() - 1, position(1)).norm() - minor_radius;
+    }
+
+    // First sign change of the distance along the unit direction, in steps of march_step up to t_end, refined by
+    // bisection. Returns -1 if there is none.
+    double march(const Vector3d& origin, const Vector3d& direction, double t_end)
+    {
+        double t = 0;
+        bool is_inside = torus_distance(origin) < 0;
+        while (t < t_end)
+        {
+            double next = t + march_step;
+            if ((torus_distance(origin + next * direction) < 0) != is_inside)
+            {
+                for (int step = 0; step < 60; step++)
+                {
+                    double middle = (t + next) / 2;
+                    if ((torus_distance(origin + middle * direction) < 0) == is_inside)
+                        t = middle;
+                    else
+                        next = middle;
+                }
+                return (t + next) / 2;
+            }
+            t = next;
+        }
+        return -1;
+    }
+
+    struct Check
+    {
+        const char* name;
+        int rays, hits, mismatches;
+    };
+
+    // Compare the shape to the march for one ray, must_hit for the rays known to enter the tube
+    void check_ray(const Shape& torus, const Vector3d& origin, const Vector3d& direction, bool must_hit, Check& check)
+    {
+        double t = numeric_limits<double>::infinity();
+        int part;
+        bool is_hit = torus.intersect(origin, direction, t, part);
+        double marched = march(origin, direction, origin.norm() + 2);
+        check.rays++;
+        check.hits += is_hit;
+
+        // The march misses crossings shorter than its step, a hit it does not find must be on the surface and before its own
+        bool is_mismatch;
+        if (!is_hit)
+            is_mismatch = marched >= 0 || must_hit;
+        else if (marched < 0)
+            is_mismatch = fabs(torus_distance(origin + t * direction)) > 1e-9;
+        else
+            is_mismatch = fabs(t - marched) > 1e-8 && !(t < marched && fabs(torus_distance(origin + t * direction)) < 1e-9);
+
+        if (is_mismatch && check.mismatches++ < 5)
+            cout << check.name << ": origin " << origin.transpose() << ", direction " << direction.transpose() << ", " << (is_hit ? "hit at " + to_string(t) : "miss")
+                 << ", marched " << marched << endl;
+    }
+}
+
+int main()
+{
+    Shape torus(torus_shape, 0, minor_radius);
+    mt19937 random(1);
+    uniform_real_distribution<double> uniform(-1, 1);
+    auto unit_vector = [&]()
+    {
+        Vector3d v;
+        do
+            v = Vector3d(uniform(random), uniform(random), uniform(random));
+        while (v.squaredNorm() > 1 || v.squaredNorm() < 1e-6);
+        return Vector3d(v.normalized());
+    };
+
+    // From a sphere around the torus towards a point of its box
+    Check random_check = {"random", 0, 0, 0};
+    for (int k = 0; k < 20000; k++)
+    {
+        Vector3d origin = 4 * unit_vector();
+        Vector3d target = torus.box_min + (torus.box_max - torus.box_min).cwiseProduct(Vector3d(uniform(random), uniform(random), uniform(random)) / 2 + Vector3d::Constant(0.5));
+        check_ray(torus, origin, (target - origin).normalized(), false, random_check);
+    }
+
+    // Through a point of the circle at the middle of the tube
+    Check deep_check = {"deep", 0, 0, 0};
+    for (int k = 0; k < 5000; k++)
+    {
+        double angle = EIGEN_PI * uniform(random);
+        Vector3d target(cos(angle), 0, sin(angle));
+        Vector3d origin = target + 4 * unit_vector();
+        check_ray(torus, origin, (target - origin).normalized(), true, deep_check);
+    }
+
+    // Along a tangent of the surface, between 1e-4 and 1e-2 under it
+    Check grazing_check = {"grazing", 0, 0, 0};
+    for (int k = 0; k < 5000; k++)
+    {
+        double angle = EIGEN_PI * uniform(random), tube_angle = EIGEN_PI * uniform(random);
+        Vector3d radial(cos(angle), 0, sin(angle));
+        Vector3d normal = cos(tube_angle) * radial + sin(tube_angle) * Vector3d::UnitY();
+        Vector3d tangent = normal.cross(unit_vector()).normalized();
+        double depth = pow(10, -3 + uniform(random));
+        Vector3d point = radial + (minor_radius - depth) * normal;
+        check_ray(torus, point - 4 * tangent, tangent, true, grazing_check);
+    }
+
+    // A shallow approach where the distance to the surface shrinks by a constant factor at every step of sphere tracing
+    Check example_check = {"example", 0, 0, 0};
+    check_ray(torus, Vector3d(-1.18, -1.40, 4.00), Vector3d(0.44, 0.29, -0.85), false, example_check);
+
+    int mismatches = 0;
+    for (const Check& check : {random_check, deep_check, grazing_check, example_check})
+    {
+        cout << check.name << ": " << check.rays << " rays, " << check.hits << " hits, " << check.mismatches << " differ from the march" << endl;
+        mismatches += check.mismatches;
+    }
+    return mismatches == 0 ? 0 : 1;
+}
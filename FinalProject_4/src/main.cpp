@@ -21,6 +21,9 @@
 // OpenGL Helpers to reduce the clutter
 #include "Helpers.h"
 
+// OFF mesh loading with a binary cache
+#include "mesh_io.h"
+
 // stb library to load image
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -287,81 +290,11 @@ int main()
     // Read file to Matrix vector
     for (int file_i = 0; file_i < off_files_string.size(); file_i++)
     {
-        ifstream off_file(off_files_string[file_i]);
-        string line;
-        int number_of_vertices = 0;
-        int number_of_faces = 0;
-
-        // Ignore the first line
-        getline(off_file, line);
-
-        // Read the numbers from the second line
-        if (getline(off_file, line))
-        {
-            istringstream line_stream(line);
-            string element;
-            int element_index = 0;
-
-            // Handle each element
-            while (getline(line_stream, element, ' '))
-            {
-                if (element_index == 0)
-                {
-                    number_of_vertices = stoi(element);
-                }
-                else if (element_index == 1)
-                {
-                    number_of_faces = stoi(element);
-                }
-                element_index++;
-            }
-        }
-
-        // Declare the vertices and faces Matrices
-        MatrixXf vertex = MatrixXf::Zero(number_of_vertices, 3);
+        MatrixXf vertex;
+        MatrixXi face;
+        load_off(off_files_string[file_i], vertex, face);
         vertices.push_back(vertex);
-        MatrixXi face = MatrixXi::Zero(number_of_faces, 3);
         faces.push_back(face);
-
-        // Read the vertices data
-        for (int row = 0; row < number_of_vertices; row++)
-        {
-            if (getline(off_file, line))
-            {
-                istringstream line_stream(line);
-                string element;
-                int element_index = 0;
-
-                // Handle each element
-                while (getline(line_stream, element, ' '))
-                {
-                    vertices[file_i](row, element_index) = stof(element);
-                    element_index++;
-                }
-            }
-        }
-
-        // Read the faces data
-        for (int row = 0; row < number_of_faces; row++)
-        {
-            if (getline(off_file, line))
-            {
-                istringstream line_stream(line);
-                string element;
-                int element_index = 0;
-
-                while (getline(line_stream, element, ' '))
-                {
-                    if (element_index == 0)
-                    {
-                        element_index++;
-                        continue;
-                    }
-                    faces[file_i](row, element_index - 1) = stoi(element);
-                    element_index++;
-                }
-            }
-        }
     }
 
     // Rescale and Reposition Picture
@@ -0,0 +1,245 @@
+#include "mesh_io.h"
+#include "mesh_parser.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <Eigen/Geometry>
+
+#include <sys/stat.h>
+
+using namespace std;
+using namespace Eigen;
+
+namespace
+{
+    // Binary mesh cache layout: the header, then the columns of V (#V x 3 Scalar), of F (#F x 3 uint32)
+    // and of N (#V x 3 Scalar) if has_normals is set. Columns are stored one after the other like in Eigen,
+    // so each matrix is filled with a single copy.
+    const uint32_t cache_magic = 0x4853454d; // "MESH"
+    const uint32_t cache_version = 1;
+    const uint32_t has_normals = 1;
+
+    struct CacheHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t scalar_size;   // 4 for float positions, 8 for double
+        uint32_t flags;
+        uint64_t vertex_count;
+        uint64_t face_count;
+        uint64_t source_size;   // Size, modification time and FNV-1a hash of the OFF file the cache was written from
+        int64_t source_mtime;
+        uint64_t source_hash;
+        double box_min[3];      // Bounding box of the vertices
+        double box_max[3];
+    };
+    static_assert(sizeof(CacheHeader) % 8 == 0, "the matrices after the header must stay aligned");
+
+    // Size and modification time (in nanoseconds where available) of a file
+    bool file_status(const string& path, uint64_t& size, int64_t& mtime)
+    {
+        struct stat status;
+        if (stat(path.c_str(), &status) != 0)
+            return false;
+        size = status.st_size;
+#if defined(__APPLE__)
+        mtime = int64_t(status.st_mtimespec.tv_sec) * 1000000000 + status.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+        mtime = int64_t(status.st_mtime) * 1000000000;
+#else
+        mtime = int64_t(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+#endif
+        return true;
+    }
+
+    uint64_t fnv1a_hash(const char* data, size_t size)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= uint8_t(data[i]);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Parse the OFF text into V and F, row by row
+    template <typename Scalar>
+    bool parse_off_matrices(const string& path, const MappedFile& source, Matrix<Scalar, Dynamic, Dynamic>& V, MatrixXi& F)
+    {
+        vector<Scalar> positions;
+        vector<int> triangles;
+        string error;
+        if (!parse_off(source.data(), source.size(), positions, triangles, error))
+        {
+            cerr << "Could not read " << path << ": " << error << endl;
+            return false;
+        }
+        V = Map<Matrix<Scalar, Dynamic, Dynamic, RowMajor>>(positions.data(), positions.size() / 3, 3);
+        F = Map<Matrix<int, Dynamic, Dynamic, RowMajor>>(triangles.data(), triangles.size() / 3, 3);
+        return true;
+    }
+
+    // Area weighted vertex normals: the sum of the unnormalized normals of the faces around each vertex
+    template <typename Scalar>
+    Matrix<Scalar, Dynamic, Dynamic> vertex_normals(const Matrix<Scalar, Dynamic, Dynamic>& V, const MatrixXi& F)
+    {
+        typedef Matrix<Scalar, 3, 1> Vector;
+        Matrix<Scalar, Dynamic, Dynamic> N = Matrix<Scalar, Dynamic, Dynamic>::Zero(V.rows(), 3);
+        for (int face_i = 0; face_i < F.rows(); face_i++)
+        {
+            if (F.row(face_i).minCoeff() < 0 || F.row(face_i).maxCoeff() >= V.rows())
+                continue;
+            Vector a = V.row(F(face_i, 0)).transpose();
+            Vector b = V.row(F(face_i, 1)).transpose();
+            Vector c = V.row(F(face_i, 2)).transpose();
+            Vector face_normal = (b - a).cross(c - a);
+            for (int k = 0; k < 3; k++)
+                N.row(F(face_i, k)) += face_normal.transpose();
+        }
+        for (int vertex_i = 0; vertex_i < N.rows(); vertex_i++)
+            N.row(vertex_i).normalize();
+        return N;
+    }
+
+    template <typename Scalar>
+    bool read_cache(const string& cache_path, uint64_t source_size, int64_t source_mtime, const MappedFile* source,
+                    Matrix<Scalar, Dynamic, Dynamic>& V, MatrixXi& F, Matrix<Scalar, Dynamic, Dynamic>* N, bool& stale_mtime)
+    {
+        MappedFile cache(cache_path);
+        if (cache.size() < sizeof(CacheHeader))
+            return false;
+
+        CacheHeader header;
+        memcpy(&header, cache.data(), sizeof(header));
+        if (header.magic != cache_magic || header.version != cache_version || header.scalar_size != sizeof(Scalar))
+            return false;
+
+        size_t vertex_bytes = header.vertex_count * 3 * sizeof(Scalar);
+        size_t face_bytes = header.face_count * 3 * sizeof(uint32_t);
+        size_t normal_bytes = (header.flags & has_normals) ? vertex_bytes : 0;
+        if (cache.size() != sizeof(CacheHeader) + vertex_bytes + face_bytes + normal_bytes)
+            return false;
+
+        // Only hash the source when its modification time moved without its size changing
+        if (header.source_size != source_size)
+            return false;
+        stale_mtime = header.source_mtime != source_mtime;
+        if (stale_mtime && (!source || header.source_hash != fnv1a_hash(source->data(), source->size())))
+            return false;
+        if (N && !(header.flags & has_normals))
+            return false;
+
+        const char* data = cache.data() + sizeof(CacheHeader);
+        V.resize(header.vertex_count, 3);
+        memcpy(V.data(), data, vertex_bytes);
+        F.resize(header.face_count, 3);
+        memcpy(F.data(), data + vertex_bytes, face_bytes);
+        if (N)
+        {
+            N->resize(header.vertex_count, 3);
+            memcpy(N->data(), data + vertex_bytes + face_bytes, vertex_bytes);
+        }
+        return true;
+    }
+
+    // Write to a temporary file renamed at the end, so that a concurrent load never sees a partial cache
+    template <typename Scalar>
+    void write_cache(const string& cache_path, uint64_t source_size, int64_t source_mtime, uint64_t source_hash,
+                     const Matrix<Scalar, Dynamic, Dynamic>& V, const MatrixXi& F, const Matrix<Scalar, Dynamic, Dynamic>& N)
+    {
+        CacheHeader header = {};
+        header.magic = cache_magic;
+        header.version = cache_version;
+        header.scalar_size = sizeof(Scalar);
+        header.flags = has_normals;
+        header.vertex_count = V.rows();
+        header.face_count = F.rows();
+        header.source_size = source_size;
+        header.source_mtime = source_mtime;
+        header.source_hash = source_hash;
+        for (int k = 0; k < 3; k++)
+        {
+            header.box_min[k] = V.rows() > 0 ? double(V.col(k).minCoeff()) : 0;
+            header.box_max[k] = V.rows() > 0 ? double(V.col(k).maxCoeff()) : 0;
+        }
+
+        const string temporary_path = cache_path + ".tmp";
+        {
+            ofstream cache(temporary_path, ios::binary);
+            if (!cache)
+                return;
+            cache.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            cache.write(reinterpret_cast<const char*>(V.data()), V.size() * sizeof(Scalar));
+            cache.write(reinterpret_cast<const char*>(F.data()), F.size() * sizeof(int));
+            cache.write(reinterpret_cast<const char*>(N.data()), N.size() * sizeof(Scalar));
+            if (!cache)
+            {
+                cache.close();
+                remove(temporary_path.c_str());
+                return;
+            }
+        }
+#ifdef _WIN32
+        remove(cache_path.c_str());
+#endif
+        if (rename(temporary_path.c_str(), cache_path.c_str()) != 0)
+            remove(temporary_path.c_str());
+    }
+}
+
+template <typename Scalar>
+bool load_off(const string& path, Matrix<Scalar, Dynamic, Dynamic>& V, MatrixXi& F, Matrix<Scalar, Dynamic, Dynamic>* N)
+{
+    V.resize(0, 3);
+    F.resize(0, 3);
+    if (N)
+        N->resize(0, 3);
+
+    uint64_t source_size;
+    int64_t source_mtime;
+    if (!file_status(path, source_size, source_mtime))
+        return false;
+
+    const string cache_path = path + ".cache";
+    bool stale_mtime = false;
+
+    // Fast path: the source is only opened if its hash has to be checked
+    if (read_cache(cache_path, source_size, source_mtime, nullptr, V, F, N, stale_mtime))
+        return true;
+
+    MappedFile source(path);
+    if (!source.is_open() || source.size() != source_size)
+        return false;
+    uint64_t source_hash = fnv1a_hash(source.data(), source.size());
+
+    Matrix<Scalar, Dynamic, Dynamic> normals;
+    if (stale_mtime && read_cache(cache_path, source_size, source_mtime, &source, V, F, &normals, stale_mtime))
+    {
+        // Same content with a new modification time, refresh the header so that the next load skips the hash
+        write_cache(cache_path, source_size, source_mtime, source_hash, V, F, normals);
+    }
+    else
+    {
+        if (!parse_off_matrices(path, source, V, F))
+        {
+            V.resize(0, 3);
+            F.resize(0, 3);
+            return false;
+        }
+        normals = vertex_normals(V, F);
+        write_cache(cache_path, source_size, source_mtime, source_hash, V, F, normals);
+    }
+
+    if (N)
+        *N = normals;
+    return true;
+}
+
+template bool load_off<float>(const string&, MatrixXf&, MatrixXi&, MatrixXf*);
+template bool load_off<double>(const string&, MatrixXd&, MatrixXi&, MatrixXd*);
@@ -0,0 +1,18 @@
+#ifndef MESH_IO_H
+#define MESH_IO_H
+
+#include <string>
+#include <Eigen/Core>
+
+// Load the triangle mesh of an OFF file: V gets one vertex per row (#V x 3), F the vertex indices of one face per row (#F x 3).
+// If N is given it gets the area weighted normal of every vertex (#V x 3).
+//
+// The first load writes a binary copy of the mesh next to the file (path + ".cache") and later loads map it
+// instead of parsing the text. The copy is only used while the size and modification time of the OFF file match,
+// or its hash when only the modification time changed (after a checkout for example); otherwise it is rewritten.
+// Returns false if the file cannot be read, V, F and N are then empty.
+template <typename Scalar>
+bool load_off(const std::string& path, Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>& V, Eigen::MatrixXi& F,
+              Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>* N = nullptr);
+
+#endif
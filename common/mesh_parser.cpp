@@ -0,0 +1,512 @@
+#include "mesh_parser.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <system_error>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+MappedFile::MappedFile(const string& path)
+{
+#ifndef _WIN32
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return;
+    opened = true;
+    struct stat status;
+    if (fstat(descriptor, &status) == 0 && status.st_size > 0)
+    {
+        void* address = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (address != MAP_FAILED)
+        {
+            mapped = static_cast<const char*>(address);
+            length = status.st_size;
+        }
+        else
+            opened = false;
+    }
+    close(descriptor);
+#else
+    ifstream file(path, ios::binary);
+    if (!file)
+        return;
+    opened = true;
+    buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    mapped = buffer.data();
+    length = buffer.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    if (mapped)
+        munmap(const_cast<char*>(mapped), length);
+#endif
+}
+
+namespace
+{
+    // Smallest chunk worth a thread, smaller files are parsed by the calling thread alone
+    const size_t min_chunk_size = 1 << 20;
+
+    struct Chunk
+    {
+        const char* begin;
+        const char* end;
+    };
+
+    // Split the text into chunks that start at the beginning of a line, a few per core to balance the load
+    vector<Chunk> split_lines(const char* text, const char* end)
+    {
+        size_t size = end - text;
+        size_t cores = max(1u, thread::hardware_concurrency());
+        size_t chunk_count = min(cores * 4, size / min_chunk_size + 1);
+
+        vector<Chunk> chunks;
+        const char* begin = text;
+        for (size_t c = 1; c <= chunk_count && begin < end; c++)
+        {
+            const char* chunk_end = c == chunk_count ? end : max(begin, text + size / chunk_count * c);
+            chunk_end = find(chunk_end, end, '\n');
+            if (chunk_end != end)
+                chunk_end++;
+            chunks.push_back({begin, chunk_end});
+            begin = chunk_end;
+        }
+        return chunks;
+    }
+
+    // Run body(i) for every i in [0, count) on all the cores, the calling thread included
+    void parallel_for(size_t count, const function<void(size_t)>& body)
+    {
+        size_t thread_count = min<size_t>(count, max(1u, thread::hardware_concurrency()));
+        atomic<size_t> next(0);
+        auto worker = [&]()
+        {
+            for (size_t i = next++; i < count; i = next++)
+                body(i);
+        };
+
+        vector<thread> threads;
+        for (size_t t = 1; t < thread_count; t++)
+            threads.emplace_back(worker);
+        worker();
+        for (thread& t : threads)
+            t.join();
+    }
+
+    // Call line(begin, end) for every line of the chunk, end stops before the newline or the comment
+    template <typename LineFunction>
+    void for_each_line(const Chunk& chunk, LineFunction line)
+    {
+        const char* begin = chunk.begin;
+        while (begin < chunk.end)
+        {
+            const char* end = static_cast<const char*>(memchr(begin, '\n', chunk.end - begin));
+            const char* next = end ? end + 1 : chunk.end;
+            if (!end)
+                end = chunk.end;
+            const char* comment = static_cast<const char*>(memchr(begin, '#', end - begin));
+            line(begin, comment ? comment : end);
+            begin = next;
+        }
+    }
+
+    bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    const char* skip_spaces(const char* p, const char* end)
+    {
+        while (p < end && is_space(*p))
+            p++;
+        return p;
+    }
+
+    const char* token_end(const char* p, const char* end)
+    {
+        while (p < end && !is_space(*p))
+            p++;
+        return p;
+    }
+
+    // Parse the number that follows the spaces at p, and move p past it
+    template <typename T>
+    bool next_number(const char*& p, const char* end, T& value)
+    {
+        p = skip_spaces(p, end);
+        if (p < end && *p == '+')
+            p++;
+        from_chars_result result = from_chars(p, end, value);
+        if (result.ec != errc())
+            return false;
+        p = result.ptr;
+        return true;
+    }
+
+    // Number of whitespace separated tokens in [p, end)
+    int count_tokens(const char* p, const char* end)
+    {
+        int count = 0;
+        for (p = skip_spaces(p, end); p < end; p = skip_spaces(token_end(p, end), end))
+            count++;
+        return count;
+    }
+
+    string line_error(long long line_number, const string& message)
+    {
+        return "line " + to_string(line_number) + ": " + message;
+    }
+
+    // Concatenate the triangles parsed by each chunk, in chunk order
+    void gather(const vector<vector<int>>& chunk_values, vector<int>& values)
+    {
+        vector<size_t> offsets(chunk_values.size() + 1, 0);
+        for (size_t c = 0; c < chunk_values.size(); c++)
+            offsets[c + 1] = offsets[c] + chunk_values[c].size();
+        values.resize(offsets.back());
+        parallel_for(chunk_values.size(), [&](size_t c)
+        {
+            copy(chunk_values[c].begin(), chunk_values[c].end(), values.begin() + offsets[c]);
+        });
+    }
+
+    // First error in file order, if any
+    bool first_error(const vector<string>& chunk_errors, string& error)
+    {
+        for (const string& chunk_error : chunk_errors)
+        {
+            if (!chunk_error.empty())
+            {
+                error = chunk_error;
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+template <typename Scalar>
+bool parse_off(const char* text, size_t size, vector<Scalar>& positions, vector<int>& triangles, string& error)
+{
+    positions.clear();
+    triangles.clear();
+    const char* end = text + size;
+
+    // Header: an optional keyword ending in OFF (COFF, NOFF, ...) then the vertex and face counts, on one or more lines
+    const char* body = text;
+    long long line_number = 0;
+    long long counts[2];
+    int counts_read = 0;
+    bool keyword_checked = false;
+    while (counts_read < 2)
+    {
+        if (body >= end)
+        {
+            error = "missing vertex and face counts";
+            return false;
+        }
+        line_number++;
+        const char* line_end = find(body, end, '\n');
+        const char* content_end = find(body, line_end, '#');
+        const char* p = skip_spaces(body, content_end);
+        if (!keyword_checked && p < content_end && isalpha(static_cast<unsigned char>(*p)))
+        {
+            const char* keyword_end = token_end(p, content_end);
+            if (keyword_end - p < 3 || strncmp(keyword_end - 3, "OFF", 3) != 0)
+            {
+                error = line_error(line_number, "not an OFF file");
+                return false;
+            }
+            p = keyword_end;
+        }
+        keyword_checked = keyword_checked || p < content_end;
+        while (counts_read < 2 && skip_spaces(p, content_end) < content_end)
+        {
+            if (!next_number(p, content_end, counts[counts_read]) || counts[counts_read] < 0 || counts[counts_read] > 0x7fffffff)
+            {
+                error = line_error(line_number, "invalid vertex or face count");
+                return false;
+            }
+            counts_read++;
+        }
+        body = line_end < end ? line_end + 1 : end;
+    }
+    const long long vertex_count = counts[0];
+    const long long face_count = counts[1];
+
+    // First pass: lines and data lines (neither blank nor comment) of every chunk, the data lines
+    // are the vertices then the faces
+    vector<Chunk> chunks = split_lines(body, end);
+    vector<long long> first_line(chunks.size() + 1, 0), first_data_line(chunks.size() + 1, 0);
+    parallel_for(chunks.size(), [&](size_t c)
+    {
+        long long lines = 0, data_lines = 0;
+        for_each_line(chunks[c], [&](const char* begin, const char* end)
+        {
+            lines++;
+            if (skip_spaces(begin, end) < end)
+                data_lines++;
+        });
+        first_line[c + 1] = lines;
+        first_data_line[c + 1] = data_lines;
+    });
+    first_line[0] = line_number + 1;
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        first_line[c + 1] += first_line[c];
+        first_data_line[c + 1] += first_data_line[c];
+    }
+    if (first_data_line.back() < vertex_count + face_count)
+    {
+        error = "expected " + to_string(vertex_count) + " vertices and " + to_string(face_count) + " faces, found " + to_string(first_data_line.back()) + " lines";
+        return false;
+    }
+
+    // Second pass: vertices go straight to their place, each chunk keeps its triangles until they are gathered
+    positions.resize(3 * vertex_count);
+    vector<vector<int>> chunk_triangles(chunks.size());
+    vector<string> chunk_errors(chunks.size());
+    parallel_for(chunks.size(), [&](size_t c)
+    {
+        long long line = first_line[c];
+        long long data_line = first_data_line[c];
+        vector<int> polygon;
+        for_each_line(chunks[c], [&](const char* p, const char* end)
+        {
+            long long current_line = line++;
+            if (!chunk_errors[c].empty() || skip_spaces(p, end) == end)
+                return;
+            long long index = data_line++;
+            if (index < vertex_count)
+            {
+                Scalar* position = &positions[3 * index];
+                if (!next_number(p, end, position[0]) || !next_number(p, end, position[1]) || !next_number(p, end, position[2]))
+                    chunk_errors[c] = line_error(current_line, "expected 3 vertex coordinates");
+            }
+            else if (index < vertex_count + face_count)
+            {
+                int corners = 0;
+                if (!next_number(p, end, corners) || corners < 3)
+                {
+                    chunk_errors[c] = line_error(current_line, "a face needs at least 3 vertices");
+                    return;
+                }
+                polygon.resize(corners);
+                for (int k = 0; k < corners; k++)
+                {
+                    if (!next_number(p, end, polygon[k]) || polygon[k] < 0 || polygon[k] >= vertex_count)
+                    {
+                        chunk_errors[c] = line_error(current_line, "invalid vertex index");
+                        return;
+                    }
+                }
+
+                // Fan around the first corner, a triangle stays as it is
+                for (int k = 1; k + 1 < corners; k++)
+                {
+                    chunk_triangles[c].push_back(polygon[0]);
+                    chunk_triangles[c].push_back(polygon[k]);
+                    chunk_triangles[c].push_back(polygon[k + 1]);
+                }
+            }
+        });
+    });
+    if (first_error(chunk_errors, error))
+    {
+        positions.clear();
+        return false;
+    }
+
+    gather(chunk_triangles, triangles);
+    return true;
+}
+
+template bool parse_off<float>(const char*, size_t, vector<float>&, vector<int>&, string&);
+template bool parse_off<double>(const char*, size_t, vector<double>&, vector<int>&, string&);
+
+namespace
+{
+    enum ObjLine { other_line, position_line, uv_line, normal_line, face_line };
+
+    // Kind of an OBJ line from its first token, p is moved past it
+    ObjLine obj_line_kind(const char*& p, const char* end)
+    {
+        p = skip_spaces(p, end);
+        const char* keyword_end = token_end(p, end);
+        size_t length = keyword_end - p;
+        ObjLine kind = other_line;
+        if (length == 1 && p[0] == 'v')
+            kind = position_line;
+        else if (length == 2 && p[0] == 'v' && p[1] == 't')
+            kind = uv_line;
+        else if (length == 2 && p[0] == 'v' && p[1] == 'n')
+            kind = normal_line;
+        else if (length == 1 && p[0] == 'f')
+            kind = face_line;
+        p = keyword_end;
+        return kind;
+    }
+
+    // Zero-based index of an OBJ index, negative ones count back from the defined_before attributes
+    bool resolve_index(int index, long long defined_before, long long total, int& resolved)
+    {
+        long long zero_based = index > 0 ? index - 1 : defined_before + index;
+        if (index == 0 || zero_based < 0 || zero_based >= total)
+            return false;
+        resolved = int(zero_based);
+        return true;
+    }
+}
+
+bool parse_obj(const char* text, size_t size, ObjMesh& mesh, string& error)
+{
+    mesh = ObjMesh();
+    vector<Chunk> chunks = split_lines(text, text + size);
+
+    // First pass: count the lines, attributes and triangles of every chunk, then turn the counts into offsets
+    enum { lines, positions, uvs, normals, triangles, count_kinds };
+    vector<array<long long, count_kinds>> first(chunks.size() + 1);
+    parallel_for(chunks.size(), [&](size_t c)
+    {
+        array<long long, count_kinds> counts = {};
+        for_each_line(chunks[c], [&](const char* p, const char* end)
+        {
+            counts[lines]++;
+            switch (obj_line_kind(p, end))
+            {
+            case position_line: counts[positions]++; break;
+            case uv_line: counts[uvs]++; break;
+            case normal_line: counts[normals]++; break;
+            case face_line: counts[triangles] += max(0, count_tokens(p, end) - 2); break;
+            default: break;
+            }
+        });
+        first[c + 1] = counts;
+    });
+    first[0] = {};
+    first[0][lines] = 1;
+    for (size_t c = 0; c < chunks.size(); c++)
+        for (int kind = 0; kind < count_kinds; kind++)
+            first[c + 1][kind] += first[c][kind];
+    const array<long long, count_kinds>& total = first.back();
+
+    mesh.positions.resize(3 * total[positions]);
+    mesh.uvs.resize(2 * total[uvs]);
+    mesh.normals.resize(3 * total[normals]);
+    mesh.position_indices.resize(3 * total[triangles]);
+    mesh.uv_indices.resize(3 * total[triangles]);
+    mesh.normal_indices.resize(3 * total[triangles]);
+
+    // Second pass: every chunk writes from its offsets
+    vector<string> chunk_errors(chunks.size());
+    parallel_for(chunks.size(), [&](size_t c)
+    {
+        array<long long, count_kinds> next = first[c];
+        vector<int> polygon;
+        for_each_line(chunks[c], [&](const char* p, const char* end)
+        {
+            long long line = next[lines]++;
+            if (!chunk_errors[c].empty())
+                return;
+            switch (obj_line_kind(p, end))
+            {
+            case position_line:
+            {
+                float* position = &mesh.positions[3 * next[positions]++];
+                if (!next_number(p, end, position[0]) || !next_number(p, end, position[1]) || !next_number(p, end, position[2]))
+                    chunk_errors[c] = line_error(line, "expected 3 vertex coordinates");
+                break;
+            }
+            case uv_line:
+            {
+                float* uv = &mesh.uvs[2 * next[uvs]++];
+                if (!next_number(p, end, uv[0]) || !next_number(p, end, uv[1]))
+                    chunk_errors[c] = line_error(line, "expected 2 texture coordinates");
+                break;
+            }
+            case normal_line:
+            {
+                float* normal = &mesh.normals[3 * next[normals]++];
+                if (!next_number(p, end, normal[0]) || !next_number(p, end, normal[1]) || !next_number(p, end, normal[2]))
+                    chunk_errors[c] = line_error(line, "expected 3 normal coordinates");
+                break;
+            }
+            case face_line:
+            {
+                // Corners are v/vt/vn, stored 3 ints per corner
+                int corners = count_tokens(p, end);
+                polygon.resize(3 * corners);
+                for (int k = 0; k < corners; k++)
+                {
+                    int index[3];
+                    bool is_valid = next_number(p, end, index[0]);
+                    for (int a = 1; a < 3 && is_valid; a++)
+                    {
+                        is_valid = p < end && *p == '/';
+                        if (is_valid)
+                        {
+                            from_chars_result result = from_chars(p + 1, end, index[a]);
+                            is_valid = result.ec == errc();
+                            p = result.ptr;
+                        }
+                    }
+                    is_valid = is_valid && (p == end || is_space(*p))
+                        && resolve_index(index[0], next[positions], total[positions], polygon[3 * k])
+                        && resolve_index(index[1], next[uvs], total[uvs], polygon[3 * k + 1])
+                        && resolve_index(index[2], next[normals], total[normals], polygon[3 * k + 2]);
+                    if (!is_valid)
+                    {
+                        chunk_errors[c] = line_error(line, "face corners must be valid v/vt/vn indices");
+                        return;
+                    }
+                }
+                if (corners < 3)
+                {
+                    chunk_errors[c] = line_error(line, "a face needs at least 3 vertices");
+                    return;
+                }
+
+                // Fan around the first corner, a triangle stays as it is
+                for (int k = 1; k + 1 < corners; k++)
+                {
+                    long long triangle = 3 * next[triangles]++;
+                    const int corner[3] = {0, k, k + 1};
+                    for (int i = 0; i < 3; i++)
+                    {
+                        mesh.position_indices[triangle + i] = polygon[3 * corner[i]];
+                        mesh.uv_indices[triangle + i] = polygon[3 * corner[i] + 1];
+                        mesh.normal_indices[triangle + i] = polygon[3 * corner[i] + 2];
+                    }
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        });
+    });
+    if (first_error(chunk_errors, error))
+    {
+        mesh = ObjMesh();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef MESH_PARSER_H
+#define MESH_PARSER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file, mapped in memory where mmap is available and read otherwise
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // False if the file could not be opened, an empty file is open with a size of 0
+    bool is_open() const { return opened; }
+    const char* data() const { return mapped; }
+    std::size_t size() const { return length; }
+
+private:
+    bool opened = false;
+    const char* mapped = nullptr;
+    std::size_t length = 0;
+    std::vector<char> buffer;
+};
+
+// The parsers split the text into newline aligned chunks of at least 1 MB and parse them on all the cores
+// with std::from_chars, so numbers are rounded exactly like strtof/strtod. A first pass counts the lines of each
+// chunk so that the second one writes straight into the preallocated arrays.
+// Comments (#), blank lines, tabs and repeated spaces are accepted, and polygons are split into fans of triangles.
+// On error they return false with a message naming the line.
+
+// Parse an OFF file: positions gets x, y, z for every vertex and triangles 3 zero-based vertex indices per triangle.
+// Colors or normals after the coordinates and after the face indices are ignored.
+template <typename Scalar>
+bool parse_off(const char* text, std::size_t size, std::vector<Scalar>& positions, std::vector<int>& triangles, std::string& error);
+
+// Attributes and zero-based indices of the triangles of an OBJ file, faces must have a texture coordinate and a normal
+struct ObjMesh
+{
+    std::vector<float> positions;   // x, y, z per v line
+    std::vector<float> uvs;         // u, v per vt line
+    std::vector<float> normals;     // x, y, z per vn line
+
+    // 3 per triangle
+    std::vector<int> position_indices, uv_indices, normal_indices;
+};
+
+// Parse the v, vt, vn and f lines of an OBJ file, the other lines are skipped. Negative indices are relative to the
+// attributes defined before the face.
+bool parse_obj(const char* text, std::size_t size, ObjMesh& mesh, std::string& error);
+
+#endif